@@ -0,0 +1,297 @@
+/**
+ * bench_accept.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A benchmark of accepting a storm of connections by MTL server, as when
+ * all clients reconnect at once after a network outage, for different
+ * numbers of acceptors and lengths of the queue of pending connections.
+ *
+ * A server is started for every run. A number of threads open all their
+ * connections at once, without blocking. Every connection, once established,
+ * sends a message to itself, and it counts as served once the message comes
+ * back, i.e. once server has accepted and registered it. Rate of served
+ * connections and the slowest connection setup are reported. Connections
+ * dropped by a full queue are retried by the kernel after a second or more,
+ * which shows up on both. A run ends once every connection is served, or
+ * none progresses for a while.
+ *
+ * Usage: ./bench_accept [<server_exec> [<port>]]
+ *  where:
+ *      -server_exec [optional] : Path of MTL server (default ./bin/server).
+ *      -port [optional] : Port used by server (default 9500).
+ *
+ * Version: 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include "message.h"
+#include "bench_util.h"
+
+
+#define STORM_CONNS 2000   // Connections of every run.
+#define STORM_THREADS 4    // Threads opening connections.
+#define DATA_LEN 16        // Length of data of messages.
+#define RX_BUF_LEN 256
+#define STALL_TIMEOUT_MS 5000  // Run ends if nothing happens for so long.
+
+
+struct conn {
+    int fd;
+    int sent;         // Set once connected and its message is sent.
+    int served;       // Set once its message came back.
+    struct timespec start;
+    char buf[RX_BUF_LEN];
+    size_t len;
+};
+
+struct storm {
+    struct conn *conns;
+    int conns_num;
+    int port;
+    int served;
+    double slowest_ms;  // Slowest connection setup.
+};
+
+struct run_cfg {
+    int acceptors;
+    int backlog;
+    int baseline;  // Set if connections are expected to be dropped.
+};
+
+int open_conn(struct conn *c, int port);
+int conn_connected(struct conn *c, struct storm *s);
+int conn_receive(struct conn *c);
+void *storm_work(void *arg);
+int run(const char *exec, int port, struct run_cfg *cfg);
+
+
+int main(int argc, char *argv[])
+{
+    const char *exec = argc > 1 ? argv[1] : "./bin/server";
+    int port = argc > 2 ? atoi(argv[2]) : 9500;
+
+    // A single acceptor with the former queue of 8 connections, and with a
+    // longer queue, against many acceptors.
+    struct run_cfg cfgs[] = { { 1, 8, 1 }, { 1, 1024, 0 }, { 4, 1024, 0 } };
+    int cfgs_num = sizeof(cfgs) / sizeof(cfgs[0]);
+
+    signal(SIGPIPE, SIG_IGN);
+    printf("%d connections opened at once by %d threads\n",
+           STORM_CONNS, STORM_THREADS);
+
+    int failed = 0;
+    for (int i = 0; i < cfgs_num; i++)
+        failed |= run(exec, port + i, cfgs + i);
+
+    printf(failed ? "FAILED\n" : "PASSED\n");
+    return failed;
+}
+
+/**
+ * Starts connecting given connection to server, without blocking.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int open_conn(struct conn *c, int port)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    clock_gettime(CLOCK_MONOTONIC, &c->start);
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd < 0) return -1;
+    if (connect(c->fd, (struct sockaddr *) &addr, sizeof(addr)) &&
+        errno != EINPROGRESS)
+        return -1;
+    return 0;
+}
+
+/**
+ * Sends a message of an established connection to itself.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int conn_connected(struct conn *c, struct storm *s)
+{
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &err_len) || err ||
+        getsockname(c->fd, (struct sockaddr *) &addr, &addr_len))
+        return -1;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double ms = bench_elapsed_ms(&c->start, &now);
+    if (ms > s->slowest_ms) s->slowest_ms = ms;
+
+    message_t m;
+    memset(&m, 0, sizeof(m));
+    m.dest_addr = INADDR_LOOPBACK;
+    m.dest_port = ntohs(addr.sin_port);
+    m.priority = MESSAGE_PRIORITY_NORMAL;
+    m.len = DATA_LEN;
+    c->sent = 1;
+    return bench_send_frame(c->fd, &m, NULL);
+}
+
+/**
+ * Receives on given connection, until its own message has come back.
+ *
+ * Returns:
+ *  0 while connection is alive, otherwise a non-zero integer.
+ */
+int conn_receive(struct conn *c)
+{
+    ssize_t n;
+    while ((n = recv(c->fd, c->buf + c->len, RX_BUF_LEN - c->len, 0)) > 0) {
+        c->len += n;
+        size_t size = message_frame_size(c->buf, c->len, MESSAGE_FORMAT_FRAMED);
+        if (!size || size > c->len) continue;
+        message_header_t *h = (message_header_t *) c->buf;
+        if (h->flags) return -1;  // NACKed.
+        c->served = 1;
+        return 0;
+    }
+    return n < 0 && errno == EAGAIN ? 0 : -1;
+}
+
+/**
+ * Opens all connections of a storm at once, and waits until every one has
+ * been served, or none progresses for a while.
+ */
+void *storm_work(void *arg)
+{
+    struct storm *s = (struct storm *) arg;
+    int epfd = epoll_create1(0);
+    if (epfd < 0) return NULL;
+
+    for (int i = 0; i < s->conns_num; i++) {
+        struct conn *c = s->conns + i;
+        if (open_conn(c, s->port)) {
+            perror("ERROR: Failed to open connection");
+            goto out;
+        }
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT, .data.ptr = c };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    }
+
+    struct epoll_event events[64];
+    while (s->served < s->conns_num) {
+        int n = epoll_wait(epfd, events, 64, STALL_TIMEOUT_MS);
+        if (n <= 0) break;
+        for (int e = 0; e < n; e++) {
+            struct conn *c = (struct conn *) events[e].data.ptr;
+            if (!c->sent) {
+                if (conn_connected(c, s)) goto out;
+                struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+                epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+                continue;
+            }
+            if (c->served) continue;
+            if (conn_receive(c)) goto out;
+            if (c->served) s->served++;
+        }
+    }
+
+out:
+    close(epfd);
+    return NULL;
+}
+
+/**
+ * Runs a storm of connections against a new server of given configuration.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int run(const char *exec, int port, struct run_cfg *cfg)
+{
+    struct conn *conns = (struct conn *) calloc(STORM_CONNS, sizeof(struct conn));
+    if (!conns) return 1;
+    for (int i = 0; i < STORM_CONNS; i++) conns[i].fd = -1;
+
+    // Server runs on event loop mode with given acceptors and backlog.
+    char acceptors_arg[16];
+    char backlog_arg[16];
+    snprintf(acceptors_arg, sizeof(acceptors_arg), "%d", cfg->acceptors);
+    snprintf(backlog_arg, sizeof(backlog_arg), "%d", cfg->backlog);
+    const char *options[] = { "-e", "4", "-a", acceptors_arg,
+                              "-L", backlog_arg, NULL };
+    pid_t pid = bench_start_server(exec, port, options);
+    if (pid < 0) {
+        free(conns);
+        return 1;
+    }
+
+    int failed = 0;
+    // Wait until server listens.
+    int probe = bench_connect_server(port, NULL);
+    if (probe < 0) {
+        fprintf(stderr, "ERROR: Failed to connect to server.\n");
+        failed = 1;
+        goto out;
+    }
+    close(probe);
+    usleep(100000);
+
+    struct storm storms[STORM_THREADS];
+    pthread_t tids[STORM_THREADS];
+    struct timespec start, stop;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int t = 0; t < STORM_THREADS; t++) {
+        storms[t].conns = conns + t * (STORM_CONNS / STORM_THREADS);
+        storms[t].conns_num = STORM_CONNS / STORM_THREADS;
+        storms[t].port = port;
+        storms[t].served = 0;
+        storms[t].slowest_ms = 0;
+        pthread_create(tids + t, NULL, storm_work, storms + t);
+    }
+
+    int served = 0;
+    double slowest_ms = 0;
+    for (int t = 0; t < STORM_THREADS; t++) {
+        pthread_join(tids[t], NULL);
+        served += storms[t].served;
+        if (storms[t].slowest_ms > slowest_ms) slowest_ms = storms[t].slowest_ms;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    // Former queue may not serve every connection before the run ends.
+    failed = !cfg->baseline &&
+             served < STORM_THREADS * (STORM_CONNS / STORM_THREADS);
+
+    double ms = bench_elapsed_ms(&start, &stop);
+    printf("%d acceptor(s), backlog %4d : %5d connections in %7.1f ms "
+           "(%8.0f connections/sec), slowest connect %7.1f ms\n",
+           cfg->acceptors, cfg->backlog, served, ms, served / ms * 1000,
+           slowest_ms);
+
+out:
+    for (int i = 0; i < STORM_CONNS; i++)
+        if (conns[i].fd >= 0) close(conns[i].fd);
+    kill(pid, SIGINT);
+    waitpid(pid, NULL, 0);
+    free(conns);
+    return failed;
+}
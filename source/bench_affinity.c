@@ -0,0 +1,277 @@
+/**
+ * bench_affinity.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A benchmark of MTL server with its threads placed on dedicated CPUs,
+ * against letting the scheduler place them.
+ *
+ * A server on event loop mode is started for every run. Pairs of clients
+ * connect, and on every pair a sender sends messages to a receiver, keeping
+ * a window of messages in flight. Every message carries the time it was
+ * sent, so receivers measure latency through server. Rate of messages and
+ * p50 and p99 latency are reported.
+ *
+ * On the pinned run, housekeeping threads are placed on CPU 0, sending unit
+ * on CPU 1 and event loops on the remaining CPUs. With fewer than 3 CPUs,
+ * threads share them.
+ *
+ * Usage: ./bench_affinity [<server_exec> [<port>]]
+ *  where:
+ *      -server_exec [optional] : Path of MTL server (default ./bin/server).
+ *      -port [optional] : Port used by server (default 9600).
+ *
+ * Version: 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include "message.h"
+#include "bench_util.h"
+
+
+#define PAIRS_NUM 4
+#define MESSAGES_NUM 20000  // Messages of every sender.
+#define WINDOW 32           // Max messages of a sender in flight.
+#define DATA_LEN 32
+#define RX_BUF_LEN 65536
+#define STALL_TIMEOUT_MS 5000  // Run fails if nothing is received for so long.
+
+
+struct pair {
+    int sender_fd;
+    int receiver_fd;
+    uint16_t receiver_port;
+    long sent;
+    long received;             // Guarded by mutex.
+    pthread_mutex_t mutex;
+    pthread_cond_t received_cond;
+    uint64_t *latencies;       // Latency of every received message in ns.
+    char buf[RX_BUF_LEN];
+    size_t len;
+};
+
+void *send_work(void *arg);
+int receive_messages(struct pair *pairs);
+int run(const char *exec, int port, const char *name,
+        const char *placement[]);
+
+
+int main(int argc, char *argv[])
+{
+    const char *exec = argc > 1 ? argv[1] : "./bin/server";
+    int port = argc > 2 ? atoi(argv[2]) : 9600;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus > 64) cpus = 64;
+    char loops[16];
+    char sender[32];
+    char handlers[32];
+    snprintf(loops, sizeof(loops), "%ld", cpus > 3 ? cpus - 2 : 1);
+    snprintf(sender, sizeof(sender), "sender=%d", cpus > 1 ? 1 : 0);
+    if (cpus > 3) snprintf(handlers, sizeof(handlers), "handlers=2-%ld", cpus - 1);
+    else snprintf(handlers, sizeof(handlers), "handlers=%ld", cpus - 1);
+
+    const char *unpinned[] = { "-e", loops, NULL };
+    const char *pinned[] = { "-e", loops, "-c", sender, "-c", handlers,
+                             "-c", "housekeeping=0", NULL };
+
+    signal(SIGPIPE, SIG_IGN);
+    printf("%d pairs, %d messages of %d bytes each, %ld CPUs, %s event loops, "
+           "%s %s housekeeping=0\n",
+           PAIRS_NUM, MESSAGES_NUM, DATA_LEN, cpus, loops, sender, handlers);
+
+    int failed = run(exec, port, "unpinned", unpinned);
+    failed |= run(exec, port + 1, "pinned", pinned);
+
+    printf(failed ? "FAILED\n" : "PASSED\n");
+    return failed;
+}
+
+/**
+ * Sends all messages of a pair, waiting while its window is full.
+ */
+void *send_work(void *arg)
+{
+    struct pair *p = (struct pair *) arg;
+    uint16_t count = 0;
+    message_t m;
+    memset(&m, 0, sizeof(m));
+    m.dest_addr = INADDR_LOOPBACK;
+    m.dest_port = p->receiver_port;
+    m.priority = MESSAGE_PRIORITY_NORMAL;
+    m.len = DATA_LEN;
+
+    for (p->sent = 0; p->sent < MESSAGES_NUM; p->sent++) {
+        pthread_mutex_lock(&p->mutex);
+        while (p->sent - p->received >= WINDOW)
+            pthread_cond_wait(&p->received_cond, &p->mutex);
+        pthread_mutex_unlock(&p->mutex);
+
+        uint64_t sent_ns = bench_now_ns();
+        memcpy(m.data, &sent_ns, sizeof(sent_ns));
+        if (bench_send_frame(p->sender_fd, &m, &count)) break;
+    }
+
+    return NULL;
+}
+
+/**
+ * Receives messages on all receivers, until each one has received all
+ * messages of its sender.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int receive_messages(struct pair *pairs)
+{
+    int epfd = epoll_create1(0);
+    if (epfd < 0) return -1;
+    for (int i = 0; i < PAIRS_NUM; i++) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &pairs[i] };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, pairs[i].receiver_fd, &ev);
+    }
+
+    long total = 0;
+    struct epoll_event events[PAIRS_NUM];
+    while (total < (long) MESSAGES_NUM * PAIRS_NUM) {
+        int n = epoll_wait(epfd, events, PAIRS_NUM, STALL_TIMEOUT_MS);
+        if (n <= 0) break;
+        for (int e = 0; e < n; e++) {
+            struct pair *p = (struct pair *) events[e].data.ptr;
+            ssize_t r = recv(p->receiver_fd, p->buf + p->len,
+                             RX_BUF_LEN - p->len, 0);
+            if (r <= 0) continue;
+            p->len += r;
+            uint64_t received_ns = bench_now_ns();
+
+            size_t off = 0;
+            long received = 0;
+            while (1) {
+                size_t size = message_frame_size(
+                    p->buf + off, p->len - off, MESSAGE_FORMAT_FRAMED);
+                if (!size || size > p->len - off) break;
+                uint64_t sent_ns;
+                memcpy(&sent_ns, p->buf + off + MESSAGE_HEADER_LENGTH,
+                       sizeof(sent_ns));
+                if (p->received + received < MESSAGES_NUM)
+                    p->latencies[p->received + received] = received_ns - sent_ns;
+                received++;
+                off += size;
+            }
+            memmove(p->buf, p->buf + off, p->len - off);
+            p->len -= off;
+
+            pthread_mutex_lock(&p->mutex);
+            p->received += received;
+            pthread_cond_signal(&p->received_cond);
+            pthread_mutex_unlock(&p->mutex);
+            total += received;
+        }
+    }
+
+    close(epfd);
+    return total < (long) MESSAGES_NUM * PAIRS_NUM;
+}
+
+/**
+ * Runs the benchmark against a new server, started with given options.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int run(const char *exec, int port, const char *name, const char *options[])
+{
+    struct pair *pairs = (struct pair *) calloc(PAIRS_NUM, sizeof(struct pair));
+    uint64_t *latencies = (uint64_t *) malloc(
+        sizeof(uint64_t) * MESSAGES_NUM * PAIRS_NUM);
+    if (!pairs || !latencies) return 1;
+
+    pid_t pid = bench_start_server(exec, port, options);
+    if (pid < 0) return 1;
+
+    int failed = 0;
+    for (int i = 0; i < PAIRS_NUM; i++) {
+        pairs[i].sender_fd = pairs[i].receiver_fd = -1;
+        pairs[i].latencies = latencies + (long) i * MESSAGES_NUM;
+        pthread_mutex_init(&pairs[i].mutex, NULL);
+        pthread_cond_init(&pairs[i].received_cond, NULL);
+    }
+
+    // Senders never hear from server, so their acks would be delayed.
+    struct sock_tuning nodelay = { .nodelay = 1 };
+    for (int i = 0; i < PAIRS_NUM; i++) {
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        pairs[i].receiver_fd = bench_connect_server(port, &nodelay);
+        pairs[i].sender_fd = bench_connect_server(port, &nodelay);
+        if (pairs[i].receiver_fd < 0 || pairs[i].sender_fd < 0 ||
+            getsockname(pairs[i].receiver_fd, (struct sockaddr *) &addr,
+                        &addr_len)) {
+            fprintf(stderr, "ERROR: Failed to connect to server.\n");
+            failed = 1;
+            goto out;
+        }
+        pairs[i].receiver_port = ntohs(addr.sin_port);
+    }
+    usleep(200000);  // Let server register all clients.
+
+    uint64_t start = bench_now_ns();
+    pthread_t tids[PAIRS_NUM];
+    for (int i = 0; i < PAIRS_NUM; i++)
+        pthread_create(&tids[i], NULL, send_work, &pairs[i]);
+    failed = receive_messages(pairs);
+    uint64_t stop = bench_now_ns();
+    for (int i = 0; i < PAIRS_NUM; i++) {
+        if (failed) {
+            // Unblock senders.
+            shutdown(pairs[i].sender_fd, SHUT_RDWR);
+            pthread_mutex_lock(&pairs[i].mutex);
+            pairs[i].received = MESSAGES_NUM;
+            pthread_cond_signal(&pairs[i].received_cond);
+            pthread_mutex_unlock(&pairs[i].mutex);
+        }
+        pthread_join(tids[i], NULL);
+    }
+
+    long received = 0;
+    for (int i = 0; i < PAIRS_NUM; i++) {
+        long n = pairs[i].received < MESSAGES_NUM ?
+                 pairs[i].received : MESSAGES_NUM;
+        memmove(latencies + received, pairs[i].latencies,
+                sizeof(uint64_t) * n);
+        received += n;
+    }
+    qsort(latencies, received, sizeof(uint64_t), bench_compare_latency);
+
+    double ms = (stop - start) / 1e6;
+    printf("%-8s : %8ld messages in %7.1f ms (%9.0f messages/sec), "
+           "p50 %7.1f us, p99 %7.1f us\n",
+           name, received, ms, received / ms * 1000,
+           received ? latencies[received / 2] / 1e3 : 0.0,
+           received ? latencies[received * 99 / 100] / 1e3 : 0.0);
+
+out:
+    for (int i = 0; i < PAIRS_NUM; i++) {
+        if (pairs[i].sender_fd >= 0) close(pairs[i].sender_fd);
+        if (pairs[i].receiver_fd >= 0) close(pairs[i].receiver_fd);
+        pthread_mutex_destroy(&pairs[i].mutex);
+        pthread_cond_destroy(&pairs[i].received_cond);
+    }
+    kill(pid, SIGINT);
+    waitpid(pid, NULL, 0);
+    free(latencies);
+    free(pairs);
+    return failed;
+}
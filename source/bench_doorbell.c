@@ -0,0 +1,197 @@
+/**
+ * bench_doorbell.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A microbenchmark of the cost of signaling a consumer on every message,
+ * the way receivers of MTL server signal sending unit.
+ *
+ * Producers publish messages as fast as they can, by incrementing a shared
+ * count, and signal a single consumer that takes all published messages at
+ * once. Signaling by a mutex and a condition variable, as sending unit used
+ * to be signaled, is compared against a doorbell, for a single and for many
+ * producers. Time per message on producers is reported, along with the
+ * number of times consumer blocked and, for doorbell, the number of
+ * syscalls made to wake it up.
+ *
+ * Usage: ./bench_doorbell
+ *
+ * Version: 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include "doorbell.h"
+
+
+#define MESSAGES_NUM 1000000  // Messages of every producer.
+#define PRODUCERS_MAX 4
+
+
+struct bench {
+    int use_doorbell;
+    int producers;
+    unsigned long published;   // Messages published by all producers.
+    unsigned long consumed;    // Accessed only by consumer.
+    unsigned long blocked;     // Times consumer blocked.
+    unsigned long wakeups;     // Syscalls made by producers to wake consumer.
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    doorbell_t *doorbell;
+};
+
+uint64_t now_ns();
+void *produce_cond(void *arg);
+void *consume_cond(void *arg);
+void *produce_doorbell(void *arg);
+void *consume_doorbell(void *arg);
+int run(int use_doorbell, int producers);
+
+
+int main()
+{
+    printf("%d messages per producer\n", MESSAGES_NUM);
+
+    int failed = 0;
+    failed |= run(0, 1);
+    failed |= run(1, 1);
+    failed |= run(0, PRODUCERS_MAX);
+    failed |= run(1, PRODUCERS_MAX);
+
+    printf(failed ? "FAILED\n" : "PASSED\n");
+    return failed;
+}
+
+uint64_t now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Publishes messages, signaling consumer under mutex on every message.
+ */
+void *produce_cond(void *arg)
+{
+    struct bench *b = (struct bench *) arg;
+    for (int i = 0; i < MESSAGES_NUM; i++) {
+        pthread_mutex_lock(&b->mutex);
+        b->published++;
+        pthread_cond_signal(&b->cond);
+        pthread_mutex_unlock(&b->mutex);
+    }
+    return NULL;
+}
+
+/**
+ * Takes published messages until all of them are taken, waiting on
+ * condition variable while there are none.
+ */
+void *consume_cond(void *arg)
+{
+    struct bench *b = (struct bench *) arg;
+    unsigned long total = (unsigned long) MESSAGES_NUM * b->producers;
+
+    pthread_mutex_lock(&b->mutex);
+    while (b->consumed < total) {
+        while (b->published == b->consumed) {
+            b->blocked++;
+            pthread_cond_wait(&b->cond, &b->mutex);
+        }
+        b->consumed = b->published;
+    }
+    pthread_mutex_unlock(&b->mutex);
+    return NULL;
+}
+
+/**
+ * Publishes messages, ringing doorbell of consumer on every message.
+ */
+void *produce_doorbell(void *arg)
+{
+    struct bench *b = (struct bench *) arg;
+    unsigned long wakeups = 0;
+    for (int i = 0; i < MESSAGES_NUM; i++) {
+        __atomic_add_fetch(&b->published, 1, __ATOMIC_RELEASE);
+        wakeups += doorbell_ring(b->doorbell);
+    }
+    __atomic_add_fetch(&b->wakeups, wakeups, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/**
+ * Takes published messages until all of them are taken, parking on doorbell
+ * while there are none.
+ */
+void *consume_doorbell(void *arg)
+{
+    struct bench *b = (struct bench *) arg;
+    unsigned long total = (unsigned long) MESSAGES_NUM * b->producers;
+    struct pollfd pfd = { .fd = doorbell_fd(b->doorbell), .events = POLLIN };
+
+    while (b->consumed < total) {
+        unsigned long published = __atomic_load_n(&b->published,
+                                                  __ATOMIC_ACQUIRE);
+        if (published != b->consumed) {
+            b->consumed = published;
+            continue;
+        }
+
+        doorbell_idle(b->doorbell);
+        if (__atomic_load_n(&b->published, __ATOMIC_SEQ_CST) == b->consumed &&
+            doorbell_park(b->doorbell)) {
+            b->blocked++;
+            poll(&pfd, 1, -1);
+        }
+        doorbell_wake(b->doorbell);
+    }
+    return NULL;
+}
+
+/**
+ * Runs the benchmark with given signaling and number of producers.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int run(int use_doorbell, int producers)
+{
+    struct bench b = { .use_doorbell = use_doorbell, .producers = producers };
+    pthread_mutex_init(&b.mutex, NULL);
+    pthread_cond_init(&b.cond, NULL);
+    if (use_doorbell && !(b.doorbell = doorbell_create())) {
+        perror("ERROR: Failed to create doorbell");
+        return 1;
+    }
+
+    pthread_t consumer;
+    pthread_t tids[PRODUCERS_MAX];
+    uint64_t start = now_ns();
+    pthread_create(&consumer, NULL,
+                   use_doorbell ? consume_doorbell : consume_cond, &b);
+    for (int i = 0; i < producers; i++)
+        pthread_create(&tids[i], NULL,
+                       use_doorbell ? produce_doorbell : produce_cond, &b);
+    for (int i = 0; i < producers; i++) pthread_join(tids[i], NULL);
+    uint64_t produced = now_ns();
+    pthread_join(consumer, NULL);
+
+    unsigned long messages = (unsigned long) MESSAGES_NUM * producers;
+    printf("%-8s, %d producers : %6.1f ns/message, consumer blocked %lu times",
+           use_doorbell ? "doorbell" : "cond", producers,
+           (double) (produced - start) / messages, b.blocked);
+    if (use_doorbell) printf(", %lu wake-up syscalls", b.wakeups);
+    printf("\n");
+
+    pthread_mutex_destroy(&b.mutex);
+    pthread_cond_destroy(&b.cond);
+    doorbell_destroy(b.doorbell);
+    return b.consumed != messages;
+}
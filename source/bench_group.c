@@ -0,0 +1,258 @@
+/**
+ * bench_group.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A benchmark of fan-out through groups of MTL server, against sending a
+ * unicast copy of every update to each subscriber.
+ *
+ * A server is started for every run. A number of member clients connect, and
+ * a single publisher sends updates of full data length. In group mode,
+ * members join a group and publisher sends every update once to the group.
+ * In unicast mode, publisher sends every update to each member. The run ends
+ * when every member has received every update. Rate of deliveries, bytes
+ * sent by publisher and peak memory of server are reported.
+ *
+ * Usage: ./bench_group [<server_exec> [<port>]]
+ *  where:
+ *      -server_exec [optional] : Path of MTL server (default ./bin/server).
+ *      -port [optional] : Port used by server (default 9400).
+ *
+ * Version: 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include "message.h"
+#include "bench_util.h"
+
+
+#define MEMBERS_NUM 200
+#define UPDATES_NUM 2000
+#define GROUP_ID 7
+#define RX_BUF_LEN 65536
+#define STALL_TIMEOUT_MS 5000  // Run fails if nothing is received for so long.
+
+
+struct member {
+    int fd;
+    uint16_t port;
+    long received;
+    char buf[RX_BUF_LEN];
+    size_t len;
+};
+
+struct publisher {
+    int fd;
+    int group;                // Send updates to group, instead of members.
+    struct member *members;
+    unsigned long sent_bytes;
+};
+
+long peak_memory_kb(pid_t pid);
+void *publish_work(void *arg);
+int receive_updates(struct member *members, long expected);
+int run(const char *exec, int port, int group);
+
+
+int main(int argc, char *argv[])
+{
+    const char *exec = argc > 1 ? argv[1] : "./bin/server";
+    int port = argc > 2 ? atoi(argv[2]) : 9400;
+
+    signal(SIGPIPE, SIG_IGN);
+    printf("%d members, %d updates of %d bytes\n",
+           MEMBERS_NUM, UPDATES_NUM, MESSAGE_DATA_LENGTH);
+
+    int failed = run(exec, port, 0);
+    failed |= run(exec, port + 1, 1);
+
+    printf(failed ? "FAILED\n" : "PASSED\n");
+    return failed;
+}
+
+/**
+ * Returns the peak resident memory of given process in KB, or -1.
+ */
+long peak_memory_kb(pid_t pid)
+{
+    char path[64];
+    char line[256];
+    long kb = -1;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "VmHWM: %ld kB", &kb) == 1) break;
+    fclose(f);
+    return kb;
+}
+
+/**
+ * Sends all updates, either to the group or to every member.
+ */
+void *publish_work(void *arg)
+{
+    struct publisher *p = (struct publisher *) arg;
+    uint16_t count = 0;
+    message_t m;
+    memset(&m, 0, sizeof(m));
+    m.priority = MESSAGE_PRIORITY_NORMAL;
+    m.len = MESSAGE_DATA_LENGTH;
+
+    for (int u = 0; u < UPDATES_NUM; u++) {
+        memset(m.data, 'a' + u % 26, MESSAGE_DATA_LENGTH);
+        if (p->group) {
+            m.dest_addr = MESSAGE_GROUP_ADDR;
+            m.dest_port = GROUP_ID;
+            if (bench_send_frame(p->fd, &m, &count)) break;
+            p->sent_bytes += message_wire_size(&m, MESSAGE_FORMAT_FRAMED);
+            continue;
+        }
+        for (int i = 0; i < MEMBERS_NUM; i++) {
+            m.dest_addr = INADDR_LOOPBACK;
+            m.dest_port = p->members[i].port;
+            if (bench_send_frame(p->fd, &m, &count)) return NULL;
+            p->sent_bytes += message_wire_size(&m, MESSAGE_FORMAT_FRAMED);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Receives updates on all members, until each one has received the expected
+ * number of them.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int receive_updates(struct member *members, long expected)
+{
+    int epfd = epoll_create1(0);
+    if (epfd < 0) return -1;
+    for (int i = 0; i < MEMBERS_NUM; i++) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &members[i] };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, members[i].fd, &ev);
+    }
+
+    long total = 0;
+    struct epoll_event events[64];
+    while (total < expected * MEMBERS_NUM) {
+        int n = epoll_wait(epfd, events, 64, STALL_TIMEOUT_MS);
+        if (n <= 0) break;
+        for (int e = 0; e < n; e++) {
+            struct member *mb = (struct member *) events[e].data.ptr;
+            ssize_t r = recv(mb->fd, mb->buf + mb->len, RX_BUF_LEN - mb->len, 0);
+            if (r <= 0) continue;
+            mb->len += r;
+
+            size_t off = 0;
+            while (1) {
+                size_t size = message_frame_size(
+                    mb->buf + off, mb->len - off, MESSAGE_FORMAT_FRAMED);
+                if (!size || size > mb->len - off) break;
+                message_header_t *h = (message_header_t *) (mb->buf + off);
+                if (!h->flags) {
+                    mb->received++;
+                    total++;
+                }
+                off += size;
+            }
+            memmove(mb->buf, mb->buf + off, mb->len - off);
+            mb->len -= off;
+        }
+    }
+
+    close(epfd);
+    return total < expected * MEMBERS_NUM;
+}
+
+/**
+ * Runs the benchmark in group or unicast mode, against a new server.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int run(const char *exec, int port, int group)
+{
+    struct member *members =
+        (struct member *) calloc(MEMBERS_NUM, sizeof(struct member));
+    if (!members) return 1;
+
+    const char *options[] = { "-e", "2", NULL };
+    pid_t pid = bench_start_server(exec, port, options);
+    if (pid < 0) return 1;
+
+    int failed = 0;
+    struct publisher p = { -1, group, members, 0 };
+    for (int i = 0; i < MEMBERS_NUM; i++) members[i].fd = -1;
+
+    for (int i = 0; i < MEMBERS_NUM; i++) {
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        members[i].fd = bench_connect_server(port, NULL);
+        if (members[i].fd < 0 ||
+            getsockname(members[i].fd, (struct sockaddr *) &addr, &addr_len)) {
+            fprintf(stderr, "ERROR: Failed to connect to server.\n");
+            failed = 1;
+            goto out;
+        }
+        members[i].port = ntohs(addr.sin_port);
+
+        if (group) {
+            uint16_t count = 0;
+            message_t join;
+            memset(&join, 0, sizeof(join));
+            join.dest_addr = MESSAGE_GROUP_ADDR;
+            join.dest_port = GROUP_ID;
+            join.flags = MESSAGE_GROUP_JOIN;
+            bench_send_frame(members[i].fd, &join, &count);
+        }
+    }
+    p.fd = bench_connect_server(port, NULL);
+    if (p.fd < 0) {
+        failed = 1;
+        goto out;
+    }
+    usleep(200000);  // Let server register all clients.
+
+    struct timespec start, stop;
+    pthread_t publisher_tid;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_create(&publisher_tid, NULL, publish_work, &p);
+    failed = receive_updates(members, UPDATES_NUM);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    if (failed) shutdown(p.fd, SHUT_RDWR);  // Unblock publisher.
+    pthread_join(publisher_tid, NULL);
+
+    double ms = bench_elapsed_ms(&start, &stop);
+    long delivered = 0;
+    for (int i = 0; i < MEMBERS_NUM; i++) delivered += members[i].received;
+    printf("%-7s : %8ld deliveries in %7.1f ms (%9.0f deliveries/sec), "
+           "publisher sent %9lu bytes, server peak memory %6ld KB\n",
+           group ? "group" : "unicast", delivered, ms, delivered / ms * 1000,
+           p.sent_bytes, peak_memory_kb(pid));
+
+out:
+    for (int i = 0; i < MEMBERS_NUM; i++)
+        if (members[i].fd >= 0) close(members[i].fd);
+    if (p.fd >= 0) close(p.fd);
+    kill(pid, SIGINT);
+    waitpid(pid, NULL, 0);
+    free(members);
+    return failed;
+}
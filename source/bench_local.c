@@ -0,0 +1,206 @@
+/**
+ * bench_local.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A benchmark of clients on the host of MTL server, connected through its
+ * unix socket given by -u option, against clients connected over loopback
+ * TCP.
+ *
+ * A server on event loop mode is started, listening on both, with Nagle's
+ * algorithm disabled. For every transport, two clients connect to it. On
+ * latency pass, a client sends messages to the other one, one at a time,
+ * each carrying the time it was sent, and p50 and p99 latency through
+ * server are reported. On throughput pass, a client keeps sending messages,
+ * with a window of them in flight, and rate of messages received by the
+ * other one is reported. Messages from a TCP client to a local one are also
+ * measured, showing local clients are reached as any other.
+ *
+ * Usage: ./bench_local [<server_exec> [<port>]]
+ *  where:
+ *      -server_exec [optional] : Path of MTL server (default ./bin/server).
+ *      -port [optional] : Port used by server (default 9660). Local clients
+ *              are bound to the following ports.
+ *
+ * Version: 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "message.h"
+#include "bench_util.h"
+
+
+#define LATENCY_MESSAGES_NUM 20000
+#define MESSAGES_NUM 200000  // Messages sent on throughput pass.
+#define WINDOW 256           // Messages in flight on throughput pass.
+#define DATA_LEN 32
+#define RECV_TIMEOUT_MS 5000  // Run fails if a message takes longer.
+#define UNIX_PATH "/tmp/mtl_bench_local.sock"
+
+
+int connect_unix(uint16_t local_port);
+int run(int sender_fd, uint16_t *count, int receiver_fd, uint32_t dest_addr,
+        uint16_t dest_port, const char *name);
+
+
+int main(int argc, char *argv[])
+{
+    const char *exec = argc > 1 ? argv[1] : "./bin/server";
+    int port = argc > 2 ? atoi(argv[2]) : 9660;
+
+    signal(SIGPIPE, SIG_IGN);
+    printf("%d messages one at a time, %d pipelined messages, "
+           "%d bytes each\n", LATENCY_MESSAGES_NUM, MESSAGES_NUM, DATA_LEN);
+
+    // Server runs a single event loop, listening on given port and on
+    // UNIX_PATH.
+    const char *options[] = { "-e", "1", "-o", "latency", "-u", UNIX_PATH,
+                              NULL };
+    pid_t pid = bench_start_server(exec, port, options);
+    if (pid < 0) return 1;
+
+    int failed = 1;
+    struct sock_tuning nodelay = { .nodelay = 1 };
+    int tcp_fds[2] = { bench_connect_server(port, &nodelay),
+                       bench_connect_server(port, &nodelay) };
+    int unix_fds[2] = { connect_unix(port + 1), connect_unix(port + 2) };
+    uint16_t tcp_count = 0;   // Counts of messages of both senders.
+    uint16_t unix_count = 0;
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    if (tcp_fds[0] < 0 || tcp_fds[1] < 0 ||
+        unix_fds[0] < 0 || unix_fds[1] < 0 ||
+        getsockname(tcp_fds[1], (struct sockaddr *) &addr, &addr_len)) {
+        fprintf(stderr, "ERROR: Failed to connect to server.\n");
+        goto out;
+    }
+    usleep(200000);  // Let server register all clients.
+
+    failed = run(tcp_fds[0], &tcp_count, tcp_fds[1], INADDR_LOOPBACK,
+                 ntohs(addr.sin_port), "tcp");
+    failed |= run(unix_fds[0], &unix_count, unix_fds[1], MESSAGE_LOCAL_ADDR,
+                  port + 2, "unix");
+    failed |= run(tcp_fds[0], &tcp_count, unix_fds[1], MESSAGE_LOCAL_ADDR,
+                  port + 2, "tcp to unix");
+
+out:
+    for (int i = 0; i < 2; i++) {
+        if (tcp_fds[i] >= 0) close(tcp_fds[i]);
+        if (unix_fds[i] >= 0) close(unix_fds[i]);
+    }
+    kill(pid, SIGINT);
+    waitpid(pid, NULL, 0);
+
+    printf(failed ? "FAILED\n" : "PASSED\n");
+    return failed;
+}
+
+/**
+ * Connects to server through UNIX_PATH, as the local client of given port.
+ *
+ * Returns:
+ *  A connected socket, or -1 on failure.
+ */
+int connect_unix(uint16_t local_port)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, UNIX_PATH);
+
+    struct sockaddr_un local;
+    memset(&local, 0, sizeof(local));
+    local.sun_family = AF_UNIX;
+    int name_len = snprintf(local.sun_path + 1, sizeof(local.sun_path) - 1,
+                            MESSAGE_LOCAL_NAME, (unsigned int) local_port);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (bind(fd, (struct sockaddr *) &local,
+             offsetof(struct sockaddr_un, sun_path) + 1 + name_len) ||
+        connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Runs both passes of the benchmark, from given sender, with given count of
+ * messages it sent so far, to given receiver, known to server by given
+ * endpoint.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int run(int sender_fd, uint16_t *count, int receiver_fd, uint32_t dest_addr,
+        uint16_t dest_port, const char *name)
+{
+    uint64_t *latencies =
+        (uint64_t *) malloc(sizeof(uint64_t) * LATENCY_MESSAGES_NUM);
+    if (!latencies) return 1;
+
+    struct timeval timeout = { RECV_TIMEOUT_MS / 1000,
+                               RECV_TIMEOUT_MS % 1000 * 1000 };
+    setsockopt(receiver_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    message_t m;
+    memset(&m, 0, sizeof(m));
+    m.dest_addr = dest_addr;
+    m.dest_port = dest_port;
+    m.priority = MESSAGE_PRIORITY_NORMAL;
+    m.len = DATA_LEN;
+    char buf[MESSAGE_FRAME_MAX];
+    size_t len = 0;
+    int size;
+    int failed = 1;
+
+    // Latency pass.
+    int received;
+    for (received = 0; received < LATENCY_MESSAGES_NUM; received++) {
+        uint64_t sent_ns = bench_now_ns();
+        if (bench_send_frame(sender_fd, &m, count)) break;
+        if (!(size = bench_receive_frame(receiver_fd, buf, &len))) break;
+        latencies[received] = bench_now_ns() - sent_ns;
+        memmove(buf, buf + size, len - size);
+        len -= size;
+    }
+    if (received < LATENCY_MESSAGES_NUM) goto out;
+    qsort(latencies, received, sizeof(uint64_t), bench_compare_latency);
+
+    // Throughput pass, keeping a window of messages in flight.
+    uint64_t start = bench_now_ns();
+    int sent = 0;
+    for (received = 0; received < MESSAGES_NUM; received++) {
+        while (sent < MESSAGES_NUM && sent - received < WINDOW) {
+            if (bench_send_frame(sender_fd, &m, count)) goto out;
+            sent++;
+        }
+        if (!(size = bench_receive_frame(receiver_fd, buf, &len))) break;
+        memmove(buf, buf + size, len - size);
+        len -= size;
+    }
+    uint64_t stop = bench_now_ns();
+    failed = received < MESSAGES_NUM;
+
+    printf("%-11s : p50 %7.1f us, p99 %7.1f us, %8.0f msgs/s\n", name,
+           latencies[LATENCY_MESSAGES_NUM / 2] / 1e3,
+           latencies[LATENCY_MESSAGES_NUM * 99 / 100] / 1e3,
+           received / ((stop - start) / 1e9));
+
+out:
+    if (failed) fprintf(stderr, "ERROR: Run over %s failed.\n", name);
+    free(latencies);
+    return failed;
+}
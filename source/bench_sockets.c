@@ -0,0 +1,163 @@
+/**
+ * bench_sockets.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A loopback benchmark of the socket tuning profiles given by -o option of
+ * MTL server, i.e. 'default', 'latency' and 'bulk'.
+ *
+ * For every profile, a server on event loop mode is started with it, and
+ * two clients, tuned the same way, connect to it. On latency pass, a client
+ * sends bursts of two messages to the other one, each on its own send()
+ * call, and waits for both of them before sending the next burst, the way a
+ * request made of a header and a body is sent. Unless Nagle's algorithm is
+ * disabled, the second message may wait for the ack of the first one, which
+ * peer may delay. p50 and p99 of the time for a whole burst to arrive are
+ * reported. On throughput pass, a client keeps sending messages and rate of
+ * messages received by the other one is reported.
+ *
+ * Usage: ./bench_sockets [<server_exec> [<port>]]
+ *  where:
+ *      -server_exec [optional] : Path of MTL server (default ./bin/server).
+ *      -port [optional] : Port used by server (default 9640).
+ *
+ * Version: 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "message.h"
+#include "sock_tuning.h"
+#include "bench_util.h"
+
+
+#define BURSTS_NUM 2000
+#define BURST_LEN 2
+#define MESSAGES_NUM 100000  // Messages sent on throughput pass.
+#define WINDOW 256           // Messages in flight on throughput pass.
+#define DATA_LEN 32
+#define RECV_TIMEOUT_MS 5000  // Run fails if a message takes longer.
+
+
+const char *profiles[] = { "default", "latency", "bulk", NULL };
+
+int run(const char *exec, int port, const char *profile);
+
+
+int main(int argc, char *argv[])
+{
+    const char *exec = argc > 1 ? argv[1] : "./bin/server";
+    int port = argc > 2 ? atoi(argv[2]) : 9640;
+
+    signal(SIGPIPE, SIG_IGN);
+    printf("%d bursts of %d messages, %d pipelined messages, "
+           "%d bytes each\n", BURSTS_NUM, BURST_LEN, MESSAGES_NUM, DATA_LEN);
+
+    int failed = 0;
+    for (int i = 0; profiles[i]; i++)
+        failed |= run(exec, port++, profiles[i]);
+
+    printf(failed ? "FAILED\n" : "PASSED\n");
+    return failed;
+}
+
+/**
+ * Runs both passes of the benchmark against a new server, with server and
+ * clients tuned by given profile.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int run(const char *exec, int port, const char *profile)
+{
+    struct sock_tuning tuning;
+    if (sock_tuning_profile(&tuning, profile)) return 1;
+
+    // Server runs a single event loop with given socket profile.
+    const char *options[] = { "-e", "1", "-o", profile, NULL };
+    pid_t pid = bench_start_server(exec, port, options);
+    if (pid < 0) return 1;
+
+    int failed = 1;
+    int sender_fd = bench_connect_server(port, &tuning);
+    int receiver_fd = bench_connect_server(port, &tuning);
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    if (sender_fd < 0 || receiver_fd < 0 ||
+        getsockname(receiver_fd, (struct sockaddr *) &addr, &addr_len)) {
+        fprintf(stderr, "ERROR: Failed to connect to server.\n");
+        goto out;
+    }
+    struct timeval timeout = { RECV_TIMEOUT_MS / 1000,
+                               RECV_TIMEOUT_MS % 1000 * 1000 };
+    setsockopt(receiver_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    usleep(200000);  // Let server register both clients.
+
+    message_t m;
+    memset(&m, 0, sizeof(m));
+    m.dest_addr = INADDR_LOOPBACK;
+    m.dest_port = ntohs(addr.sin_port);
+    m.priority = MESSAGE_PRIORITY_NORMAL;
+    m.len = DATA_LEN;
+    uint16_t count = 0;
+    char buf[MESSAGE_FRAME_MAX];
+    size_t len = 0;
+    int size;
+
+    // Latency pass.
+    uint64_t latencies[BURSTS_NUM];
+    int bursts;
+    for (bursts = 0; bursts < BURSTS_NUM; bursts++) {
+        uint64_t sent_ns = bench_now_ns();
+        int i;
+        for (i = 0; i < BURST_LEN; i++)
+            if (bench_send_frame(sender_fd, &m, &count)) break;
+        for (i = 0; i < BURST_LEN; i++) {
+            if (!(size = bench_receive_frame(receiver_fd, buf, &len))) break;
+            memmove(buf, buf + size, len - size);
+            len -= size;
+        }
+        if (i < BURST_LEN) break;
+        latencies[bursts] = bench_now_ns() - sent_ns;
+    }
+    if (bursts < BURSTS_NUM) goto out;
+    qsort(latencies, bursts, sizeof(uint64_t), bench_compare_latency);
+
+    // Throughput pass, keeping a window of messages in flight.
+    uint64_t start = bench_now_ns();
+    int sent = 0;
+    int received;
+    for (received = 0; received < MESSAGES_NUM; received++) {
+        while (sent < MESSAGES_NUM && sent - received < WINDOW) {
+            if (bench_send_frame(sender_fd, &m, &count)) goto out;
+            sent++;
+        }
+        if (!(size = bench_receive_frame(receiver_fd, buf, &len))) break;
+        memmove(buf, buf + size, len - size);
+        len -= size;
+    }
+    uint64_t stop = bench_now_ns();
+    failed = received < MESSAGES_NUM;
+
+    printf("%-7s : burst p50 %8.1f us, p99 %8.1f us, %8.0f msgs/s\n",
+           profile, latencies[bursts / 2] / 1e3,
+           latencies[bursts * 99 / 100] / 1e3,
+           received / ((stop - start) / 1e9));
+
+out:
+    if (failed) fprintf(stderr, "ERROR: Run of %s profile failed.\n", profile);
+    if (sender_fd >= 0) close(sender_fd);
+    if (receiver_fd >= 0) close(receiver_fd);
+    kill(pid, SIGINT);
+    waitpid(pid, NULL, 0);
+    return failed;
+}
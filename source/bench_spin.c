@@ -0,0 +1,181 @@
+/**
+ * bench_spin.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A benchmark of the latency of waking up an idle sending unit of MTL
+ * server, against the CPU time it spends busy-polling, for a series of spin
+ * budgets given by -s option of server.
+ *
+ * For every budget, a server on event loop mode is started, and a client
+ * sends messages to another one, one at a time, after an idle gap. Gaps are
+ * either shorter than budgets, so a spinning sending unit catches every
+ * message, or longer than all of them, so spinning is only a cost. Every
+ * message carries the time it was sent, so its receiver measures latency
+ * through server. p50 and p99 latency are reported, along with CPU usage of
+ * server over the run, read from /proc/<pid>/stat.
+ *
+ * Server doesn't spin when sending unit can only run on a single CPU, so on
+ * such hosts all budgets perform the same.
+ *
+ * Usage: ./bench_spin [<server_exec> [<port>]]
+ *  where:
+ *      -server_exec [optional] : Path of MTL server (default ./bin/server).
+ *      -port [optional] : Port used by server (default 9620).
+ *
+ * Version: 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "message.h"
+#include "bench_util.h"
+
+
+#define MESSAGES_NUM 1000
+#define DATA_LEN 32
+#define RECV_TIMEOUT_MS 5000  // Run fails if a message takes longer.
+
+
+const char *spin_budgets[] = { "0", "50", "200", NULL };
+const int gaps_us[] = { 20, 2000, 0 };  // Idle times before every message.
+
+long cpu_ticks(pid_t pid);
+int run(const char *exec, int port, const char *spin_us, int gap_us);
+
+
+int main(int argc, char *argv[])
+{
+    const char *exec = argc > 1 ? argv[1] : "./bin/server";
+    int port = argc > 2 ? atoi(argv[2]) : 9620;
+
+    signal(SIGPIPE, SIG_IGN);
+    printf("%d messages of %d bytes each, %ld CPUs\n",
+           MESSAGES_NUM, DATA_LEN, sysconf(_SC_NPROCESSORS_ONLN));
+
+    int failed = 0;
+    for (int g = 0; gaps_us[g]; g++)
+        for (int i = 0; spin_budgets[i]; i++)
+            failed |= run(exec, port++, spin_budgets[i], gaps_us[g]);
+
+    printf(failed ? "FAILED\n" : "PASSED\n");
+    return failed;
+}
+
+/**
+ * Returns CPU time of given process in clock ticks, in user and kernel mode,
+ * or -1 on failure.
+ */
+long cpu_ticks(pid_t pid)
+{
+    char path[64];
+    char stat[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    ssize_t n = read(fd, stat, sizeof(stat) - 1);
+    close(fd);
+    if (n <= 0) return -1;
+    stat[n] = '\0';
+
+    // Name of process may hold spaces, so fields are counted after it.
+    char *fields = strrchr(stat, ')');
+    unsigned long utime, stime;
+    if (!fields || sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u "
+                                      "%*u %*u %lu %lu", &utime, &stime) != 2)
+        return -1;
+    return utime + stime;
+}
+
+/**
+ * Runs the benchmark against a new server, started with given spin budget,
+ * sending a message after every gap of given length.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int run(const char *exec, int port, const char *spin_us, int gap_us)
+{
+    uint64_t *latencies = (uint64_t *) malloc(sizeof(uint64_t) * MESSAGES_NUM);
+    if (!latencies) return 1;
+
+    // Server runs a single event loop with given spin budget.
+    const char *options[] = { "-e", "1", "-s", spin_us, NULL };
+    pid_t pid = bench_start_server(exec, port, options);
+    if (pid < 0) {
+        free(latencies);
+        return 1;
+    }
+
+    int failed = 1;
+    // Sender never hears from server, so its acks would be delayed.
+    struct sock_tuning nodelay = { .nodelay = 1 };
+    int sender_fd = bench_connect_server(port, &nodelay);
+    int receiver_fd = bench_connect_server(port, &nodelay);
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    if (sender_fd < 0 || receiver_fd < 0 ||
+        getsockname(receiver_fd, (struct sockaddr *) &addr, &addr_len)) {
+        fprintf(stderr, "ERROR: Failed to connect to server.\n");
+        goto out;
+    }
+    struct timeval timeout = { RECV_TIMEOUT_MS / 1000,
+                               RECV_TIMEOUT_MS % 1000 * 1000 };
+    setsockopt(receiver_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    usleep(200000);  // Let server register both clients.
+
+    message_t m;
+    memset(&m, 0, sizeof(m));
+    m.dest_addr = INADDR_LOOPBACK;
+    m.dest_port = ntohs(addr.sin_port);
+    m.priority = MESSAGE_PRIORITY_NORMAL;
+    m.len = DATA_LEN;
+    uint16_t count = 0;
+    char buf[MESSAGE_FRAME_MAX];
+    size_t len = 0;
+
+    uint64_t start = bench_now_ns();
+    long start_ticks = cpu_ticks(pid);
+    int received;
+    for (received = 0; received < MESSAGES_NUM; received++) {
+        usleep(gap_us);
+        uint64_t sent_ns = bench_now_ns();
+        memcpy(m.data, &sent_ns, sizeof(sent_ns));
+        if (bench_send_frame(sender_fd, &m, &count)) break;
+
+        int size = bench_receive_frame(receiver_fd, buf, &len);
+        if (!size) break;
+        latencies[received] = bench_now_ns() - sent_ns;
+        memmove(buf, buf + size, len - size);
+        len -= size;
+    }
+    long stop_ticks = cpu_ticks(pid);
+    uint64_t stop = bench_now_ns();
+    failed = received < MESSAGES_NUM;
+
+    qsort(latencies, received, sizeof(uint64_t), bench_compare_latency);
+    double cpu = (double) (stop_ticks - start_ticks) / sysconf(_SC_CLK_TCK) /
+                 ((stop - start) / 1e9) * 100;
+    printf("gap %4d us, spin %3s us : p50 %7.1f us, p99 %7.1f us, "
+           "server CPU %5.1f%%\n", gap_us, spin_us,
+           received ? latencies[received / 2] / 1e3 : 0.0,
+           received ? latencies[received * 99 / 100] / 1e3 : 0.0, cpu);
+
+out:
+    if (sender_fd >= 0) close(sender_fd);
+    if (receiver_fd >= 0) close(receiver_fd);
+    kill(pid, SIGINT);
+    waitpid(pid, NULL, 0);
+    free(latencies);
+    return failed;
+}
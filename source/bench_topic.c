@@ -0,0 +1,266 @@
+/**
+ * bench_topic.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A benchmark of the index of subscriptions to topics, at 10k subscriptions.
+ *
+ * Subscribers watch rooms of buildings, e.g. "building/3/floor/2/room/7",
+ * whole floors through "building/3/floor/2/#" or whole buildings through
+ * "building/3/#". Topics of random rooms are then matched, by one and by
+ * concurrent threads, as publishers of sending unit would do. Results are
+ * checked against, and compared to, scanning all filters linearly.
+ *
+ * Usage: ./bench_topic
+ *
+ * Version: 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "topic_index.h"
+
+
+#define SUBSCRIBERS_NUM 10000
+#define BUILDINGS_NUM 100
+#define FLOORS_NUM 10
+#define ROOMS_NUM 10
+#define MATCHES_NUM 1000000
+#define LINEAR_MATCHES_NUM 10000
+#define THREADS_NUM 4
+#define TOPICS_NUM 4096      // Random topics published, generated upfront.
+#define TOPIC_LEN 64
+
+
+struct subscriber {
+    char filter[TOPIC_LEN];
+};
+
+struct match_arg {
+    topic_index_t *t;
+    int n;
+    unsigned long seq;
+    unsigned long *seen;       // Last match of every subscriber, per thread.
+    long delivered;
+};
+
+struct subscriber subscribers[SUBSCRIBERS_NUM];
+char topics[TOPICS_NUM][TOPIC_LEN];
+
+double elapsed_ms(struct timespec *start, struct timespec *stop);
+void random_topic(char *topic, unsigned int *seed);
+void match_init(struct match_arg *a, topic_index_t *t, int n);
+void count_subscriber(void *member, void *arg);
+void *match_work(void *arg);
+int filter_matches(const char *filter, const char *topic);
+int check_matches(topic_index_t *t);
+
+
+int main()
+{
+    struct timespec start, stop;
+    int failed = 0;
+
+    topic_index_t *t = topic_index_create();
+    if (!t) return 1;
+
+    // Every tenth subscriber watches a floor and every hundredth a building.
+    for (int i = 0; i < SUBSCRIBERS_NUM; i++) {
+        int b = i % BUILDINGS_NUM;
+        int f = i / BUILDINGS_NUM % FLOORS_NUM;
+        int r = i / BUILDINGS_NUM / FLOORS_NUM % ROOMS_NUM;
+        char *filter = subscribers[i].filter;
+        if (i % 100 == 99) sprintf(filter, "building/%d/#", b);
+        else if (i % 10 == 9) sprintf(filter, "building/%d/floor/%d/#", b, f);
+        else sprintf(filter, "building/%d/floor/%d/room/%d", b, f, r);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < SUBSCRIBERS_NUM; i++) {
+        char *filter = subscribers[i].filter;
+        if (topic_index_subscribe(t, filter, strlen(filter), &subscribers[i]))
+            failed = 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    printf("subscribe          : %8.1f ns/subscription\n",
+           elapsed_ms(&start, &stop) * 1e6 / SUBSCRIBERS_NUM);
+
+    unsigned int seed = 1;
+    for (int i = 0; i < TOPICS_NUM; i++) random_topic(topics[i], &seed);
+
+    failed |= check_matches(t);
+
+    // Matching by a single publisher.
+    struct match_arg single;
+    match_init(&single, t, MATCHES_NUM);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    match_work(&single);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    double ms = elapsed_ms(&start, &stop);
+    printf("match, 1 thread    : %8.1f ns/topic (%.0f topics/sec, "
+           "%.1f subscribers/topic)\n",
+           ms * 1e6 / MATCHES_NUM, MATCHES_NUM / ms * 1000,
+           (double) single.delivered / MATCHES_NUM);
+
+    // Matching by concurrent publishers, which only share a read lock.
+    pthread_t tids[THREADS_NUM];
+    struct match_arg args[THREADS_NUM];
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < THREADS_NUM; i++) match_init(&args[i], t, MATCHES_NUM);
+    for (int i = 0; i < THREADS_NUM; i++) {
+        pthread_create(&tids[i], NULL, match_work, &args[i]);
+    }
+    for (int i = 0; i < THREADS_NUM; i++) pthread_join(tids[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    for (int i = 0; i < THREADS_NUM; i++)
+        if (args[i].delivered != single.delivered) failed = 1;
+    ms = elapsed_ms(&start, &stop);
+    printf("match, %d threads   : %8.1f ns/topic (%.0f topics/sec)\n",
+           THREADS_NUM, ms * 1e6 / (MATCHES_NUM * THREADS_NUM),
+           MATCHES_NUM * THREADS_NUM / ms * 1000);
+
+    // Matching by scanning all filters, as a baseline.
+    long delivered = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int n = 0; n < LINEAR_MATCHES_NUM; n++) {
+        const char *topic = topics[n % TOPICS_NUM];
+        for (int i = 0; i < SUBSCRIBERS_NUM; i++)
+            delivered += filter_matches(subscribers[i].filter, topic);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    ms = elapsed_ms(&start, &stop);
+    printf("match, linear scan : %8.1f ns/topic (%.0f topics/sec, "
+           "%.1f subscribers/topic)\n",
+           ms * 1e6 / LINEAR_MATCHES_NUM, LINEAR_MATCHES_NUM / ms * 1000,
+           (double) delivered / LINEAR_MATCHES_NUM);
+
+    // Subscribers leave one by one, e.g. when disconnecting.
+    int removed = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < SUBSCRIBERS_NUM; i += 10)
+        removed += topic_index_remove_member(t, &subscribers[i]);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    printf("remove member      : %8.1f us/subscriber\n",
+           elapsed_ms(&start, &stop) * 1e3 / (SUBSCRIBERS_NUM / 10));
+    if (removed != SUBSCRIBERS_NUM / 10) failed = 1;
+
+    for (int i = 0; i < SUBSCRIBERS_NUM; i++) {
+        char *filter = subscribers[i].filter;
+        int rc = topic_index_unsubscribe(t, filter, strlen(filter),
+                                         &subscribers[i]);
+        if (!rc != !!(i % 10)) failed = 1;
+    }
+    if (t->root.children_num || t->levels_num) failed = 1;  // All freed.
+    topic_index_destroy(t, NULL);
+    free(single.seen);
+    for (int i = 0; i < THREADS_NUM; i++) free(args[i].seen);
+
+    printf(failed ? "FAILED\n" : "PASSED\n");
+    return failed;
+}
+
+double elapsed_ms(struct timespec *start, struct timespec *stop)
+{
+    return (stop->tv_sec - start->tv_sec) * 1e3 +
+           (stop->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/**
+ * Writes the topic of a random room, or rarely of a whole floor.
+ */
+void random_topic(char *topic, unsigned int *seed)
+{
+    int b = rand_r(seed) % BUILDINGS_NUM;
+    int f = rand_r(seed) % FLOORS_NUM;
+    int r = rand_r(seed) % (ROOMS_NUM + 1);
+    if (r == ROOMS_NUM) sprintf(topic, "building/%d/floor/%d", b, f);
+    else sprintf(topic, "building/%d/floor/%d/room/%d", b, f, r);
+}
+
+void match_init(struct match_arg *a, topic_index_t *t, int n)
+{
+    a->t = t;
+    a->n = n;
+    a->seq = 0;
+    a->seen = (unsigned long *) calloc(SUBSCRIBERS_NUM, sizeof(unsigned long));
+    a->delivered = 0;
+}
+
+/**
+ * Counts a subscriber once per match, as sending unit does.
+ */
+void count_subscriber(void *member, void *arg)
+{
+    struct match_arg *a = (struct match_arg *) arg;
+    int i = (struct subscriber *) member - subscribers;
+    if (a->seen[i] == a->seq) return;
+    a->seen[i] = a->seq;
+    a->delivered++;
+}
+
+/**
+ * Matches topics, all threads going through the same ones.
+ */
+void *match_work(void *arg)
+{
+    struct match_arg *a = (struct match_arg *) arg;
+
+    for (int n = 0; n < a->n; n++) {
+        const char *topic = topics[n % TOPICS_NUM];
+        a->seq++;
+        topic_index_for_each(a->t, topic, strlen(topic), count_subscriber, a);
+    }
+
+    return NULL;
+}
+
+/**
+ * Returns 1 if given filter matches given topic, otherwise 0.
+ */
+int filter_matches(const char *filter, const char *topic)
+{
+    size_t len = strlen(filter);
+    if (len >= 1 && filter[len - 1] == '#') {
+        if (len == 1) return 1;
+        size_t prefix = len - 2;  // Without trailing "/#".
+        return !strncmp(filter, topic, prefix) &&
+               (topic[prefix] == '\0' || topic[prefix] == '/');
+    }
+    return !strcmp(filter, topic);
+}
+
+/**
+ * Checks that the index finds the same subscribers as scanning all filters.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int check_matches(topic_index_t *t)
+{
+    struct match_arg a;
+    int failed = 0;
+    match_init(&a, t, 0);
+
+    for (int n = 0; n < TOPICS_NUM && !failed; n++) {
+        const char *topic = topics[n];
+        a.seq++;
+        a.delivered = 0;
+        topic_index_for_each(t, topic, strlen(topic), count_subscriber, &a);
+
+        long expected = 0;
+        for (int i = 0; i < SUBSCRIBERS_NUM; i++) {
+            int matches = filter_matches(subscribers[i].filter, topic);
+            if (matches != (a.seen[i] == a.seq)) failed = 1;
+            expected += matches;
+        }
+        if (a.delivered != expected) failed = 1;
+    }
+
+    free(a.seen);
+    return failed;
+}
@@ -0,0 +1,124 @@
+/**
+ * bench_util.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * An implementation of routines defined in bench_util.h.
+ *
+ * Version: 0.1
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "bench_util.h"
+
+
+pid_t
+bench_start_server(const char *exec, int port, const char *options[])
+{
+    char port_arg[16];
+    snprintf(port_arg, sizeof(port_arg), "%d", port);
+
+    const char *argv[BENCH_SERVER_ARGS_MAX] = { exec };
+    int argc = 1;
+    while (options && *options && argc < BENCH_SERVER_ARGS_MAX - 2)
+        argv[argc++] = *options++;
+    argv[argc++] = port_arg;
+    argv[argc] = NULL;
+
+    pid_t pid = fork();
+    if (pid) return pid;
+
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+    execv(exec, (char * const *) argv);
+    _exit(127);
+}
+
+
+int
+bench_connect_server(int port, const struct sock_tuning *t)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    for (int attempt = 0; attempt < 100; attempt++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) return -1;
+        if (t && sock_tuning_apply(fd, t)) {
+            close(fd);
+            return -1;
+        }
+        if (!connect(fd, (struct sockaddr *) &addr, sizeof(addr))) return fd;
+        close(fd);
+        usleep(20000);
+    }
+    return -1;
+}
+
+
+int
+bench_send_frame(int fd, message_t *m, uint16_t *count)
+{
+    char frame[MESSAGE_FRAME_MAX];
+    if (count) m->count = (*count)++;
+    size_t size = message_serialize(m, frame, MESSAGE_FORMAT_FRAMED);
+
+    size_t off = 0;
+    while (off < size) {
+        ssize_t n = send(fd, frame + off, size - off, MSG_NOSIGNAL);
+        if (n <= 0) return -1;
+        off += n;
+    }
+    return 0;
+}
+
+
+int
+bench_receive_frame(int fd, char *buf, size_t *len)
+{
+    size_t size;
+    while (!(size = message_frame_size(buf, *len, MESSAGE_FORMAT_FRAMED)) ||
+           size > *len) {
+        ssize_t n = recv(fd, buf + *len, MESSAGE_FRAME_MAX - *len, 0);
+        if (n <= 0) return 0;
+        *len += n;
+    }
+    return size;
+}
+
+
+uint64_t
+bench_now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+
+double
+bench_elapsed_ms(struct timespec *start, struct timespec *stop)
+{
+    return (stop->tv_sec - start->tv_sec) * 1e3 +
+           (stop->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+
+int
+bench_compare_latency(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
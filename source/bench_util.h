@@ -0,0 +1,117 @@
+/**
+ * bench_util.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header defining routines shared by benchmarks that run an MTL server
+ * and talk to it through raw sockets, on framed wire format.
+ *
+ * Routines defined in bench_util.h:
+ *  -pid_t
+ *   bench_start_server(const char *exec, int port, const char *options[])
+ *  -int
+ *   bench_connect_server(int port, const struct sock_tuning *t)
+ *  -int
+ *   bench_send_frame(int fd, message_t *m, uint16_t *count)
+ *  -int
+ *   bench_receive_frame(int fd, char *buf, size_t *len)
+ *  -uint64_t
+ *   bench_now_ns()
+ *  -double
+ *   bench_elapsed_ms(struct timespec *start, struct timespec *stop)
+ *  -int
+ *   bench_compare_latency(const void *a, const void *b)
+ *
+ * Version: 0.1
+ */
+
+#ifndef __bench_util_h__
+#define __bench_util_h__
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include "message.h"
+#include "sock_tuning.h"
+
+
+#define BENCH_SERVER_ARGS_MAX 16  // Max arguments a server is started with.
+
+
+/**
+ * Starts a server listening on given port, with given options, with its
+ * output discarded.
+ *
+ * Parameters:
+ *  -exec : Path of MTL server.
+ *  -port : Port server listens on.
+ *  -options : NULL-terminated list of options passed before port, or NULL.
+ *
+ * Returns:
+ *  Process id of server, or -1 on failure.
+ */
+pid_t
+bench_start_server(const char *exec, int port, const char *options[]);
+
+/**
+ * Connects to server on local host, retrying while it starts.
+ *
+ * Parameters:
+ *  -port : Port server listens on.
+ *  -t : Tuning applied to the socket before connecting, or NULL to keep
+ *          defaults.
+ *
+ * Returns:
+ *  A connected socket, or -1 on failure.
+ */
+int
+bench_connect_server(int port, const struct sock_tuning *t);
+
+/**
+ * Sends given message on framed format.
+ *
+ * Parameters:
+ *  -count : If not NULL, the count of the next message of the sender, which
+ *          is given to the message and incremented. Otherwise, count of
+ *          message is sent as is.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int
+bench_send_frame(int fd, message_t *m, uint16_t *count);
+
+/**
+ * Receives a single frame to given buffer of MESSAGE_FRAME_MAX bytes, where
+ * len bytes are already held. Bytes after the frame are kept in buffer.
+ *
+ * Returns:
+ *  Size of received frame, or 0 on failure and timeout.
+ */
+int
+bench_receive_frame(int fd, char *buf, size_t *len);
+
+/**
+ * Returns current time of CLOCK_MONOTONIC in nanoseconds.
+ */
+uint64_t
+bench_now_ns();
+
+/**
+ * Returns milliseconds elapsed between given times.
+ */
+double
+bench_elapsed_ms(struct timespec *start, struct timespec *stop);
+
+/**
+ * Compares two latencies of uint64_t, for sorting them by qsort().
+ */
+int
+bench_compare_latency(const void *a, const void *b);
+
+
+#endif
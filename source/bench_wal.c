@@ -0,0 +1,191 @@
+/**
+ * bench_wal.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A benchmark of the write-ahead log of accepted messages.
+ *
+ * It measures the cost of appending messages, by one and by concurrent
+ * threads, and of marking them in batches the way sending unit does. Then,
+ * it reopens a log holding 1M undelivered messages and measures the time to
+ * replay them. Finally, it checks that compaction removes delivered segments.
+ *
+ * Usage: ./bench_wal [<dir>]
+ *  where:
+ *      -dir [optional] : Directory used for the log (default /tmp/bench_wal).
+ *              Its segments are removed first.
+ *
+ * Version: 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include "wal.h"
+#include "message.h"
+
+
+#define MESSAGES_NUM 1000000
+#define PAYLOAD 64           // Data bytes of every message.
+#define THREADS_NUM 4
+#define MARK_BATCH 64        // Ids marked at once, as by sending unit.
+
+
+struct append_arg {
+    wal_t *w;
+    int n;
+    uint64_t *ids;
+};
+
+void remove_segments(const char *dir);
+double elapsed_ms(struct timespec *start, struct timespec *stop);
+void *append_work(void *arg);
+void count_replayed(message_t *m, uint64_t id, void *arg);
+
+
+int main(int argc, char *argv[])
+{
+    const char *dir = argc > 1 ? argv[1] : "/tmp/bench_wal";
+    struct timespec start, stop;
+    int failed = 0;
+
+    uint64_t *ids = (uint64_t *) malloc(sizeof(uint64_t) * MESSAGES_NUM);
+    if (!ids) return 1;
+
+    // Append by a single thread.
+    remove_segments(dir);
+    wal_t *w = wal_open(dir, 0);
+    if (!w) return 1;
+    struct append_arg single = { w, MESSAGES_NUM, ids };
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    append_work(&single);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    double ms = elapsed_ms(&start, &stop);
+    printf("append, 1 thread   : %8.1f ns/message (%.0f messages/sec)\n",
+           ms * 1e6 / MESSAGES_NUM, MESSAGES_NUM / ms * 1000);
+
+    // Marking, as sending unit does after every batch.
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < MESSAGES_NUM; i += MARK_BATCH) {
+        int n = MESSAGES_NUM - i < MARK_BATCH ? MESSAGES_NUM - i : MARK_BATCH;
+        wal_mark(w, ids + i, n);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    ms = elapsed_ms(&start, &stop);
+    printf("mark, batches of %2d: %8.1f ns/message\n",
+           MARK_BATCH, ms * 1e6 / MESSAGES_NUM);
+
+    int removed = wal_compact(w);
+    printf("compaction         : %d delivered segments removed\n", removed);
+    if (removed < 1) failed = 1;
+    wal_close(w);
+
+    // Append by concurrent threads, as by event loops.
+    remove_segments(dir);
+    w = wal_open(dir, 0);
+    if (!w) return 1;
+    pthread_t tids[THREADS_NUM];
+    struct append_arg args[THREADS_NUM];
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int t = 0; t < THREADS_NUM; t++) {
+        args[t].w = w;
+        args[t].n = MESSAGES_NUM / THREADS_NUM;
+        args[t].ids = ids + t * (MESSAGES_NUM / THREADS_NUM);
+        pthread_create(&tids[t], NULL, append_work, &args[t]);
+    }
+    for (int t = 0; t < THREADS_NUM; t++) pthread_join(tids[t], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    ms = elapsed_ms(&start, &stop);
+    printf("append, %d threads  : %8.1f ns/message (%.0f messages/sec)\n",
+           THREADS_NUM, ms * 1e6 / MESSAGES_NUM, MESSAGES_NUM / ms * 1000);
+    wal_close(w);
+
+    // Replay of all messages, left undelivered.
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    w = wal_open(dir, 0);
+    if (!w) return 1;
+    long replayed = 0;
+    int rc = wal_replay(w, count_replayed, &replayed);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    printf("replay             : %ld messages in %.1f ms\n",
+           replayed, elapsed_ms(&start, &stop));
+    if (rc != MESSAGES_NUM || replayed != MESSAGES_NUM) failed = 1;
+
+    // Replayed messages keep their ids, so delivering them frees the log.
+    for (int i = 0; i < MESSAGES_NUM; i += MARK_BATCH) {
+        int n = MESSAGES_NUM - i < MARK_BATCH ? MESSAGES_NUM - i : MARK_BATCH;
+        wal_mark(w, ids + i, n);
+    }
+    removed = wal_compact(w);
+    printf("compaction         : %d replayed segments removed\n", removed);
+    if (removed < 1) failed = 1;
+    wal_close(w);
+
+    remove_segments(dir);
+    free(ids);
+
+    printf(failed ? "FAILED\n" : "PASSED\n");
+    return failed;
+}
+
+/**
+ * Removes segment files of a log from given directory.
+ */
+void remove_segments(const char *dir)
+{
+    DIR *d = opendir(dir);
+    if (!d) return;
+
+    struct dirent *e;
+    char path[4096];
+    while ((e = readdir(d))) {
+        if (strncmp(e->d_name, "wal-", 4)) continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        unlink(path);
+    }
+    closedir(d);
+}
+
+double elapsed_ms(struct timespec *start, struct timespec *stop)
+{
+    return (stop->tv_sec - start->tv_sec) * 1e3 +
+           (stop->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/**
+ * Appends messages to a log, keeping their ids.
+ */
+void *append_work(void *arg)
+{
+    struct append_arg *a = (struct append_arg *) arg;
+    message_t m;
+    memset(&m, 0, sizeof(m));
+    m.src_addr = 0x7f000001;
+    m.src_port = 40000;
+    m.dest_addr = 0x7f000001;
+    m.dest_port = 40001;
+    m.priority = MESSAGE_PRIORITY_NORMAL;
+    m.len = PAYLOAD;
+
+    for (int i = 0; i < a->n; i++) {
+        m.count = i;
+        a->ids[i] = wal_append(a->w, &m);
+    }
+
+    return NULL;
+}
+
+/**
+ * Counts replayed messages, checking they're intact.
+ */
+void count_replayed(message_t *m, uint64_t id, void *arg)
+{
+    long *replayed = (long *) arg;
+    if (m->len == PAYLOAD && m->dest_port == 40001 && id) (*replayed)++;
+}
@@ -13,12 +13,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <string.h>
 #include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
@@ -29,6 +31,8 @@
 #include "client_svc.h"
 
 
+int
+_connect_local(client_svc_t *svc, struct client_svc_cfg *options);
 int
 _start_sending_messages(client_svc_t *svc);
 int
@@ -45,6 +49,12 @@ int
 _send_message(client_svc_t *svc, message_t *m);
 void
 _handle_nacked_message(client_svc_t *svc, message_t *m);
+void
+_schedule_message(client_svc_t *svc, message_t *m);
+void
+_schedule_group_request(client_svc_t *svc, uint16_t group, uint8_t flags);
+int
+_schedule_topic_request(client_svc_t *svc, const char *filter, uint8_t flags);
 
 
 client_svc_t *
@@ -75,6 +85,7 @@ client_svc_create()
     svc->handle_incoming = NULL;
     svc->counter = 0;
     svc->sender_unit_run = 0;
+    svc->wire_format = MESSAGE_FORMAT_FRAMED;
     
     return svc;
 
@@ -123,6 +134,10 @@ client_svc_connect(client_svc_t *svc, struct client_svc_cfg *options)
 
     int rc;
 
+    svc->wire_format = options->wire_format;
+
+    if (options->unix_path) return _connect_local(svc, options);
+
     // Open an IPv4 TCP socket.
     svc->socket_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (svc->socket_fd < 0) {
@@ -130,6 +145,13 @@ client_svc_connect(client_svc_t *svc, struct client_svc_cfg *options)
         return -1;
     }
 
+    // Buffers are sized before connecting, so the window accounts for them.
+    rc = sock_tuning_apply(svc->socket_fd, &options->sock);
+    if (rc) {
+        perror("ERROR tuning socket");
+        return -1;
+    }
+
     // Bind new socket to provided service port.
     struct sockaddr_in svc_addr;
     svc_addr.sin_family = AF_INET;
@@ -175,6 +197,69 @@ client_svc_connect(client_svc_t *svc, struct client_svc_cfg *options)
 }
 
 
+/**
+ * Connects given client service to a server on local host, through the unix
+ * socket at the path given by options.
+ *
+ * Socket is bound to an abstract name holding local port, so server knows
+ * service by the same endpoint other clients send messages to.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero number.
+ */
+int
+_connect_local(client_svc_t *svc, struct client_svc_cfg *options)
+{
+    int rc;
+
+    struct sockaddr_un server_addr;
+    memset(&server_addr, 0, sizeof(struct sockaddr_un));
+    server_addr.sun_family = AF_UNIX;
+    if (strlen(options->unix_path) >= sizeof(server_addr.sun_path)) {
+        fprintf(stderr, "ERROR: Path of unix socket is too long.\n");
+        return -1;
+    }
+    strcpy(server_addr.sun_path, options->unix_path);
+
+    svc->socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (svc->socket_fd < 0) {
+        perror("ERROR opening socket");
+        return -1;
+    }
+
+    struct sock_tuning tuning = options->sock;
+    sock_tuning_local(&tuning);
+    rc = sock_tuning_apply(svc->socket_fd, &tuning);
+    if (rc) {
+        perror("ERROR tuning socket");
+        return -1;
+    }
+
+    // Abstract names start by a null byte, and are as long as the address.
+    struct sockaddr_un svc_addr;
+    memset(&svc_addr, 0, sizeof(struct sockaddr_un));
+    svc_addr.sun_family = AF_UNIX;
+    int name_len = snprintf(svc_addr.sun_path + 1,
+                            sizeof(svc_addr.sun_path) - 1, MESSAGE_LOCAL_NAME,
+                            (unsigned int) (uint16_t) options->local_port);
+    rc = bind(svc->socket_fd, (struct sockaddr *) &svc_addr,
+              offsetof(struct sockaddr_un, sun_path) + 1 + name_len);
+    if (rc) {
+        perror("ERROR binding to provided service port");
+        return -1;
+    }
+
+    rc = connect(svc->socket_fd, (struct sockaddr *) &server_addr,
+                 sizeof(struct sockaddr_un));
+    if (rc < 0) {
+        perror("ERROR connecting to local server");
+        return -1;
+    }
+
+    return 0;
+}
+
+
 int
 client_svc_start(client_svc_t *svc)
 {
@@ -215,12 +300,82 @@ client_svc_stop(client_svc_t *svc)
 
 void
 client_svc_schedule_out_message(client_svc_t *svc, message_t *m)
+{
+    m->flags = 0;
+    _schedule_message(svc, m);
+}
+
+
+void
+client_svc_schedule_priority_message(
+        client_svc_t *svc, message_t *m, uint8_t priority)
+{
+    m->priority = priority;
+    client_svc_schedule_out_message(svc, m);
+}
+
+
+void
+client_svc_join_group(client_svc_t *svc, uint16_t group)
+{
+    _schedule_group_request(svc, group, MESSAGE_GROUP_JOIN);
+}
+
+
+void
+client_svc_leave_group(client_svc_t *svc, uint16_t group)
+{
+    _schedule_group_request(svc, group, MESSAGE_GROUP_LEAVE);
+}
+
+
+int
+client_svc_subscribe(client_svc_t *svc, const char *filter)
+{
+    return _schedule_topic_request(svc, filter, MESSAGE_TOPIC_SUBSCRIBE);
+}
+
+
+int
+client_svc_unsubscribe(client_svc_t *svc, const char *filter)
+{
+    return _schedule_topic_request(svc, filter, MESSAGE_TOPIC_UNSUBSCRIBE);
+}
+
+
+int
+client_svc_publish(client_svc_t *svc, const char *topic,
+                   const void *data, size_t len)
+{
+    size_t topic_len = strlen(topic) + 1;
+    if (topic_len + len > MESSAGE_DATA_LENGTH) return -1;
+
+    message_t *m = message_create();
+    if (!m) {
+        perror("Failed to allocate published message");
+        return -1;
+    }
+    m->dest_addr = MESSAGE_TOPIC_ADDR;
+    m->dest_port = 0;
+    memcpy(m->data, topic, topic_len);
+    memcpy(m->data + topic_len, data, len);
+    m->len = topic_len + len;
+    client_svc_schedule_out_message(svc, m);
+    return 0;
+}
+
+
+/**
+ * Schedules given message for sending, keeping its flags.
+ */
+void
+_schedule_message(client_svc_t *svc, message_t *m)
 {
     // TODO: Fill these properties in a different place.
     m->src_addr = 0;
     m->src_port = 0;
-    m->flags = 0;
-    m->len = MESSAGE_DATA_LENGTH;
+    if (m->len > MESSAGE_DATA_LENGTH) m->len = MESSAGE_DATA_LENGTH;
+    if (m->priority > MESSAGE_PRIORITY_HIGH) m->priority = MESSAGE_PRIORITY_HIGH;
 
     pthread_mutex_lock(svc->out_messages_mutex);
     while ((linked_list_size(svc->out_messages) +
@@ -237,6 +392,53 @@ client_svc_schedule_out_message(client_svc_t *svc, message_t *m)
 }
 
 
+/**
+ * Schedules a request for joining or leaving given group on server.
+ */
+void
+_schedule_group_request(client_svc_t *svc, uint16_t group, uint8_t flags)
+{
+    message_t *m = message_create();
+    if (!m) {
+        perror("Failed to allocate group request");
+        return;
+    }
+    m->dest_addr = MESSAGE_GROUP_ADDR;
+    m->dest_port = group;
+    m->flags = flags;
+    m->len = 0;
+    _schedule_message(svc, m);
+}
+
+
+/**
+ * Schedules a request for subscribing with given filter on server, or for
+ * unsubscribing.
+ *
+ * Returns:
+ *  0 on success, or -1 if filter doesn't fit in a message.
+ */
+int
+_schedule_topic_request(client_svc_t *svc, const char *filter, uint8_t flags)
+{
+    size_t len = strlen(filter);
+    if (len > MESSAGE_DATA_LENGTH) return -1;
+
+    message_t *m = message_create();
+    if (!m) {
+        perror("Failed to allocate topic request");
+        return -1;
+    }
+    m->dest_addr = MESSAGE_TOPIC_ADDR;
+    m->dest_port = 0;
+    m->flags = flags;
+    memcpy(m->data, filter, len);
+    m->len = len;
+    _schedule_message(svc, m);
+    return 0;
+}
+
+
 void
 client_svc_set_incoming_mes_listener(
         client_svc_t *svc,
@@ -367,18 +569,32 @@ _receive_messages(void *args)
 {
     client_svc_t *svc = (client_svc_t *) args;
 
-    char *in_buffer = (char *) malloc(sizeof(message_t));
+    char *in_buffer = (char *) malloc(MESSAGE_FRAME_MAX);
+    size_t received = 0;
     int n;
 
-    while ((n = recv(svc->socket_fd, in_buffer,
-                     sizeof(message_t), MSG_WAITALL)) > 0) {
-        // If for any reason a message was only partially read, discard it.
-        if (n < (int) sizeof(message_t)) {
-            fprintf(stderr, "Failed to completely read incoming message.\n");
-            continue;
+    // Read as many bytes as needed for learning the size of next message,
+    // then the rest of it.
+    while ((n = recv(svc->socket_fd, in_buffer + received,
+                     message_frame_size(in_buffer, received, svc->wire_format)
+                        - received,
+                     MSG_WAITALL)) > 0) {
+        received += n;
+
+        size_t size = message_frame_size(in_buffer, received, svc->wire_format);
+        if (!size) {
+            fprintf(stderr, "Received an invalid message frame.\n");
+            break;
         }
+        if (size > received) continue;  // Header read, now read the rest.
+        received = 0;
 
-        message_t *message = message_net_to_host(in_buffer);
+        message_t *message = message_create();
+        if (!message) {
+            perror("Failed to allocate incoming message");
+            continue;
+        }
+        message_deserialize(in_buffer, message, svc->wire_format);
 
         if (message->flags) {
             _handle_nacked_message(svc, message);
@@ -396,17 +612,15 @@ _send_message(client_svc_t *svc, message_t *m)
 {
     int rc;
 
-    char *serial_message = message_host_to_net(m);
+    char serial_message[MESSAGE_FRAME_MAX];
+    size_t len = message_serialize(m, serial_message, svc->wire_format);
 
-    ssize_t n = send(
-        svc->socket_fd, serial_message, sizeof(message_t), MSG_NOSIGNAL);
-    if (n < (ssize_t) sizeof(message_t)) {
+    ssize_t n = send(svc->socket_fd, serial_message, len, MSG_NOSIGNAL);
+    if (n < (ssize_t) len) {
         fprintf(stderr, "Failed to send message\n");
         rc = -1;
     } else rc = 0;
 
-    free(serial_message);
-
     return rc;
 }
 
@@ -37,6 +37,20 @@
  *  -void
  *   client_svc_schedule_out_message(client_svc_t *svc, message_t *m)
  *  -void
+ *   client_svc_schedule_priority_message(
+ *       client_svc_t *svc, message_t *m, uint8_t priority)
+ *  -void
+ *   client_svc_join_group(client_svc_t *svc, uint16_t group)
+ *  -void
+ *   client_svc_leave_group(client_svc_t *svc, uint16_t group)
+ *  -int
+ *   client_svc_subscribe(client_svc_t *svc, const char *filter)
+ *  -int
+ *   client_svc_unsubscribe(client_svc_t *svc, const char *filter)
+ *  -int
+ *   client_svc_publish(client_svc_t *svc, const char *topic,
+ *                      const void *data, size_t len)
+ *  -void
  *   client_svc_set_incoming_mes_listener(
  *       client_svc_t *svc,
  *       void (*callback) (client_svc_t *, message_t *, void *),
@@ -52,6 +66,7 @@
 #include <stdint.h>
 #include <pthread.h>
 #include "linked_list.h"
+#include "sock_tuning.h"
 
 
 // Maximum number of pending messages to be send.
@@ -71,6 +86,7 @@ struct Client_Svc {
     pthread_t sender_tid;    // Thread id of sender unit.
     int sender_unit_run;     // Indicates whether sender unit should keep running.
     uint16_t counter;     // Counter for outgoing messages.
+    int wire_format;      // Wire format of messages exchanged with server.
     // Callback function for incoming messages.
     void (*handle_incoming) (client_svc_t *svc, message_t *m, void *arg);
     void *callback_arg;
@@ -92,6 +108,15 @@ struct client_svc_cfg {
     // Port on local host to be used for running MTL client service in host
     // byte order.
     int16_t local_port;
+    // Wire format of messages, one of MESSAGE_FORMAT_* defined in message.h.
+    // It should match the format the server is running with.
+    int wire_format;
+    // Tuning of the socket connected to server. See sock_tuning.h.
+    struct sock_tuning sock;
+    // Path of unix socket of a server on the same host, or NULL to connect
+    // over TCP. When given, hostname and server_port are not used, and
+    // service is known to other clients as MESSAGE_LOCAL_ADDR:local_port.
+    char *unix_path;
 };
 
 
@@ -116,7 +141,8 @@ void
 client_svc_destroy(client_svc_t *svc);
 
 /**
- * Connects a MTL client service to a remote MTL server.
+ * Connects a MTL client service to a remote MTL server, or to a server on
+ * local host through its unix socket.
  *
  * Parameters:
  *  -svc : Client service object to connect.
@@ -166,6 +192,14 @@ client_svc_stop(client_svc_t *svc);
 /**
  * Schedules given message for sending.
  *
+ * Only the first 'len' bytes of message's data are sent. Longer lengths are
+ * truncated to MESSAGE_DATA_LENGTH.
+ *
+ * Message is sent on the priority class set in its 'priority' field, which
+ * is MESSAGE_PRIORITY_NORMAL for messages built by message_create(). Server
+ * forwards pending messages of higher classes first. Messages still leave
+ * this client in the order they were scheduled.
+ *
  * If buffer is full, this routine will block until the message is successfully
  * scheduled.
  *
@@ -175,6 +209,74 @@ client_svc_stop(client_svc_t *svc);
 void
 client_svc_schedule_out_message(client_svc_t *svc, message_t *m);
 
+/**
+ * Schedules given message for sending on given priority class. It works like
+ * client_svc_schedule_out_message().
+ *
+ * Parameters:
+ *  -m: Message to be scheduled for sending.
+ *  -priority: One of MESSAGE_PRIORITY_* classes defined in message.h.
+ */
+void
+client_svc_schedule_priority_message(
+        client_svc_t *svc, message_t *m, uint8_t priority);
+
+/**
+ * Joins the group of given id on server. Messages sent to the group, i.e.
+ * with destination address MESSAGE_GROUP_ADDR and destination port set to
+ * group id, are then delivered to this client too. Server stores such a
+ * message once for all members. Membership lasts until it's left or the
+ * connection closes.
+ *
+ * Request is scheduled like an outgoing message, so it blocks while buffer
+ * is full.
+ */
+void
+client_svc_join_group(client_svc_t *svc, uint16_t group);
+
+/**
+ * Leaves the group of given id on server. It works like
+ * client_svc_join_group().
+ */
+void
+client_svc_leave_group(client_svc_t *svc, uint16_t group);
+
+/**
+ * Subscribes to topics matching given filter on server. Filter is either a
+ * topic, made of levels separated by '/', or a prefix of levels followed by
+ * a "#" level, matching every topic below that prefix. Messages published to
+ * a matching topic are then delivered to this client, once even if many of
+ * its filters match. Subscriptions last until they're removed or the
+ * connection closes.
+ *
+ * Request is scheduled like an outgoing message, so it blocks while buffer
+ * is full.
+ *
+ * Returns:
+ *  0 on success, or -1 if filter doesn't fit in a message.
+ */
+int
+client_svc_subscribe(client_svc_t *svc, const char *filter);
+
+/**
+ * Removes the subscription made with given filter. It works like
+ * client_svc_subscribe().
+ */
+int
+client_svc_unsubscribe(client_svc_t *svc, const char *filter);
+
+/**
+ * Publishes given data to given topic. Subscribers receive a message to
+ * MESSAGE_TOPIC_ADDR, whose data hold the null-terminated topic followed by
+ * given data.
+ *
+ * Returns:
+ *  0 on success, or -1 if topic and data don't fit in a message.
+ */
+int
+client_svc_publish(client_svc_t *svc, const char *topic,
+                   const void *data, size_t len);
+
 /**
  * Sets a listener routine for incoming messages.
  *
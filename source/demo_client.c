@@ -9,10 +9,12 @@
 * on interactive mode and testing mode.
 *
 * Usage: ./exec_name <server_hostname> <server_port> -mode=<mode>
-*                    [...mode_specific_args...]
+*                    [...mode_specific_args...] [-sock=<profile>] [-legacy]
 *   where:
-*      -server_hostname : IPv4 address in dot format or hostname of server.
+*      -server_hostname : IPv4 address in dot format or hostname of server,
+*              or absolute path of unix socket of a server on local host.
 *      -server_port : Port number on server where MTL service is running.
+*              Not used for unix sockets.
 *      -mode : 'i' for interactive mode, 't' for testing mode
 *      -mode_specific_args:
 *           +interactive mode: ... <port>
@@ -28,6 +30,12 @@
 *                           for communicating with the server. It should be
 *                           the IP visible to the server. If device is behind
 *                           a NAT, the public IP of the NAT should be provided.
+*                           Not used for unix sockets, where clients are
+*                           known by local address 127.255.255.254.
+*      -sock : Tuning of sockets of clients, either 'default', 'latency' or
+*              'bulk'. See sock_tuning.h.
+*      -legacy : Exchange messages on legacy fixed-size wire format. It should
+*              be used for servers started with -l flag.
 *
 * Version: 0.1
 */
@@ -90,6 +98,8 @@ pthread_mutex_t *clients_mutex;
 pthread_cond_t *client_finished;
 
 client_svc_t *msg_svc;  // Messaging service (valid on interactive mode).
+int wire_format = MESSAGE_FORMAT_FRAMED;  // Wire format used by all clients.
+struct sock_tuning sock_tuning;  // Tuning of sockets of all clients.
 
 
 message_t *
@@ -124,6 +134,18 @@ main(int argc, char *argv[])
        exit(-1);
     }
 
+    if (strcmp(argv[argc-1], "-legacy") == 0) {
+        wire_format = MESSAGE_FORMAT_LEGACY;
+        argc--;
+    }
+    if (strncmp(argv[argc-1], "-sock=", 6) == 0) {
+        if (sock_tuning_profile(&sock_tuning, argv[argc-1] + 6)) {
+            fprintf(stderr, "%s : Invalid socket profile.\n", argv[argc-1]);
+            exit(-1);
+        }
+        argc--;
+    }
+
     char *host = argv[1];
     int server_port = atoi(argv[2]);
     int mode;
@@ -182,6 +204,9 @@ interactive_mode(char *host, int server_port, int svc_port)
     options.hostname = host;
     options.server_port = server_port;
     options.local_port = svc_port;
+    options.wire_format = wire_format;
+    options.sock = sock_tuning;
+    options.unix_path = host[0] == '/' ? host : NULL;
 
     client_svc_t *svc = client_svc_create();
     if (!svc) error("Could not initialize service");
@@ -238,10 +263,13 @@ test_mode(char *hostname, int server_port,
     memset(&hints, 0, sizeof(struct addrinfo));
     hints.ai_family = AF_INET;
     hints.ai_socktype = SOCK_STREAM;
-    rc = getaddrinfo(if_ip, NULL, &hints, &res);
-    if (rc) error("Could not resolve hostname");
-    if_ip_bin = ntohl(((struct sockaddr_in *) res->ai_addr)->sin_addr.s_addr);
-    freeaddrinfo(res);
+    if (hostname[0] == '/') if_ip_bin = MESSAGE_LOCAL_ADDR;
+    else {
+        rc = getaddrinfo(if_ip, NULL, &hints, &res);
+        if (rc) error("Could not resolve hostname");
+        if_ip_bin = ntohl(((struct sockaddr_in *) res->ai_addr)->sin_addr.s_addr);
+        freeaddrinfo(res);
+    }
 
     // Init a PRNG.
     struct random_data *prng_state =
@@ -278,6 +306,9 @@ test_mode(char *hostname, int server_port,
             options.hostname = hostname;
             options.server_port = server_port;
             options.local_port = range_start + i;
+            options.wire_format = wire_format;
+            options.sock = sock_tuning;
+            options.unix_path = hostname[0] == '/' ? hostname : NULL;
 
             client_svc_t *svc = client_svc_create();
             if (!svc) error("Could not initialize service");
@@ -445,6 +476,8 @@ get_user_message()
     m->dest_addr = ntohl(dest_ip.s_addr);
     m->dest_port = dest_port;
     memcpy(m->data, data, MESSAGE_DATA_LENGTH);
+    m->len = strnlen(m->data, MESSAGE_DATA_LENGTH - 1) + 1;
+    m->data[m->len-1] = '\0';
 
     return m;
 
@@ -513,7 +546,8 @@ parse_received_message(client_svc_t *svc, message_t *m, void *arg)
         // inet_ntop(AF_INET, &dest_addr, dest_ip, INET_ADDRSTRLEN);
 
         char data_txt[MESSAGE_DATA_LENGTH+1];
-        memcpy(data_txt, m->data, MESSAGE_DATA_LENGTH);
+        memcpy(data_txt, m->data, m->len);
+        data_txt[m->len] = '\0';
 
         printf("Receiving from %s:%d --> %s\n", src_ip, m->src_port, data_txt);
     }
@@ -0,0 +1,114 @@
+/**
+ * doorbell.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * An implementation of routines defined in doorbell.h.
+ *
+ * Version: 0.1
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "doorbell.h"
+
+
+doorbell_t *
+doorbell_create()
+{
+    doorbell_t *d = (doorbell_t *) calloc(1, sizeof(doorbell_t));
+    if (!d) return NULL;
+
+    d->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (d->fd < 0) {
+        free(d);
+        return NULL;
+    }
+    d->state = DOORBELL_RUNNING;
+
+    return d;
+}
+
+
+void
+doorbell_destroy(doorbell_t *d)
+{
+    if (!d) return;
+    close(d->fd);
+    free(d);
+}
+
+
+int
+doorbell_fd(doorbell_t *d)
+{
+    return d->fd;
+}
+
+
+int
+doorbell_ring(doorbell_t *d)
+{
+    // Work of caller becomes visible before state is read, the same way
+    // consumer announces its state before its last look for work. So either
+    // consumer sees the work, or the ring sees consumer idle.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&d->state, __ATOMIC_RELAXED) == DOORBELL_RUNNING)
+        return 0;
+
+    // Only the first ring of an idle period goes further.
+    if (__atomic_load_n(&d->rung, __ATOMIC_RELAXED) ||
+        __atomic_exchange_n(&d->rung, 1, __ATOMIC_SEQ_CST))
+        return 0;
+
+    // Consumer parking after the ring sees it rung, so it doesn't block.
+    if (__atomic_load_n(&d->state, __ATOMIC_SEQ_CST) != DOORBELL_PARKED)
+        return 0;
+
+    uint64_t one = 1;
+    while (write(d->fd, &one, sizeof(one)) < 0 && errno == EINTR);
+    return 1;
+}
+
+
+void
+doorbell_idle(doorbell_t *d)
+{
+    __atomic_store_n(&d->state, DOORBELL_IDLE, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+
+int
+doorbell_rung(doorbell_t *d)
+{
+    return __atomic_load_n(&d->rung, __ATOMIC_ACQUIRE);
+}
+
+
+int
+doorbell_park(doorbell_t *d)
+{
+    __atomic_store_n(&d->state, DOORBELL_PARKED, __ATOMIC_SEQ_CST);
+    return !__atomic_load_n(&d->rung, __ATOMIC_SEQ_CST);
+}
+
+
+void
+doorbell_wake(doorbell_t *d)
+{
+    int state = __atomic_exchange_n(&d->state, DOORBELL_RUNNING,
+                                    __ATOMIC_SEQ_CST);
+    __atomic_store_n(&d->rung, 0, __ATOMIC_RELEASE);
+
+    // A ring that found consumer parked may write to eventfd even after
+    // consumer stopped blocking on it, so it's drained whenever parked.
+    uint64_t rings;
+    if (state == DOORBELL_PARKED)
+        while (read(d->fd, &rings, sizeof(rings)) < 0 && errno == EINTR);
+}
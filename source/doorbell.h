@@ -0,0 +1,130 @@
+/**
+ * doorbell.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header defining a doorbell, through which many producers wake up a
+ * single consumer when they publish new work.
+ *
+ * Doorbell coalesces wake-ups. Producers ring it without locks, and a ring
+ * costs no more than a memory fence while consumer is running, since it will
+ * look for work anyway before going idle. Only the first ring after consumer
+ * went idle is recorded, and only a ring that finds consumer parked writes to
+ * an eventfd, so a burst of work costs at most one syscall.
+ *
+ * Consumer should announce it's idle before its last look for work, and may
+ * then poll the doorbell for a while. Before blocking, it parks the doorbell
+ * and blocks only if it wasn't rung meanwhile, either by poll() or epoll on
+ * the eventfd of doorbell, along with any other file descriptor it serves.
+ * Once woken up, or after finding work, it marks itself running again.
+ *
+ * Types defined in doorbell.h:
+ *  -doorbell_t
+ *
+ * Routines defined in doorbell.h:
+ *  -doorbell_t *
+ *   doorbell_create()
+ *  -void
+ *   doorbell_destroy(doorbell_t *d)
+ *  -int
+ *   doorbell_fd(doorbell_t *d)
+ *  -int
+ *   doorbell_ring(doorbell_t *d)
+ *  -void
+ *   doorbell_idle(doorbell_t *d)
+ *  -int
+ *   doorbell_rung(doorbell_t *d)
+ *  -int
+ *   doorbell_park(doorbell_t *d)
+ *  -void
+ *   doorbell_wake(doorbell_t *d)
+ *
+ * Version: 0.1
+ */
+
+#ifndef __doorbell_h__
+#define __doorbell_h__
+
+
+// States of consumer.
+#define DOORBELL_RUNNING 0  // Will look for work, so rings are skipped.
+#define DOORBELL_IDLE 1     // Found no work, may be polling the doorbell.
+#define DOORBELL_PARKED 2   // Blocked, or about to block, on eventfd.
+
+
+typedef struct {
+    int fd;     // Eventfd, readable once rung while consumer is parked.
+    int state;  // One of DOORBELL_* states, written only by consumer.
+    int rung;   // Set by the first ring after consumer went idle.
+} doorbell_t;
+
+
+/**
+ * Creates a new doorbell, with its consumer running.
+ *
+ * Returns:
+ *  On success, a new doorbell. On failure, NULL.
+ */
+doorbell_t *
+doorbell_create();
+
+/**
+ * Destroys given doorbell.
+ */
+void
+doorbell_destroy(doorbell_t *d);
+
+/**
+ * Returns the eventfd of given doorbell, non-blocking, to be polled for
+ * input by consumer while parked.
+ */
+int
+doorbell_fd(doorbell_t *d);
+
+/**
+ * Rings given doorbell. Should be called by a producer after publishing new
+ * work.
+ *
+ * Returns:
+ *  1 if consumer was parked, so it was woken up by a syscall, otherwise 0.
+ */
+int
+doorbell_ring(doorbell_t *d);
+
+/**
+ * Announces that consumer of given doorbell found no work. Should be called
+ * before consumer looks for work for the last time, so a producer publishing
+ * work after that look rings the doorbell.
+ */
+void
+doorbell_idle(doorbell_t *d);
+
+/**
+ * Returns a non-zero integer if given doorbell has been rung since its
+ * consumer went idle. It's cheap enough to be polled.
+ */
+int
+doorbell_rung(doorbell_t *d);
+
+/**
+ * Announces that consumer of given idle doorbell is about to block on its
+ * eventfd.
+ *
+ * Returns:
+ *  A non-zero integer if consumer may block, or 0 if doorbell has been rung
+ *  meanwhile.
+ */
+int
+doorbell_park(doorbell_t *d);
+
+/**
+ * Marks consumer of given doorbell running again, after it found work or it
+ * was woken up, and resets the doorbell.
+ */
+void
+doorbell_wake(doorbell_t *d);
+
+
+#endif
@@ -0,0 +1,95 @@
+/**
+ * drr.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * An implementation of routines defined in drr.h.
+ *
+ * Version: 0.1
+ */
+
+#include <stdlib.h>
+#include "drr.h"
+
+
+drr_t *
+drr_create(unsigned long quantum)
+{
+    drr_t *drr = (drr_t *) malloc(sizeof(drr_t));
+    if (!drr) return NULL;
+
+    drr->quantum = quantum ? quantum : 1;
+    drr->head = drr->tail = NULL;
+    drr->size = 0;
+
+    return drr;
+}
+
+
+void
+drr_destroy(drr_t *drr)
+{
+    free(drr);
+}
+
+
+void
+drr_flow_init(drr_t *drr, drr_flow_t *flow, int weight, void *owner)
+{
+    if (weight < 1) weight = 1;
+    flow->quantum = drr->quantum * weight;
+    flow->deficit = 0;
+    flow->owner = owner;
+    flow->next = NULL;
+}
+
+
+void
+drr_enqueue(drr_t *drr, drr_flow_t *flow)
+{
+    flow->next = NULL;
+    if (drr->tail) drr->tail->next = flow;
+    else drr->head = flow;
+    drr->tail = flow;
+    drr->size++;
+}
+
+
+drr_flow_t *
+drr_next(drr_t *drr)
+{
+    drr_flow_t *flow = drr->head;
+    if (!flow) return NULL;
+
+    drr->head = flow->next;
+    if (!drr->head) drr->tail = NULL;
+    drr->size--;
+    flow->next = NULL;
+    flow->deficit += flow->quantum;
+    return flow;
+}
+
+
+int
+drr_charge(drr_flow_t *flow, unsigned long size)
+{
+    if (size > flow->deficit) return -1;
+    flow->deficit -= size;
+    return 0;
+}
+
+
+void
+drr_flow_idle(drr_flow_t *flow)
+{
+    flow->deficit = 0;
+}
+
+
+int
+drr_size(drr_t *drr)
+{
+    return drr->size;
+}
@@ -0,0 +1,145 @@
+/**
+ * drr.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header defining a deficit round-robin (DRR) scheduler, that shares
+ * bandwidth among flows of variable-sized packets in proportion to their
+ * weights.
+ *
+ * Scheduler keeps flows with pending packets in a round-robin list. Every
+ * time a flow comes to the head of the list, its deficit counter is credited
+ * with its quantum, i.e. a base quantum multiplied by flow's weight. The flow
+ * may then send packets as long as their size doesn't exceed its deficit,
+ * which is charged with the size of every packet sent. Unused deficit is
+ * carried to the next round, unless the flow runs out of packets.
+ *
+ * Flows are linked into the round through a link of their own, so scheduling
+ * never allocates memory and can't fail.
+ *
+ * Scheduler does no locking. Callers should serialize access to a scheduler
+ * and its flows.
+ *
+ * Types defined in drr.h:
+ *  -drr_t
+ *  -drr_flow_t
+ *
+ * Routines defined in drr.h:
+ *  -drr_t *
+ *   drr_create(unsigned long quantum)
+ *  -void
+ *   drr_destroy(drr_t *drr)
+ *  -void
+ *   drr_flow_init(drr_t *drr, drr_flow_t *flow, int weight, void *owner)
+ *  -void
+ *   drr_enqueue(drr_t *drr, drr_flow_t *flow)
+ *  -drr_flow_t *
+ *   drr_next(drr_t *drr)
+ *  -int
+ *   drr_charge(drr_flow_t *flow, unsigned long size)
+ *  -void
+ *   drr_flow_idle(drr_flow_t *flow)
+ *  -int
+ *   drr_size(drr_t *drr)
+ *
+ * Version: 0.1
+ */
+
+#ifndef __drr_h__
+#define __drr_h__
+
+
+typedef struct drr_flow {
+    unsigned long quantum;  // Credit added to deficit on every round.
+    unsigned long deficit;  // Bytes flow may still send on current round.
+    void *owner;            // Object the flow belongs to.
+    struct drr_flow *next;  // Next flow of the round, while flow is active.
+} drr_flow_t;
+
+typedef struct {
+    unsigned long quantum;  // Quantum of flows with a weight of 1.
+    // Flows with pending packets, in service order.
+    drr_flow_t *head;
+    drr_flow_t *tail;
+    int size;
+} drr_t;
+
+
+/**
+ * Creates a new DRR scheduler.
+ *
+ * Parameters:
+ *  -quantum : Bytes credited on every round to flows with a weight of 1. It
+ *          should be at least the size of the largest packet, so a flow
+ *          sends at least one packet on every round.
+ *
+ * Returns:
+ *  On success, a new scheduler with no active flows. On failure, NULL.
+ */
+drr_t *
+drr_create(unsigned long quantum);
+
+/**
+ * Destroys given scheduler. Flows still active are not touched.
+ */
+void
+drr_destroy(drr_t *drr);
+
+/**
+ * Initializes a flow to be scheduled by given scheduler.
+ *
+ * Parameters:
+ *  -drr : Scheduler the flow will be scheduled by.
+ *  -flow : Flow to initialize.
+ *  -weight : Weight of the flow. A flow with a weight of w gets w times the
+ *          bandwidth of a flow with weight 1. Values below 1 are set to 1.
+ *  -owner : Object the flow belongs to, returned through flow's owner field.
+ */
+void
+drr_flow_init(drr_t *drr, drr_flow_t *flow, int weight, void *owner);
+
+/**
+ * Appends a flow with pending packets to the end of the round. A flow should
+ * not be enqueued more than once.
+ */
+void
+drr_enqueue(drr_t *drr, drr_flow_t *flow);
+
+/**
+ * Removes the flow at the head of the round and credits it with its quantum.
+ * Caller should then charge the flow for every packet it sends, and enqueue
+ * it again if it still has pending packets, or mark it idle otherwise.
+ *
+ * Returns:
+ *  The next flow to be served, or NULL if no flow is active.
+ */
+drr_flow_t *
+drr_next(drr_t *drr);
+
+/**
+ * Charges a flow for sending a packet of given size.
+ *
+ * Returns:
+ *  0 if flow's deficit allowed sending the packet, so it has been charged.
+ *  A non-zero integer if packet should wait for the next round.
+ */
+int
+drr_charge(drr_flow_t *flow, unsigned long size);
+
+/**
+ * Resets deficit of a flow that has no more pending packets, so idle flows
+ * don't accumulate credit.
+ */
+void
+drr_flow_idle(drr_flow_t *flow);
+
+/**
+ * Returns the number of active flows.
+ */
+int
+drr_size(drr_t *drr);
+
+
+#endif
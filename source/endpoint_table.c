@@ -0,0 +1,310 @@
+/**
+ * endpoint_table.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * An implementation of routines defined in endpoint_table.h.
+ *
+ * Version: 0.1
+ */
+
+#include <stdlib.h>
+#include <sched.h>
+#include "endpoint_table.h"
+
+
+struct endpoint_slots *
+_endpoint_slots_create(size_t capacity);
+void
+_endpoint_slots_destroy(struct endpoint_slots *s);
+int
+_endpoint_table_grow(endpoint_table_t *table);
+void
+_endpoint_table_write_begin(endpoint_table_t *table);
+void
+_endpoint_table_write_end(endpoint_table_t *table);
+
+
+/**
+ * Packs an endpoint to a 48-bit key. Bit 48 is always set, so a valid key is
+ * never 0, which marks empty slots.
+ */
+static inline uint64_t
+_endpoint_key(uint32_t address, uint16_t port)
+{
+    return ((uint64_t) address << 16) | port | (1ULL << 48);
+}
+
+
+static inline size_t
+_endpoint_hash(uint64_t key)
+{
+    // Fibonacci hashing spreads successive ports and addresses.
+    return (size_t) ((key * 0x9E3779B97F4A7C15ULL) >> 24);
+}
+
+
+endpoint_table_t *
+endpoint_table_create(size_t capacity)
+{
+    size_t slots = 16;
+    while (slots < capacity) slots <<= 1;
+
+    endpoint_table_t *table =
+        (endpoint_table_t *) calloc(1, sizeof(endpoint_table_t));
+    if (!table) return NULL;
+
+    table->current = _endpoint_slots_create(slots);
+    table->retired = linked_list_create();
+    table->wr_mutex = (pthread_mutex_t *) malloc(sizeof(pthread_mutex_t));
+    if (!table->current || !table->retired || !table->wr_mutex ||
+        pthread_mutex_init(table->wr_mutex, NULL)) {
+        _endpoint_slots_destroy(table->current);
+        if (table->retired) linked_list_destroy(table->retired);
+        free(table->wr_mutex);
+        free(table);
+        return NULL;
+    }
+
+    return table;
+}
+
+
+void
+endpoint_table_destroy(endpoint_table_t *table)
+{
+    if (!table) return;
+
+    struct endpoint_slots *s;
+    while ((s = linked_list_pop(table->retired))) _endpoint_slots_destroy(s);
+    linked_list_destroy(table->retired);
+    _endpoint_slots_destroy(table->current);
+    pthread_mutex_destroy(table->wr_mutex);
+    free(table->wr_mutex);
+    free(table);
+}
+
+
+void *
+endpoint_table_lookup(endpoint_table_t *table, uint32_t address, uint16_t port)
+{
+    uint64_t key = _endpoint_key(address, port);
+
+    while (1) {
+        unsigned long seq = __atomic_load_n(&table->seq, __ATOMIC_ACQUIRE);
+        struct endpoint_slots *cur =
+            __atomic_load_n(&table->current, __ATOMIC_ACQUIRE);
+
+        size_t i = _endpoint_hash(key) & cur->mask;
+        for (size_t n = 0; n <= cur->mask; n++, i = (i + 1) & cur->mask) {
+            uint64_t k = __atomic_load_n(&cur->slots[i].key, __ATOMIC_ACQUIRE);
+            if (!k) break;
+            if (k == key) {
+                void *value =
+                    __atomic_load_n(&cur->slots[i].value, __ATOMIC_ACQUIRE);
+                if (value) return value;
+                break;
+            }
+        }
+
+        // A miss is only trusted when no writer touched the table meanwhile,
+        // since an entry may have been shifted behind the probe.
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (!(seq & 1) && __atomic_load_n(&table->seq, __ATOMIC_RELAXED) == seq)
+            return NULL;
+        if (seq & 1) sched_yield();  // Let a preempted writer finish.
+    }
+}
+
+
+int
+endpoint_table_insert(endpoint_table_t *table, uint32_t address, uint16_t port,
+                      void *value, void **replaced)
+{
+    uint64_t key = _endpoint_key(address, port);
+    int rc = 0;
+
+    if (replaced) *replaced = NULL;
+
+    pthread_mutex_lock(table->wr_mutex);
+
+    struct endpoint_slots *cur = table->current;
+    if ((table->size + 1) * 10 > (cur->mask + 1) * 7) {
+        if (_endpoint_table_grow(table)) {
+            rc = -1;
+            goto exit;
+        }
+        cur = table->current;
+    }
+
+    _endpoint_table_write_begin(table);
+
+    size_t i = _endpoint_hash(key) & cur->mask;
+    while (cur->slots[i].key && cur->slots[i].key != key)
+        i = (i + 1) & cur->mask;
+
+    if (cur->slots[i].key == key) {
+        if (replaced) *replaced = cur->slots[i].value;
+        __atomic_store_n(&cur->slots[i].value, value, __ATOMIC_RELEASE);
+    } else {
+        // Value is published before key, so readers never see a key
+        // without its value.
+        __atomic_store_n(&cur->slots[i].value, value, __ATOMIC_RELEASE);
+        __atomic_store_n(&cur->slots[i].key, key, __ATOMIC_RELEASE);
+        table->size++;
+    }
+
+    _endpoint_table_write_end(table);
+
+exit:
+    pthread_mutex_unlock(table->wr_mutex);
+    return rc;
+}
+
+
+int
+endpoint_table_remove(endpoint_table_t *table, uint32_t address, uint16_t port,
+                      void *value)
+{
+    uint64_t key = _endpoint_key(address, port);
+
+    pthread_mutex_lock(table->wr_mutex);
+
+    struct endpoint_slots *cur = table->current;
+    size_t mask = cur->mask;
+    size_t i = _endpoint_hash(key) & mask;
+    while (cur->slots[i].key && cur->slots[i].key != key) i = (i + 1) & mask;
+
+    if (cur->slots[i].key != key || cur->slots[i].value != value) {
+        pthread_mutex_unlock(table->wr_mutex);
+        return -1;
+    }
+
+    _endpoint_table_write_begin(table);
+
+    // Backward-shift deletion: move back every following entry of the
+    // cluster, whose home slot is not within (i, j].
+    size_t j = i;
+    while (1) {
+        j = (j + 1) & mask;
+        uint64_t k = cur->slots[j].key;
+        if (!k) break;
+
+        size_t home = _endpoint_hash(k) & mask;
+        int stays = (i < j) ? (home > i && home <= j) : (home > i || home <= j);
+        if (stays) continue;
+
+        __atomic_store_n(&cur->slots[i].key, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&cur->slots[i].value, cur->slots[j].value,
+                         __ATOMIC_RELEASE);
+        __atomic_store_n(&cur->slots[i].key, k, __ATOMIC_RELEASE);
+        i = j;
+    }
+    __atomic_store_n(&cur->slots[i].key, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&cur->slots[i].value, NULL, __ATOMIC_RELEASE);
+    table->size--;
+
+    _endpoint_table_write_end(table);
+
+    pthread_mutex_unlock(table->wr_mutex);
+    return 0;
+}
+
+
+size_t
+endpoint_table_size(endpoint_table_t *table)
+{
+    return __atomic_load_n(&table->size, __ATOMIC_RELAXED);
+}
+
+
+void
+endpoint_table_for_each(endpoint_table_t *table,
+                        void (*callback) (void *value, void *arg), void *arg)
+{
+    pthread_mutex_lock(table->wr_mutex);
+
+    struct endpoint_slots *cur = table->current;
+    for (size_t i = 0; i <= cur->mask; i++) {
+        if (cur->slots[i].key) callback(cur->slots[i].value, arg);
+    }
+
+    pthread_mutex_unlock(table->wr_mutex);
+}
+
+
+struct endpoint_slots *
+_endpoint_slots_create(size_t capacity)
+{
+    struct endpoint_slots *s =
+        (struct endpoint_slots *) malloc(sizeof(struct endpoint_slots));
+    if (!s) return NULL;
+    s->slots = (endpoint_slot_t *) calloc(capacity, sizeof(endpoint_slot_t));
+    if (!s->slots) {
+        free(s);
+        return NULL;
+    }
+    s->mask = capacity - 1;
+    return s;
+}
+
+
+void
+_endpoint_slots_destroy(struct endpoint_slots *s)
+{
+    if (!s) return;
+    free(s->slots);
+    free(s);
+}
+
+
+/**
+ * Doubles the capacity of given table. Should be called with write mutex
+ * acquired.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int
+_endpoint_table_grow(endpoint_table_t *table)
+{
+    struct endpoint_slots *old = table->current;
+    struct endpoint_slots *new = _endpoint_slots_create((old->mask + 1) * 2);
+    if (!new) return -1;
+
+    for (size_t i = 0; i <= old->mask; i++) {
+        uint64_t k = old->slots[i].key;
+        if (!k) continue;
+        size_t j = _endpoint_hash(k) & new->mask;
+        while (new->slots[j].key) j = (j + 1) & new->mask;
+        new->slots[j] = old->slots[i];
+    }
+
+    if (!linked_list_append(table->retired, old)) {
+        _endpoint_slots_destroy(new);
+        return -1;
+    }
+
+    _endpoint_table_write_begin(table);
+    __atomic_store_n(&table->current, new, __ATOMIC_RELEASE);
+    _endpoint_table_write_end(table);
+
+    return 0;
+}
+
+
+void
+_endpoint_table_write_begin(endpoint_table_t *table)
+{
+    __atomic_store_n(&table->seq, table->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+
+void
+_endpoint_table_write_end(endpoint_table_t *table)
+{
+    __atomic_store_n(&table->seq, table->seq + 1, __ATOMIC_RELEASE);
+}
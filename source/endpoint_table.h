@@ -0,0 +1,186 @@
+/**
+ * endpoint_table.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header defining a concurrent open-addressing hash table, that maps
+ * network endpoints, i.e. (IPv4 address, port) pairs, to arbitrary objects.
+ *
+ * Table is optimized for a read-mostly workload. Lookups never lock, nor
+ * write to shared memory. Inserts and removes are serialized by a mutex.
+ * Linear probing with backward-shift deletion is used, so no tombstones
+ * accumulate under connection churn. A lookup that misses while a writer is
+ * active is retried, by means of a sequence counter bumped by every writer.
+ *
+ * Since lookups run concurrently with removes, an object returned by a lookup
+ * may have been removed in the meantime. Stored objects should therefore be
+ * type-stable (their memory is never returned to the system while the table
+ * is in use) and callers should validate the returned object.
+ *
+ * Types defined in endpoint_table.h:
+ *  -endpoint_table_t
+ *
+ * Routines defined in endpoint_table.h:
+ *  -endpoint_table_t *
+ *   endpoint_table_create(size_t capacity)
+ *  -void
+ *   endpoint_table_destroy(endpoint_table_t *table)
+ *  -void *
+ *   endpoint_table_lookup(endpoint_table_t *table,
+ *                         uint32_t address, uint16_t port)
+ *  -int
+ *   endpoint_table_insert(endpoint_table_t *table,
+ *                         uint32_t address, uint16_t port,
+ *                         void *value, void **replaced)
+ *  -int
+ *   endpoint_table_remove(endpoint_table_t *table,
+ *                         uint32_t address, uint16_t port, void *value)
+ *  -size_t
+ *   endpoint_table_size(endpoint_table_t *table)
+ *  -void
+ *   endpoint_table_for_each(endpoint_table_t *table,
+ *                           void (*callback) (void *value, void *arg),
+ *                           void *arg)
+ *
+ * Version: 0.1
+ */
+
+#ifndef __endpoint_table_h__
+#define __endpoint_table_h__
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "linked_list.h"
+
+
+// Default number of slots of a newly created table.
+#define ENDPOINT_TABLE_DEFAULT_CAPACITY 1024
+
+
+typedef struct {
+    uint64_t key;  // Endpoint key, or 0 when slot is empty.
+    void *value;   // Object mapped to the endpoint.
+} endpoint_slot_t;
+
+struct endpoint_slots {
+    size_t mask;             // Number of slots minus 1 (power of 2).
+    endpoint_slot_t *slots;  // Slots array.
+};
+
+typedef struct {
+    struct endpoint_slots *current;  // Slots array currently in use.
+    // Sequence counter. Odd while a writer is modifying the table.
+    unsigned long seq;
+    size_t size;              // Number of stored endpoints.
+    pthread_mutex_t *wr_mutex;  // Mutex serializing writers.
+    // Slot arrays replaced by growing the table. Lookups may still traverse
+    // them, so they are released only on destruction.
+    linked_list_t *retired;
+} endpoint_table_t;
+
+
+/**
+ * Creates a new endpoint table.
+ *
+ * Parameters:
+ *  -capacity : Initial number of slots. It is rounded up to a power of 2.
+ *          Table grows automatically when it becomes 70% full.
+ *
+ * Returns:
+ *  On success, a new and empty endpoint table. On failure, NULL.
+ */
+endpoint_table_t *
+endpoint_table_create(size_t capacity);
+
+/**
+ * Destroys given endpoint table.
+ *
+ * Objects contained in the table are not touched.
+ *
+ * Parameters:
+ *  -table : Endpoint table to destroy.
+ */
+void
+endpoint_table_destroy(endpoint_table_t *table);
+
+/**
+ * Looks up the object mapped to given endpoint.
+ *
+ * It never blocks and is safe to be called concurrently with any other
+ * operation on the table.
+ *
+ * Parameters:
+ *  -table : Endpoint table to search.
+ *  -address : IPv4 address of the endpoint in host byte order.
+ *  -port : Port of the endpoint in host byte order.
+ *
+ * Returns:
+ *  The object mapped to the endpoint, or NULL if no such endpoint exists. If
+ *  a writer runs concurrently, returned object may have just been removed
+ *  from the table.
+ */
+void *
+endpoint_table_lookup(endpoint_table_t *table, uint32_t address, uint16_t port);
+
+/**
+ * Maps given endpoint to given object.
+ *
+ * Parameters:
+ *  -table : Endpoint table to insert to.
+ *  -address : IPv4 address of the endpoint in host byte order.
+ *  -port : Port of the endpoint in host byte order.
+ *  -value : Object to be mapped to endpoint. Should not be NULL.
+ *  -replaced : If not NULL, it is set to the object previously mapped to the
+ *          endpoint, or to NULL if endpoint didn't exist.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int
+endpoint_table_insert(endpoint_table_t *table, uint32_t address, uint16_t port,
+                      void *value, void **replaced);
+
+/**
+ * Removes given endpoint from the table, only if it's mapped to given object.
+ *
+ * Parameters:
+ *  -table : Endpoint table to remove from.
+ *  -address : IPv4 address of the endpoint in host byte order.
+ *  -port : Port of the endpoint in host byte order.
+ *  -value : Object expected to be mapped to endpoint.
+ *
+ * Returns:
+ *  0 if endpoint was removed. A non-zero integer if endpoint doesn't exist or
+ *  is mapped to a different object.
+ */
+int
+endpoint_table_remove(endpoint_table_t *table, uint32_t address, uint16_t port,
+                      void *value);
+
+/**
+ * Returns the number of endpoints contained in given table.
+ */
+size_t
+endpoint_table_size(endpoint_table_t *table);
+
+/**
+ * Calls given routine for every object contained in given table.
+ *
+ * Writers are blocked while iterating, so callback should be light and
+ * should never modify the table.
+ *
+ * Parameters:
+ *  -table : Endpoint table to iterate.
+ *  -callback : Routine to be called with each contained object.
+ *  -arg : Extra argument to be passed to callback.
+ */
+void
+endpoint_table_for_each(endpoint_table_t *table,
+                        void (*callback) (void *value, void *arg), void *arg);
+
+
+#endif
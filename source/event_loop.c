@@ -0,0 +1,234 @@
+/**
+ * event_loop.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * An implementation of routines defined in event_loop.h.
+ *
+ * Version: 0.1
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "event_loop.h"
+
+
+struct loop_task {
+    void (*task) (event_loop_t *, void *);
+    void *arg;
+};
+
+
+void *
+_event_loop_enter(void *args);
+void
+_event_loop_wake_handler(event_loop_t *loop, uint32_t events, void *arg);
+void
+_event_loop_run_tasks(event_loop_t *loop);
+
+
+event_loop_t *
+event_loop_create()
+{
+    event_loop_t *loop = (event_loop_t *) calloc(1, sizeof(event_loop_t));
+    if (!loop) goto error;
+    loop->epoll_fd = -1;
+    loop->wake_fd = -1;
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) goto error;
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->wake_fd < 0) goto error;
+
+    loop->tasks = linked_list_create();
+    loop->spare_tasks = linked_list_create();
+    loop->tasks_mutex = (pthread_mutex_t *) malloc(sizeof(pthread_mutex_t));
+    if (!loop->tasks || !loop->spare_tasks || !loop->tasks_mutex) goto error;
+    if (pthread_mutex_init(loop->tasks_mutex, NULL)) goto error;
+
+    loop->wake_watcher.fd = loop->wake_fd;
+    loop->wake_watcher.handler = _event_loop_wake_handler;
+    loop->wake_watcher.arg = NULL;
+    if (event_loop_add(loop, &loop->wake_watcher, EPOLLIN)) goto error;
+
+    return loop;
+
+error:
+    perror("Failed to create event loop");
+    if (loop) {
+        if (loop->epoll_fd > -1) close(loop->epoll_fd);
+        if (loop->wake_fd > -1) close(loop->wake_fd);
+        if (loop->tasks) linked_list_destroy(loop->tasks);
+        if (loop->spare_tasks) linked_list_destroy(loop->spare_tasks);
+        free(loop->tasks_mutex);
+        free(loop);
+    }
+    return NULL;
+}
+
+
+void
+event_loop_destroy(event_loop_t *loop)
+{
+    if (!loop) return;
+
+    // Tasks that never got the chance to run may hold resources handed over
+    // to them, so they are run here instead of being discarded, along with
+    // any task they post in turn.
+    while (linked_list_size(loop->tasks)) _event_loop_run_tasks(loop);
+
+    linked_list_destroy(loop->tasks);
+    linked_list_destroy(loop->spare_tasks);
+    pthread_mutex_destroy(loop->tasks_mutex);
+    free(loop->tasks_mutex);
+    close(loop->wake_fd);
+    close(loop->epoll_fd);
+    free(loop);
+}
+
+
+int
+event_loop_start(event_loop_t *loop, const pthread_attr_t *attr)
+{
+    loop->run = 1;
+    return pthread_create(&loop->tid, attr, _event_loop_enter, (void *) loop);
+}
+
+
+int
+event_loop_stop(event_loop_t *loop)
+{
+    uint64_t one = 1;
+
+    loop->run = 0;
+    // Wake the loop, so it notices the termination request.
+    if (write(loop->wake_fd, &one, sizeof(one)) < 0)
+        perror("Failed to wake event loop");
+    return pthread_join(loop->tid, NULL);
+}
+
+
+int
+event_loop_add(event_loop_t *loop, event_watcher_t *watcher, uint32_t events)
+{
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = watcher;
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, watcher->fd, &ev);
+}
+
+
+int
+event_loop_remove(event_loop_t *loop, event_watcher_t *watcher)
+{
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, watcher->fd, NULL);
+}
+
+
+int
+event_loop_post(event_loop_t *loop,
+                void (*task) (event_loop_t *, void *), void *arg)
+{
+    uint64_t one = 1;
+
+    struct loop_task *t = (struct loop_task *) malloc(sizeof(struct loop_task));
+    if (!t) return -1;
+    t->task = task;
+    t->arg = arg;
+
+    // Loop is woken while holding the mutex, so it can't detach pending
+    // tasks before this one is queued, and a task is only queued when the
+    // loop is sure to run it.
+    pthread_mutex_lock(loop->tasks_mutex);
+    if (write(loop->wake_fd, &one, sizeof(one)) < 0) {
+        pthread_mutex_unlock(loop->tasks_mutex);
+        perror("Failed to wake event loop");
+        free(t);
+        return -1;
+    }
+    // A loop woken for nothing finds no task to run, so it's harmless.
+    if (!linked_list_append(loop->tasks, t)) {
+        pthread_mutex_unlock(loop->tasks_mutex);
+        free(t);
+        return -1;
+    }
+    pthread_mutex_unlock(loop->tasks_mutex);
+
+    return 0;
+}
+
+
+/**
+ * Entry point of the thread running an event loop.
+ */
+void *
+_event_loop_enter(void *args)
+{
+    event_loop_t *loop = (event_loop_t *) args;
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+
+    while (loop->run) {
+        int n = epoll_wait(loop->epoll_fd, events, EVENT_LOOP_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("Event loop failed to wait for events");
+            break;
+        }
+
+        int woken = 0;
+        for (int i = 0; i < n && loop->run; i++) {
+            event_watcher_t *w = (event_watcher_t *) events[i].data.ptr;
+            if (w == &loop->wake_watcher) woken = 1;
+            w->handler(loop, events[i].events, w->arg);
+        }
+
+        // Tasks run after all events of the batch, so a task that removes a
+        // watcher is never followed by an event already fetched for it.
+        if (woken && loop->run) _event_loop_run_tasks(loop);
+    }
+
+    pthread_exit(0);
+}
+
+
+/**
+ * Handler of the wake eventfd. Posted tasks are executed once the rest of
+ * events fetched along with it are handled.
+ */
+void
+_event_loop_wake_handler(event_loop_t *loop, uint32_t events, void *arg)
+{
+    (void) events;
+    (void) arg;
+
+    uint64_t count;
+    if (read(loop->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("Failed to read wake eventfd");
+}
+
+
+/**
+ * Executes all tasks posted so far.
+ */
+void
+_event_loop_run_tasks(event_loop_t *loop)
+{
+    // Detach pending tasks, so they can run without holding the mutex. New
+    // tasks are queued on the spare list meanwhile, which never fails.
+    pthread_mutex_lock(loop->tasks_mutex);
+    linked_list_t *pending = loop->tasks;
+    loop->tasks = loop->spare_tasks;
+    pthread_mutex_unlock(loop->tasks_mutex);
+
+    struct loop_task *t;
+    while ((t = linked_list_pop(pending))) {
+        t->task(loop, t->arg);
+        free(t);
+    }
+    loop->spare_tasks = pending;  // Drained, so it becomes the spare one.
+}
@@ -0,0 +1,178 @@
+/**
+ * event_loop.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header defining a minimal epoll based event loop, running on its own
+ * thread. File descriptors are registered through watcher objects, which are
+ * owned by the caller, so no allocation is required on the event path. Other
+ * threads can hand work over to an event loop by posting tasks to it.
+ *
+ * Types defined in event_loop.h:
+ *  -event_loop_t
+ *  -event_watcher_t
+ *
+ * Routines defined in event_loop.h:
+ *  -event_loop_t *
+ *   event_loop_create()
+ *  -void
+ *   event_loop_destroy(event_loop_t *loop)
+ *  -int
+ *   event_loop_start(event_loop_t *loop, const pthread_attr_t *attr)
+ *  -int
+ *   event_loop_stop(event_loop_t *loop)
+ *  -int
+ *   event_loop_add(event_loop_t *loop, event_watcher_t *watcher,
+ *                  uint32_t events)
+ *  -int
+ *   event_loop_remove(event_loop_t *loop, event_watcher_t *watcher)
+ *  -int
+ *   event_loop_post(event_loop_t *loop,
+ *                   void (*task) (event_loop_t *, void *), void *arg)
+ *
+ * Version: 0.1
+ */
+
+#ifndef __event_loop_h__
+#define __event_loop_h__
+
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include "linked_list.h"
+
+
+// Maximum number of events fetched from epoll at each iteration.
+#define EVENT_LOOP_MAX_EVENTS 64
+
+
+typedef struct Event_Loop event_loop_t;
+
+typedef struct {
+    int fd;  // File descriptor watched.
+    // Routine called by the loop thread when fd reports any of the events
+    // it is registered for.
+    void (*handler) (event_loop_t *loop, uint32_t events, void *arg);
+    void *arg;  // Argument passed to handler.
+} event_watcher_t;
+
+struct Event_Loop {
+    int epoll_fd;         // Epoll instance of the loop.
+    int wake_fd;          // Eventfd used for waking up the loop.
+    pthread_t tid;        // Thread id of the thread running the loop.
+    int run;              // Indicates whether loop should keep running.
+    linked_list_t *tasks; // Tasks posted by other threads.
+    // Empty list swapped with tasks when they are run. Accessed only by the
+    // thread running tasks.
+    linked_list_t *spare_tasks;
+    pthread_mutex_t *tasks_mutex;     // Mutex for tasks list synchronization.
+    event_watcher_t wake_watcher;     // Watcher of wake_fd.
+};
+
+
+/**
+ * Creates a new event loop.
+ *
+ * Returns:
+ *  On success, a new event loop ready to be started. On failure, NULL.
+ */
+event_loop_t *
+event_loop_create();
+
+/**
+ * Destroys given event loop, releasing all its resources.
+ *
+ * Loop should have been stopped before destruction. Watchers still registered
+ * are not touched, since they are owned by the caller. Any posted task that
+ * has not run yet is executed by the calling thread, so resources handed over
+ * to tasks are not leaked. No task should be posted to the loop concurrently.
+ *
+ * Parameters:
+ *  -loop : Event loop to destroy.
+ */
+void
+event_loop_destroy(event_loop_t *loop);
+
+/**
+ * Starts given event loop on a new thread.
+ *
+ * Parameters:
+ *  -loop : Event loop to start.
+ *  -attr : Attributes of the new thread, e.g. its CPUs, or NULL for the
+ *          default ones.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int
+event_loop_start(event_loop_t *loop, const pthread_attr_t *attr);
+
+/**
+ * Stops given event loop and waits for its thread to terminate.
+ *
+ * Parameters:
+ *  -loop : Event loop to stop.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int
+event_loop_stop(event_loop_t *loop);
+
+/**
+ * Registers a watcher on given event loop.
+ *
+ * Watcher should remain valid until it's removed from the loop.
+ *
+ * Parameters:
+ *  -loop : Event loop on which watcher will be registered.
+ *  -watcher : Watcher object with fd, handler and arg fields filled.
+ *  -events : Epoll events to watch for (e.g. EPOLLIN | EPOLLET).
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int
+event_loop_add(event_loop_t *loop, event_watcher_t *watcher, uint32_t events);
+
+/**
+ * Removes a previously registered watcher from given event loop.
+ *
+ * It should only be called from the thread running the loop, so it is
+ * guaranteed that handler of watcher won't be called again afterwards.
+ *
+ * Parameters:
+ *  -loop : Event loop from which watcher will be removed.
+ *  -watcher : Watcher to remove.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int
+event_loop_remove(event_loop_t *loop, event_watcher_t *watcher);
+
+/**
+ * Posts a task to be executed by the thread running given event loop.
+ *
+ * It's safe to be called from any thread. Tasks are executed in the order
+ * they are posted, after the handlers of any events the loop has already
+ * fetched.
+ *
+ * Parameters:
+ *  -loop : Event loop that will execute the task.
+ *  -task : Routine to execute.
+ *  -arg : Argument to be passed to task.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer. On failure task is not queued,
+ *  so any resource handed over to it remains owned by the caller.
+ */
+int
+event_loop_post(event_loop_t *loop,
+                void (*task) (event_loop_t *, void *), void *arg);
+
+
+#endif
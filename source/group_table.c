@@ -0,0 +1,191 @@
+/**
+ * group_table.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * An implementation of routines defined in group_table.h.
+ *
+ * Version: 0.1
+ */
+
+#include <stdlib.h>
+#include "group_table.h"
+
+
+struct group **
+_group_table_bucket(group_table_t *t, uint16_t id);
+struct group *
+_group_table_find(group_table_t *t, uint16_t id);
+void
+_group_table_remove(group_table_t *t, struct group *g);
+
+
+group_table_t *
+group_table_create()
+{
+    group_table_t *t = (group_table_t *) calloc(1, sizeof(group_table_t));
+    if (!t) return NULL;
+
+    t->mutex = (pthread_mutex_t *) malloc(sizeof(pthread_mutex_t));
+    if (!t->mutex || pthread_mutex_init(t->mutex, NULL)) {
+        free(t->mutex);
+        free(t);
+        return NULL;
+    }
+
+    return t;
+}
+
+
+void
+group_table_destroy(group_table_t *t, void (*release) (void *member))
+{
+    if (!t) return;
+
+    for (int i = 0; i < GROUP_TABLE_BUCKETS; i++) {
+        struct group *g = t->buckets[i];
+        while (g) {
+            struct group *next = g->next;
+            for (int k = 0; release && k < g->members_num; k++)
+                release(g->members[k]);
+            free(g->members);
+            free(g);
+            g = next;
+        }
+    }
+
+    pthread_mutex_destroy(t->mutex);
+    free(t->mutex);
+    free(t);
+}
+
+
+int
+group_table_join(group_table_t *t, uint16_t id, void *member)
+{
+    int rc = -1;
+
+    pthread_mutex_lock(t->mutex);
+
+    struct group *g = _group_table_find(t, id);
+    if (!g) {
+        g = (struct group *) calloc(1, sizeof(struct group));
+        if (!g) goto out;
+        g->id = id;
+        struct group **bucket = _group_table_bucket(t, id);
+        g->next = *bucket;
+        *bucket = g;
+    }
+
+    for (int k = 0; k < g->members_num; k++) {
+        if (g->members[k] == member) {
+            rc = 1;
+            goto out;
+        }
+    }
+
+    if (g->members_num == g->members_cap) {
+        int cap = g->members_cap ? g->members_cap * 2 : 8;
+        void **members = (void **) realloc(g->members, cap * sizeof(void *));
+        if (!members) {
+            if (!g->members_num) _group_table_remove(t, g);
+            goto out;
+        }
+        g->members = members;
+        g->members_cap = cap;
+    }
+    g->members[g->members_num++] = member;
+    rc = 0;
+
+out:
+    pthread_mutex_unlock(t->mutex);
+    return rc;
+}
+
+
+int
+group_table_leave(group_table_t *t, uint16_t id, void *member)
+{
+    int rc = -1;
+
+    pthread_mutex_lock(t->mutex);
+
+    struct group *g = _group_table_find(t, id);
+    for (int k = 0; g && k < g->members_num; k++) {
+        if (g->members[k] != member) continue;
+        // Order of members doesn't matter, so the last one fills the gap.
+        g->members[k] = g->members[--g->members_num];
+        if (!g->members_num) _group_table_remove(t, g);
+        rc = 0;
+        break;
+    }
+
+    pthread_mutex_unlock(t->mutex);
+    return rc;
+}
+
+
+int
+group_table_for_each(group_table_t *t, uint16_t id,
+                     int (*callback) (void *member, void *arg), void *arg)
+{
+    int visited = 0;
+
+    pthread_mutex_lock(t->mutex);
+
+    struct group *g = _group_table_find(t, id);
+    if (g) {
+        int k = 0;
+        while (k < g->members_num) {
+            visited++;
+            if (callback(g->members[k], arg))
+                g->members[k] = g->members[--g->members_num];
+            else k++;
+        }
+        if (!g->members_num) _group_table_remove(t, g);
+    }
+
+    pthread_mutex_unlock(t->mutex);
+    return visited;
+}
+
+
+/**
+ * Returns the bucket where group of given id is chained.
+ */
+struct group **
+_group_table_bucket(group_table_t *t, uint16_t id)
+{
+    return t->buckets + ((id ^ (id >> 8)) & (GROUP_TABLE_BUCKETS - 1));
+}
+
+
+/**
+ * Finds the group of given id. Should be called with mutex acquired.
+ *
+ * Returns:
+ *  The group, or NULL if it has no members.
+ */
+struct group *
+_group_table_find(group_table_t *t, uint16_t id)
+{
+    struct group *g = *_group_table_bucket(t, id);
+    while (g && g->id != id) g = g->next;
+    return g;
+}
+
+
+/**
+ * Unlinks and frees given group. Should be called with mutex acquired.
+ */
+void
+_group_table_remove(group_table_t *t, struct group *g)
+{
+    struct group **p = _group_table_bucket(t, g->id);
+    while (*p != g) p = &(*p)->next;
+    *p = g->next;
+    free(g->members);
+    free(g);
+}
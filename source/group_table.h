@@ -0,0 +1,115 @@
+/**
+ * group_table.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header defining a table of groups, that maps 16-bit group ids to sets of
+ * arbitrary member objects.
+ *
+ * Groups are created on the first join and freed on the last leave. Members
+ * of a group are kept in an array, so visiting them is a linear scan. All
+ * routines are serialized by a mutex, which is held while members are
+ * visited, so a visited member can't leave concurrently.
+ *
+ * Types defined in group_table.h:
+ *  -group_table_t
+ *
+ * Routines defined in group_table.h:
+ *  -group_table_t *
+ *   group_table_create()
+ *  -void
+ *   group_table_destroy(group_table_t *t,
+ *                       void (*release) (void *member))
+ *  -int
+ *   group_table_join(group_table_t *t, uint16_t id, void *member)
+ *  -int
+ *   group_table_leave(group_table_t *t, uint16_t id, void *member)
+ *  -int
+ *   group_table_for_each(group_table_t *t, uint16_t id,
+ *                        int (*callback) (void *member, void *arg),
+ *                        void *arg)
+ *
+ * Version: 0.1
+ */
+
+#ifndef __group_table_h__
+#define __group_table_h__
+
+
+#include <stdint.h>
+#include <pthread.h>
+
+
+#define GROUP_TABLE_BUCKETS 256  // Number of hash buckets of groups.
+
+
+struct group {
+    uint16_t id;
+    void **members;
+    int members_num;
+    int members_cap;
+    struct group *next;  // Next group of the same bucket.
+};
+
+typedef struct {
+    struct group *buckets[GROUP_TABLE_BUCKETS];
+    pthread_mutex_t *mutex;
+} group_table_t;
+
+
+/**
+ * Creates a new table with no groups.
+ *
+ * Returns:
+ *  On success, a new table. On failure, NULL.
+ */
+group_table_t *
+group_table_create();
+
+/**
+ * Destroys given table.
+ *
+ * Parameters:
+ *  -release : If not NULL, routine called with every member of every group.
+ */
+void
+group_table_destroy(group_table_t *t, void (*release) (void *member));
+
+/**
+ * Adds given member to the group of given id.
+ *
+ * Returns:
+ *  0 if member joined, 1 if it was already a member, or -1 on failure.
+ */
+int
+group_table_join(group_table_t *t, uint16_t id, void *member);
+
+/**
+ * Removes given member from the group of given id.
+ *
+ * Returns:
+ *  0 if member left, or a non-zero integer if it wasn't a member.
+ */
+int
+group_table_leave(group_table_t *t, uint16_t id, void *member);
+
+/**
+ * Calls given routine with every member of the group of given id, with the
+ * mutex of the table acquired. Members for which the routine returns a
+ * non-zero integer are removed from the group.
+ *
+ * Parameters:
+ *  -callback : Routine called with a member and given argument.
+ *  -arg : Argument passed to callback.
+ *
+ * Returns:
+ *  The number of visited members.
+ */
+int
+group_table_for_each(group_table_t *t, uint16_t id,
+                     int (*callback) (void *member, void *arg), void *arg);
+
+
+#endif
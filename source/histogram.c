@@ -0,0 +1,125 @@
+/**
+ * histogram.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * An implementation of routines defined in histogram.h.
+ *
+ * Version: 0.1
+ */
+
+#include "histogram.h"
+
+
+#define SUB_BUCKETS (1 << HISTOGRAM_PRECISION_BITS)  // Per power of 2.
+
+
+int
+_histogram_index(uint64_t value);
+uint64_t
+_histogram_highest(int index);
+
+
+void
+histogram_record(histogram_t *h, uint64_t value)
+{
+    uint64_t *count = h->counts + _histogram_index(value);
+    // Only writer updates counts, so a plain increment is enough. It's
+    // still atomic, so readers never see a torn count.
+    __atomic_store_n(count, __atomic_load_n(count, __ATOMIC_RELAXED) + 1,
+                     __ATOMIC_RELAXED);
+}
+
+
+void
+histogram_record_shared(histogram_t *h, uint64_t value)
+{
+    __atomic_add_fetch(h->counts + _histogram_index(value), 1,
+                       __ATOMIC_RELAXED);
+}
+
+
+void
+histogram_snapshot(histogram_t *dst, histogram_t *src)
+{
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+        dst->counts[i] = __atomic_load_n(src->counts + i, __ATOMIC_RELAXED);
+}
+
+
+void
+histogram_subtract(histogram_t *h, histogram_t *prev)
+{
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+        h->counts[i] -= prev->counts[i];
+}
+
+
+uint64_t
+histogram_count(histogram_t *h)
+{
+    uint64_t count = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) count += h->counts[i];
+    return count;
+}
+
+
+uint64_t
+histogram_percentile(histogram_t *h, double percentile)
+{
+    uint64_t count = histogram_count(h);
+    if (!count) return 0;
+
+    // Rank of the value, counting from 1.
+    uint64_t rank = (uint64_t) (percentile / 100.0 * count + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > count) rank = count;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) return _histogram_highest(i);
+    }
+    return 0;
+}
+
+
+uint64_t
+histogram_max(histogram_t *h)
+{
+    for (int i = HISTOGRAM_BUCKETS - 1; i >= 0; i--)
+        if (h->counts[i]) return _histogram_highest(i);
+    return 0;
+}
+
+
+/**
+ * Returns the index of the bucket counting given value.
+ */
+int
+_histogram_index(uint64_t value)
+{
+    if (value >> HISTOGRAM_MAX_BITS)
+        value = ((uint64_t) 1 << HISTOGRAM_MAX_BITS) - 1;
+    if (value < 2 * SUB_BUCKETS) return (int) value;
+
+    // Values of [2^e, 2^(e+1)) are split in SUB_BUCKETS buckets.
+    int shift = 63 - __builtin_clzll(value) - HISTOGRAM_PRECISION_BITS;
+    return shift * SUB_BUCKETS + (int) (value >> shift);
+}
+
+
+/**
+ * Returns the highest value counted by the bucket of given index.
+ */
+uint64_t
+_histogram_highest(int index)
+{
+    if (index < 2 * SUB_BUCKETS) return index;
+
+    int shift = index / SUB_BUCKETS - 1;
+    uint64_t sub = index - shift * SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
@@ -0,0 +1,116 @@
+/**
+ * histogram.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header defining a log-linear histogram of values, e.g. latencies in
+ * nanoseconds, in the spirit of HDR histograms.
+ *
+ * Values below 2^(HISTOGRAM_PRECISION_BITS + 1) get a bucket each. Above
+ * that, every power of 2 is split in 2^HISTOGRAM_PRECISION_BITS linear
+ * buckets, so any value is counted within a relative error of about
+ * 2^-HISTOGRAM_PRECISION_BITS, at a fixed memory cost. Recording a value
+ * takes a few instructions and no allocation.
+ *
+ * A histogram has a single writer, which never waits, unless it's recorded
+ * through histogram_record_shared(), which any thread may call at the cost
+ * of an atomic increment. Other threads may read it at any time through a
+ * snapshot. Counts only grow, so counts of an
+ * interval are the difference of the snapshots at its start and end.
+ *
+ * Types defined in histogram.h:
+ *  -histogram_t
+ *
+ * Routines defined in histogram.h:
+ *  -void
+ *   histogram_record(histogram_t *h, uint64_t value)
+ *  -void
+ *   histogram_record_shared(histogram_t *h, uint64_t value)
+ *  -void
+ *   histogram_snapshot(histogram_t *dst, histogram_t *src)
+ *  -void
+ *   histogram_subtract(histogram_t *h, histogram_t *prev)
+ *  -uint64_t
+ *   histogram_count(histogram_t *h)
+ *  -uint64_t
+ *   histogram_percentile(histogram_t *h, double percentile)
+ *  -uint64_t
+ *   histogram_max(histogram_t *h)
+ *
+ * Version: 0.1
+ */
+
+#ifndef __histogram_h__
+#define __histogram_h__
+
+
+#include <stdint.h>
+
+
+#define HISTOGRAM_PRECISION_BITS 5  // Relative error of about 3%.
+#define HISTOGRAM_MAX_BITS 36       // Larger values are counted as the max,
+                                    // e.g. about 68 sec in nanoseconds.
+#define HISTOGRAM_BUCKETS \
+    ((HISTOGRAM_MAX_BITS - HISTOGRAM_PRECISION_BITS + 1) << \
+     HISTOGRAM_PRECISION_BITS)
+
+
+typedef struct {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+
+/**
+ * Counts given value. Should be called only by the writer of histogram.
+ */
+void
+histogram_record(histogram_t *h, uint64_t value);
+
+/**
+ * Counts given value, on a histogram recorded by many threads concurrently.
+ */
+void
+histogram_record_shared(histogram_t *h, uint64_t value);
+
+/**
+ * Copies the counts of given histogram, while its writer may keep recording.
+ *
+ * Parameters:
+ *  -dst : Histogram where counts are copied.
+ *  -src : Histogram to be copied.
+ */
+void
+histogram_snapshot(histogram_t *dst, histogram_t *src);
+
+/**
+ * Subtracts the counts of a previous snapshot from given histogram, leaving
+ * only the values recorded since then.
+ */
+void
+histogram_subtract(histogram_t *h, histogram_t *prev);
+
+/**
+ * Returns the number of values counted by given histogram.
+ */
+uint64_t
+histogram_count(histogram_t *h);
+
+/**
+ * Returns the value below or at which given percentile of counted values
+ * fall, e.g. 99.9 for p99.9, as the highest value of its bucket. It is 0 if
+ * histogram is empty.
+ */
+uint64_t
+histogram_percentile(histogram_t *h, double percentile);
+
+/**
+ * Returns the largest counted value, as the highest value of its bucket. It
+ * is 0 if histogram is empty.
+ */
+uint64_t
+histogram_max(histogram_t *h);
+
+
+#endif
@@ -0,0 +1,295 @@
+/**
+ * hold_queue.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * An implementation of routines defined in hold_queue.h.
+ *
+ * Version: 0.1
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "hold_queue.h"
+
+
+struct hold_dest **
+_hold_queue_bucket(hold_queue_t *q, uint32_t address, uint16_t port);
+struct hold_dest *
+_hold_queue_dest(hold_queue_t *q, uint32_t address, uint16_t port);
+hold_entry_t *
+_hold_queue_unlink(hold_queue_t *q, struct hold_dest *d);
+
+
+hold_queue_t *
+hold_queue_create(long ttl, size_t max_bytes, int dest_max, int whole_data)
+{
+    hold_queue_t *q = (hold_queue_t *) calloc(1, sizeof(hold_queue_t));
+    if (!q) return NULL;
+
+    q->ttl = ttl;
+    q->max_bytes = max_bytes;
+    q->dest_max = dest_max;
+    q->whole_data = whole_data;
+
+    q->mutex = (pthread_mutex_t *) malloc(sizeof(pthread_mutex_t));
+    if (!q->mutex || pthread_mutex_init(q->mutex, NULL)) {
+        free(q->mutex);
+        free(q);
+        return NULL;
+    }
+
+    return q;
+}
+
+
+void
+hold_queue_destroy(hold_queue_t *q)
+{
+    if (!q) return;
+
+    hold_entry_t *e = q->oldest;
+    while (e) {
+        hold_entry_t *next = e->age_next;
+        free(e);
+        e = next;
+    }
+    for (int i = 0; i < HOLD_QUEUE_BUCKETS; i++) {
+        struct hold_dest *d = q->buckets[i];
+        while (d) {
+            struct hold_dest *next = d->next;
+            free(d);
+            d = next;
+        }
+    }
+
+    pthread_mutex_destroy(q->mutex);
+    free(q->mutex);
+    free(q);
+}
+
+
+int
+hold_queue_put(hold_queue_t *q, message_t *m, uint64_t tag,
+               struct timespec *now, int force)
+{
+    uint16_t len = m->len > MESSAGE_DATA_LENGTH || q->whole_data ?
+                   MESSAGE_DATA_LENGTH : m->len;
+    size_t size = sizeof(hold_entry_t) + offsetof(message_t, data) + len;
+    int rc = -1;
+
+    pthread_mutex_lock(q->mutex);
+
+    if (q->bytes + size > q->max_bytes && !force) goto out;
+
+    struct hold_dest **bucket =
+        _hold_queue_bucket(q, m->dest_addr, m->dest_port);
+    struct hold_dest *d = _hold_queue_dest(q, m->dest_addr, m->dest_port);
+    if (d && d->count >= q->dest_max && !force) goto out;
+
+    // Entry is allocated first, so a destination is never linked without a
+    // message held for it.
+    hold_entry_t *e = (hold_entry_t *) malloc(size);
+    if (!e) goto out;
+    if (!d) {
+        d = (struct hold_dest *) calloc(1, sizeof(struct hold_dest));
+        if (!d) {
+            free(e);
+            goto out;
+        }
+        d->address = m->dest_addr;
+        d->port = m->dest_port;
+        d->next = *bucket;
+        *bucket = d;
+    }
+
+    e->m = (message_t *) (e + 1);
+    memcpy(e->m, m, offsetof(message_t, data) + len);
+    if (!q->whole_data) e->m->len = len;
+    e->size = size;
+    e->tag = tag;
+    e->dest = d;
+    e->expiry.tv_sec = now->tv_sec + q->ttl / 1000;
+    e->expiry.tv_nsec = now->tv_nsec + (q->ttl % 1000) * 1000000;
+    if (e->expiry.tv_nsec >= 1000000000) {
+        e->expiry.tv_sec++;
+        e->expiry.tv_nsec -= 1000000000;
+    }
+
+    // Append to the queue of the destination.
+    e->next = NULL;
+    if (d->tail) d->tail->next = e;
+    else d->head = e;
+    d->tail = e;
+    d->count++;
+
+    // Append to the age list. TTL is common, so it's sorted by expiry.
+    e->age_next = NULL;
+    e->age_prev = q->newest;
+    if (q->newest) q->newest->age_next = e;
+    else q->oldest = e;
+    q->newest = e;
+
+    q->bytes += size;
+    __atomic_store_n(&q->size, q->size + 1, __ATOMIC_RELAXED);
+    rc = 0;
+
+out:
+    pthread_mutex_unlock(q->mutex);
+    return rc;
+}
+
+
+message_t *
+hold_queue_peek(hold_queue_t *q, uint32_t address, uint16_t port)
+{
+    pthread_mutex_lock(q->mutex);
+    struct hold_dest *d = _hold_queue_dest(q, address, port);
+    message_t *m = d && d->head ? d->head->m : NULL;
+    pthread_mutex_unlock(q->mutex);
+    return m;
+}
+
+
+void
+hold_queue_pop(hold_queue_t *q, uint32_t address, uint16_t port)
+{
+    pthread_mutex_lock(q->mutex);
+    struct hold_dest *d = _hold_queue_dest(q, address, port);
+    hold_entry_t *e = d ? _hold_queue_unlink(q, d) : NULL;
+    pthread_mutex_unlock(q->mutex);
+    free(e);
+}
+
+
+int
+hold_queue_count(hold_queue_t *q, uint32_t address, uint16_t port)
+{
+    pthread_mutex_lock(q->mutex);
+    struct hold_dest *d = _hold_queue_dest(q, address, port);
+    int count = d ? d->count : 0;
+    pthread_mutex_unlock(q->mutex);
+    return count;
+}
+
+
+int
+hold_queue_size(hold_queue_t *q)
+{
+    return __atomic_load_n(&q->size, __ATOMIC_RELAXED);
+}
+
+
+message_t *
+hold_queue_expire(hold_queue_t *q, struct timespec *now)
+{
+    hold_entry_t *e = NULL;
+
+    pthread_mutex_lock(q->mutex);
+    hold_entry_t *oldest = q->oldest;
+    if (oldest && (oldest->expiry.tv_sec < now->tv_sec ||
+                   (oldest->expiry.tv_sec == now->tv_sec &&
+                    oldest->expiry.tv_nsec <= now->tv_nsec))) {
+        // Oldest message is always at the head of its destination's queue.
+        e = _hold_queue_unlink(q, oldest->dest);
+    }
+    pthread_mutex_unlock(q->mutex);
+
+    return e ? e->m : NULL;
+}
+
+
+int
+hold_queue_next_expiry(hold_queue_t *q, struct timespec *expiry)
+{
+    int rc = -1;
+
+    pthread_mutex_lock(q->mutex);
+    if (q->oldest) {
+        *expiry = q->oldest->expiry;
+        rc = 0;
+    }
+    pthread_mutex_unlock(q->mutex);
+
+    return rc;
+}
+
+
+void
+hold_queue_release(message_t *m)
+{
+    if (m) free((hold_entry_t *) m - 1);
+}
+
+
+uint64_t
+hold_queue_tag(message_t *m)
+{
+    return ((hold_entry_t *) m - 1)->tag;
+}
+
+
+/**
+ * Returns the bucket where given destination is chained.
+ */
+struct hold_dest **
+_hold_queue_bucket(hold_queue_t *q, uint32_t address, uint16_t port)
+{
+    uint64_t key = ((uint64_t) address << 16) | port;
+    // Fibonacci hashing spreads successive ports and addresses.
+    uint64_t hash = (key * 11400714819323198485ull) >> 56;
+    return q->buckets + (hash & (HOLD_QUEUE_BUCKETS - 1));
+}
+
+
+/**
+ * Finds given destination. Should be called with mutex acquired.
+ *
+ * Returns:
+ *  The destination, or NULL if no message is held for it.
+ */
+struct hold_dest *
+_hold_queue_dest(hold_queue_t *q, uint32_t address, uint16_t port)
+{
+    struct hold_dest *d = *_hold_queue_bucket(q, address, port);
+    while (d && (d->address != address || d->port != port)) d = d->next;
+    return d;
+}
+
+
+/**
+ * Removes the oldest message of given destination from the store, freeing
+ * the destination if it becomes empty. Should be called with mutex acquired.
+ *
+ * Returns:
+ *  The removed entry, which should be freed by the caller.
+ */
+hold_entry_t *
+_hold_queue_unlink(hold_queue_t *q, struct hold_dest *d)
+{
+    hold_entry_t *e = d->head;
+    if (!e) return NULL;
+
+    d->head = e->next;
+    if (!d->head) d->tail = NULL;
+    d->count--;
+
+    if (e->age_prev) e->age_prev->age_next = e->age_next;
+    else q->oldest = e->age_next;
+    if (e->age_next) e->age_next->age_prev = e->age_prev;
+    else q->newest = e->age_prev;
+
+    q->bytes -= e->size;
+    __atomic_store_n(&q->size, q->size - 1, __ATOMIC_RELAXED);
+
+    if (!d->count) {
+        struct hold_dest **p = _hold_queue_bucket(q, d->address, d->port);
+        while (*p != d) p = &(*p)->next;
+        *p = d->next;
+        free(d);
+    }
+
+    return e;
+}
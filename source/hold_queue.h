@@ -0,0 +1,212 @@
+/**
+ * hold_queue.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header defining a store of messages held for offline destinations.
+ *
+ * Messages are kept in a FIFO queue per destination endpoint, so they can be
+ * forwarded in order once the destination connects again. Every message is
+ * held up to a time-to-live (TTL), after which it expires. Memory used by
+ * held messages is capped globally, and the number of messages held for a
+ * single destination is bounded too. Unless told otherwise, only the 'len'
+ * used bytes of data of a message are stored.
+ *
+ * All routines are thread-safe. Though, messages returned by
+ * hold_queue_peek() remain valid only as long as no other thread removes
+ * messages, so removals are expected to be done by a single thread.
+ *
+ * Types defined in hold_queue.h:
+ *  -hold_queue_t
+ *
+ * Routines defined in hold_queue.h:
+ *  -hold_queue_t *
+ *   hold_queue_create(long ttl, size_t max_bytes, int dest_max,
+ *                     int whole_data)
+ *  -void
+ *   hold_queue_destroy(hold_queue_t *q)
+ *  -int
+ *   hold_queue_put(hold_queue_t *q, message_t *m, uint64_t tag,
+ *                  struct timespec *now, int force)
+ *  -message_t *
+ *   hold_queue_peek(hold_queue_t *q, uint32_t address, uint16_t port)
+ *  -void
+ *   hold_queue_pop(hold_queue_t *q, uint32_t address, uint16_t port)
+ *  -int
+ *   hold_queue_count(hold_queue_t *q, uint32_t address, uint16_t port)
+ *  -int
+ *   hold_queue_size(hold_queue_t *q)
+ *  -message_t *
+ *   hold_queue_expire(hold_queue_t *q, struct timespec *now)
+ *  -int
+ *   hold_queue_next_expiry(hold_queue_t *q, struct timespec *expiry)
+ *  -void
+ *   hold_queue_release(message_t *m)
+ *  -uint64_t
+ *   hold_queue_tag(message_t *m)
+ *
+ * Version: 0.1
+ */
+
+#ifndef __hold_queue_h__
+#define __hold_queue_h__
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include "message.h"
+
+
+#define HOLD_QUEUE_BUCKETS 256  // Number of hash buckets of destinations.
+
+
+typedef struct hold_entry hold_entry_t;
+struct hold_entry {
+    hold_entry_t *next;       // Next held message of the same destination.
+    hold_entry_t *age_next;   // Next held message of any destination.
+    hold_entry_t *age_prev;   // Previous held message of any destination.
+    struct hold_dest *dest;   // Destination the message is held for.
+    struct timespec expiry;   // Time of CLOCK_MONOTONIC message expires at.
+    size_t size;              // Bytes accounted for this entry.
+    uint64_t tag;             // Value kept along with the message.
+    message_t *m;             // Held message, stored right after the entry
+                              // with only its 'len' data bytes.
+};
+
+struct hold_dest {
+    uint32_t address;
+    uint16_t port;
+    hold_entry_t *head;       // Oldest held message of the destination.
+    hold_entry_t *tail;       // Newest held message of the destination.
+    int count;                // Number of held messages.
+    struct hold_dest *next;   // Next destination of the same bucket.
+};
+
+typedef struct {
+    struct hold_dest *buckets[HOLD_QUEUE_BUCKETS];
+    hold_entry_t *oldest;     // Held messages in order of expiry.
+    hold_entry_t *newest;
+    int size;                 // Number of held messages.
+    size_t bytes;             // Memory used by held messages.
+    long ttl;                 // Time-to-live of messages in ms.
+    size_t max_bytes;         // Max memory used by held messages.
+    int dest_max;             // Max number of messages per destination.
+    int whole_data;           // All data bytes of messages are stored.
+    pthread_mutex_t *mutex;
+} hold_queue_t;
+
+
+/**
+ * Creates a new and empty store of held messages.
+ *
+ * Parameters:
+ *  -ttl : Time in milliseconds a message is held, before it expires.
+ *  -max_bytes : Max memory used by all held messages.
+ *  -dest_max : Max number of messages held for a single destination.
+ *  -whole_data : If non-zero, all data bytes of messages are stored, e.g.
+ *          for wire formats that send them regardless of 'len'.
+ *
+ * Returns:
+ *  On success, a new store. On failure, NULL.
+ */
+hold_queue_t *
+hold_queue_create(long ttl, size_t max_bytes, int dest_max, int whole_data);
+
+/**
+ * Destroys given store, discarding any messages still held.
+ */
+void
+hold_queue_destroy(hold_queue_t *q);
+
+/**
+ * Holds a copy of given message for its destination.
+ *
+ * Parameters:
+ *  -q : Store to hold the message.
+ *  -m : Message to be held.
+ *  -tag : Value kept along with the message, see hold_queue_tag().
+ *  -now : Current time of CLOCK_MONOTONIC. Message expires after ttl.
+ *  -force : If non-zero, message is held even if memory cap or bound of its
+ *          destination has been hit.
+ *
+ * Returns:
+ *  0 if message is held, or a non-zero integer if memory cap or bound of its
+ *  destination has been hit.
+ */
+int
+hold_queue_put(hold_queue_t *q, message_t *m, uint64_t tag,
+               struct timespec *now, int force);
+
+/**
+ * Returns the oldest message held for given destination, without removing
+ * it. Message remains valid until it's removed.
+ *
+ * Returns:
+ *  A held message, or NULL if no message is held for destination.
+ */
+message_t *
+hold_queue_peek(hold_queue_t *q, uint32_t address, uint16_t port);
+
+/**
+ * Removes and frees the oldest message held for given destination.
+ */
+void
+hold_queue_pop(hold_queue_t *q, uint32_t address, uint16_t port);
+
+/**
+ * Returns the number of messages held for given destination.
+ */
+int
+hold_queue_count(hold_queue_t *q, uint32_t address, uint16_t port);
+
+/**
+ * Returns the number of messages held for all destinations, without locking.
+ * It's just a snapshot, meant for skipping the store while it's empty.
+ */
+int
+hold_queue_size(hold_queue_t *q);
+
+/**
+ * Removes the oldest held message, if it has expired.
+ *
+ * Parameters:
+ *  -now : Current time of CLOCK_MONOTONIC.
+ *
+ * Returns:
+ *  An expired message, which should be freed by hold_queue_release(). NULL
+ *  if no message has expired.
+ */
+message_t *
+hold_queue_expire(hold_queue_t *q, struct timespec *now);
+
+/**
+ * Gets the time the oldest held message expires at.
+ *
+ * Parameters:
+ *  -expiry : Storage for the time of CLOCK_MONOTONIC.
+ *
+ * Returns:
+ *  0 on success, or a non-zero integer if no message is held.
+ */
+int
+hold_queue_next_expiry(hold_queue_t *q, struct timespec *expiry);
+
+/**
+ * Frees a message returned by hold_queue_expire().
+ */
+void
+hold_queue_release(message_t *m);
+
+/**
+ * Returns the tag given message was held with. Message should have been
+ * returned by hold_queue_peek() or hold_queue_expire().
+ */
+uint64_t
+hold_queue_tag(message_t *m);
+
+
+#endif
@@ -18,9 +18,14 @@ linked_list_t *
 linked_list_create()
 {
     linked_list_t *list = (linked_list_t *) malloc(sizeof(linked_list_t));
+    if (!list) return NULL;
 
     // Create an empty root node.
     node_t *root = (node_t *) malloc(sizeof(node_t));
+    if (!root) {
+        free(list);
+        return NULL;
+    }
     root->data = NULL;
     root->prev = NULL;
     root->next = NULL;
@@ -56,6 +61,7 @@ node_t *
 linked_list_append(linked_list_t *list, void *data)
 {
     node_t *node = (node_t *) malloc(sizeof(node_t));
+    if (!node) return NULL;
 
 	list->size++;
 
@@ -86,6 +92,7 @@ node_t *
 linked_list_push(linked_list_t *list, void *data)
 {
     node_t *node = (node_t *) malloc(sizeof(node_t));
+    if (!node) return NULL;
 
     list->size++;
 
@@ -70,7 +70,7 @@ typedef struct {
  * Creates a new linked list.
  *
  * Returns:
- *  A reference to the linked list object.
+ *  A reference to the linked list object, or NULL on failure.
  */
 linked_list_t *
 linked_list_create();
@@ -101,7 +101,8 @@ linked_list_get_first(linked_list_t *list);
  *  -data: Value to append to the list.
  *
  * Returns:
- *  A reference to the interal node used by linked list to store given item.
+ *  A reference to the interal node used by linked list to store given item,
+ *  or NULL if it couldn't be allocated, so item was not inserted.
  */
 node_t *
 linked_list_append(linked_list_t *list, void *data);
@@ -127,7 +128,8 @@ linked_list_pop(linked_list_t *list);
  *  -data: Item to be inserted to the list.
  *
  * Returns:
- * A reference to the interal node used by linked list to store given item.
+ * A reference to the interal node used by linked list to store given item,
+ * or NULL if it couldn't be allocated, so item was not inserted.
  */
 node_t *
 linked_list_push(linked_list_t *list, void *data);
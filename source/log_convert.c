@@ -0,0 +1,157 @@
+/**
+ * log_convert.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A tool converting binary log files of server to text, on stdout.
+ *
+ * By default, output is in the text layout of server logs: a first line
+ * holding size of messages and of their data, followed by a line per
+ * record, holding elapsed milliseconds, messages sent, CPU usage of server,
+ * connected clients, sending syscalls per batch size, achieved and
+ * configured rate, latency percentiles in microseconds, and after a `|`
+ * separator, occupancy of output buffers as `ip:port=bytes`.
+ *
+ * With -csv option, the same fields are written as CSV with a header row,
+ * with occupancy entries separated by spaces in the last column.
+ *
+ * Usage: ./log_convert [-csv] <log_file>
+ *
+ * Version: 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "log_record.h"
+
+
+char *read_file(const char *path, size_t *len);
+void print_header_csv();
+void print_record(struct log_record *r, int csv);
+void print_occupancy(struct log_occupancy *o, int csv, int first);
+
+const char *latency_names[LOG_LATENCY_FIELDS] = {
+    "queue_p50_us", "queue_p99_us", "queue_p999_us", "queue_max_us",
+    "send_p50_us", "send_p99_us", "send_p999_us", "send_max_us"
+};
+
+
+int main(int argc, char *argv[])
+{
+    int csv = argc == 3 && !strcmp(argv[1], "-csv");
+    if (argc != 2 && !csv) {
+        fprintf(stderr, "Usage: %s [-csv] <log_file>\n", argv[0]);
+        return 1;
+    }
+
+    size_t len;
+    char *buf = read_file(argv[argc - 1], &len);
+    if (!buf) {
+        perror("ERROR: Failed to read log file");
+        return 1;
+    }
+
+    struct log_header header;
+    size_t off = log_header_decode(buf, len, &header);
+    if (!off) {
+        fprintf(stderr, "ERROR: Not a log file of a supported version.\n");
+        free(buf);
+        return 1;
+    }
+    if (csv) print_header_csv();
+    else printf("%u %u\n", header.message_size, header.data_size);
+
+    static struct log_record r;
+    size_t n;
+    while ((n = log_record_decode(buf + off, len - off, &r))) {
+        print_record(&r, csv);
+        off += n;
+    }
+
+    // A record may be truncated, if server was killed while writing it.
+    int rc = 0;
+    if (off != len) {
+        fprintf(stderr, "ERROR: %zu trailing bytes are not a valid record.\n",
+                len - off);
+        rc = 1;
+    }
+
+    free(buf);
+    return rc;
+}
+
+/**
+ * Reads the whole file of given path to memory.
+ *
+ * Returns:
+ *  A buffer holding file, to be freed by caller, or NULL on failure.
+ */
+char *read_file(const char *path, size_t *len)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) return NULL;
+
+    size_t cap = 65536;
+    char *buf = (char *) malloc(cap);
+    *len = 0;
+    while (buf) {
+        *len += fread(buf + *len, 1, cap - *len, f);
+        if (*len < cap) break;
+        cap *= 2;
+        char *larger = (char *) realloc(buf, cap);
+        if (!larger) free(buf);
+        buf = larger;
+    }
+
+    if (buf && ferror(f)) {
+        free(buf);
+        buf = NULL;
+    }
+    fclose(f);
+    return buf;
+}
+
+void print_header_csv()
+{
+    printf("elapsed_ms,messages,cpu_usage,clients");
+    for (int i = 0; i < LOG_BATCH_BUCKETS; i++) {
+        int low = 1 << i;
+        if (i == 0 || i == LOG_BATCH_BUCKETS - 1) printf(",batch_%d", low);
+        else printf(",batch_%d_%d", low, 2 * low - 1);
+    }
+    printf(",rate,configured_rate");
+    for (int i = 0; i < LOG_LATENCY_FIELDS; i++)
+        printf(",%s", latency_names[i]);
+    printf(",occupancy\n");
+}
+
+void print_record(struct log_record *r, int csv)
+{
+    char sep = csv ? ',' : ' ';
+
+    printf("%u%c%u%c%.6f%c%u", r->elapsed, sep, r->messages, sep,
+           r->cpu_usage / 1e6, sep, r->clients);
+    for (int i = 0; i < LOG_BATCH_BUCKETS; i++)
+        printf("%c%u", sep, r->batches[i]);
+    printf("%c%.1f%c%u", sep, r->rate / 10.0, sep, r->configured_rate);
+    for (int i = 0; i < LOG_LATENCY_FIELDS; i++)
+        printf("%c%.1f", sep, r->latency[i] / 10.0);
+
+    printf(csv ? "," : " |");
+    for (uint32_t i = 0; i < r->occupancy_num; i++)
+        print_occupancy(r->occupancy + i, csv, !i);
+    printf("\n");
+}
+
+void print_occupancy(struct log_occupancy *o, int csv, int first)
+{
+    char ip[INET_ADDRSTRLEN];
+    struct in_addr addr;
+    addr.s_addr = htonl(o->address);
+    inet_ntop(AF_INET, &addr, ip, INET_ADDRSTRLEN);
+    printf(csv && first ? "%s:%u=%u" : " %s:%u=%u", ip, o->port, o->bytes);
+}
@@ -0,0 +1,108 @@
+/**
+ * log_record.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * An implementation of routines defined in log_record.h.
+ *
+ * Version: 0.1
+ */
+
+#include <string.h>
+#include <arpa/inet.h>
+#include "log_record.h"
+
+
+// Size of the fixed fields of a record on file.
+#define RECORD_FIXED_SIZE (offsetof(struct log_record, occupancy))
+
+
+void
+_log_words_to_net(void *dst, const void *src, size_t size);
+void
+_log_words_to_host(void *dst, const void *src, size_t size);
+
+
+size_t
+log_header_encode(struct log_header *h, void *buf)
+{
+    _log_words_to_net(buf, h, sizeof(struct log_header));
+    return sizeof(struct log_header);
+}
+
+
+size_t
+log_header_decode(const void *buf, size_t len, struct log_header *h)
+{
+    if (len < sizeof(struct log_header)) return 0;
+    _log_words_to_host(h, buf, sizeof(struct log_header));
+    if (h->magic != LOG_MAGIC || h->version != LOG_VERSION) return 0;
+    return sizeof(struct log_header);
+}
+
+
+size_t
+log_record_size(struct log_record *r)
+{
+    return RECORD_FIXED_SIZE +
+           r->occupancy_num * sizeof(struct log_occupancy);
+}
+
+
+size_t
+log_record_encode(struct log_record *r, void *buf)
+{
+    if (r->occupancy_num > LOG_OCCUPANCY_MAX)
+        r->occupancy_num = LOG_OCCUPANCY_MAX;
+    r->size = log_record_size(r);
+    _log_words_to_net(buf, r, r->size);
+    return r->size;
+}
+
+
+size_t
+log_record_decode(const void *buf, size_t len, struct log_record *r)
+{
+    if (len < RECORD_FIXED_SIZE) return 0;
+    _log_words_to_host(r, buf, RECORD_FIXED_SIZE);
+
+    if (r->occupancy_num > LOG_OCCUPANCY_MAX ||
+        r->size != log_record_size(r) || r->size > len)
+        return 0;
+    _log_words_to_host(r->occupancy, (const char *) buf + RECORD_FIXED_SIZE,
+                       r->size - RECORD_FIXED_SIZE);
+    return r->size;
+}
+
+
+/**
+ * Copies given number of bytes, made of 32-bit words in host byte order, to
+ * network byte order. Destination needs no alignment.
+ */
+void
+_log_words_to_net(void *dst, const void *src, size_t size)
+{
+    const uint32_t *words = (const uint32_t *) src;
+    for (size_t i = 0; i < size / sizeof(uint32_t); i++) {
+        uint32_t w = htonl(words[i]);
+        memcpy((char *) dst + i * sizeof(uint32_t), &w, sizeof(uint32_t));
+    }
+}
+
+
+/**
+ * Copies given number of bytes, made of 32-bit words in network byte order,
+ * to host byte order. Source needs no alignment.
+ */
+void
+_log_words_to_host(void *dst, const void *src, size_t size)
+{
+    uint32_t *words = (uint32_t *) dst;
+    for (size_t i = 0; i < size / sizeof(uint32_t); i++) {
+        uint32_t w;
+        memcpy(&w, (const char *) src + i * sizeof(uint32_t), sizeof(uint32_t));
+        words[i] = ntohl(w);
+    }
+}
@@ -0,0 +1,129 @@
+/**
+ * log_record.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header defining the binary format of log files written by the logger of
+ * messaging service.
+ *
+ * A log file starts with a header, followed by a record per sample of the
+ * logger. Every field is a 32-bit unsigned integer in network byte order, so
+ * logs of a target can be converted on any host. Fractional values are kept
+ * as integers of fixed units. A record ends with a variable number of
+ * entries of output buffer occupancy, and starts with its size in bytes.
+ *
+ * Types defined in log_record.h:
+ *  -struct log_header
+ *  -struct log_record
+ *  -struct log_occupancy
+ *
+ * Routines defined in log_record.h:
+ *  -size_t
+ *   log_header_encode(struct log_header *h, void *buf)
+ *  -size_t
+ *   log_header_decode(const void *buf, size_t len, struct log_header *h)
+ *  -size_t
+ *   log_record_size(struct log_record *r)
+ *  -size_t
+ *   log_record_encode(struct log_record *r, void *buf)
+ *  -size_t
+ *   log_record_decode(const void *buf, size_t len, struct log_record *r)
+ *
+ * Version: 0.1
+ */
+
+#ifndef __log_record_h__
+#define __log_record_h__
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define LOG_MAGIC 0x4d544c47    // "MTLG"
+#define LOG_VERSION 1
+#define LOG_BATCH_BUCKETS 11    // Buckets of batch sizes, as counted by
+                                // sending unit.
+#define LOG_LATENCY_FIELDS 8    // p50, p99, p99.9 and max, of queue wait and
+                                // of receive to write latency.
+#define LOG_OCCUPANCY_MAX 1024  // Max entries of occupancy per record.
+
+
+struct log_header {
+    uint32_t magic;         // LOG_MAGIC.
+    uint32_t version;       // LOG_VERSION.
+    uint32_t message_size;  // Size of a message object on server.
+    uint32_t data_size;     // Size of data of a message.
+    uint32_t interval;      // Period of logger in ms.
+};
+
+// Unsent bytes on the output buffer of a client.
+struct log_occupancy {
+    uint32_t address;  // IPv4 address of client in host byte order.
+    uint32_t port;
+    uint32_t bytes;
+};
+
+struct log_record {
+    uint32_t size;        // Size of record on file in bytes.
+    uint32_t elapsed;     // Time in ms since previous sample.
+    uint32_t messages;    // Messages sent since previous sample.
+    uint32_t cpu_usage;   // CPU usage of server, in millionths.
+    uint32_t clients;     // Connected clients.
+    uint32_t batches[LOG_BATCH_BUCKETS];  // Sending syscalls per batch size.
+    uint32_t rate;        // Achieved rate, in tenths of messages/sec.
+    uint32_t configured_rate;  // Rate of global limiter, or 0 if disabled.
+    uint32_t latency[LOG_LATENCY_FIELDS];  // In tenths of microseconds.
+    uint32_t occupancy_num;
+    struct log_occupancy occupancy[LOG_OCCUPANCY_MAX];
+};
+
+
+/**
+ * Writes given header to given buffer, in file format.
+ *
+ * Returns:
+ *  The number of bytes written.
+ */
+size_t
+log_header_encode(struct log_header *h, void *buf);
+
+/**
+ * Reads a header from given buffer of given length.
+ *
+ * Returns:
+ *  The number of bytes read, or 0 if buffer holds no valid header.
+ */
+size_t
+log_header_decode(const void *buf, size_t len, struct log_header *h);
+
+/**
+ * Returns the size in bytes of given record on file.
+ */
+size_t
+log_record_size(struct log_record *r);
+
+/**
+ * Writes given record to given buffer, in file format. Size of record is
+ * set by this routine.
+ *
+ * Returns:
+ *  The number of bytes written.
+ */
+size_t
+log_record_encode(struct log_record *r, void *buf);
+
+/**
+ * Reads a record from given buffer of given length.
+ *
+ * Returns:
+ *  The number of bytes read, or 0 if buffer holds no complete and valid
+ *  record.
+ */
+size_t
+log_record_decode(const void *buf, size_t len, struct log_record *r);
+
+
+#endif
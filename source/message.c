@@ -11,6 +11,7 @@
 */
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <arpa/inet.h>
 #include "message.h"
@@ -20,6 +21,10 @@ message_t *
 message_create()
 {
     message_t *m = (message_t *) malloc(sizeof(message_t));
+    if (!m) return NULL;
+    memset(m, 0, offsetof(message_t, data));
+    m->priority = MESSAGE_PRIORITY_NORMAL;
+    m->len = MESSAGE_DATA_LENGTH;
     return m;
 }
 
@@ -41,6 +46,7 @@ message_host_to_net_buf(message_t *m, void *buffer)
     net->dest_addr = htonl(m->dest_addr);
     net->dest_port = htons(m->dest_port);
     net->flags = m->flags;
+    net->priority = 0;  // Not part of legacy format.
     net->count = htons(m->count);
     net->len = htons(m->len);
     memcpy(net->data, m->data, MESSAGE_DATA_LENGTH);
@@ -67,8 +73,12 @@ message_net_to_host_buf(void *m, message_t *dest)
     dest->dest_addr = ntohl(mc->dest_addr);
     dest->dest_port = ntohs(mc->dest_port);
     dest->flags = mc->flags;
+    dest->priority = MESSAGE_PRIORITY_NORMAL;
     dest->count = ntohs(mc->count);
+    // Legacy format carries all data bytes whatever 'len' says, so a 'len'
+    // beyond data is clamped, as routines reading data trust it.
     dest->len = ntohs(mc->len);
+    if (dest->len > MESSAGE_DATA_LENGTH) dest->len = MESSAGE_DATA_LENGTH;
     memcpy(dest->data, mc->data, MESSAGE_DATA_LENGTH);
 
     return dest;
@@ -81,3 +91,82 @@ message_net_to_host(void *m)
     message_t *host = (message_t *) malloc(sizeof(message_t));
     return message_net_to_host_buf(m, host);
 }
+
+
+size_t
+message_serialize(message_t *m, void *buffer, int format)
+{
+    if (format == MESSAGE_FORMAT_LEGACY) {
+        message_host_to_net_buf(m, buffer);
+        return sizeof(message_t);
+    }
+
+    message_header_t *h = (message_header_t *) buffer;
+    uint16_t len = m->len > MESSAGE_DATA_LENGTH ? MESSAGE_DATA_LENGTH : m->len;
+
+    h->src_addr = htonl(m->src_addr);
+    h->src_port = htons(m->src_port);
+    h->dest_addr = htonl(m->dest_addr);
+    h->dest_port = htons(m->dest_port);
+    h->flags = m->flags;
+    h->priority = m->priority;
+    h->count = htons(m->count);
+    h->len = htons(len);
+    memcpy((char *) buffer + MESSAGE_HEADER_LENGTH, m->data, len);
+
+    return MESSAGE_HEADER_LENGTH + len;
+}
+
+
+message_t *
+message_deserialize(void *buffer, message_t *dest, int format)
+{
+    if (format == MESSAGE_FORMAT_LEGACY)
+        return message_net_to_host_buf(buffer, dest);
+
+    message_header_t *h = (message_header_t *) buffer;
+
+    dest->src_addr = ntohl(h->src_addr);
+    dest->src_port = ntohs(h->src_port);
+    dest->dest_addr = ntohl(h->dest_addr);
+    dest->dest_port = ntohs(h->dest_port);
+    dest->flags = h->flags;
+    dest->priority = h->priority;
+    dest->count = ntohs(h->count);
+    dest->len = ntohs(h->len);
+    memcpy(dest->data, (char *) buffer + MESSAGE_HEADER_LENGTH, dest->len);
+
+    return dest;
+}
+
+
+size_t
+message_frame_size(void *buffer, size_t available, int format)
+{
+    if (format == MESSAGE_FORMAT_LEGACY) return sizeof(message_t);
+    if (available < MESSAGE_HEADER_LENGTH) return MESSAGE_HEADER_LENGTH;
+
+    uint16_t len = ntohs(((message_header_t *) buffer)->len);
+    if (len > MESSAGE_DATA_LENGTH) return 0;
+
+    return MESSAGE_HEADER_LENGTH + len;
+}
+
+
+size_t
+message_wire_size(message_t *m, int format)
+{
+    if (format == MESSAGE_FORMAT_LEGACY) return sizeof(message_t);
+    return MESSAGE_HEADER_LENGTH +
+           (m->len > MESSAGE_DATA_LENGTH ? MESSAGE_DATA_LENGTH : m->len);
+}
+
+
+uint8_t
+message_frame_priority(void *buffer, int format)
+{
+    if (format == MESSAGE_FORMAT_LEGACY) return MESSAGE_PRIORITY_NORMAL;
+
+    uint8_t priority = ((message_header_t *) buffer)->priority;
+    return priority > MESSAGE_PRIORITY_HIGH ? MESSAGE_PRIORITY_HIGH : priority;
+}
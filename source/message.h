@@ -21,6 +21,16 @@
  *   message_net_to_host(char *m)
  *  -message_t *
  *   message_net_to_host_buf(void *m, message_t *dest)
+ *  -size_t
+ *   message_serialize(message_t *m, void *buffer, int format)
+ *  -message_t *
+ *   message_deserialize(void *buffer, message_t *dest, int format)
+ *  -size_t
+ *   message_frame_size(void *buffer, size_t available, int format)
+ *  -size_t
+ *   message_wire_size(message_t *m, int format)
+ *  -uint8_t
+ *   message_frame_priority(void *buffer, int format)
  *
  * Version: 0.1
  */
@@ -38,6 +48,43 @@
 #define ERR_INVALID_ORDER 2  // Error when received messages are out of order.
 #define ERR_TARGET_DOWN 4    // Error when message destination is not active.
 
+// Wire formats of messages.
+// Framed format: A packed header followed by exactly 'len' bytes of data.
+#define MESSAGE_FORMAT_FRAMED 0
+// Legacy format: The whole message_t struct, always carrying all data bytes.
+#define MESSAGE_FORMAT_LEGACY 1
+
+// Priority classes of messages. Server always sends pending messages of a
+// higher class first. Lowest class is still served from time to time, so it
+// never starves.
+#define MESSAGE_PRIORITY_LOW 0     // Bulk traffic.
+#define MESSAGE_PRIORITY_NORMAL 1  // Default class of new messages.
+#define MESSAGE_PRIORITY_HIGH 2    // Urgent traffic, e.g. alarms.
+#define MESSAGE_PRIORITY_CLASSES 3
+
+// Messages sent to group address are delivered to every member of the group,
+// whose id is given by destination port. Members receive them unchanged, so
+// they can tell messages of a group apart.
+#define MESSAGE_GROUP_ADDR 0xffffffff
+// Flags of messages sent by a client to a group address, for joining or
+// leaving the group. Such messages are not delivered.
+#define MESSAGE_GROUP_JOIN 0x10
+#define MESSAGE_GROUP_LEAVE 0x20
+// Messages sent to topic address are delivered to every client subscribed
+// to their topic. Topic is held at the start of data, ended by a null byte
+// or by the end of data. Subscribers receive them unchanged.
+#define MESSAGE_TOPIC_ADDR 0xfffffffe
+// Flags of messages sent by a client to topic address, for subscribing with
+// the filter held in their data, or unsubscribing. Such messages are not
+// delivered.
+#define MESSAGE_TOPIC_SUBSCRIBE MESSAGE_GROUP_JOIN
+#define MESSAGE_TOPIC_UNSUBSCRIBE MESSAGE_GROUP_LEAVE
+// Clients on the host of server, connected through its unix socket, are
+// identified by local address, along with the port in the abstract name
+// their socket is bound to, formatted by MESSAGE_LOCAL_NAME.
+#define MESSAGE_LOCAL_ADDR 0x7ffffffe  // 127.255.255.254
+#define MESSAGE_LOCAL_NAME "mtl.%u"
+
 
 typedef struct {
     uint32_t src_addr;   // IPv4 address of message's source.
@@ -45,16 +92,37 @@ typedef struct {
     uint32_t dest_addr;  // IPv4 address of message's destination.
     uint16_t dest_port;  // Port number on which message should be delivered.
     uint8_t flags;       // Error flags.
+    uint8_t priority;    // One of MESSAGE_PRIORITY_* classes.
     uint16_t count;      // Mod16 counter that indicates correct order of messages.
     uint16_t len;        // Length of data array in bytes.
     // A byte array containing data of the message.
     char data[MESSAGE_DATA_LENGTH];
 } message_t;
 
+// Header of a message on framed wire format, in network byte order.
+typedef struct {
+    uint32_t src_addr;
+    uint16_t src_port;
+    uint32_t dest_addr;
+    uint16_t dest_port;
+    uint8_t flags;
+    uint8_t priority;
+    uint16_t count;
+    uint16_t len;
+} __attribute__((packed)) message_header_t;
+
+#define MESSAGE_HEADER_LENGTH (sizeof(message_header_t))
+// Max length of a message on the wire, for any format.
+#define MESSAGE_FRAME_MAX (sizeof(message_t))
+
 
 /**
  * Constructs a new message object.
  *
+ * Header fields of the new message are zeroed, while its length is set to
+ * MESSAGE_DATA_LENGTH, so users unaware of 'len' keep sending all data, and
+ * its priority to MESSAGE_PRIORITY_NORMAL.
+ *
  * Returns:
  *  A newly created message object.
  */
@@ -110,7 +178,8 @@ message_host_to_net(message_t *m);
  *
  * Returns:
  *  Pointer provided in dest. The message it points to should now contain
- *  the message provided in m buffer in byte order of the host machine.
+ *  the message provided in m buffer in byte order of the host machine, with
+ *  its 'len' clamped to MESSAGE_DATA_LENGTH.
  */
 message_t *
 message_net_to_host_buf(void *m, message_t *dest);
@@ -127,5 +196,77 @@ message_net_to_host_buf(void *m, message_t *dest);
 message_t *
 message_net_to_host(void *m);
 
+/**
+ * Serializes a message to given wire format, in network byte order.
+ *
+ * Legacy format carries no priority, so it's dropped.
+ *
+ * Parameters:
+ *  -m : A message object in host byte order. Its 'len' field should not
+ *          exceed MESSAGE_DATA_LENGTH.
+ *  -buffer : Buffer to store the serialized message, at least of size
+ *          MESSAGE_FRAME_MAX.
+ *  -format : One of MESSAGE_FORMAT_* wire formats.
+ *
+ * Returns:
+ *  Number of bytes written to buffer, that should be sent as is.
+ */
+size_t
+message_serialize(message_t *m, void *buffer, int format);
+
+/**
+ * Deserializes a complete message received on given wire format.
+ *
+ * On framed format, only the first 'len' bytes of data field are written.
+ * On legacy format, priority is set to MESSAGE_PRIORITY_NORMAL.
+ *
+ * Parameters:
+ *  -buffer : A complete serialized message, as received through the network.
+ *  -dest : Destination to store the converted message.
+ *  -format : One of MESSAGE_FORMAT_* wire formats.
+ *
+ * Returns:
+ *  Pointer provided in dest.
+ */
+message_t *
+message_deserialize(void *buffer, message_t *dest, int format);
+
+/**
+ * Calculates the size of the serialized message starting at given buffer.
+ *
+ * It's meant for readers of a byte stream, to find how many bytes complete
+ * the message currently being received.
+ *
+ * Parameters:
+ *  -buffer : Start of a serialized message.
+ *  -available : Number of bytes of the message currently available in buffer.
+ *  -format : One of MESSAGE_FORMAT_* wire formats.
+ *
+ * Returns:
+ *  Total size in bytes of the message. If not enough bytes are available to
+ *  determine it, the number of bytes needed for doing so is returned, which
+ *  is always greater than available. If message is invalid, 0 is returned.
+ */
+size_t
+message_frame_size(void *buffer, size_t available, int format);
+
+/**
+ * Returns the number of bytes given message occupies when serialized to given
+ * wire format.
+ */
+size_t
+message_wire_size(message_t *m, int format);
+
+/**
+ * Returns the priority class of a serialized message, without deserializing
+ * it. Classes above MESSAGE_PRIORITY_HIGH are treated as MESSAGE_PRIORITY_HIGH.
+ *
+ * Parameters:
+ *  -buffer : A serialized message, with at least its header available.
+ *  -format : One of MESSAGE_FORMAT_* wire formats.
+ */
+uint8_t
+message_frame_priority(void *buffer, int format);
+
 
 #endif
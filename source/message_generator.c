@@ -134,6 +134,7 @@ _message_generator_enter(void *args)
             memset(m->data, 0, MESSAGE_DATA_LENGTH);
             snprintf(m->data, MESSAGE_DATA_LENGTH,
                      "%ld:%s", generated, message_content);
+            m->len = strlen(m->data) + 1;
 
             g->handle_message(m, g->arg);
         }
@@ -11,85 +11,576 @@
  * Version: 0.1
  */
 
+#define _GNU_SOURCE  // pthread_attr_setaffinity_np()
+
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <error.h>
 #include <pthread.h>
+#include <sched.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <time.h>
 #include "message_svc.h"
-
-#define CLIENT_BUF_LEN 4 // Number of incoming messages to be buffered for
-                         // each client.
-
-
-// A list containing all connected clients.
-linked_list_t **clients;
-int connected_clients;  // Total numbwe
-pthread_mutex_t *clients_mutex;  // clients list corresponding mutex
-
-// A list of clients that have pending messages.
-linked_list_t *active_clients;
+#include "endpoint_table.h"
+#include "drr.h"
+#include "wal.h"
+#include "group_table.h"
+#include "topic_index.h"
+#include "metrics.h"
+#include "histogram.h"
+#include "log_record.h"
+#include "trace.h"
+#include "doorbell.h"
+
+#define CLIENT_BUF_LEN 4 // Default number of incoming messages to be
+                         // buffered for each client.
+#define CLIENT_RX_BUF_LEN 2048  // Size of receiving buffer of each client.
+#define CLIENT_TX_BUF_LEN 65536  // Size of sending buffer of each client.
+// Max number of messages on sending buffer of each client.
+#define CLIENT_OUT_MARKS (CLIENT_TX_BUF_LEN / MESSAGE_HEADER_LENGTH)
+#define CLIENT_NACK_BACKLOG 1024  // Max NACKs of a client waiting for space
+                                  // in its sending buffer.
+#define SEND_BATCH_DEFAULT 32  // Default max number of messages sent to a
+                               // destination by a single syscall.
+#define HOLD_MAX_BYTES_DEFAULT (16 << 20)  // Default max memory of messages
+                                          // held for offline destinations.
+#define HOLD_DEST_MAX_DEFAULT 1024  // Default max number of messages held for
+                                    // a destination.
+#define HOLD_TTL_WAL_DEFAULT 60000  // Default TTL in ms of held messages, when
+                                    // only implied by write-ahead log.
+#define WAL_COMPACT_PERIOD_MS 1000  // Period of write-ahead log compaction.
+#define CLIENT_GROUP_QUEUE_LEN 1024  // Max number of frames of groups pending
+                                     // for a client. Power of 2.
+#define FANOUT_CLOSED_MAX 16  // Max closed subscribers removed per fan-out.
+#define STARVATION_LIMIT_DEFAULT 16  // Default max number of batches lowest
+                                     // priority class may be passed over.
+#define LOG_INTERVAL_DEFAULT 1000  // Default period of logger in ms.
+#define LOG_RING_LEN 65536  // Size of ring buffer of log records.
+#define LOG_FLUSH_PERIOD_MS 10000  // Max time records wait on ring buffer.
+
+// Hints CPU that caller is busy-polling, so it saves power and yields to a
+// sibling hyper-thread.
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define CPU_RELAX() __asm__ __volatile__("yield")
+#else
+#define CPU_RELAX() __asm__ __volatile__("" ::: "memory")
+#endif
+
+#if LOG_BATCH_BUCKETS != SEND_BATCH_BUCKETS
+#error "Log records should hold every bucket of batch sizes."
+#endif
+
+
+// A table mapping endpoints of all connected clients to client objects.
+endpoint_table_t *clients;
+// Client objects no longer in use. Client objects are recycled and never
+// freed while the service runs, since lockless lookups on clients table may
+// still reference them.
+linked_list_t *free_clients;
+pthread_mutex_t *free_clients_mutex;  // free clients corresponding mutex
+
+// Number of pending outgoing messages buffered for each client.
+int out_queue_depth;
+// Wire format of messages exchanged with clients.
+int wire_format;
+// Tuning of sockets of clients.
+struct sock_tuning client_sock_tuning;
+
+// Deficit round-robin schedulers of clients that have pending messages, one
+// per priority class. Each flow contained holds a reference to its client.
+drr_t *active_clients[MESSAGE_PRIORITY_CLASSES];
 pthread_mutex_t *active_clients_mutex;  // active clients corresponding mutex
+// Messages held for offline destinations, or NULL if they're NACKed.
+hold_queue_t *held_messages;
+// Connected clients whose held messages, or frames of groups, should be
+// forwarded by sending unit. Each client contained holds a reference.
+// Guarded by active clients mutex.
+linked_list_t *forward_ready;
+// Max number of consecutive batches lowest class may be passed over.
+int starvation_limit;
+// Number of consecutive batches lowest class had pending messages but none
+// of them was taken. Accessed only by sending unit.
+int lowest_skipped;
+// Weights of clients on sending unit, matched at connect time.
+struct client_weight *client_weights;
+int client_weights_num;
 
 // Defines whether sending unit should keep running or terminate.
 int sending_unit_run;
 // Thread id of thread that runs sending unit.
 pthread_t sending_unit_tid;
-// Condition for blocking sending unit when no outgoing messages are available.
-pthread_cond_t *messages_exist_cond;
-pthread_mutex_t *messages_exist_mutex;
-uint32_t total_messages_sent;
-struct timespec message_sending_period;
+// Flows of clients that got their first pending message of a class, pushed
+// by receivers without locks, until sending unit moves them to active
+// clients. A list linked through scheduled_next of clients, newest first.
+drr_flow_t *scheduled_flows;
+// Doorbell rung when sending unit has new work, i.e. scheduled flows, or
+// anything else guarded by active clients mutex.
+doorbell_t *sending_doorbell;
+// Epoll instance sending unit blocks on while idle, watching its doorbell
+// and a timer armed with the deadline of its wait, if any.
+int sending_epfd;
+int sending_timer;
+// Max time in ns sending unit spins for new work once idle, before blocking
+// on its epoll instance. Zero when it blocks at once.
+long sending_spin_ns;
+
+// Metrics of the service, updated by every thread on a shard of its own.
+enum svc_metric {
+    METRIC_MESSAGES_RECEIVED,
+    METRIC_MESSAGES_SENT,
+    METRIC_BYTES_RECEIVED,
+    METRIC_BYTES_SENT,
+    METRIC_NACKS_BUFFER_FULL,    // NACKs by error code, in order of bits.
+    METRIC_NACKS_INVALID_ORDER,
+    METRIC_NACKS_TARGET_DOWN,
+    METRIC_GROUP_DROPS,
+    METRIC_NACK_DROPS,
+    METRIC_OUTPUT_DROP_BYTES,
+    METRIC_QUEUED_MESSAGES,
+    METRIC_CONNECTED_CLIENTS,
+    METRIC_HANDLER_WORKERS,
+    METRIC_HANDLER_BUSY,
+    METRIC_HANDLER_QUEUED,
+    METRIC_HANDLER_WAITS,
+    METRIC_SENDING_SPINS,
+    METRIC_SENDING_SPIN_WAKES,
+    METRIC_SENDING_SPIN_NS,
+    METRIC_SENDING_PARKS,
+    METRIC_SENDING_WAKEUPS,
+    SVC_METRICS_NUM
+};
+const struct metric_def svc_metric_defs[SVC_METRICS_NUM] = {
+    { "mtl_messages_received_total", "Messages received from clients.",
+      METRIC_COUNTER, NULL },
+    { "mtl_messages_sent_total", "Messages sent to their destinations.",
+      METRIC_COUNTER, NULL },
+    { "mtl_received_bytes_total", "Bytes received from clients.",
+      METRIC_COUNTER, NULL },
+    { "mtl_sent_bytes_total", "Bytes sent to clients.",
+      METRIC_COUNTER, NULL },
+    { "mtl_nacks_total", "Messages NACKed to their sources, by error code.",
+      METRIC_COUNTER, "code=\"buffer_full\"" },
+    { "mtl_nacks_total", "Messages NACKed to their sources, by error code.",
+      METRIC_COUNTER, "code=\"invalid_order\"" },
+    { "mtl_nacks_total", "Messages NACKed to their sources, by error code.",
+      METRIC_COUNTER, "code=\"target_down\"" },
+    { "mtl_group_drops_total",
+      "Frames of groups and topics dropped, as too many were pending.",
+      METRIC_COUNTER, NULL },
+    { "mtl_nack_drops_total",
+      "NACKs dropped, as too many were waiting for space on their source, "
+      "or it disconnected while they waited.",
+      METRIC_COUNTER, NULL },
+    { "mtl_output_dropped_bytes_total",
+      "Bytes buffered for clients that were never written, as their "
+      "connection failed or closed.",
+      METRIC_COUNTER, NULL },
+    { "mtl_queued_messages",
+      "Messages pending on queues of clients, waiting for sending unit.",
+      METRIC_GAUGE, NULL },
+    { "mtl_connected_clients", "Clients currently connected.",
+      METRIC_GAUGE, NULL },
+    { "mtl_handler_workers", "Workers of the pool handling clients.",
+      METRIC_GAUGE, NULL },
+    { "mtl_handler_workers_busy", "Workers of the pool handling a client.",
+      METRIC_GAUGE, NULL },
+    { "mtl_handler_queued_connections",
+      "Accepted connections waiting for a free worker of the pool.",
+      METRIC_GAUGE, NULL },
+    { "mtl_handler_waits_total",
+      "Accepted connections that found all workers of the pool busy.",
+      METRIC_COUNTER, NULL },
+    { "mtl_sending_spins_total",
+      "Times idle sending unit busy-polled for new messages.",
+      METRIC_COUNTER, NULL },
+    { "mtl_sending_spin_wakes_total",
+      "Times sending unit found new messages while busy-polling.",
+      METRIC_COUNTER, NULL },
+    { "mtl_sending_spin_nanoseconds_total",
+      "Time sending unit spent busy-polling, i.e. CPU used while idle.",
+      METRIC_COUNTER, NULL },
+    { "mtl_sending_parks_total",
+      "Times idle sending unit blocked, until woken or until a deadline.",
+      METRIC_COUNTER, NULL },
+    { "mtl_sending_wakeups_total",
+      "Syscalls made to wake sending unit up, after coalescing signals.",
+      METRIC_COUNTER, NULL },
+};
+metrics_t *svc_metrics;
+// Flight recorder of events of messages and clients, or NULL if disabled.
+trace_t *tracer;
+// Attributes of threads of the service, placing them on their CPUs.
+pthread_attr_t sending_attr;       // Sending unit.
+pthread_attr_t handler_attr;       // Event loops and handlers of clients.
+pthread_attr_t housekeeping_attr;  // Logger, log compactor and exporter.
+
+int
+_usable_cpus(uint64_t cpus);
+
+// Max number of messages sent to a destination by a single syscall.
+int send_batch_max;
+// Max time sending unit waits for more messages, before sending a batch
+// that is not full.
+struct timespec send_batch_delay;
+// Number of sending syscalls per size of batch. Bucket i counts batches of
+// [2^i, 2^(i+1)) messages.
+unsigned long send_batches[SEND_BATCH_BUCKETS];
+// Set when latency of messages is tracked for the logger. Messages are then
+// timestamped when received, and sending unit records the time they waited
+// on queues until taken, and the time until they were written to the socket
+// of their destination. Histograms are written only by sending unit.
+int track_latency;
+histogram_t queue_latency;
+histogram_t send_latency;
+
+// A destination of messages taken by sending unit on a single pass.
+struct batch_dest {
+    uint32_t address;
+    uint16_t port;
+    client_t *client;  // Destination client, or NULL if it's offline.
+    int held;          // Destination has held messages not yet forwarded.
+    int count;         // Number of messages buffered for the destination.
+};
+
+// Messages taken by sending unit on a single pass.
+struct send_batch {
+    client_t **sources;   // Clients messages were taken from.
+    int *taken;           // Number of messages taken from each source.
+    int *handled;         // Number of messages of each source sent or NACKed.
+    int *nacked;          // Number of messages of each source NACKed.
+    int *blocked;         // Set for sources waiting for space on a destination.
+    int *classes;         // Priority class messages were taken from.
+    int *deferred;        // Set for sources waiting for destination tokens.
+    uint64_t *delivered;  // Log ids of messages buffered for destinations.
+    int delivered_num;
+    int sources_num;
+    message_t **messages; // Taken messages, in the order they were taken.
+    int *owners;          // Index of the source of each taken message.
+    int size;             // Number of taken messages.
+    int max;              // Max number of messages to be taken.
+    long retry;           // Nanoseconds until a deferred message may be sent.
+    struct batch_dest *dests;  // Destinations of taken messages.
+    int dests_num;
+};
+
+struct send_batch *
+_send_batch_create(int max);
+void
+_send_batch_destroy(struct send_batch *b);
+void
+_collect_batch(struct send_batch *b);
+void
+_collect_class(struct send_batch *b, int cls);
+int
+_take_messages(struct send_batch *b, int i);
+void
+_update_starvation(struct send_batch *b);
+int
+_active_flows();
+void
+_signal_sending_unit();
+drr_flow_t **
+_scheduled_next(drr_flow_t *flow);
+void
+_enqueue_scheduled();
+int
+_sending_wait(struct timespec *deadline, int spin);
+int
+_spin_for_messages();
+int
+_park_sending_unit(struct timespec *deadline);
+int
+_wait_batch_messages(struct timespec *deadline);
+int
+_send_batch(struct send_batch *b);
+struct batch_dest *
+_batch_dest(struct send_batch *b, message_t *m);
+int
+_batch_hold(struct send_batch *b, int s, message_t *m, uint64_t id);
+int
+_batch_nack(struct send_batch *b, int s, message_t *m);
+void
+_record_taken(client_t *src, message_t *m, uint64_t taken);
+void
+_trace_message(int type, message_t *m, uint16_t arg);
+void
+_trace_client(int type, client_t *c, uint32_t bytes);
+
+// Event loop flushing output buffers of clients, when each client is handled
+// by a dedicated thread.
+event_loop_t *flush_loop;
+
+int
+_buffer_message(client_t *dest, message_t *m, drr_flow_t *waiter,
+                uint64_t received);
+int
+_nack_to(client_t *src, message_t *m, uint8_t error_code);
+void
+_count_nack(message_t *m, uint8_t error_code);
+int
+_out_append(client_t *c, message_t *m);
+int
+_out_append_frame(client_t *c, void *frame, size_t size);
+int
+_out_append_nacks(client_t *c);
+void
+_out_mark(client_t *c, uint64_t received);
+void
+_out_record_written(client_t *c);
+int
+_out_reserve(client_t *c);
+void
+_flush_client(client_t *c);
+void
+_flush_event(event_loop_t *loop, uint32_t events, void *arg);
+void
+_flush_unwatch_client(event_loop_t *loop, void *arg);
+void
+_close_output(client_t *c);
+void
+_wake_waiters(client_t *c);
+
+
+// ---- Definitions of event loops ----
+struct Svc_Loop {
+    event_loop_t *loop;      // Event loop multiplexing clients' sockets.
+    linked_list_t *clients;  // Clients handled by this event loop.
+};
+
+struct Svc_Loop *svc_loops;  // Event loops of the service.
+int svc_loops_num;           // Number of event loops (0 if disabled).
+unsigned int next_loop;      // Loop to assign the next client to.
+
+int
+_start_svc_loops(int loops_num);
+void
+_stop_svc_loops();
+void
+_loop_attach_client(event_loop_t *loop, void *arg);
+void
+_loop_client_event(event_loop_t *loop, uint32_t events, void *arg);
+void
+_loop_resume_client(event_loop_t *loop, void *arg);
+void
+_loop_read_client(client_t *c);
+void
+_loop_close_client(client_t *c);
+
+
+// ---- Definitions of handler pool ----
+// Workers handling a client each, when clients are not handled by event
+// loops. Accepted sockets wait on a bounded queue until a worker is free.
+pthread_t *handler_tids;
+int handler_workers;   // Number of workers (0 if pool is disabled).
+int handler_run;
+int handler_busy;      // Workers currently handling a client.
+int *handler_sockets;      // Socket handled by each worker, or -1.
+int *handler_queue;    // Ring of accepted sockets, as long as the pool.
+int handler_queue_head;
+int handler_queue_len;
+pthread_mutex_t *handler_mutex;
+pthread_cond_t *handler_queued_cond;  // Signaled when a socket is queued.
+pthread_cond_t *handler_space_cond;   // Signaled when a socket is taken.
+
+int
+_start_handler_pool(int workers);
+void
+_stop_handler_pool();
+void *
+_handler_work(void *arg);
+void
+_handle_client(int socket_fd, int *slot);
+void
+_release_handler_slot(int *slot);
 
 
 // ---- Definitions of logger  ----
-FILE *log_file;      // File where log data will
+int log_fd;          // File where log records are written.
+int pid_stat_fd;     // /proc/self/stat, kept open and read by pread().
+int cpu_stat_fd;     // /proc/stat, kept open and read by pread().
 pthread_t log_tid;   // Thread if of logger.
 int logger_run;
+long log_interval;   // Period of logger in ms.
+// Records not yet written to log file, in a ring buffer. Positions only
+// grow, and are taken modulo the length of ring.
+char *log_ring;
+size_t log_ring_head;  // Position where next record is put.
+size_t log_ring_tail;  // Position of first byte not yet written.
+struct timespec log_flushed;  // Time ring was last written.
+// Record of current sample and its encoding. Accessed only by logger.
+struct log_record log_current;
+char log_encoded[sizeof(struct log_record)];
 
 struct log_data {
     struct timespec timestamp;  // Timestamp of sample.
     unsigned long messages;     // Number of messages sent at this sample.
+    unsigned long batches[SEND_BATCH_BUCKETS];  // Sending syscalls per size.
     unsigned long total_cpu;    // Total system-wide CPU usage at this sample.
     unsigned long utime;  // Total CPU time consumed by server in user mode.
     unsigned long stime;  // Total CPU time consumed by server in kernel mode.
+    histogram_t queue_latency;  // Snapshots of latency histograms.
+    histogram_t send_latency;
 };
 
 int
-_start_logger(char *logger_fn);
+_start_logger(char *logger_fn, long interval);
 int
 _stop_logger();
 void *
 _logger_work(void *arg);
 void
-_log(FILE *log_file, struct log_data *prev);
+_log(struct log_data *prev);
+int
+_log_read_cpu(struct log_data *d);
+void
+_log_latency(uint32_t *fields, histogram_t *current, histogram_t *prev);
+void
+_log_out_occupancy(void *value, void *arg);
+int
+_log_ring_put(const void *buf, size_t len);
+int
+_log_flush();
+
+
+// ---- Definitions of rate limiter ----
+int speed_limiter_run;  // Global rate limiter is enabled.
+// Limits the rate of all messages sent. Accessed only by sending unit.
+token_bucket_t rate_bucket;
+struct timespec limiter_start;  // Time rate limiter started.
+long limiter_max_rate;
+long limiter_min_rate;
+long limiter_step;
+long limiter_period;    // Period in ms of rate reduction by limiter_step.
+long configured_rate;   // Current rate of global limiter (messages/sec).
+long dest_rate;         // Rate limit of each destination, or 0 if disabled.
+long dest_burst;
+
+void
+_start_speed_limiter(struct svc_cfg *options);
+int
+_limiter_acquire(int max);
+void
+_limiter_update_rate(struct timespec *now);
+void
+_wait_deferred(long delay);
+
 
+// ---- Definitions of store-and-forward ----
+int
+_hold_message(message_t *m, uint64_t id);
+int
+_dest_has_held(uint32_t address, uint16_t port);
+void
+_schedule_forward(client_t *c);
+void
+_forward_pending();
+void
+_forward_client(client_t *c);
+void
+_expire_held();
+int
+_wait_expiry();
 
-// ---- Definitions of speed limiter ----
-int speed_limiter_run;
-pthread_t limiter_tid;
 
-struct limiter_data {
-    long period;
-    long max_rate;
-    long min_rate;
-    long rate_step;
+// ---- Definitions of groups and topics ----
+// A message sent to a group or a topic, serialized once and shared by all
+// members it's pending for. Accessed only by sending unit.
+struct group_frame {
+    int refs;       // Members it's pending for, plus one while fanning out.
+    size_t size;    // Bytes of serialized message.
+    char data[];
+};
+// State of the fan-out of a single message.
+struct fanout {
+    struct group_frame *frame;
+    int members;            // Members reached by the frame.
+    unsigned long seq;
+    client_t *closed[FANOUT_CLOSED_MAX];  // Closed subscribers of topic.
+    int closed_num;
 };
+// Members of groups. Each member holds a reference to its client.
+group_table_t *groups;
+// Subscribers of topics. Every subscription holds a reference to its client.
+topic_index_t *topics;
+// Sequence number of the last fan-out. Accessed only by sending unit.
+unsigned long fanout_seq;
 
+void
+_handle_group_request(client_t *c, message_t *m, uint8_t request);
+void
+_handle_topic_request(client_t *c, message_t *m, uint8_t request);
+int
+_fanout_message(message_t *m);
+int
+_queue_frame(client_t *c, struct fanout *fanout);
 int
-_start_speed_limiter(long period, long max_rate, long min_rate, long step);
+_queue_group_frame(void *member, void *arg);
+void
+_queue_topic_frame(void *member, void *arg);
+void
+_drop_group_frames(client_t *c);
+void
+_release_member(void *member);
+
+
+// ---- Definitions of write-ahead log ----
+wal_t *message_log;     // Log of accepted messages, or NULL if disabled.
+int wal_compactor_run;
+pthread_t wal_compactor_tid;
+
 int
-_stop_speed_limiter();
+_start_wal(struct svc_cfg *options);
+void
+_stop_wal();
 void *
-_speed_limiter_worker(void *arg);
+_wal_compactor_work(void *arg);
+void
+_replay_message(message_t *m, uint64_t id, void *arg);
+void
+_log_delivered(uint64_t id);
 
 
 // ---- Definitions of util routines ----
+int
+_client_weight(uint32_t address, uint16_t port);
+int
+_local_client_port(struct sockaddr_un *addr, socklen_t addr_len,
+                   uint16_t *port);
+int
+_register_client(client_t *c);
+void
+_unregister_client(client_t *c);
+client_t *
+_lookup_client(uint32_t address, uint16_t port);
+client_t *
+_client_alloc();
+void
+_client_free(client_t *client);
+int
+_receive_frames(client_t *c, int nonblocking);
+void
+_receive_message(client_t *c, void *frame, uint64_t received);
+int
+_out_messages_full(client_t *c, int cls);
+void
+_schedule_client(client_t *c, int cls);
+void
+_reschedule_client(client_t *c, int cls);
+void
+_resume_receiving(client_t *c);
 void
 define_sender(message_t *m, client_t *client);
 long
@@ -98,6 +589,8 @@ void
 timespec_add(struct timespec *res, struct timespec *a, struct timespec *b);
 void
 timespec_subtract(struct timespec *res, struct timespec *a, struct timespec *b);
+uint64_t
+_monotonic_ns();
 
 
 void
@@ -105,45 +598,162 @@ init_svc(struct svc_cfg *options)
 {
     int rc;
 
-    // Initialize list for keeping all connected clients.
-    clients = (linked_list_t **) malloc(sizeof(linked_list_t *) * 256);
-    // clients = linked_list_create();
-    clients_mutex = (pthread_mutex_t *) malloc(sizeof(pthread_mutex_t));
-    if (!clients || !clients_mutex) goto error;
-    if (pthread_mutex_init(clients_mutex, NULL)) goto error;
-
-    // Initialize list for keeping clients with pending outgoing messages.
-    active_clients = linked_list_create();
+    // Initialize table for keeping all connected clients.
+    clients = endpoint_table_create(ENDPOINT_TABLE_DEFAULT_CAPACITY);
+    free_clients = linked_list_create();
+    free_clients_mutex = (pthread_mutex_t *) malloc(sizeof(pthread_mutex_t));
+    if (!clients || !free_clients || !free_clients_mutex) goto error;
+    if (pthread_mutex_init(free_clients_mutex, NULL)) goto error;
+
+    // Initialize lists for keeping clients with pending outgoing messages.
+    for (int k = 0; k < MESSAGE_PRIORITY_CLASSES; k++) {
+        active_clients[k] = drr_create(
+            options && options->send_quantum > 0 ?
+            (unsigned long) options->send_quantum : MESSAGE_FRAME_MAX);
+        if (!active_clients[k]) goto error;
+    }
     active_clients_mutex = (pthread_mutex_t *) malloc(sizeof(pthread_mutex_t));
-    if (!active_clients || !active_clients_mutex) goto error;
+    forward_ready = linked_list_create();
+    groups = group_table_create();
+    topics = topic_index_create();
+    if (!active_clients_mutex || !forward_ready || !groups || !topics)
+        goto error;
+    fanout_seq = 0;
     if (pthread_mutex_init(active_clients_mutex, NULL)) goto error;
+    starvation_limit = STARVATION_LIMIT_DEFAULT;
+    if (options && options->starvation_limit > 0)
+        starvation_limit = options->starvation_limit;
+    lowest_skipped = 0;
 
     // Initialize tools for signaling sender unit that outgoing messages exist.
-    messages_exist_cond = (pthread_cond_t *) malloc(sizeof(pthread_cond_t));
-    messages_exist_mutex = (pthread_mutex_t *) malloc(sizeof(pthread_mutex_t));
-    if (!messages_exist_cond || !messages_exist_mutex) goto error;
-    if (pthread_cond_init(messages_exist_cond, NULL)) goto error;
-    if (pthread_mutex_init(messages_exist_mutex, NULL)) goto error;
+    scheduled_flows = NULL;
+    sending_doorbell = doorbell_create();
+    sending_epfd = epoll_create1(EPOLL_CLOEXEC);
+    sending_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (!sending_doorbell || sending_epfd < 0 || sending_timer < 0)
+        goto error;
+    struct epoll_event ev = { .events = EPOLLIN };
+    ev.data.fd = doorbell_fd(sending_doorbell);
+    if (epoll_ctl(sending_epfd, EPOLL_CTL_ADD, ev.data.fd, &ev)) goto error;
+    ev.data.fd = sending_timer;
+    if (epoll_ctl(sending_epfd, EPOLL_CTL_ADD, ev.data.fd, &ev)) goto error;
+
+    svc_metrics = metrics_create(svc_metric_defs, SVC_METRICS_NUM);
+    if (!svc_metrics) goto error;
+    // Every thread is created on its configured CPUs, so it never runs
+    // elsewhere, not even before it could move itself.
+    if (init_thread_attr(&sending_attr, options ? options->sending_cpus : 0) ||
+        init_thread_attr(&handler_attr, options ? options->handler_cpus : 0) ||
+        init_thread_attr(&housekeeping_attr,
+                          options ? options->housekeeping_cpus : 0))
+        goto error;
+    if (options && options->handler_stack_size > 0 &&
+        pthread_attr_setstacksize(&handler_attr, options->handler_stack_size))
+        goto error;
+    // Recorder is ready before any thread of the service records an event.
+    if (options) client_sock_tuning = options->sock;
+    else memset(&client_sock_tuning, 0, sizeof(client_sock_tuning));
+
+    if (options && options->trace_path) {
+        tracer = trace_open(options->trace_path);
+        if (!tracer) goto error;
+    }
+    // Depth of out messages rings is a power of 2.
+    int depth = CLIENT_BUF_LEN;
+    if (options && options->out_queue_depth > 0)
+        depth = options->out_queue_depth;
+    for (out_queue_depth = 1; out_queue_depth < depth; out_queue_depth <<= 1);
+    wire_format = options ? options->wire_format : MESSAGE_FORMAT_FRAMED;
+
+    // Keep a copy of configured weights of clients.
+    if (options && options->weights_num > 0) {
+        client_weights = (struct client_weight *) malloc(
+            sizeof(struct client_weight) * options->weights_num);
+        if (!client_weights) goto error;
+        memcpy(client_weights, options->weights,
+               sizeof(struct client_weight) * options->weights_num);
+        client_weights_num = options->weights_num;
+    }
+
+    // Latency of messages is tracked only to be logged.
+    track_latency = options && options->enable_logger;
+    memset(&queue_latency, 0, sizeof(queue_latency));
+    memset(&send_latency, 0, sizeof(send_latency));
+
+    // Setup batching of sending unit.
+    send_batch_max = SEND_BATCH_DEFAULT;
+    if (options && options->send_batch_max > 0)
+        send_batch_max = options->send_batch_max;
+    if (send_batch_max > SEND_BATCH_LIMIT) send_batch_max = SEND_BATCH_LIMIT;
+
+    // Hold messages for offline destinations, if enabled.
+    if (options && (options->hold_ttl > 0 || options->wal_dir)) {
+        held_messages = hold_queue_create(
+            options->hold_ttl > 0 ? options->hold_ttl : HOLD_TTL_WAL_DEFAULT,
+            options->hold_max_bytes > 0 ?
+            (size_t) options->hold_max_bytes : HOLD_MAX_BYTES_DEFAULT,
+            options->hold_dest_max > 0 ?
+            options->hold_dest_max : HOLD_DEST_MAX_DEFAULT,
+            wire_format == MESSAGE_FORMAT_LEGACY);
+        if (!held_messages) goto error;
+    }
+
+    // Replay messages logged before restart, then keep logging.
+    if (options && options->wal_dir) {
+        rc = _start_wal(options);
+        if (rc) goto error;
+    }
 
-    total_messages_sent = 0;
-    connected_clients = 0;
+    // Setup rate limiters before sending unit uses them.
+    if (options && options->enable_speed_limiter)
+        _start_speed_limiter(options);
+    dest_rate = options ? options->dest_rate : 0;
+    dest_burst = options && options->dest_burst > 0 ?
+                 options->dest_burst : send_batch_max;
+    long delay = options ? options->send_batch_delay : 0;
+    send_batch_delay.tv_sec = delay / 1000000;
+    send_batch_delay.tv_nsec = (delay % 1000000) * 1000;
+    sending_spin_ns = options ? options->sending_spin * 1000 : 0;
+    if (sending_spin_ns && _usable_cpus(options->sending_cpus) < 2) {
+        // A producer can't run while sending unit spins on the only CPU.
+        fprintf(stderr, "Sending unit has a single CPU, so it won't spin.\n");
+        sending_spin_ns = 0;
+    }
+    memset(send_batches, 0, sizeof(send_batches));
 
     // Start sending unit.
     sending_unit_run = 1;
     rc = pthread_create(
-        &sending_unit_tid, NULL, start_sending_unit, (void *) NULL);
+        &sending_unit_tid, &sending_attr, start_sending_unit, (void *) NULL);
     if (rc) goto error;
 
+    // Start event loops. Otherwise, output buffers of clients handled by
+    // dedicated threads are flushed by a loop of their own.
+    if (options && options->event_loops > 0) {
+        rc = _start_svc_loops(options->event_loops);
+        if (rc) goto error;
+    } else {
+        flush_loop = event_loop_create();
+        if (!flush_loop) goto error;
+        rc = event_loop_start(flush_loop, &handler_attr);
+        if (rc) goto error;
+        if (options && options->handler_workers > 0) {
+            rc = _start_handler_pool(options->handler_workers);
+            if (rc) goto error;
+        }
+    }
+
     // Initialize logger.
     if (options && options->enable_logger) {
-        rc = _start_logger(options->log_fn);
+        rc = _start_logger(options->log_fn, options->log_interval);
         if (rc) goto error;
     }
 
-    // Initialize speed limiter.
-    if (options && options->enable_speed_limiter) {
-        rc = _start_speed_limiter(options->time_of_step, options->max_rate,
-                                  options->min_rate, options->rate_step);
+    // Serve metrics on a thread of their own, so scrapes never wait for
+    // forwarding threads.
+    if (options && options->metrics_endpoint) {
+        rc = metrics_serve(svc_metrics, options->metrics_endpoint,
+                           &housekeeping_attr);
         if (rc) goto error;
     }
 
@@ -159,153 +769,240 @@ void
 stop_svc()
 {
     if (logger_run) _stop_logger();
-    if (speed_limiter_run) _stop_speed_limiter();
+
+    // Event loops and handlers should stop feeding the sending unit before
+    // it stops.
+    if (svc_loops_num) _stop_svc_loops();
+    if (handler_workers) _stop_handler_pool();
 
     // Ask sender unit to terminate and wait until it terminates.
     sending_unit_run = 0;
-    pthread_cond_signal(messages_exist_cond);  // Cause it to stop waiting for messages.
+    pthread_mutex_lock(active_clients_mutex);
+    _signal_sending_unit();  // Cause it to stop waiting for messages.
+    pthread_mutex_unlock(active_clients_mutex);
     pthread_join(sending_unit_tid, NULL);
 
+    if (flush_loop) {
+        event_loop_stop(flush_loop);
+        event_loop_destroy(flush_loop);
+        flush_loop = NULL;
+    }
+
+    // Release clients still handled by event loops. Destroying a loop runs
+    // its pending tasks, which may attach further clients.
+    client_t *c;
+    for (int i = 0; i < svc_loops_num; i++) {
+        event_loop_destroy(svc_loops[i].loop);
+        while ((c = linked_list_pop(svc_loops[i].clients))) {
+            _unregister_client(c);
+            client_put(c);
+        }
+        linked_list_destroy(svc_loops[i].clients);
+    }
+    free(svc_loops);
+    svc_loops_num = 0;
+
+    // Messages still pending will never be sent. Clients waiting for space
+    // on output buffers were moved here when their destinations closed.
+    while ((c = linked_list_pop(forward_ready))) {
+        _drop_group_frames(c);
+        c->forward_scheduled = 0;
+        client_put(c);
+    }
+    linked_list_destroy(forward_ready);
+    group_table_destroy(groups, _release_member);
+    groups = NULL;
+    topic_index_destroy(topics, _release_member);
+    topics = NULL;
+    hold_queue_destroy(held_messages);
+    held_messages = NULL;
+    // Anything not delivered by now is replayed on next start.
+    if (message_log) _stop_wal();
+
+    drr_flow_t *flow;
+    _enqueue_scheduled();
+    for (int k = 0; k < MESSAGE_PRIORITY_CLASSES; k++) {
+        while ((flow = drr_next(active_clients[k]))) {
+            c = (client_t *) flow->owner;
+            c->scheduled[k] = 0;
+            client_put(c);
+        }
+        drr_destroy(active_clients[k]);
+    }
+
     // Clean-up global allocated resources.
-    pthread_mutex_destroy(clients_mutex);
+    while ((c = linked_list_pop(free_clients))) _client_free(c);
+    linked_list_destroy(free_clients);
+    pthread_mutex_destroy(free_clients_mutex);
+    free(free_clients_mutex);
+    endpoint_table_destroy(clients);
     pthread_mutex_destroy(active_clients_mutex);
-    pthread_mutex_destroy(messages_exist_mutex);
-    pthread_cond_destroy(messages_exist_cond);
-    free(clients_mutex);
     free(active_clients_mutex);
-    free(messages_exist_mutex);
-    free(messages_exist_cond);
-    linked_list_destroy(active_clients);
-    // linked_list_destroy(clients);
-    free(clients);
+    close(sending_epfd);
+    close(sending_timer);
+    doorbell_destroy(sending_doorbell);
+    free(client_weights);
+    client_weights = NULL;
+    client_weights_num = 0;
+    speed_limiter_run = 0;
+    metrics_destroy(svc_metrics);
+    svc_metrics = NULL;
+    trace_close(tracer);
+    tracer = NULL;
+    pthread_attr_destroy(&sending_attr);
+    pthread_attr_destroy(&handler_attr);
+    pthread_attr_destroy(&housekeeping_attr);
+}
+
+
+void
+dump_svc_trace()
+{
+    if (tracer) trace_dump(tracer);
 }
 
 
 void
 handle_client(int socket_fd)
+{
+    _handle_client(socket_fd, NULL);
+}
+
+
+/**
+ * Handles given client until its connection is dead, like handle_client().
+ *
+ * Parameters:
+ *  -slot : Slot of a worker of handler pool holding the socket, so pool can
+ *          shut it down, or NULL. It's cleared before the socket may be
+ *          closed, so pool never touches a reused descriptor.
+ */
+void
+_handle_client(int socket_fd, int *slot)
 {
     client_t *c = NULL;
-    node_t *c_ref = NULL;
-    char *in = NULL;
-    message_t *mspace = NULL;
-    int rc;
+    int registered = 0;
+    int watched = 0;
+    int n;
 
     c = client_create(socket_fd);
-    if (!c) goto error;
-
-    // Add new client to list of connected clients.
-    pthread_mutex_lock(clients_mutex);
-    int index = (c->address + c->port) & 0xFF;
-    if (!clients[index]) clients[index] = linked_list_create();
-    if (!clients[index]) {
-        pthread_mutex_unlock(clients_mutex);
+    if (!c) {
+        _release_handler_slot(slot);
+        close(socket_fd);
         goto error;
     }
-    c_ref = linked_list_append(clients[index], c);
-    if (!c_ref) {
-        pthread_mutex_unlock(clients_mutex);
+
+    // Add new client to list of connected clients.
+    if (_register_client(c)) goto error;
+    registered = 1;
+    if (tracer) trace_name_thread(tracer, "client handler");
+
+    // Output buffer is flushed by flush loop, whenever socket is writable.
+    c->watcher.fd = socket_fd;
+    c->watcher.handler = _flush_event;
+    c->watcher.arg = c;
+    if (event_loop_add(flush_loop, &c->watcher, EPOLLOUT | EPOLLET))
         goto error;
+    watched = 1;
+
+    // Keep reading incoming messages until the connection is dead. Read as
+    // much as available, so a single recv usually brings many messages.
+    while ((n = recv(socket_fd, c->in + c->in_len,
+                     CLIENT_RX_BUF_LEN - c->in_len, 0)) > 0) {
+        c->in_len += n;
+        metrics_add(svc_metrics, METRIC_BYTES_RECEIVED, n);
+        _trace_client(TRACE_RECV, c, n);
+        if (_receive_frames(c, 0)) {
+            fprintf(stderr, "Received an invalid message frame.\n");
+            break;
+        }
     }
-    connected_clients++;
-    pthread_mutex_unlock(clients_mutex);
+    goto cleanup;
 
-    // Allocate buffer for incoming data.
-    in = (char *) malloc(sizeof(message_t));
-    if (!in) goto error;
-    int n;
-    uint16_t counter = 0;  // Local counter that should match incoming messages.
-    uint8_t first_message = 1;  // Flag for first message to ignore counter.
+error:
+    perror("Could not handle new client");
 
-    // Workspace memory for storing outgoing messages in order to avoid
-    // malloc at each receive. We need CLIENT_BUF_LEN for pending messages
-    // plus 1 more slot for the currently receiving message plus 1 more slot
-    // for the currently sending message (on the sender unit).
-    mspace = (message_t *) malloc (sizeof(message_t) * (CLIENT_BUF_LEN + 2));
-    if (!mspace) goto error;
-    int mspace_i = 0;  // Mod(CLIENT_BUF_LEN+1) counter for circular usage
-                       // of mspace.
-
-    // Keep reading incoming messages until the connection is dead.
-    while ((n = recv(socket_fd, in, sizeof(message_t), MSG_WAITALL)) > 0) {
-        if (n < (int) sizeof(message_t)) {
-            fprintf(stderr, "Failed to completely read incoming messages.\n");
-            // first_message = 1;
-            continue;
-        }
-        message_t *message = message_net_to_host_buf(in, mspace+mspace_i);
-        define_sender(message, c);  // fill sender fields of message
+cleanup:
+    // Socket is closed once the last reference of client drops, which may
+    // happen on flush loop before this handler returns.
+    _release_handler_slot(slot);
 
-        message->flags = 0;
-        uint8_t error_code = 0;  // clear error flags
+    // Remove client from connected clients.
+    if (registered) _unregister_client(c);
 
-        // A message is not valid unless its 'count' field is a direct increment
-        // from the previous successfully received message.
-        if (message->count != (counter+1)%(MESSAGE_COUNT_MAX+1) && !first_message) {
-            error_code |= ERR_INVALID_ORDER;
+    // Wait until sender has handled all pending outgoing messages. Output
+    // buffer keeps being flushed meanwhile.
+    if (c) {
+        for (int k = 0; k < MESSAGE_PRIORITY_CLASSES; k++)
+            spsc_ring_wait_empty(c->out_messages[k]);
+
+        // Watcher is removed by flush loop itself, which then drops the
+        // reference of handler, so the watcher never runs on a recycled
+        // client. Socket is closed when the last reference drops.
+        if (!watched) client_put(c);
+        else if (event_loop_post(flush_loop, _flush_unwatch_client, c)) {
+            perror("Failed to stop flushing client");
+            event_loop_remove(flush_loop, &c->watcher);
+            client_put(c);
         }
+    }
+}
 
-        if (!error_code) {
-            first_message = 0;
-            counter = message->count;
-
-            // If no error, push message to pending outgoing messages of this
-            // client.
-            rc = pthread_mutex_lock(c->out_mutex);
-            if (rc) perror("Failed to acquire client out mutex.\n");
-
-            while (linked_list_size(c->out_messages) >= CLIENT_BUF_LEN)
-                pthread_cond_wait(c->out_message_removed, c->out_mutex);
 
-            int had_messages = linked_list_size(c->out_messages);
-            linked_list_append(c->out_messages, message);
+int
+handle_client_async(int socket_fd)
+{
+    if (!svc_loops_num) {
+        fprintf(stderr, "ERROR: Event loops are not enabled.\n");
+        return -1;
+    }
 
-            // If there were no messages in out_messages list, then this client
-            // had been removed from active clients list by the sending unit.
-            // So, add it again and signal sender unit.
-            if (!had_messages) {
-                rc = pthread_mutex_lock(active_clients_mutex);
-                if (rc) perror("Failed to acquire global out mutex.\n");
-                linked_list_append(active_clients, c);
-                pthread_cond_signal(messages_exist_cond);
-                pthread_mutex_unlock(active_clients_mutex);
-            }
+    client_t *c = client_create(socket_fd);
+    if (!c) return -1;
 
-            pthread_mutex_unlock(c->out_mutex);
-            mspace_i = (mspace_i + 1) % (CLIENT_BUF_LEN + 2);
+    // Spread clients over event loops in a round-robin fashion.
+    unsigned int i = __atomic_fetch_add(&next_loop, 1, __ATOMIC_RELAXED);
+    c->owner = svc_loops + i % svc_loops_num;
 
-        } else NACK_message(message, error_code);
+    // Client is attached by the loop thread itself, so all state of a loop
+    // is only touched by its own thread.
+    if (event_loop_post(c->owner->loop, _loop_attach_client, c)) {
+        c->socket_fd = -1;  // Socket remains owned by the caller.
+        client_put(c);
+        return -1;
     }
-    goto cleanup;
+    return 0;
+}
 
-error:
-    perror("Could not handle new client");
 
-cleanup:
-    // Remove client from connected clients.
-    if (clients[index]) {
-        pthread_mutex_lock(clients_mutex);
-        if (c_ref) {
-            linked_list_remove(clients[index], c_ref);
-            connected_clients--;
-        }
-        if (linked_list_size(clients[index]) == 0) {
-            linked_list_destroy(clients[index]);
-            clients[index] = NULL;
-        }
-        pthread_mutex_unlock(clients_mutex);
+int
+handle_client_pooled(int socket_fd)
+{
+    if (!handler_workers) {
+        fprintf(stderr, "ERROR: Handler pool is not enabled.\n");
+        return -1;
     }
 
-    // Wait until sender has handled all pending outgoing messages.
-    if (c) {
-        pthread_mutex_lock(c->out_mutex);
-        while(linked_list_size(c->out_messages) > 0)
-            pthread_cond_wait(c->out_message_removed, c->out_mutex);
-        pthread_mutex_unlock(c->out_mutex);
-        client_destroy(c);
+    pthread_mutex_lock(handler_mutex);
+    // Connection waits for a worker if all are busy, and the caller too if
+    // the queue is also full.
+    if (handler_busy + handler_queue_len >= handler_workers)
+        metrics_add(svc_metrics, METRIC_HANDLER_WAITS, 1);
+    while (handler_run && handler_queue_len == handler_workers)
+        pthread_cond_wait(handler_space_cond, handler_mutex);
+    if (!handler_run) {
+        pthread_mutex_unlock(handler_mutex);
+        return -1;
     }
 
-    if (in) free(in);
-    if (mspace) free(mspace);
+    int tail = (handler_queue_head + handler_queue_len) % handler_workers;
+    handler_queue[tail] = socket_fd;
+    handler_queue_len++;
+    metrics_add(svc_metrics, METRIC_HANDLER_QUEUED, 1);
+    pthread_cond_signal(handler_queued_cond);
+    pthread_mutex_unlock(handler_mutex);
+
+    return 0;
 }
 
 
@@ -314,63 +1011,72 @@ start_sending_unit(void *args)
 {
     int rc;
 
-    struct timespec target;     // Target time for next timeout.
-    struct timespec cur_time;   // Current time.
-    struct timespec diff;       // Difference between current time and target.
+    struct timespec deadline;   // Time a batch should be sent at the latest.
 
-    // Set first target to current time plus a period.
-    clock_gettime(CLOCK_MONOTONIC, &target);
-    timespec_add(&target, &target, &message_sending_period);
+    struct send_batch *batch = _send_batch_create(send_batch_max);
+    if (!batch) {
+        perror("Failed to start sending unit");
+        return (void *) -1;
+    }
+    if (tracer) trace_name_thread(tracer, "sending unit");
 
     while (sending_unit_run) {
-        if (speed_limiter_run) {
-            // Calculate the difference between current time and target.
-            clock_gettime(CLOCK_MONOTONIC, &cur_time);
-            timespec_subtract(&diff, &target, &cur_time);
-
-            if (diff.tv_sec >= 0 && diff.tv_nsec >= 0) {
-                // Sleep for calculated diff time.
-                int rc = nanosleep(&diff, NULL);
-                if (rc != 0) {
-                    perror("Nanosleep not completed properly.\n");
-                }
-            }
-        }
+        // Held messages go before any newer message of their destinations.
+        _expire_held();
+        _forward_pending();
 
         rc = pthread_mutex_lock(active_clients_mutex);
         if (rc) perror("Failed to acquire mutex of active clients\n");
-
-        while (linked_list_size(active_clients) < 1 && sending_unit_run)
-            pthread_cond_wait(messages_exist_cond, active_clients_mutex);
+        _enqueue_scheduled();
+
+        // Only the first wait of an idle period spins.
+        int spin = sending_spin_ns > 0;
+        while (_active_flows() < 1 && !linked_list_size(forward_ready) &&
+               sending_unit_run) {
+            if (held_messages && hold_queue_size(held_messages)) {
+                if (_wait_expiry()) break;  // Oldest held message expired.
+            } else {
+                _sending_wait(NULL, spin);
+                spin = 0;
+            }
+        }
         if (!sending_unit_run) { // Required for termination request.
             pthread_mutex_unlock(active_clients_mutex);
             break;
         }
-
-        // Select the first client with a pending outgoing message.
-        client_t *selected = (client_t *) linked_list_pop(active_clients);
-        rc = pthread_mutex_lock(selected->out_mutex);
-        if (rc) perror("Failed to acquire mutex of selected client\n");
-
-        message_t *message = (message_t *) linked_list_pop(selected->out_messages);
-        pthread_cond_signal(selected->out_message_removed);
-
-        // If there are pending messages from this client, push it to the back.
-        // A simple one-message round-robin scheduling is used.
-        if (linked_list_size(selected->out_messages) > 0)
-            linked_list_append(active_clients, (void *) selected);
-
-        pthread_mutex_unlock(selected->out_mutex);
+        int idle = _active_flows() < 1;
         pthread_mutex_unlock(active_clients_mutex);
+        if (idle) continue;  // Only held messages to handle.
+
+        // Never take more messages than global limiter allows.
+        batch->max = send_batch_max;
+        if (speed_limiter_run) batch->max = _limiter_acquire(send_batch_max);
+
+        _collect_batch(batch);
+
+        // A batch that is not full may wait a bit for more messages, so they
+        // share syscalls, but never longer than the configured delay.
+        if (batch->size < batch->max &&
+            (send_batch_delay.tv_sec || send_batch_delay.tv_nsec)) {
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            timespec_add(&deadline, &deadline, &send_batch_delay);
+            while (batch->size < batch->max &&
+                   _wait_batch_messages(&deadline))
+                _collect_batch(batch);
+            _collect_batch(batch);  // Sources in batch may have pushed more.
+        }
 
-        send_message(message);
+        _update_starvation(batch);
+        int handled = _send_batch(batch);
+        if (speed_limiter_run) token_bucket_consume(&rate_bucket, handled);
 
-        if (speed_limiter_run) {
-            // Set next target. Everything is integral, so no error accumulation.
-            timespec_add(&target, &target, &message_sending_period);
-        }
+        // When all pending messages wait for tokens of their destinations,
+        // there is nothing to do until the first of them gets one.
+        if (!handled && batch->retry) _wait_deferred(batch->retry);
     }
 
+    _send_batch_destroy(batch);
+
     return 0;
 }
 
@@ -378,93 +1084,50 @@ start_sending_unit(void *args)
 void
 NACK_message(message_t *m, uint8_t error_code)
 {
-    int rc;
-
-    m->flags = error_code;
-
-    client_t *src = NULL;
-
-    pthread_mutex_lock(clients_mutex);
-
-    int index = (m->src_addr + m->src_port) & 0xFF;
-    linked_list_t *hashed_list = clients[index];
-    if (hashed_list && linked_list_size(hashed_list) == 1) {
-        src = linked_list_get_first(hashed_list);
-    } else if (hashed_list && linked_list_size(hashed_list) > 1) {
-        iterator_t *it = linked_list_iterator(hashed_list);
-        while(iterator_has_next(it)) {
-            client_t *c = iterator_next(it);
-            if (m->src_addr == c->address && m->src_port == c->port) {
-                src = c;
-                break;
-            }
-        }
-        iterator_destroy(it);
-    }
+    client_t *src = _lookup_client(m->src_addr, m->src_port);
 
     // If the source has gone offline, it's impossible to NACK the message.
     if (src) {
-        char *out_buffer = message_host_to_net(m);
-        rc = pthread_mutex_lock(src->sock_wr_mutex);
-        if (rc) perror("Failed to acquire socket writing mutex.\n");
-        int socket_fd = src->socket_fd;
-        int n = send(socket_fd, out_buffer, sizeof(message_t), MSG_NOSIGNAL);
-        pthread_mutex_unlock(src->sock_wr_mutex);
-        if (n < (int) sizeof(message_t))
-            fprintf(stderr, "Failed to sent NACK message.\n");
-        free(out_buffer);
-    }
-    pthread_mutex_unlock(clients_mutex);
+        if (!_nack_to(src, m, error_code)) _flush_client(src);
+        client_put(src);
+    } else m->flags = error_code;
 }
 
 
-void
+int
 send_message(message_t *m)
 {
-    // Static buffer to be used for network byte-order messages.
-    static char out_buffer[sizeof(message_t)];
-
-    client_t *dest = NULL;
-    int rc;
+    int rc = 0;
 
-    pthread_mutex_lock(clients_mutex);
-
-    int index = (m->dest_addr + m->dest_port) & 0xFF;
-    linked_list_t *hashed_list = clients[index];
-    if (hashed_list && linked_list_size(hashed_list) == 1) {
-        dest = linked_list_get_first(hashed_list);
-    } else if (hashed_list && linked_list_size(hashed_list) > 1) {
-        iterator_t *it = linked_list_iterator(hashed_list);
-        while(iterator_has_next(it)) {
-            client_t *c = iterator_next(it);
-            if (m->dest_addr == c->address && m->dest_port == c->port) {
-                dest = c;
-                break;
-            }
-        }
-        iterator_destroy(it);
+    if (m->dest_addr == MESSAGE_GROUP_ADDR ||
+        m->dest_addr == MESSAGE_TOPIC_ADDR) {
+        if (!_fanout_message(m)) NACK_message(m, ERR_TARGET_DOWN);
+        return 0;
     }
 
-    // If there is a connected client that matches destination ip and port of
-    // message, send it the message. Otherwise, NACK it.
-    if (dest) {
-        message_host_to_net_buf(m, out_buffer);
-        rc = pthread_mutex_lock(dest->sock_wr_mutex);
-        if (rc) perror("Failed to acquire socket writing mutex.\n");
-        int n = send(
-            dest->socket_fd, out_buffer, sizeof(message_t), MSG_NOSIGNAL);
-        pthread_mutex_unlock(dest->sock_wr_mutex);
-        if (n < (int) sizeof(message_t))
-            fprintf(stderr, "Failed to sent message.\n");
+    client_t *dest = _lookup_client(m->dest_addr, m->dest_port);
 
-    } else {
-        pthread_mutex_unlock(clients_mutex);
-        NACK_message(m, ERR_TARGET_DOWN);
+    // If there is a connected client that matches destination ip and port of
+    // message, send it the message. Otherwise, hold it until destination
+    // connects again. Message also waits behind messages already held.
+
+    int held = 0;
+    if (dest && !_dest_has_held(m->dest_addr, m->dest_port)) {
+        rc = _buffer_message(dest, m, NULL, 0);
+        if (rc < 0) held = 1;
+        else if (!rc) _flush_client(dest);
+
+    } else held = 1;
+    if (dest) client_put(dest);
+
+    if (held) {
+        // It's counted as sent once forwarded.
+        if (_hold_message(m, 0)) NACK_message(m, ERR_TARGET_DOWN);
+        return 0;
     }
-
-    pthread_mutex_unlock(clients_mutex);
-
-    total_messages_sent++;
+    if (rc > 0) return -1;
+    metrics_add(svc_metrics, METRIC_MESSAGES_SENT, 1);
+    return 0;
 }
 
 
@@ -476,304 +1139,2745 @@ define_sender(message_t *m, client_t *client)
 }
 
 
-client_t *
-client_create(int socket_fd)
+/**
+ * Finds the configured weight of the client with given endpoint. First
+ * matching configuration is used.
+ *
+ * Returns:
+ *  Weight of the client, or 1 if no configuration matches it.
+ */
+int
+_client_weight(uint32_t address, uint16_t port)
 {
-    struct sockaddr_in addr;
-    socklen_t addr_len = sizeof(struct sockaddr_in);
-    int rc;
-
-    // Acquire a sockaddr_in object to get client's IPv4 address.
-    rc = getpeername(socket_fd, (struct sockaddr *) &addr, &addr_len);
-    if (rc) {
-        perror("client_create() failed");
-        return NULL;
-    }
-    if (addr_len > sizeof(struct sockaddr_in)) {
-        printf("Invalid protocol.\n");
-        return NULL;
+    for (int i = 0; i < client_weights_num; i++) {
+        struct client_weight *w = client_weights + i;
+        if (w->address == address && (!w->port || w->port == port))
+            return w->weight;
     }
+    return 1;
+}
 
-    client_t *client = (client_t *) malloc(sizeof(client_t));
-    if (!client) {
-        perror("client_create() failed");
-        return NULL;
-    }
-    client->socket_fd = socket_fd;
-    client->address = ntohl(addr.sin_addr.s_addr);
-    client->port = ntohs(addr.sin_port);
-    client->out_messages = linked_list_create();
-    client->out_mutex =
-        (pthread_mutex_t *) malloc(sizeof(pthread_mutex_t));
-    client->sock_wr_mutex =
-        (pthread_mutex_t *) malloc(sizeof(pthread_mutex_t));
-    client->out_message_removed =
-        (pthread_cond_t *) malloc(sizeof(pthread_cond_t));
-    if (!client->out_mutex || !client->sock_wr_mutex ||
-        !client->out_message_removed) {
-        perror("client_create() failed");
+
+/**
+ * Extracts the port of a local client, from the abstract name of unix
+ * socket it's bound to, of given length.
+ *
+ * Returns:
+ *  0 on success, or a non-zero integer if socket is not bound to a name
+ *  formatted by MESSAGE_LOCAL_NAME.
+ */
+int
+_local_client_port(struct sockaddr_un *addr, socklen_t addr_len,
+                   uint16_t *port)
+{
+    char name[sizeof(addr->sun_path)];
+    size_t name_len = addr_len - offsetof(struct sockaddr_un, sun_path);
+    unsigned int p;
+    int parsed = 0;
+
+    // Abstract names start by a null byte and are not null-terminated.
+    if (addr_len <= offsetof(struct sockaddr_un, sun_path) + 1 ||
+        addr_len > sizeof(struct sockaddr_un) || addr->sun_path[0])
+        return -1;
+    memcpy(name, addr->sun_path + 1, name_len - 1);
+    name[name_len - 1] = '\0';
+
+    if (sscanf(name, MESSAGE_LOCAL_NAME "%n", &p, &parsed) != 1 ||
+        parsed != (int) name_len - 1 || !p || p > UINT16_MAX)
+        return -1;
+    *port = p;
+    return 0;
+}
+
+
+/**
+ * Adds given client to the table of connected clients. If another client
+ * was registered with the same endpoint, it's replaced.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int
+_register_client(client_t *c)
+{
+    client_t *replaced;
+
+    client_get(c);  // Reference held by the table.
+    if (endpoint_table_insert(
+            clients, c->address, c->port, c, (void **) &replaced)) {
+        client_put(c);
+        return -1;
+    }
+    if (replaced) client_put(replaced);
+    metrics_add(svc_metrics, METRIC_CONNECTED_CLIENTS, 1);
+    _trace_client(TRACE_CONNECT, c, 0);
+
+    // Forward messages held while client was offline.
+    if (_dest_has_held(c->address, c->port)) _schedule_forward(c);
+
+    return 0;
+}
+
+
+/**
+ * Removes given client from the table of connected clients.
+ */
+void
+_unregister_client(client_t *c)
+{
+    // Client may have already been replaced by a newer connection from the
+    // same endpoint.
+    if (!endpoint_table_remove(clients, c->address, c->port, c))
+        client_put(c);
+    _close_output(c);
+    metrics_add(svc_metrics, METRIC_CONNECTED_CLIENTS, -1);
+    _trace_client(TRACE_DISCONNECT, c, 0);
+}
+
+
+/**
+ * Looks up the connected client with given endpoint.
+ *
+ * Returns:
+ *  A client object with a reference acquired for the caller, who should
+ *  release it with client_put(). If no such client is connected, NULL.
+ */
+client_t *
+_lookup_client(uint32_t address, uint16_t port)
+{
+    client_t *c;
+
+    while ((c = endpoint_table_lookup(clients, address, port))) {
+        if (!client_get(c)) {
+            // Object may have been recycled for another client, after it
+            // was returned by lookup.
+            if (c->address == address && c->port == port) return c;
+            client_put(c);
+        }
+        // Client removed meanwhile, so check again.
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Handles all complete messages contained in the receiving buffer of given
+ * client. Any partially received message is moved to the start of buffer.
+ *
+ * Parameters:
+ *  -c : Client whose receiving buffer will be processed.
+ *  -nonblocking : When set, processing stops if pending outgoing messages of
+ *          the client are full, instead of blocking until they're not.
+ *
+ * Returns:
+ *  0 if every complete message was handled, 1 if processing stopped on a full
+ *  buffer, or -1 if an invalid frame was found.
+ */
+int
+_receive_frames(client_t *c, int nonblocking)
+{
+    size_t offset = 0;
+    uint64_t received = 0;
+    int rc = 0;
+
+    while (1) {
+        char *frame = c->in + offset;
+        size_t available = c->in_len - offset;
+        size_t size = message_frame_size(frame, available, wire_format);
+
+        if (!size) return -1;
+        if (size > available) break;  // Rest of frame not received yet.
+        if (nonblocking &&
+            _out_messages_full(c, message_frame_priority(frame, wire_format))) {
+            rc = 1;
+            break;
+        }
+
+        // A single timestamp serves all messages of a read.
+        if (track_latency && !received) received = _monotonic_ns();
+        _receive_message(c, frame, received);
+        offset += size;
+    }
+
+    if (offset) {
+        memmove(c->in, c->in + offset, c->in_len - offset);
+        c->in_len -= offset;
+    }
+
+    return rc;
+}
+
+
+/**
+ * Handles a completely received message frame.
+ *
+ * Valid messages are pushed to the pending outgoing messages of the client
+ * for their priority class, blocking while they are full. Invalid ones are
+ * NACKed.
+ */
+void
+_receive_message(client_t *c, void *frame, uint64_t received)
+{
+    // Every class has its own slots, as classes are released out of order.
+    int cls = message_frame_priority(frame, wire_format);
+    message_t *slots = c->mspace + cls * (out_queue_depth + 1);
+    message_t *message = message_deserialize(
+        frame, slots + c->mspace_i[cls], wire_format);
+    define_sender(message, c);  // fill sender fields of message
+    message->priority = cls;
+    if (track_latency) c->received_ns[message - c->mspace] = received;
+    metrics_add(svc_metrics, METRIC_MESSAGES_RECEIVED, 1);
+
+    uint8_t request = message->flags & (MESSAGE_GROUP_JOIN | MESSAGE_GROUP_LEAVE);
+    message->flags = 0;
+    uint8_t error_code = 0;  // clear error flags
+
+    // A message is not valid unless its 'count' field is a direct increment
+    // from the previous successfully received message.
+    if (message->count != (c->counter+1)%(MESSAGE_COUNT_MAX+1) &&
+        !c->first_message) {
+        error_code |= ERR_INVALID_ORDER;
+    }
+
+    if (error_code) {
+        NACK_message(message, error_code);
+        return;
+    }
+
+    c->first_message = 0;
+    c->counter = message->count;
+
+    // Requests for groups and topics are handled right away, as they're not
+    // delivered.
+    if (message->dest_addr == MESSAGE_GROUP_ADDR && request) {
+        _handle_group_request(c, message, request);
+        return;
+    }
+    if (message->dest_addr == MESSAGE_TOPIC_ADDR && request) {
+        _handle_topic_request(c, message, request);
+        return;
+    }
+
+    // Message is logged before being accepted, so it survives a restart.
+    if (message_log)
+        c->wal_ids[message - c->mspace] = wal_append(message_log, message);
+
+    // If no error, push message to pending outgoing messages of this
+    // client.
+    spsc_ring_push_wait(c->out_messages[cls], message);
+    metrics_add(svc_metrics, METRIC_QUEUED_MESSAGES, 1);
+    _trace_message(TRACE_ENQUEUE, message, message->count);
+    _schedule_client(c, cls);
+
+    c->mspace_i[cls] = (c->mspace_i[cls] + 1) % (out_queue_depth + 1);
+}
+
+
+/**
+ * Checks whether pending outgoing messages of given class of given client
+ * are full. If so, client is marked as paused, so the sending unit will
+ * resume it when a slot becomes available. Should only be called by the
+ * receiver of client.
+ *
+ * Returns:
+ *  1 if buffer is full, otherwise 0.
+ */
+int
+_out_messages_full(client_t *c, int cls)
+{
+    spsc_ring_t *ring = c->out_messages[cls];
+    size_t depth = spsc_ring_capacity(ring);
+
+    if (spsc_ring_size(ring) < depth) return 0;
+
+    // Pairs with the fence of sending unit after releasing a message. Either
+    // we see the free slot, or sending unit sees the pause.
+    __atomic_store_n(&c->rx_paused, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (spsc_ring_size(ring) < depth) {
+        __atomic_store_n(&c->rx_paused, 0, __ATOMIC_SEQ_CST);
+        return 0;
+    }
+
+    return 1;
+}
+
+
+/**
+ * Adds given class of given client to the list of active clients of the
+ * class, unless it's already contained. Should be called after pushing a new
+ * outgoing message of the class.
+ */
+void
+_schedule_client(client_t *c, int cls)
+{
+    if (__atomic_exchange_n(&c->scheduled[cls], 1, __ATOMIC_SEQ_CST)) return;
+
+    client_get(c);  // Reference held by active clients list.
+
+    // Flow is moved to active clients by sending unit, so receivers don't
+    // contend on mutex of active clients.
+    drr_flow_t *flow = &c->flow[cls];
+    drr_flow_t *head = __atomic_load_n(&scheduled_flows, __ATOMIC_RELAXED);
+    do {
+        c->scheduled_next[cls] = head;
+    } while (!__atomic_compare_exchange_n(&scheduled_flows, &head, flow, 1,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+    if (doorbell_ring(sending_doorbell))
+        metrics_add(svc_metrics, METRIC_SENDING_WAKEUPS, 1);
+}
+
+
+/**
+ * Puts given class of a client popped by the sending unit back to the end of
+ * the round of active clients of the class, if it still has pending messages.
+ * Otherwise, its deficit is reset and reference held by the scheduler is
+ * released.
+ */
+void
+_reschedule_client(client_t *c, int cls)
+{
+    if (!spsc_ring_peek(c->out_messages[cls], 0)) {
+        drr_flow_idle(&c->flow[cls]);
+        // Receiver may push a message right after we check, but it won't
+        // schedule the client while it seems scheduled. So, unmark and check
+        // again.
+        __atomic_store_n(&c->scheduled[cls], 0, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!spsc_ring_peek(c->out_messages[cls], 0) ||
+            __atomic_exchange_n(&c->scheduled[cls], 1, __ATOMIC_SEQ_CST)) {
+            client_put(c);
+            return;
+        }
+    }
+
+    pthread_mutex_lock(active_clients_mutex);
+    drr_enqueue(active_clients[cls], &c->flow[cls]);
+    pthread_mutex_unlock(active_clients_mutex);
+}
+
+
+/**
+ * Asks the event loop of given client to resume reading, if it was paused
+ * because pending outgoing messages were full. Should be called by sending
+ * unit after releasing a message.
+ */
+void
+_resume_receiving(client_t *c)
+{
+    if (__atomic_load_n(&c->rx_paused, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&c->rx_paused, 0, __ATOMIC_SEQ_CST)) {
+        client_get(c);  // Reference held by the task.
+        if (event_loop_post(c->owner->loop, _loop_resume_client, c))
+            client_put(c);
+    }
+}
+
+
+/**
+ * Allocates the workspace of sending unit, for batches of up to given number
+ * of messages.
+ *
+ * Returns:
+ *  On success, an empty batch. On failure, NULL.
+ */
+struct send_batch *
+_send_batch_create(int max)
+{
+    struct send_batch *b =
+        (struct send_batch *) calloc(1, sizeof(struct send_batch));
+    if (!b) return NULL;
+
+    b->sources = (client_t **) malloc(sizeof(client_t *) * max);
+    b->taken = (int *) malloc(sizeof(int) * max);
+    b->handled = (int *) malloc(sizeof(int) * max);
+    b->nacked = (int *) malloc(sizeof(int) * max);
+    b->blocked = (int *) malloc(sizeof(int) * max);
+    b->classes = (int *) malloc(sizeof(int) * max);
+    b->deferred = (int *) malloc(sizeof(int) * max);
+    b->messages = (message_t **) malloc(sizeof(message_t *) * max);
+    b->owners = (int *) malloc(sizeof(int) * max);
+    b->dests = (struct batch_dest *) malloc(sizeof(struct batch_dest) * max);
+    b->delivered = (uint64_t *) malloc(sizeof(uint64_t) * max);
+    if (!b->sources || !b->taken || !b->handled || !b->nacked || !b->blocked ||
+        !b->classes || !b->deferred || !b->messages || !b->owners ||
+        !b->dests || !b->delivered) {
+        _send_batch_destroy(b);
         return NULL;
     }
 
-    rc = pthread_mutex_init(client->out_mutex, NULL);
-    rc |= pthread_mutex_init(client->sock_wr_mutex, NULL);
-    rc |= pthread_cond_init(client->out_message_removed, NULL);
-    if (rc) {
-        perror("client_create() failed to init a mutex");
-        client_destroy(client);  // Clean all allocated memory before return.
-        return NULL;
+    return b;
+}
+
+
+void
+_send_batch_destroy(struct send_batch *b)
+{
+    if (!b) return;
+    free(b->sources);
+    free(b->taken);
+    free(b->handled);
+    free(b->nacked);
+    free(b->blocked);
+    free(b->classes);
+    free(b->deferred);
+    free(b->messages);
+    free(b->owners);
+    free(b->dests);
+    free(b->delivered);
+    free(b);
+}
+
+
+/**
+ * Fills given batch with pending messages, until it holds send_batch_max
+ * messages.
+ *
+ * Priority classes are served in strict order, from the highest to the
+ * lowest, unless lowest class has been passed over for starvation_limit
+ * batches. Then, it's served first.
+ *
+ * Messages are only peeked, so they remain in the out messages of their
+ * sources until the batch is sent.
+ */
+void
+_collect_batch(struct send_batch *b)
+{
+    for (int i = 0; i < b->sources_num && b->size < b->max; i++)
+        _take_messages(b, i);
+
+    int lowest_first = lowest_skipped >= starvation_limit;
+    if (lowest_first) _collect_class(b, MESSAGE_PRIORITY_LOW);
+
+    for (int cls = MESSAGE_PRIORITY_CLASSES - 1;
+         cls >= 0 && b->size < b->max; cls--) {
+        if (cls == MESSAGE_PRIORITY_LOW && lowest_first) break;
+        _collect_class(b, cls);
+    }
+}
+
+
+/**
+ * Fills given batch with pending messages of given priority class.
+ *
+ * Active clients of the class are served in deficit round-robin order, so
+ * each one takes messages only up to its deficit in bytes. Rounds are run,
+ * visiting every active client and every source of the batch of the class,
+ * until the batch is full or no more messages can be taken. Clients that
+ * take messages are removed from the round of active clients and their
+ * references are held by the batch, while the rest keep their credit for the
+ * next round.
+ */
+void
+_collect_class(struct send_batch *b, int cls)
+{
+    int progress = 1;
+    while (b->size < b->max && progress) {
+        progress = 0;
+
+        pthread_mutex_lock(active_clients_mutex);
+        int round = drr_size(active_clients[cls]);
+        for (int k = 0; k < round && b->size < b->max; k++) {
+            drr_flow_t *flow = drr_next(active_clients[cls]);
+            client_t *c = (client_t *) flow->owner;
+
+            // Every active client has at least one pending message.
+            int i = b->sources_num;
+            b->sources[i] = c;
+            b->classes[i] = cls;
+            b->taken[i] = 0;
+            b->handled[i] = 0;
+            b->nacked[i] = 0;
+            b->blocked[i] = 0;
+            b->deferred[i] = 0;
+            int n = _take_messages(b, i);
+            if (!n) {
+                // Next message exceeds deficit, so it waits for next round.
+                drr_enqueue(active_clients[cls], flow);
+                continue;
+            }
+            b->sources_num++;
+            progress += n;
+        }
+        pthread_mutex_unlock(active_clients_mutex);
+
+        // Sources of the batch take part in next round too.
+        for (int i = 0; i < b->sources_num && b->size < b->max; i++) {
+            if (b->classes[i] != cls) continue;
+            client_t *c = b->sources[i];
+            if (!spsc_ring_peek(c->out_messages[cls], b->taken[i])) {
+                drr_flow_idle(&c->flow[cls]);
+                continue;
+            }
+            c->flow[cls].deficit += c->flow[cls].quantum;
+            progress += _take_messages(b, i);
+        }
+    }
+}
+
+
+/**
+ * Takes pending messages of the i-th source of given batch, charging them to
+ * the deficit of the source, as long as deficit allows.
+ *
+ * Returns:
+ *  The number of messages taken.
+ */
+int
+_take_messages(struct send_batch *b, int i)
+{
+    client_t *c = b->sources[i];
+    int cls = b->classes[i];
+    message_t *m;
+    int n = 0;
+
+    while (b->size < b->max &&
+           (m = spsc_ring_peek(c->out_messages[cls], b->taken[i])) &&
+           !drr_charge(&c->flow[cls], message_wire_size(m, wire_format))) {
+        b->owners[b->size] = i;
+        b->messages[b->size++] = m;
+        b->taken[i]++;
+        n++;
+    }
+
+    return n;
+}
+
+
+/**
+ * Counts consecutive batches that passed over pending messages of the lowest
+ * priority class. Should be called once for every collected batch.
+ */
+void
+_update_starvation(struct send_batch *b)
+{
+    for (int i = 0; i < b->sources_num; i++) {
+        if (b->classes[i] == MESSAGE_PRIORITY_LOW) {
+            lowest_skipped = 0;
+            return;
+        }
+    }
+
+    pthread_mutex_lock(active_clients_mutex);
+    if (drr_size(active_clients[MESSAGE_PRIORITY_LOW]) > 0) lowest_skipped++;
+    else lowest_skipped = 0;
+    pthread_mutex_unlock(active_clients_mutex);
+}
+
+
+/**
+ * Returns the number of active flows of all classes. Should be called with
+ * mutex of active clients acquired.
+ */
+int
+_active_flows()
+{
+    int n = 0;
+    for (int k = 0; k < MESSAGE_PRIORITY_CLASSES; k++)
+        n += drr_size(active_clients[k]);
+    return n;
+}
+
+
+/**
+ * Wakes up sending unit, if it's idle. Should be called with mutex of active
+ * clients acquired, after changing anything sending unit waits for.
+ */
+void
+_signal_sending_unit()
+{
+    if (doorbell_ring(sending_doorbell))
+        metrics_add(svc_metrics, METRIC_SENDING_WAKEUPS, 1);
+}
+
+
+/**
+ * Returns the link of given flow on the list of scheduled flows.
+ */
+drr_flow_t **
+_scheduled_next(drr_flow_t *flow)
+{
+    client_t *c = (client_t *) flow->owner;
+    return &c->scheduled_next[flow - c->flow];
+}
+
+
+/**
+ * Moves flows scheduled by receivers to active clients, in the order they
+ * were scheduled. Should be called by sending unit with mutex of active
+ * clients acquired.
+ */
+void
+_enqueue_scheduled()
+{
+    drr_flow_t *flow = __atomic_exchange_n(&scheduled_flows, NULL,
+                                           __ATOMIC_ACQUIRE);
+    drr_flow_t *oldest = NULL;
+    while (flow) {
+        drr_flow_t *next = *_scheduled_next(flow);
+        *_scheduled_next(flow) = oldest;
+        oldest = flow;
+        flow = next;
+    }
+
+    for (flow = oldest; flow; flow = *_scheduled_next(flow)) {
+        client_t *c = (client_t *) flow->owner;
+        drr_enqueue(active_clients[flow - c->flow], flow);
+    }
+}
+
+
+/**
+ * Waits until sending unit is signaled, or until given deadline passes.
+ * Should be called by sending unit with mutex of active clients acquired,
+ * after finding nothing to do, and returns with it acquired. Flows scheduled
+ * meanwhile are moved to active clients.
+ *
+ * Parameters:
+ *  -deadline : Absolute time of CLOCK_MONOTONIC to wait until, or NULL to
+ *      wait until signaled.
+ *  -spin : Set to busy-poll for up to sending_spin_ns, before blocking.
+ *
+ * Returns:
+ *  ETIMEDOUT if deadline passed, otherwise 0.
+ */
+int
+_sending_wait(struct timespec *deadline, int spin)
+{
+    int rc = 0;
+
+    // Receivers scheduling a flow after this look ring the doorbell, while
+    // anything else is signaled under mutex.
+    doorbell_idle(sending_doorbell);
+    if (!__atomic_load_n(&scheduled_flows, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_unlock(active_clients_mutex);
+        if (!spin || !_spin_for_messages())
+            rc = _park_sending_unit(deadline);
+        pthread_mutex_lock(active_clients_mutex);
+    }
+    doorbell_wake(sending_doorbell);
+    _enqueue_scheduled();
+
+    return rc;
+}
+
+
+/**
+ * Busy-polls doorbell of sending unit until it's rung, or until spin budget
+ * of sending unit is used up. Should be called by an idle sending unit.
+ *
+ * Returns:
+ *  1 if sending unit was signaled, or 0 if budget was used up.
+ */
+int
+_spin_for_messages()
+{
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int signaled = 0;
+    long spun;
+    do {
+        // Clock is read once every few polls, to keep polling tight.
+        for (int i = 0; i < 64 && !signaled; i++) {
+            CPU_RELAX();
+            signaled = doorbell_rung(sending_doorbell);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        spun = (now.tv_sec - start.tv_sec) * 1000000000 +
+               now.tv_nsec - start.tv_nsec;
+    } while (!signaled && spun < sending_spin_ns);
+
+    metrics_add(svc_metrics, METRIC_SENDING_SPINS, 1);
+    metrics_add(svc_metrics, METRIC_SENDING_SPIN_WAKES, signaled);
+    metrics_add(svc_metrics, METRIC_SENDING_SPIN_NS, spun);
+    return signaled;
+}
+
+
+/**
+ * Blocks an idle sending unit on its epoll instance, until its doorbell is
+ * rung or until given deadline passes. Deadline is kept by a timer, so it's
+ * met to the nanosecond without needing epoll_pwait2() of Linux 5.11.
+ *
+ * Parameters:
+ *  -deadline : Absolute time of CLOCK_MONOTONIC to wait until, or NULL to
+ *      wait until signaled.
+ *
+ * Returns:
+ *  ETIMEDOUT if deadline passed, otherwise 0.
+ */
+int
+_park_sending_unit(struct timespec *deadline)
+{
+    struct timespec now;
+    struct epoll_event events[2];
+
+    if (!doorbell_park(sending_doorbell)) return 0;  // Rung meanwhile.
+
+    if (deadline) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > deadline->tv_sec ||
+            (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec))
+            return ETIMEDOUT;
+        // Arming the timer also clears an expiration of a previous wait.
+        struct itimerspec timer = { { 0, 0 }, *deadline };
+        if (timerfd_settime(sending_timer, TFD_TIMER_ABSTIME, &timer, NULL)) {
+            perror("Failed to arm timer of sending unit");
+            return ETIMEDOUT;
+        }
+    }
+
+    metrics_add(svc_metrics, METRIC_SENDING_PARKS, 1);
+    int n;
+    do {
+        n = epoll_wait(sending_epfd, events, 2, -1);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        perror("Sending unit failed to wait");
+        return ETIMEDOUT;
+    }
+
+    // A timer left armed by a wait the doorbell ended may still expire, so
+    // it only counts when a deadline is given.
+    int rung = 0, expired = 0;
+    for (int i = 0; i < n; i++) {
+        if (events[i].data.fd == sending_timer) {
+            uint64_t count;
+            if (read(sending_timer, &count, sizeof(count)) < 0 &&
+                errno != EAGAIN)
+                perror("Failed to read timer of sending unit");
+            expired = deadline != NULL;
+        } else rung = 1;
+    }
+    return expired && !rung ? ETIMEDOUT : 0;
+}
+
+
+/**
+ * Waits until new active clients exist, or until given deadline passes.
+ *
+ * Parameters:
+ *  -deadline : Absolute time of CLOCK_MONOTONIC to wait until.
+ *
+ * Returns:
+ *  1 if active clients exist, or 0 on timeout and termination request.
+ */
+int
+_wait_batch_messages(struct timespec *deadline)
+{
+    int rc = 0;
+
+    pthread_mutex_lock(active_clients_mutex);
+    _enqueue_scheduled();
+    while (_active_flows() < 1 && sending_unit_run && !rc)
+        rc = _sending_wait(deadline, 0);
+    int exist = _active_flows() > 0 && sending_unit_run;
+    pthread_mutex_unlock(active_clients_mutex);
+
+    return exist;
+}
+
+
+/**
+ * Sends all messages of given batch and empties the batch.
+ *
+ * Messages are appended to the output buffers of their destinations, which
+ * are then flushed, so a single syscall is used for all messages with a
+ * common destination. A source whose message finds no space in the output
+ * buffer of its destination, waits until the destination frees some space.
+ * Its following messages wait too, so their order is preserved. Messages
+ * for offline destinations are NACKed.
+ *
+ * When destinations are rate limited, a message for a destination out of
+ * tokens is deferred, along with the following messages of its source, and
+ * taken again on a next batch. Time until the first deferred message may be
+ * sent is stored in 'retry' field of the batch.
+ *
+ * Sent messages are released from their sources, which are scheduled again
+ * if they have more pending messages.
+ *
+ * Returns:
+ *  The number of messages sent or NACKed.
+ */
+int
+_send_batch(struct send_batch *b)
+{
+    struct timespec now;
+    int handled = 0;
+    int sent = 0;
+
+    b->retry = 0;
+    if (dest_rate) clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t taken = track_latency ? _monotonic_ns() : 0;
+    // Messages are only counted as taken by this pass once it's clear they
+    // are not taken again, so every message has a single dequeue event.
+
+    for (int i = 0; i < b->size; i++) {
+        int s = b->owners[i];
+        message_t *m = b->messages[i];
+        client_t *src = b->sources[s];
+        drr_flow_t *flow = src->flow + b->classes[s];
+        uint64_t id = message_log ? src->wal_ids[m - src->mspace] : 0;
+        if (b->blocked[s] || b->deferred[s]) {
+            // Message is taken again later, so its charge is refunded.
+            flow->deficit += message_wire_size(m, wire_format);
+            continue;
+        }
+
+        if (m->dest_addr == MESSAGE_GROUP_ADDR ||
+            m->dest_addr == MESSAGE_TOPIC_ADDR) {
+            // Members are served later, by forwarding frames of groups.
+            if (!_fanout_message(m) && _batch_nack(b, s, m)) continue;
+            b->handled[s]++;
+            handled++;
+            _record_taken(src, m, taken);
+            if (id) b->delivered[b->delivered_num++] = id;
+            continue;
+        }
+
+        struct batch_dest *d = _batch_dest(b, m);
+        if (d->held) {
+            // Message should wait behind messages already held.
+            if (_batch_hold(b, s, m, id)) continue;
+            b->handled[s]++;
+            handled++;
+            _record_taken(src, m, taken);
+            continue;
+        }
+        if (d->client && dest_rate &&
+            token_bucket_take(&d->client->rate_bucket, 1, &now)) {
+            long delay = token_bucket_delay(&d->client->rate_bucket, 1);
+            if (!b->retry || delay < b->retry) b->retry = delay;
+            b->deferred[s] = 1;
+            flow->deficit += message_wire_size(m, wire_format);
+            continue;
+        }
+        uint64_t received =
+            track_latency ? src->received_ns[m - src->mspace] : 0;
+        int rc = d->client ? _buffer_message(d->client, m, flow, received) : -1;
+        if (rc > 0) {
+            b->blocked[s] = 1;  // Reference of source is now held by dest.
+            flow->deficit += message_wire_size(m, wire_format);
+            continue;
+        }
+        if (rc < 0 && _batch_hold(b, s, m, id)) continue;
+        b->handled[s]++;
+        handled++;
+        _record_taken(src, m, taken);
+        if (rc < 0) continue;
+        d->count++;
+        sent++;
+        if (id) b->delivered[b->delivered_num++] = id;
+    }
+
+    if (b->delivered_num) {
+        wal_mark(message_log, b->delivered, b->delivered_num);
+        b->delivered_num = 0;
+    }
+    metrics_add(svc_metrics, METRIC_MESSAGES_SENT, sent);
+    metrics_add(svc_metrics, METRIC_QUEUED_MESSAGES, -handled);
+
+    for (int i = 0; i < b->dests_num; i++) {
+        struct batch_dest *d = b->dests + i;
+        if (!d->client) continue;
+
+        _flush_client(d->client);
+        client_put(d->client);
+
+        if (d->count) {
+            int bucket = 31 - __builtin_clz(d->count);
+            if (bucket >= SEND_BATCH_BUCKETS) bucket = SEND_BATCH_BUCKETS - 1;
+            send_batches[bucket]++;
+        }
+    }
+
+    for (int i = 0; i < b->sources_num; i++) {
+        client_t *c = b->sources[i];
+        if (b->nacked[i]) _flush_client(c);  // All NACKs of batch at once.
+        spsc_ring_release(c->out_messages[b->classes[i]], b->handled[i]);
+        _resume_receiving(c);
+        if (!b->blocked[i]) _reschedule_client(c, b->classes[i]);
+    }
+
+    b->sources_num = 0;
+    b->size = 0;
+    b->dests_num = 0;
+
+    return handled;
+}
+
+
+/**
+ * Returns the destination of given message among destinations of the batch.
+ * On the first message for a destination, the destination client is looked
+ * up and its reference is held by the batch.
+ */
+struct batch_dest *
+_batch_dest(struct send_batch *b, message_t *m)
+{
+    for (int i = 0; i < b->dests_num; i++) {
+        if (b->dests[i].address == m->dest_addr &&
+            b->dests[i].port == m->dest_port) return b->dests + i;
+    }
+
+    struct batch_dest *d = b->dests + b->dests_num++;
+    d->address = m->dest_addr;
+    d->port = m->dest_port;
+    d->client = _lookup_client(m->dest_addr, m->dest_port);
+    d->held = d->client && _dest_has_held(m->dest_addr, m->dest_port);
+    d->count = 0;
+    return d;
+}
+
+
+/**
+ * Holds a message of the batch until its destination connects again, or
+ * NACKs it if it can't be held.
+ *
+ * Parameters:
+ *  -s : Index of the source of message in the batch.
+ *  -id : Id of message on write-ahead log, or 0 if it's not logged.
+ *
+ * Returns:
+ *  0 if message was held or NACKed, or 1 if it waits for space on the
+ *  output buffer of its source.
+ */
+int
+_batch_hold(struct send_batch *b, int s, message_t *m, uint64_t id)
+{
+    if (!_hold_message(m, id)) return 0;
+    if (_batch_nack(b, s, m)) return 1;
+    if (id) b->delivered[b->delivered_num++] = id;
+    return 0;
+}
+
+
+/**
+ * NACKs a message of the batch, whose destination is down. NACK is appended
+ * to the output buffer of its source, like any outgoing message, and the
+ * buffer is flushed once at the end of the batch, so all NACKs of a source
+ * share a single write. When the buffer is full, source waits for space, as
+ * it would for a full destination, instead of losing the NACK.
+ *
+ * Parameters:
+ *  -s : Index of the source of message in the batch.
+ *
+ * Returns:
+ *  0 if message was NACKed, or 1 if it waits for space on the output buffer
+ *  of its source.
+ */
+int
+_batch_nack(struct send_batch *b, int s, message_t *m)
+{
+    client_t *src = b->sources[s];
+    drr_flow_t *flow = src->flow + b->classes[s];
+
+    m->flags = ERR_TARGET_DOWN;
+    int rc = _buffer_message(src, m, flow, 0);
+    if (rc > 0) {
+        m->flags = 0;       // Message is taken again, once there is space.
+        b->blocked[s] = 1;  // Reference of source is now held by itself.
+        flow->deficit += message_wire_size(m, wire_format);
+        return 1;
+    }
+    if (!rc) {
+        b->nacked[s]++;  // Otherwise, source has gone offline.
+        _count_nack(m, ERR_TARGET_DOWN);
+    }
+
+    return 0;
+}
+
+
+/**
+ * Records that given message of given source was taken by sending unit at
+ * given time, for the time it waited since it was received and for the
+ * flight recorder.
+ */
+void
+_record_taken(client_t *src, message_t *m, uint64_t taken)
+{
+    if (track_latency) {
+        uint64_t received = src->received_ns[m - src->mspace];
+        histogram_record(&queue_latency, taken - received);
+    }
+    _trace_message(TRACE_DEQUEUE, m, m->count);
+}
+
+
+/**
+ * Records an event of given type for given message on the flight recorder,
+ * if it's enabled.
+ */
+void
+_trace_message(int type, message_t *m, uint16_t arg)
+{
+    if (!tracer) return;
+    trace_record(tracer, type, arg, m->len, m->src_addr, m->src_port,
+                 m->dest_addr, m->dest_port);
+}
+
+
+/**
+ * Records an event of given type for given client on the flight recorder,
+ * if it's enabled.
+ *
+ * Parameters:
+ *  -bytes : Bytes read or written, if any.
+ */
+void
+_trace_client(int type, client_t *c, uint32_t bytes)
+{
+    if (!tracer) return;
+    trace_record(tracer, type, 0, bytes, c->address, c->port, 0, 0);
+}
+
+
+/**
+ * Appends given message to the output buffer of given destination, without
+ * blocking. It's not written to the socket until buffer is flushed.
+ *
+ * Parameters:
+ *  -dest : Destination client of the message.
+ *  -m : Message to be buffered.
+ *  -waiter : If not NULL, a flow of an active client, whose reference is
+ *          passed to destination when buffer is full. It is scheduled again
+ *          once destination has written enough of its buffered data.
+ *  -received : Monotonic time in ns message was received, for timing it
+ *          until it's written to the socket, or 0 if it's not timed.
+ *
+ * Returns:
+ *  0 if message was buffered, 1 if buffer is full, or -1 if connection to
+ *  destination has been closed.
+ */
+int
+_buffer_message(client_t *dest, message_t *m, drr_flow_t *waiter,
+                uint64_t received)
+{
+    int rc = pthread_mutex_lock(dest->sock_wr_mutex);
+    if (rc) perror("Failed to acquire socket writing mutex.\n");
+
+    if (dest->out_closed) rc = -1;
+    else if (_out_append(dest, m)) {
+        if (waiter) linked_list_append(dest->out_waiters, waiter);
+        rc = 1;
+    } else if (received && dest->out_marks) _out_mark(dest, received);
+
+    pthread_mutex_unlock(dest->sock_wr_mutex);
+    return rc;
+}
+
+
+/**
+ * Appends given message, NACKed with given error code, to the output buffer
+ * of its source, without blocking. It's not written to the socket until
+ * buffer is flushed. When the buffer is full, a copy of the NACK waits for
+ * space in one of CLIENT_NACK_BACKLOG slots of the source, and is
+ * buffered before any waiting client is scheduled again. Only NACKs beyond
+ * that are dropped.
+ *
+ * Returns:
+ *  0 if NACK was buffered or waits for space, otherwise a non-zero integer.
+ */
+int
+_nack_to(client_t *src, message_t *m, uint8_t error_code)
+{
+    int rc = pthread_mutex_lock(src->sock_wr_mutex);
+    if (rc) perror("Failed to acquire socket writing mutex.\n");
+
+    m->flags = error_code;
+    if (src->out_closed) rc = -1;
+    else if (src->out_nacks_size || _out_append(src, m)) {
+        // NACKs already waiting go first, so they keep their order.
+        if (src->out_nacks_size < CLIENT_NACK_BACKLOG) {
+            int tail = (src->out_nacks_head + src->out_nacks_size) %
+                       CLIENT_NACK_BACKLOG;
+            memcpy(src->out_nacks + tail, m, sizeof(message_t));
+            src->out_nacks_size++;
+        } else {
+            metrics_add(svc_metrics, METRIC_NACK_DROPS, 1);
+            rc = 1;
+        }
+    }
+
+    pthread_mutex_unlock(src->sock_wr_mutex);
+    if (!rc) _count_nack(m, error_code);
+    return rc;
+}
+
+
+/**
+ * Counts a NACK of given message buffered with given error code, under every
+ * error it holds.
+ */
+void
+_count_nack(message_t *m, uint8_t error_code)
+{
+    _trace_message(TRACE_NACK, m, error_code);
+    if (error_code & ERR_BUFFER_FULL)
+        metrics_add(svc_metrics, METRIC_NACKS_BUFFER_FULL, 1);
+    if (error_code & ERR_INVALID_ORDER)
+        metrics_add(svc_metrics, METRIC_NACKS_INVALID_ORDER, 1);
+    if (error_code & ERR_TARGET_DOWN)
+        metrics_add(svc_metrics, METRIC_NACKS_TARGET_DOWN, 1);
+}
+
+
+/**
+ * Serializes given message at the end of the output buffer of given client.
+ * Should be called with socket writing mutex of the client acquired.
+ *
+ * Returns:
+ *  0 on success, or a non-zero integer if buffer has no space for a message.
+ */
+int
+_out_append(client_t *c, message_t *m)
+{
+    if (_out_reserve(c)) return -1;
+    size_t size = message_serialize(m, c->out + c->out_len, wire_format);
+    c->out_len += size;
+    c->out_total += size;
+    return 0;
+}
+
+
+/**
+ * Copies given serialized message at the end of the output buffer of given
+ * client. Should be called with socket writing mutex of the client acquired.
+ *
+ * Returns:
+ *  0 on success, or a non-zero integer if buffer has no space for a message.
+ */
+int
+_out_append_frame(client_t *c, void *frame, size_t size)
+{
+    if (_out_reserve(c)) return -1;
+    memcpy(c->out + c->out_len, frame, size);
+    c->out_len += size;
+    c->out_total += size;
+    return 0;
+}
+
+
+/**
+ * Moves NACKs waiting for space to the output buffer of given client, in
+ * order, as long as there is space. Buffered NACKs are written by the next
+ * flush. Should be called with socket writing mutex of the client acquired.
+ *
+ * Returns:
+ *  0 if no NACK waits for space anymore, or a non-zero integer otherwise.
+ */
+int
+_out_append_nacks(client_t *c)
+{
+    while (c->out_nacks_size) {
+        if (_out_append(c, c->out_nacks + c->out_nacks_head)) return -1;
+        c->out_nacks_head = (c->out_nacks_head + 1) % CLIENT_NACK_BACKLOG;
+        c->out_nacks_size--;
+    }
+    return 0;
+}
+
+
+/**
+ * Times the message last appended to the output buffer of given client,
+ * received at given monotonic time in ns, until it's written to the socket.
+ * Should be called with socket writing mutex of the client acquired.
+ */
+void
+_out_mark(client_t *c, uint64_t received)
+{
+    // Every message takes a header at least, so it never fills up.
+    if (c->out_marks_size == CLIENT_OUT_MARKS) return;
+    struct out_mark *mark =
+        c->out_marks + (c->out_marks_head + c->out_marks_size++) %
+                       CLIENT_OUT_MARKS;
+    mark->end = c->out_total;
+    mark->received = received;
+}
+
+
+/**
+ * Records latency of timed messages of given client that have been written
+ * to its socket by now. Should be called with socket writing mutex of the
+ * client acquired.
+ */
+void
+_out_record_written(client_t *c)
+{
+    uint64_t written = c->out_total - (c->out_len - c->out_off);
+    uint64_t now = _monotonic_ns();
+
+    while (c->out_marks_size) {
+        struct out_mark *mark = c->out_marks + c->out_marks_head;
+        if (mark->end > written) break;
+        // Written by any thread flushing the client.
+        histogram_record_shared(&send_latency, now - mark->received);
+        c->out_marks_head = (c->out_marks_head + 1) % CLIENT_OUT_MARKS;
+        c->out_marks_size--;
+    }
+}
+
+
+/**
+ * Makes room for a message of any size at the end of the output buffer of
+ * given client, moving unsent data to its start if needed.
+ *
+ * Returns:
+ *  0 on success, or a non-zero integer if buffer has no space for a message.
+ */
+int
+_out_reserve(client_t *c)
+{
+    if (CLIENT_TX_BUF_LEN - c->out_len < MESSAGE_FRAME_MAX) {
+        if (CLIENT_TX_BUF_LEN - (c->out_len - c->out_off) < MESSAGE_FRAME_MAX)
+            return -1;
+        // Move unsent data to the start of buffer.
+        memmove(c->out, c->out + c->out_off, c->out_len - c->out_off);
+        c->out_len -= c->out_off;
+        c->out_off = 0;
+    }
+    return 0;
+}
+
+
+/**
+ * Writes as much of the output buffer of given client as its socket accepts,
+ * without blocking. The rest is written when socket becomes writable again.
+ *
+ * When at least half of the buffer is free, NACKs waiting for space are
+ * buffered and written first, and then clients waiting for space are
+ * scheduled again.
+ */
+void
+_flush_client(client_t *c)
+{
+    int rc = pthread_mutex_lock(c->sock_wr_mutex);
+    if (rc) perror("Failed to acquire socket writing mutex.\n");
+
+again:
+    while (c->out_off < c->out_len) {
+        ssize_t n = send(c->socket_fd, c->out + c->out_off,
+                         c->out_len - c->out_off, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n > 0) {
+            c->out_off += n;
+            metrics_add(svc_metrics, METRIC_BYTES_SENT, n);
+            _trace_client(TRACE_SEND, c, n);
+        } else if (n < 0 && errno == EINTR) continue;
+        else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        else {
+            // Connection failed, so its receiver is going to close it.
+            fprintf(stderr, "Failed to send message.\n");
+            metrics_add(svc_metrics, METRIC_OUTPUT_DROP_BYTES,
+                        c->out_len - c->out_off);
+            c->out_off = c->out_len;
+            c->out_marks_size = 0;  // Discarded messages are not timed.
+        }
+    }
+    if (c->out_marks_size) _out_record_written(c);
+    if (c->out_off == c->out_len) c->out_off = c->out_len = 0;
+
+    if (c->out_len - c->out_off <= CLIENT_TX_BUF_LEN / 2) {
+        if (c->out_nacks_size) {
+            _out_append_nacks(c);
+            goto again;
+        }
+        _wake_waiters(c);
+    }
+
+    pthread_mutex_unlock(c->sock_wr_mutex);
+}
+
+
+/**
+ * Handler of flush loop, called when socket of a client becomes writable.
+ */
+void
+_flush_event(event_loop_t *loop, uint32_t events, void *arg)
+{
+    (void) loop;
+    (void) events;
+    client_t *c = (client_t *) arg;
+
+    // Handler of client holds a reference until the watcher is removed.
+    _flush_client(c);
+}
+
+
+/**
+ * Flush loop task that stops watching the socket of given client, once its
+ * handler is done with it, and drops the reference of the handler.
+ */
+void
+_flush_unwatch_client(event_loop_t *loop, void *arg)
+{
+    client_t *c = (client_t *) arg;
+
+    event_loop_remove(loop, &c->watcher);
+    client_put(c);
+}
+
+
+/**
+ * Stops using the output buffer of given client, discarding any unsent data
+ * and NACKs waiting for space, which are counted as dropped. Messages already
+ * buffered are neither held nor NACKed. Clients waiting for space on the
+ * buffer are scheduled again, so their messages get held or NACKed.
+ */
+void
+_close_output(client_t *c)
+{
+    pthread_mutex_lock(c->sock_wr_mutex);
+    c->out_closed = 1;
+    if (c->out_len > c->out_off)
+        metrics_add(svc_metrics, METRIC_OUTPUT_DROP_BYTES,
+                    c->out_len - c->out_off);
+    if (c->out_nacks_size)
+        metrics_add(svc_metrics, METRIC_NACK_DROPS, c->out_nacks_size);
+    c->out_off = c->out_len = 0;
+    c->out_marks_size = 0;
+    c->out_nacks_size = 0;
+    _wake_waiters(c);
+    pthread_mutex_unlock(c->sock_wr_mutex);
+}
+
+
+/**
+ * Moves flows waiting for space on the output buffer of given client back
+ * to active clients of their classes. Should be called with socket writing
+ * mutex of the client acquired.
+ */
+void
+_wake_waiters(client_t *c)
+{
+    if (!linked_list_size(c->out_waiters) && !c->forward_blocked) return;
+
+    pthread_mutex_lock(active_clients_mutex);
+    drr_flow_t *w;
+    while ((w = linked_list_pop(c->out_waiters))) {
+        int cls = w - ((client_t *) w->owner)->flow;
+        drr_enqueue(active_clients[cls], w);
+    }
+    if (c->forward_blocked) {
+        c->forward_blocked = 0;
+        linked_list_append(forward_ready, c);  // Reference moves to the list.
+    }
+    _signal_sending_unit();
+    pthread_mutex_unlock(active_clients_mutex);
+}
+
+
+client_t *
+client_create(int socket_fd)
+{
+    union {
+        struct sockaddr_in in;
+        struct sockaddr_un un;
+    } addr;
+    socklen_t addr_len = sizeof(addr);
+    struct sock_tuning tuning = client_sock_tuning;
+    uint32_t address;
+    uint16_t port;
+    int rc;
+
+    // Acquire address of peer, to get client's IPv4 endpoint, or the local
+    // endpoint it has been given.
+    rc = getpeername(socket_fd, (struct sockaddr *) &addr, &addr_len);
+    if (rc) {
+        perror("client_create() failed");
+        return NULL;
+    }
+    if (addr.in.sin_family == AF_INET && addr_len == sizeof(addr.in)) {
+        address = ntohl(addr.in.sin_addr.s_addr);
+        port = ntohs(addr.in.sin_port);
+    } else if (addr.un.sun_family == AF_UNIX) {
+        if (_local_client_port(&addr.un, addr_len, &port)) {
+            printf("Local client is not bound to a port.\n");
+            return NULL;
+        }
+        address = MESSAGE_LOCAL_ADDR;
+        sock_tuning_local(&tuning);
+    } else {
+        printf("Invalid protocol.\n");
+        return NULL;
+    }
+    if (sock_tuning_apply(socket_fd, &tuning))
+        perror("Failed to tune socket of client");
+
+    // Prefer recycling a previously used client object.
+    pthread_mutex_lock(free_clients_mutex);
+    client_t *client = (client_t *) linked_list_pop(free_clients);
+    pthread_mutex_unlock(free_clients_mutex);
+    if (!client) client = _client_alloc();
+    if (!client) {
+        perror("client_create() failed");
+        return NULL;
+    }
+
+    client->socket_fd = socket_fd;
+    client->address = address;
+    client->port = port;
+    client->in_len = 0;
+    client->out_off = 0;
+    client->out_len = 0;
+    client->out_closed = 0;
+    client->out_total = 0;
+    client->out_marks_head = 0;
+    client->out_marks_size = 0;
+    client->out_nacks_head = 0;
+    client->out_nacks_size = 0;
+    client->forward_blocked = 0;
+    client->forward_scheduled = 0;
+    client->group_head = 0;
+    client->group_size = 0;
+    client->fanout_seq = 0;
+    int weight = _client_weight(client->address, client->port);
+    for (int k = 0; k < MESSAGE_PRIORITY_CLASSES; k++) {
+        drr_flow_init(active_clients[k], &client->flow[k], weight, client);
+        client->mspace_i[k] = 0;
+        client->scheduled[k] = 0;
+    }
+    if (dest_rate) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        token_bucket_init(&client->rate_bucket, dest_rate, dest_burst, &now);
+    }
+    client->counter = 0;
+    client->first_message = 1;
+    client->owner = NULL;
+    client->owner_ref = NULL;
+    client->rx_paused = 0;
+    client->closing = 0;
+
+    // Object becomes visible to lookups only after it has been filled.
+    __atomic_store_n(&client->refs, 1, __ATOMIC_RELEASE);
+
+    return client;
+}
+
+
+void
+client_destroy(client_t *client)
+{
+    if (!client) return;
+
+    if (client->socket_fd > -1) close(client->socket_fd);
+    client->socket_fd = -1;
+
+    pthread_mutex_lock(free_clients_mutex);
+    linked_list_push(free_clients, client);
+    pthread_mutex_unlock(free_clients_mutex);
+}
+
+
+int
+client_get(client_t *client)
+{
+    int refs = __atomic_load_n(&client->refs, __ATOMIC_RELAXED);
+    do {
+        if (refs == 0) return -1;  // Already destroyed.
+    } while (!__atomic_compare_exchange_n(&client->refs, &refs, refs + 1, 1,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    return 0;
+}
+
+
+void
+client_put(client_t *client)
+{
+    if (__atomic_sub_fetch(&client->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        client_destroy(client);
+}
+
+
+/**
+ * Allocates a new client object along with all its resources.
+ *
+ * Returns:
+ *  On success, a client object with all its resources initialized. Upon
+ *  failure, it returns NULL.
+ */
+client_t *
+_client_alloc()
+{
+    int rc;
+
+    client_t *client = (client_t *) calloc(1, sizeof(client_t));
+    if (!client) return NULL;
+
+    for (int k = 0; k < MESSAGE_PRIORITY_CLASSES; k++) {
+        client->out_messages[k] = spsc_ring_create(out_queue_depth);
+        if (!client->out_messages[k]) {
+            _client_free(client);
+            return NULL;
+        }
+    }
+    client->sock_wr_mutex =
+        (pthread_mutex_t *) malloc(sizeof(pthread_mutex_t));
+    // Allocate buffers for incoming and outgoing data.
+    client->in = (char *) malloc(CLIENT_RX_BUF_LEN);
+    client->out = (char *) malloc(CLIENT_TX_BUF_LEN);
+    client->out_waiters = linked_list_create();
+    client->out_nacks = (message_t *) malloc(
+        sizeof(message_t) * CLIENT_NACK_BACKLOG);
+    // Workspace memory for storing outgoing messages in order to avoid
+    // malloc at each receive. We need a slot for each pending message,
+    // including the one currently sending (sending unit releases it after
+    // sending) plus 1 more slot for the currently receiving message, for
+    // every priority class.
+    client->mspace = (message_t *) malloc(
+        sizeof(message_t) * (out_queue_depth + 1) * MESSAGE_PRIORITY_CLASSES);
+    client->group_frames = (struct group_frame **) malloc(
+        sizeof(struct group_frame *) * CLIENT_GROUP_QUEUE_LEN);
+    if (message_log) {
+        client->wal_ids = (uint64_t *) malloc(
+            sizeof(uint64_t) * (out_queue_depth + 1) * MESSAGE_PRIORITY_CLASSES);
+    }
+    if (track_latency) {
+        client->received_ns = (uint64_t *) malloc(
+            sizeof(uint64_t) * (out_queue_depth + 1) * MESSAGE_PRIORITY_CLASSES);
+        client->out_marks = (struct out_mark *) malloc(
+            sizeof(struct out_mark) * CLIENT_OUT_MARKS);
+    }
+    if (!client->sock_wr_mutex ||
+        !client->in || !client->out || !client->out_waiters ||
+        !client->out_nacks || !client->mspace || !client->group_frames ||
+        (message_log && !client->wal_ids) ||
+        (track_latency && (!client->received_ns || !client->out_marks))) {
+        _client_free(client);
+        return NULL;
+    }
+
+    rc = pthread_mutex_init(client->sock_wr_mutex, NULL);
+    if (rc) {
+        perror("client_create() failed to init a mutex");
+        _client_free(client);  // Clean all allocated memory before return.
+        return NULL;
+    }
+
+    return client;
+}
+
+
+/**
+ * Releases all resources of a client object, including its memory.
+ */
+void
+_client_free(client_t *client)
+{
+    int rc;
+
+    if (client->sock_wr_mutex) {
+        rc = pthread_mutex_destroy(client->sock_wr_mutex);
+        if (rc) perror("Failed to destroy mutex");
+        free(client->sock_wr_mutex);
+    }
+    for (int k = 0; k < MESSAGE_PRIORITY_CLASSES; k++)
+        spsc_ring_destroy(client->out_messages[k]);
+    free(client->in);
+    free(client->out);
+    if (client->out_waiters) linked_list_destroy(client->out_waiters);
+    free(client->out_nacks);
+    free(client->mspace);
+    free(client->wal_ids);
+    free(client->received_ns);
+    free(client->out_marks);
+    free(client->group_frames);
+    free(client);
+}
+
+
+/**
+ * Starts given number of event loops for multiplexing clients' sockets.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int
+_start_svc_loops(int loops_num)
+{
+    svc_loops = (struct Svc_Loop *) calloc(loops_num, sizeof(struct Svc_Loop));
+    if (!svc_loops) return -1;
+
+    for (int i = 0; i < loops_num; i++) {
+        svc_loops[i].loop = event_loop_create();
+        svc_loops[i].clients = linked_list_create();
+        if (!svc_loops[i].loop || !svc_loops[i].clients) return -1;
+        svc_loops_num++;
+        if (event_loop_start(svc_loops[i].loop, &handler_attr)) return -1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Stops all event loops of the service.
+ *
+ * Clients handled by the loops are left untouched, so loops resources are
+ * destroyed later by stop_svc().
+ */
+void
+_stop_svc_loops()
+{
+    for (int i = 0; i < svc_loops_num; i++) {
+        if (event_loop_stop(svc_loops[i].loop))
+            perror("Failed to stop event loop");
+    }
+}
+
+
+/**
+ * Loop task that starts handling a newly accepted client.
+ */
+void
+_loop_attach_client(event_loop_t *loop, void *arg)
+{
+    client_t *c = (client_t *) arg;
+
+    c->owner_ref = linked_list_append(c->owner->clients, c);
+    c->watcher.fd = c->socket_fd;
+    c->watcher.handler = _loop_client_event;
+    c->watcher.arg = c;
+    if (tracer) trace_name_thread(tracer, "event loop");
+
+    if (_register_client(c)) {
+        perror("Could not handle new client");
+        linked_list_remove(c->owner->clients, c->owner_ref);
+        client_put(c);
+        return;
+    }
+
+    // Edge-triggered, so socket should be drained on every notification.
+    // Output buffer is flushed when socket becomes writable.
+    if (event_loop_add(loop, &c->watcher,
+                       EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)) {
+        perror("Could not watch new client");
+        _loop_close_client(c);
+    }
+}
+
+
+/**
+ * Handler of events reported for the socket of a client.
+ */
+void
+_loop_client_event(event_loop_t *loop, uint32_t events, void *arg)
+{
+    (void) loop;
+    client_t *c = (client_t *) arg;
+
+    if (c->closing) return;
+
+    if (events & EPOLLOUT) _flush_client(c);
+
+    // Read even on hang-up, so messages sent right before closing the
+    // connection are not lost.
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+        _loop_read_client(c);
+}
+
+
+/**
+ * Loop task that resumes reading of a client previously paused because its
+ * pending outgoing messages were full.
+ */
+void
+_loop_resume_client(event_loop_t *loop, void *arg)
+{
+    (void) loop;
+    client_t *c = (client_t *) arg;
+    if (!c->closing) _loop_read_client(c);
+    client_put(c);
+}
+
+
+/**
+ * Reads everything available on the socket of given client, without
+ * blocking. Reading pauses when pending outgoing messages of the client
+ * are full.
+ */
+void
+_loop_read_client(client_t *c)
+{
+    while (1) {
+        // Messages may be held in buffer, waiting for free slots.
+        int rc = _receive_frames(c, 1);
+        if (rc == 1) return;  // Paused until sending unit frees a slot.
+        if (rc < 0) {
+            fprintf(stderr, "Received an invalid message frame.\n");
+            _loop_close_client(c);
+            return;
+        }
+
+        ssize_t n = recv(c->socket_fd, c->in + c->in_len,
+                         CLIENT_RX_BUF_LEN - c->in_len, MSG_DONTWAIT);
+        if (n > 0) {
+            c->in_len += n;
+            metrics_add(svc_metrics, METRIC_BYTES_RECEIVED, n);
+            _trace_client(TRACE_RECV, c, n);
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;  // Drained. Wait for next notification.
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            _loop_close_client(c);  // Connection closed or failed.
+            return;
+        }
+    }
+}
+
+
+/**
+ * Stops handling the connection of given client. Client is destroyed once
+ * sending unit has sent all its pending messages.
+ */
+void
+_loop_close_client(client_t *c)
+{
+    event_loop_remove(c->owner->loop, &c->watcher);
+    _unregister_client(c);
+    c->closing = 1;
+    linked_list_remove(c->owner->clients, c->owner_ref);
+    client_put(c);
+}
+
+
+/**
+ * Starts given number of workers handling clients.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int
+_start_handler_pool(int workers)
+{
+    handler_tids = (pthread_t *) malloc(sizeof(pthread_t) * workers);
+    handler_sockets = (int *) malloc(sizeof(int) * workers);
+    handler_queue = (int *) malloc(sizeof(int) * workers);
+    handler_mutex = (pthread_mutex_t *) malloc(sizeof(pthread_mutex_t));
+    handler_queued_cond = (pthread_cond_t *) malloc(sizeof(pthread_cond_t));
+    handler_space_cond = (pthread_cond_t *) malloc(sizeof(pthread_cond_t));
+    if (!handler_tids || !handler_sockets || !handler_queue || !handler_mutex ||
+        !handler_queued_cond || !handler_space_cond)
+        return -1;
+    if (pthread_mutex_init(handler_mutex, NULL) ||
+        pthread_cond_init(handler_queued_cond, NULL) ||
+        pthread_cond_init(handler_space_cond, NULL))
+        return -1;
+    for (int i = 0; i < workers; i++) handler_sockets[i] = -1;
+    handler_queue_head = handler_queue_len = handler_busy = 0;
+    handler_run = 1;
+
+    for (int i = 0; i < workers; i++) {
+        if (pthread_create(handler_tids + i, &handler_attr, _handler_work,
+                           (void *) (intptr_t) i))
+            return -1;
+        handler_workers++;
+    }
+    metrics_add(svc_metrics, METRIC_HANDLER_WORKERS, workers);
+
+    return 0;
+}
+
+
+/**
+ * Stops all workers handling clients. Connections they handle are shut down
+ * and connections still waiting for a worker are closed.
+ */
+void
+_stop_handler_pool()
+{
+    pthread_mutex_lock(handler_mutex);
+    handler_run = 0;
+    for (int i = 0; i < handler_workers; i++)
+        if (handler_sockets[i] >= 0) shutdown(handler_sockets[i], SHUT_RDWR);
+    for (; handler_queue_len; handler_queue_len--) {
+        close(handler_queue[handler_queue_head]);
+        handler_queue_head = (handler_queue_head + 1) % handler_workers;
+        metrics_add(svc_metrics, METRIC_HANDLER_QUEUED, -1);
+    }
+    pthread_cond_broadcast(handler_queued_cond);
+    pthread_cond_broadcast(handler_space_cond);
+    pthread_mutex_unlock(handler_mutex);
+
+    for (int i = 0; i < handler_workers; i++)
+        pthread_join(handler_tids[i], NULL);
+    metrics_add(svc_metrics, METRIC_HANDLER_WORKERS, -handler_workers);
+
+    pthread_mutex_destroy(handler_mutex);
+    pthread_cond_destroy(handler_queued_cond);
+    pthread_cond_destroy(handler_space_cond);
+    free(handler_mutex);
+    free(handler_queued_cond);
+    free(handler_space_cond);
+    free(handler_tids);
+    free(handler_sockets);
+    free(handler_queue);
+    handler_workers = 0;
+}
+
+
+/**
+ * Entry point of a worker of handler pool, with its index as argument. It
+ * handles queued sockets one at a time, until pool is stopped.
+ */
+void *
+_handler_work(void *arg)
+{
+    int i = (int) (intptr_t) arg;
+
+    pthread_mutex_lock(handler_mutex);
+    while (1) {
+        while (handler_run && !handler_queue_len)
+            pthread_cond_wait(handler_queued_cond, handler_mutex);
+        if (!handler_run) break;
+
+        int fd = handler_queue[handler_queue_head];
+        handler_queue_head = (handler_queue_head + 1) % handler_workers;
+        handler_queue_len--;
+        handler_sockets[i] = fd;
+        handler_busy++;
+        metrics_add(svc_metrics, METRIC_HANDLER_QUEUED, -1);
+        metrics_add(svc_metrics, METRIC_HANDLER_BUSY, 1);
+        pthread_cond_signal(handler_space_cond);
+        pthread_mutex_unlock(handler_mutex);
+
+        _handle_client(fd, handler_sockets + i);
+
+        pthread_mutex_lock(handler_mutex);
+        handler_busy--;
+        metrics_add(svc_metrics, METRIC_HANDLER_BUSY, -1);
+    }
+    pthread_mutex_unlock(handler_mutex);
+
+    return NULL;
+}
+
+
+/**
+ * Clears given slot of a worker of handler pool, so pool no longer shuts
+ * down the socket it holds. NULL slots are ignored.
+ */
+void
+_release_handler_slot(int *slot)
+{
+    if (!slot) return;
+    pthread_mutex_lock(handler_mutex);
+    *slot = -1;
+    pthread_mutex_unlock(handler_mutex);
+}
+
+
+int
+_start_logger(char *logger_fn, long interval)
+{
+    log_interval = interval > 0 ? interval : LOG_INTERVAL_DEFAULT;
+    log_ring_head = log_ring_tail = 0;
+
+    // Files are opened once, so sampling costs just a read of each.
+    log_fd = open(logger_fn, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    pid_stat_fd = open("/proc/self/stat", O_RDONLY);
+    cpu_stat_fd = open("/proc/stat", O_RDONLY);
+    log_ring = (char *) malloc(LOG_RING_LEN);
+    if (log_fd < 0 || pid_stat_fd < 0 || cpu_stat_fd < 0 || !log_ring)
+        goto error;
+
+    // Log starts with the size of messages, so it can be interpreted.
+    struct log_header header = { LOG_MAGIC, LOG_VERSION, sizeof(message_t),
+                                 MESSAGE_DATA_LENGTH, log_interval };
+    size_t len = log_header_encode(&header, log_encoded);
+    if (_log_ring_put(log_encoded, len) || _log_flush()) goto error;
+
+    logger_run = 1;
+    if (pthread_create(&log_tid, &housekeeping_attr, _logger_work, NULL))
+        goto error;
+    return 0;
+
+error:
+    logger_run = 0;
+    if (log_fd >= 0) close(log_fd);
+    if (pid_stat_fd >= 0) close(pid_stat_fd);
+    if (cpu_stat_fd >= 0) close(cpu_stat_fd);
+    free(log_ring);
+    log_ring = NULL;
+    return -1;
+}
+
+
+int
+_stop_logger()
+{
+    logger_run = 0;
+    if (pthread_join(log_tid, NULL)) return -1;
+    int rc = _log_flush();
+    close(pid_stat_fd);
+    close(cpu_stat_fd);
+    free(log_ring);
+    log_ring = NULL;
+    return close(log_fd) || rc;
+}
+
+
+void *
+_logger_work(void *arg)
+{
+    (void) arg;
+
+    struct log_data previous;
+    memset(&previous, 0, sizeof(struct log_data));
+
+    struct timespec period_spec;
+    period_spec.tv_sec = log_interval / 1000;
+    period_spec.tv_nsec = (log_interval % 1000) * 1000000;
+
+    struct timespec target;     // Target time for next timeout.
+    struct timespec cur_time;   // Current time.
+    struct timespec diff;       // Difference between current time and target.
+
+    // Set first target to current time plus a period.
+    clock_gettime(CLOCK_MONOTONIC, &target);
+    timespec_add(&target, &target, &period_spec);
+
+    while (logger_run) {
+        // Calculate the difference between current time and target.
+        clock_gettime(CLOCK_MONOTONIC, &cur_time);
+        timespec_subtract(&diff, &target, &cur_time);
+
+        if (diff.tv_sec >= 0 && diff.tv_nsec >= 0) {
+            // Sleep for calculated diff time.
+            int rc = nanosleep(&diff, NULL);
+            if (rc != 0) {
+                perror("Nanosleep not completed properly.\n");
+            }
+        }
+
+        _log(&previous);
+
+        // Set next target. Everything is integral, so no error accumulation.
+        timespec_add(&target, &target, &period_spec);
+    }
+
+    pthread_exit(0);
+}
+
+
+/**
+ * Samples the service and puts a record of it on the ring of log records.
+ * Ring is written to log file once it's half full, or once it's held
+ * records for LOG_FLUSH_PERIOD_MS.
+ *
+ * Parameters:
+ *  -prev : Previous sample, which is replaced by current one.
+ */
+void
+_log(struct log_data *prev)
+{
+    struct log_data current;
+    struct log_record *r = &log_current;
+
+    if (_log_read_cpu(&current)) {
+        fprintf(stderr, "ERROR: Failed to read CPU usage\n");
+        return;
+    }
+
+    // Get current timestamp.
+    clock_gettime(CLOCK_MONOTONIC, &current.timestamp);
+
+    // Get messages number.
+    current.messages = metrics_value(svc_metrics, METRIC_MESSAGES_SENT);
+    memcpy(current.batches, send_batches, sizeof(current.batches));
+    histogram_snapshot(&current.queue_latency, &queue_latency);
+    histogram_snapshot(&current.send_latency, &send_latency);
+
+    memset(r, 0, offsetof(struct log_record, occupancy));
+
+    // There is nothing to calculate on initial sample.
+    if (prev->timestamp.tv_sec != 0 && prev->timestamp.tv_nsec != 0) {
+        r->elapsed = get_elapsed_time_millis(
+            prev->timestamp, current.timestamp);
+        r->messages = current.messages - prev->messages;
+        r->cpu_usage = 1000000.0 *
+            (current.utime - prev->utime + current.stime - prev->stime) /
+            (current.total_cpu - prev->total_cpu) + 0.5;
+    }
+    r->clients = endpoint_table_size(clients);
+
+    // Then, the number of sending syscalls per batch size since previous
+    // sample.
+    for (int i = 0; i < SEND_BATCH_BUCKETS; i++)
+        r->batches[i] = current.batches[i] - prev->batches[i];
+    // Then, achieved rate versus rate configured on global limiter (0 when
+    // disabled).
+    r->rate = r->elapsed ? r->messages * 10000.0 / r->elapsed + 0.5 : 0;
+    r->configured_rate = speed_limiter_run ?
+        __atomic_load_n(&configured_rate, __ATOMIC_RELAXED) : 0;
+    // Then, p50, p99, p99.9 and max latency of messages sent since previous
+    // sample, first from being received until taken by sending unit, then
+    // until written to their destinations.
+    _log_latency(r->latency, &current.queue_latency, &prev->queue_latency);
+    _log_latency(r->latency + 4, &current.send_latency, &prev->send_latency);
+    // Then, occupancy of output buffers for every destination with unsent
+    // data.
+    endpoint_table_for_each(clients, _log_out_occupancy, r);
+
+    size_t len = log_record_encode(r, log_encoded);
+    if (_log_ring_put(log_encoded, len))
+        fprintf(stderr, "Log buffer is full, dropping a record.\n");
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (log_ring_head - log_ring_tail >= LOG_RING_LEN / 2 ||
+        get_elapsed_time_millis(log_flushed, now) >= LOG_FLUSH_PERIOD_MS)
+        _log_flush();
+
+    // Current sample is from now on the previous one.
+    memcpy(prev, &current, sizeof(struct log_data));
+}
+
+
+/**
+ * Reads CPU time consumed by server and by the whole system into given
+ * sample.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int
+_log_read_cpu(struct log_data *d)
+{
+    char buf[512];
+    char *p;
+
+    // Get utime and stime. Name of executable may contain spaces, so fields
+    // are counted after it. They're the 12th and 13th ones after it.
+    ssize_t n = pread(pid_stat_fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0) return -1;
+    buf[n] = '\0';
+    p = strrchr(buf, ')');
+    for (int i = 0; i < 12 && p; i++) p = strchr(p + 1, ' ');
+    if (!p) return -1;
+    d->utime = strtoul(p, &p, 10);
+    d->stime = strtoul(p, NULL, 10);
+
+    // Get total cpu usage, as the sum of the fields of the first line.
+    n = pread(cpu_stat_fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0) return -1;
+    buf[n] = '\0';
+    char *eol = strchr(buf, '\n');
+    if (eol) *eol = '\0';
+    d->total_cpu = 0;
+    p = buf + strcspn(buf, " ");  // Skip "cpu" label.
+    while (1) {
+        char *end;
+        unsigned long value = strtoul(p, &end, 10);
+        if (end == p) break;
+        d->total_cpu += value;
+        p = end;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Writes to given fields percentiles of latencies, in tenths of
+ * microseconds, recorded on given histogram since its previous snapshot.
+ */
+void
+_log_latency(uint32_t *fields, histogram_t *current, histogram_t *prev)
+{
+    histogram_t interval;
+    memcpy(&interval, current, sizeof(histogram_t));
+    histogram_subtract(&interval, prev);
+
+    uint64_t values[4] = {
+        histogram_percentile(&interval, 50.0),
+        histogram_percentile(&interval, 99.0),
+        histogram_percentile(&interval, 99.9),
+        histogram_max(&interval)
+    };
+    for (int i = 0; i < 4; i++) {
+        uint64_t tenths = values[i] / 100;
+        fields[i] = tenths > UINT32_MAX ? UINT32_MAX : tenths;
+    }
+}
+
+
+/**
+ * Adds to given log record the number of unsent bytes held in the output
+ * buffer of given client, if any.
+ */
+void
+_log_out_occupancy(void *value, void *arg)
+{
+    client_t *c = (client_t *) value;
+    struct log_record *r = (struct log_record *) arg;
+
+    if (r->occupancy_num == LOG_OCCUPANCY_MAX) return;
+
+    pthread_mutex_lock(c->sock_wr_mutex);
+    size_t pending = c->out_len - c->out_off;
+    pthread_mutex_unlock(c->sock_wr_mutex);
+    if (!pending) return;
+
+    struct log_occupancy *o = r->occupancy + r->occupancy_num++;
+    o->address = c->address;
+    o->port = c->port;
+    o->bytes = pending;
+}
+
+
+/**
+ * Puts given bytes on the ring of log records.
+ *
+ * Returns:
+ *  0 on success, or a non-zero integer if ring has no space for them.
+ */
+int
+_log_ring_put(const void *buf, size_t len)
+{
+    if (LOG_RING_LEN - (log_ring_head - log_ring_tail) < len) return -1;
+
+    size_t off = log_ring_head % LOG_RING_LEN;
+    size_t first = LOG_RING_LEN - off < len ? LOG_RING_LEN - off : len;
+    memcpy(log_ring + off, buf, first);
+    memcpy(log_ring, (const char *) buf + first, len - first);
+    log_ring_head += len;
+
+    return 0;
+}
+
+
+/**
+ * Writes all records held on ring to log file, usually by a single syscall.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer. Records not written are kept.
+ */
+int
+_log_flush()
+{
+    struct iovec iov[2];
+
+    while (log_ring_tail < log_ring_head) {
+        size_t off = log_ring_tail % LOG_RING_LEN;
+        size_t len = log_ring_head - log_ring_tail;
+        iov[0].iov_base = log_ring + off;
+        iov[0].iov_len = LOG_RING_LEN - off < len ? LOG_RING_LEN - off : len;
+        iov[1].iov_base = log_ring;
+        iov[1].iov_len = len - iov[0].iov_len;
+
+        ssize_t n = writev(log_fd, iov, iov[1].iov_len ? 2 : 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            perror("Failed to write log file");
+            return -1;
+        }
+        log_ring_tail += n;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &log_flushed);
+
+    return 0;
+}
+
+
+/**
+ * Sets up the global rate limiter. Its bucket is used only by sending unit.
+ */
+void
+_start_speed_limiter(struct svc_cfg *options)
+{
+    limiter_max_rate = options->max_rate > 0 ? options->max_rate : 1;
+    limiter_min_rate = options->min_rate;
+    limiter_step = options->rate_step;
+    limiter_period = options->time_of_step;
+
+    clock_gettime(CLOCK_MONOTONIC, &limiter_start);
+    token_bucket_init(&rate_bucket, limiter_max_rate,
+                      options->rate_burst > 0 ?
+                      options->rate_burst : send_batch_max,
+                      &limiter_start);
+    __atomic_store_n(&configured_rate, limiter_max_rate, __ATOMIC_RELAXED);
+
+    speed_limiter_run = 1;
+}
+
+
+/**
+ * Waits until global limiter has at least one token.
+ *
+ * Parameters:
+ *  -max : Max number of tokens needed.
+ *
+ * Returns:
+ *  The number of tokens available, up to max. They should be consumed after
+ *  messages have been sent.
+ */
+int
+_limiter_acquire(int max)
+{
+    struct timespec now;
+    long available;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    _limiter_update_rate(&now);
+
+    while ((available = token_bucket_available(&rate_bucket, &now)) < 1) {
+        long delay = token_bucket_delay(&rate_bucket, 1);
+        struct timespec wait = { delay / 1000000000L, delay % 1000000000L };
+        nanosleep(&wait, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &now);
     }
 
-    return client;
+    return available < max ? available : max;
 }
 
 
+/**
+ * Applies the current step of rate reduction to global limiter. Rate starts
+ * at max rate and is reduced by a step every period. When it drops below
+ * min rate, it starts again from max rate.
+ */
 void
-client_destroy(client_t *client)
+_limiter_update_rate(struct timespec *now)
 {
-    if (!client) return;
+    if (limiter_step <= 0 || limiter_period <= 0) return;
 
-    int rc;
+    long steps = get_elapsed_time_millis(limiter_start, *now) / limiter_period;
+    long rates_num = (limiter_max_rate - limiter_min_rate) / limiter_step + 1;
+    if (rates_num < 1) rates_num = 1;
+    long rate = limiter_max_rate - (steps % rates_num) * limiter_step;
+    if (rate < 1) rate = 1;
 
-    if (client->out_mutex) {
-        rc = pthread_mutex_destroy(client->out_mutex);
-        if (rc) perror("Failed to destroy mutex");
-        free(client->out_mutex);
-    }
-    if (client->sock_wr_mutex) {
-        rc = pthread_mutex_destroy(client->sock_wr_mutex);
-        if (rc) perror("Failed to destroy mutex");
-        free(client->sock_wr_mutex);
+    if (rate != configured_rate) {
+        token_bucket_set_rate(&rate_bucket, rate, now);
+        __atomic_store_n(&configured_rate, rate, __ATOMIC_RELAXED);
     }
-    if (client->out_message_removed) {
-        rc = pthread_cond_destroy(client->out_message_removed);
-        if (rc) perror("Failed to destroy condition");
-        free(client->out_message_removed);
-    }
-    if (client->out_messages) linked_list_destroy(client->out_messages);
-    free(client);
 }
 
 
+/**
+ * Waits for given time in nanoseconds, or until a client becomes active.
+ */
+void
+_wait_deferred(long delay)
+{
+    struct timespec deadline;
+    struct timespec wait = { delay / 1000000000L, delay % 1000000000L };
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    timespec_add(&deadline, &deadline, &wait);
+
+    pthread_mutex_lock(active_clients_mutex);
+    _enqueue_scheduled();
+    if (_active_flows() < 1 && sending_unit_run)
+        _sending_wait(&deadline, 0);
+    pthread_mutex_unlock(active_clients_mutex);
+}
+
+
+/**
+ * Holds given message until its destination connects again.
+ *
+ * Parameters:
+ *  -m : Message to be held.
+ *  -id : Id of message on write-ahead log, or 0 if it's not logged.
+ *
+ * Returns:
+ *  0 if message is held, or a non-zero integer if store-and-forward is
+ *  disabled or store has no room for it, so it should be NACKed.
+ */
 int
-_start_logger(char *logger_fn)
+_hold_message(message_t *m, uint64_t id)
 {
-    log_file = fopen(logger_fn, "w");
-    if (!log_file) return -1;
+    struct timespec now;
 
-    logger_run = 1;
-    return pthread_create(&log_tid, NULL, _logger_work, log_file);
+    if (!held_messages) return -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (hold_queue_put(held_messages, m, id, &now, 0)) return -1;
+
+    // Destination may have connected while message was being held.
+    client_t *dest = _lookup_client(m->dest_addr, m->dest_port);
+    if (dest) {
+        _schedule_forward(dest);
+        client_put(dest);
+    }
+
+    pthread_mutex_lock(active_clients_mutex);
+    _signal_sending_unit();  // Expiry should be tracked.
+    pthread_mutex_unlock(active_clients_mutex);
+
+    return 0;
 }
 
 
+/**
+ * Returns a non-zero integer if there are messages held for given endpoint.
+ */
 int
-_stop_logger()
+_dest_has_held(uint32_t address, uint16_t port)
 {
-    logger_run = 0;
-    if (pthread_join(log_tid, NULL)) return -1;
-    return fclose(log_file);
+    if (!held_messages || !hold_queue_size(held_messages)) return 0;
+    return hold_queue_count(held_messages, address, port) > 0;
 }
 
 
-void *
-_logger_work(void *arg)
+/**
+ * Schedules forwarding of messages held for given client, and of frames of
+ * its groups, by sending unit, unless already scheduled.
+ */
+void
+_schedule_forward(client_t *c)
+{
+    if (__atomic_exchange_n(&c->forward_scheduled, 1, __ATOMIC_ACQ_REL)) return;
+
+    client_get(c);  // Reference held by the list of ready clients.
+
+    pthread_mutex_lock(active_clients_mutex);
+    linked_list_append(forward_ready, c);
+    _signal_sending_unit();
+    pthread_mutex_unlock(active_clients_mutex);
+}
+
+
+/**
+ * Forwards messages held for clients that have connected again, and frames
+ * of groups pending for their members.
+ */
+void
+_forward_pending()
+{
+    if (!linked_list_size(forward_ready)) return;
+
+    client_t *c;
+    while (1) {
+        pthread_mutex_lock(active_clients_mutex);
+        c = linked_list_pop(forward_ready);
+        pthread_mutex_unlock(active_clients_mutex);
+        if (!c) break;
+        _forward_client(c);
+    }
+}
+
+
+/**
+ * Buffers as many messages held for given client as its output buffer
+ * accepts, in the order they were held, followed by pending frames of its
+ * groups. When buffer fills up, forwarding resumes once it has been flushed
+ * enough. Frames are dropped once connection has been closed.
+ *
+ * Reference of the client, held by the list of ready clients, is either
+ * passed to its output buffer or released.
+ */
+void
+_forward_client(client_t *c)
 {
-    // Write message and data size to the beggining of logfile.
-    int message_size = sizeof(message_t);
-    int data_size = MESSAGE_DATA_LENGTH;
-    int rc = fprintf(log_file, "%d %d\n", message_size, data_size);
-    if (rc < 1) {
-        fprintf(stderr, "Failed to write header data to log file.\n");
-        pthread_exit((void *) -1);
+    int rc = pthread_mutex_lock(c->sock_wr_mutex);
+    if (rc) perror("Failed to acquire socket writing mutex.\n");
+
+    message_t *m;
+    uint64_t ids[SEND_BATCH_LIMIT];
+    int ids_num = 0;
+    int n = 0;
+    while (held_messages && !c->out_closed && n < SEND_BATCH_LIMIT &&
+           (m = hold_queue_peek(held_messages, c->address, c->port))) {
+        if (_out_append(c, m)) {
+            c->forward_blocked = 1;  // Reference is now held by the buffer.
+            break;
+        }
+        uint64_t id = hold_queue_tag(m);
+        if (id) ids[ids_num++] = id;
+        hold_queue_pop(held_messages, c->address, c->port);
+        n++;
     }
-    fflush(log_file);
 
-    struct log_data previous;
-    memset(&previous, 0, sizeof(struct log_data));
+    while (!c->out_closed && !c->forward_blocked && c->group_size) {
+        struct group_frame *f = c->group_frames[c->group_head];
+        if (_out_append_frame(c, f->data, f->size)) {
+            c->forward_blocked = 1;
+            break;
+        }
+        c->group_head = (c->group_head + 1) & (CLIENT_GROUP_QUEUE_LEN - 1);
+        c->group_size--;
+        if (!--f->refs) free(f);
+        n++;
+    }
+    if (c->out_closed) _drop_group_frames(c);
+    int blocked = c->forward_blocked;
 
-    struct timespec period_spec;
-    period_spec.tv_sec = 1;  // 1 sec period
-    period_spec.tv_nsec = 0;
+    pthread_mutex_unlock(c->sock_wr_mutex);
 
-    struct timespec target;     // Target time for next timeout.
-    struct timespec cur_time;   // Current time.
-    struct timespec diff;       // Difference between current time and target.
+    metrics_add(svc_metrics, METRIC_MESSAGES_SENT, n);
+    if (ids_num) wal_mark(message_log, ids, ids_num);
 
-    // Set first target to current time plus a period.
-    clock_gettime(CLOCK_MONOTONIC, &target);
-    timespec_add(&target, &target, &period_spec);
+    _flush_client(c);
+    if (blocked) return;
 
-    while (logger_run) {
-        // Calculate the difference between current time and target.
-        clock_gettime(CLOCK_MONOTONIC, &cur_time);
-        timespec_subtract(&diff, &target, &cur_time);
+    // A message held while forwarding should not be left behind.
+    __atomic_store_n(&c->forward_scheduled, 0, __ATOMIC_SEQ_CST);
+    if (!c->out_closed &&
+        (c->group_size || _dest_has_held(c->address, c->port)))
+        _schedule_forward(c);
+    client_put(c);
+}
 
-        if (diff.tv_sec >= 0 && diff.tv_nsec >= 0) {
-            // Sleep for calculated diff time.
-            int rc = nanosleep(&diff, NULL);
-            if (rc != 0) {
-                perror("Nanosleep not completed properly.\n");
+
+/**
+ * NACKs held messages whose time-to-live has passed. Consecutive messages of
+ * a source, which usually expire together, are NACKed by a single write.
+ */
+void
+_expire_held()
+{
+    if (!held_messages || !hold_queue_size(held_messages)) return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    message_t *m;
+    client_t *src = NULL;
+    while ((m = hold_queue_expire(held_messages, &now))) {
+        if (!src || src->address != m->src_addr || src->port != m->src_port) {
+            if (src) {
+                _flush_client(src);
+                client_put(src);
             }
+            src = _lookup_client(m->src_addr, m->src_port);
         }
+        if (src) _nack_to(src, m, ERR_TARGET_DOWN);
+        _log_delivered(hold_queue_tag(m));
+        hold_queue_release(m);
+    }
+    if (src) {
+        _flush_client(src);
+        client_put(src);
+    }
+}
 
-        _log((FILE *) arg, &previous);
 
-        // Set next target. Everything is integral, so no error accumulation.
-        timespec_add(&target, &target, &period_spec);
-    }
+/**
+ * Waits until the oldest held message expires, or until sending unit is
+ * signaled. Should be called with active clients mutex acquired.
+ *
+ * Returns:
+ *  A non-zero integer if the oldest held message has expired, otherwise 0.
+ */
+int
+_wait_expiry()
+{
+    struct timespec expiry;
 
-    pthread_exit(0);
+    if (hold_queue_next_expiry(held_messages, &expiry)) return 0;
+
+    // Expiry is kept on CLOCK_MONOTONIC, like deadlines of sending unit.
+    return _sending_wait(&expiry, 0) == ETIMEDOUT;
 }
 
 
+/**
+ * Makes given client join or leave the group addressed by given message.
+ * Should be called by the receiver of the client.
+ */
 void
-_log(FILE *log_file, struct log_data *prev)
+_handle_group_request(client_t *c, message_t *m, uint8_t request)
 {
-    struct log_data current;
+    if (request & MESSAGE_GROUP_JOIN) {
+        int rc = group_table_join(groups, m->dest_port, c);
+        if (!rc) client_get(c);  // Reference held by the group.
+        else if (rc < 0) fprintf(stderr, "Failed to join group.\n");
+    } else if (!group_table_leave(groups, m->dest_port, c)) client_put(c);
+}
 
-    // Get utime and stime.
-    pid_t pid = getpid();
-    char pid_path[128];
-    sprintf(pid_path, "/proc/%d/stat", pid);
-    FILE *pid_proc = fopen(pid_path, "r");
-    if (!pid_proc) {
-        fprintf(stderr, "ERROR: Failed to open %s\n", pid_path);
-        return;
+
+/**
+ * Subscribes given client with the filter held by given message, or
+ * unsubscribes it. Should be called by the receiver of the client.
+ */
+void
+_handle_topic_request(client_t *c, message_t *m, uint8_t request)
+{
+    if (request & MESSAGE_TOPIC_SUBSCRIBE) {
+        int rc = topic_index_subscribe(topics, m->data, m->len, c);
+        if (!rc) client_get(c);  // Reference held by the subscription.
+        else if (rc < 0) fprintf(stderr, "Failed to subscribe to topic.\n");
+    } else if (!topic_index_unsubscribe(topics, m->data, m->len, c)) {
+        client_put(c);
     }
-    fscanf(pid_proc,
-           "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*lu %*lu %*lu %*lu %lu %lu",
-           &current.utime, &current.stime);
-    fclose(pid_proc);
+}
 
-    // Get total cpu usage.
-    char stat_buf[256];
-    FILE *proc = fopen("/proc/stat", "r");
-    if (!proc) {
-        fprintf(stderr, "ERROR: Failed to open /proc/stat\n");
-        return;
+
+/**
+ * Sends given message to every member of its destination group, or to every
+ * subscriber of its topic. Message is serialized once into a frame, which is
+ * queued for all members and freed after it has been buffered for the last
+ * of them. Should be called only by sending unit.
+ *
+ * Returns:
+ *  The number of members reached.
+ */
+int
+_fanout_message(message_t *m)
+{
+    size_t size = message_wire_size(m, wire_format);
+    struct group_frame *f =
+        (struct group_frame *) malloc(sizeof(struct group_frame) + size);
+    if (!f) {
+        perror("Failed to allocate frame of group");
+        return 0;
     }
-    if (!fgets(stat_buf, 256, proc)) {
-        fprintf(stderr, "ERROR: Failed to read /proc/stat\n");
-        fclose(proc);
-        return;
+    f->size = message_serialize(m, f->data, wire_format);
+    f->refs = 1;
+
+    struct fanout fanout;
+    fanout.frame = f;
+    fanout.members = 0;
+    fanout.seq = ++fanout_seq;
+    fanout.closed_num = 0;
+
+    if (m->dest_addr == MESSAGE_GROUP_ADDR) {
+        group_table_for_each(groups, m->dest_port, _queue_group_frame, &fanout);
+    } else {
+        size_t len = strnlen(m->data, m->len);  // Topic ends at a null byte.
+        topic_index_for_each(topics, m->data, len, _queue_topic_frame, &fanout);
+        // Index can't be modified while matching, so closed subscribers are
+        // removed afterwards. The rest are removed by a later fan-out.
+        for (int i = 0; i < fanout.closed_num; i++) {
+            client_t *c = fanout.closed[i];
+            int removed = topic_index_remove_member(topics, c);
+            while (removed--) client_put(c);  // References of subscriptions.
+        }
     }
-    current.total_cpu = 0;
-    char *saveptr;
-    char *next_field = strtok_r(stat_buf, " ", &saveptr);
-    while(next_field) {
-        current.total_cpu += atol(next_field);
-        next_field = strtok_r(NULL, " ", &saveptr);
+
+    if (!--f->refs) free(f);
+    return fanout.members;
+}
+
+
+/**
+ * Queues the frame of given fan-out for given client.
+ *
+ * Returns:
+ *  A non-zero integer if connection of client has been closed, otherwise 0.
+ */
+int
+_queue_frame(client_t *c, struct fanout *fanout)
+{
+    if (__atomic_load_n(&c->out_closed, __ATOMIC_RELAXED)) return 1;
+
+    fanout->members++;
+    if (c->group_size == CLIENT_GROUP_QUEUE_LEN) {
+        metrics_add(svc_metrics, METRIC_GROUP_DROPS, 1);
+        return 0;
     }
-    fclose(proc);
+    int tail = (c->group_head + c->group_size) & (CLIENT_GROUP_QUEUE_LEN - 1);
+    c->group_frames[tail] = fanout->frame;
+    c->group_size++;
+    fanout->frame->refs++;
+    _schedule_forward(c);
 
-    // Get current timestamp.
-    clock_gettime(CLOCK_MONOTONIC, &current.timestamp);
+    return 0;
+}
 
-    // Get messages number.
-    current.messages = total_messages_sent;
 
-    unsigned long out_timestamp = 0;
-    unsigned long out_messages = 0;
-    float out_cpu_usage = 0;
+/**
+ * Queues a frame of a group for given member, during fan-out. Members whose
+ * connection has been closed are removed from the group.
+ *
+ * Returns:
+ *  A non-zero integer if member should be removed, otherwise 0.
+ */
+int
+_queue_group_frame(void *member, void *arg)
+{
+    client_t *c = (client_t *) member;
+    if (!_queue_frame(c, (struct fanout *) arg)) return 0;
+
+    client_put(c);  // Reference held by the group.
+    return 1;
+}
 
-    // There is nothing to calculate on initial sample.
-    if (prev->timestamp.tv_sec != 0 && prev->timestamp.tv_nsec != 0) {
 
-        out_timestamp = get_elapsed_time_millis(
-            prev->timestamp, current.timestamp);
+/**
+ * Queues a frame of a topic for given subscriber, during fan-out, unless a
+ * previous filter of the subscriber already matched. Subscribers whose
+ * connection has been closed are kept for removal.
+ */
+void
+_queue_topic_frame(void *member, void *arg)
+{
+    client_t *c = (client_t *) member;
+    struct fanout *fanout = (struct fanout *) arg;
 
-        if (current.messages < prev->messages)
-            out_messages = UINT32_MAX - prev->messages + 1 + current.messages;
-        else out_messages = current.messages - prev->messages;
+    if (c->fanout_seq == fanout->seq) return;
+    c->fanout_seq = fanout->seq;
 
-        out_cpu_usage =
-            (float) (current.utime - prev->utime + current.stime - prev->stime) /
-            (float) (current.total_cpu - prev->total_cpu);
+    if (_queue_frame(c, fanout) && fanout->closed_num < FANOUT_CLOSED_MAX)
+        fanout->closed[fanout->closed_num++] = c;
+}
+
+
+/**
+ * Drops all frames of groups pending for given client.
+ */
+void
+_drop_group_frames(client_t *c)
+{
+    while (c->group_size) {
+        struct group_frame *f = c->group_frames[c->group_head];
+        if (!--f->refs) free(f);
+        c->group_head = (c->group_head + 1) & (CLIENT_GROUP_QUEUE_LEN - 1);
+        c->group_size--;
     }
+}
 
-    // Append to log file.
-    int rc = fprintf(log_file, "%lu %lu %.6f %d\n",
-                     out_timestamp, out_messages, out_cpu_usage,
-                     connected_clients);
-    if (rc < 1) fprintf(stderr, "Failed to write log file\n");
-    fflush(log_file);
 
-    // Current sample is from now on the previous one.
-    memcpy(prev, &current, sizeof(struct log_data));
+/**
+ * Releases the reference of a member held by its group.
+ */
+void
+_release_member(void *member)
+{
+    client_put((client_t *) member);
 }
 
 
+/**
+ * Opens the write-ahead log, replays messages it holds that haven't been
+ * delivered and starts its compaction. Messages are replayed into the store
+ * of held messages, so they're forwarded once their destinations connect.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
 int
-_start_speed_limiter(long period, long max_rate, long min_rate, long step)
+_start_wal(struct svc_cfg *options)
 {
-    struct limiter_data *specs =
-        (struct limiter_data *) malloc(sizeof(struct limiter_data));
-    specs->period = period;
-    specs->max_rate = max_rate;
-    specs->min_rate = min_rate;
-    specs->rate_step = step;
-
-    // Set message_sending_period for max_rate.
-    message_sending_period.tv_sec = 1 / max_rate;
-    message_sending_period.tv_nsec = (1000000000 / max_rate) % 1000000000;
+    struct timespec start, stop;
+
+    message_log = wal_open(options->wal_dir, options->wal_segment_size > 0 ?
+                           (size_t) options->wal_segment_size : 0);
+    if (!message_log) return -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int replayed = wal_replay(message_log, _replay_message, &start);
+    if (replayed < 0) return -1;
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    if (replayed) {
+        printf("Replayed %d messages from write-ahead log in %ld ms.\n",
+               replayed, get_elapsed_time_millis(start, stop));
+    }
 
-    speed_limiter_run = 1;
-    return pthread_create(&limiter_tid, NULL, _speed_limiter_worker, specs);
+    wal_compactor_run = 1;
+    return pthread_create(&wal_compactor_tid, &housekeeping_attr,
+                          _wal_compactor_work, (void *) NULL);
 }
-int
-_stop_speed_limiter()
+
+
+/**
+ * Stops compaction and closes the write-ahead log.
+ */
+void
+_stop_wal()
 {
-    speed_limiter_run = 0;
-    pthread_cancel(limiter_tid);
-    return pthread_join(limiter_tid, NULL);
+    wal_compactor_run = 0;
+    pthread_join(wal_compactor_tid, NULL);
+    wal_close(message_log);
+    message_log = NULL;
 }
 
+
+/**
+ * Periodically removes segments of write-ahead log, whose messages have all
+ * been delivered.
+ */
 void *
-_speed_limiter_worker(void *arg)
+_wal_compactor_work(void *arg)
 {
-    struct limiter_data *arg_specs = (struct limiter_data *) arg;
-    struct limiter_data local_specs;
-    struct limiter_data *specs = &local_specs;  // Bored to change all references.
-    memcpy(specs, arg_specs, sizeof(struct limiter_data));
-    free(arg_specs);  // Struct in stack and free is needed for thread cancellation.
-
-    struct timespec period_spec;
-    period_spec.tv_sec = specs->period / 1000;
-    period_spec.tv_nsec = (specs->period % 1000) * 1000000;
+    (void) arg;
+    struct timespec period = { 0, 100 * 1000000L };
+    int elapsed = 0;
+
+    // Sleeps in short steps, so termination is not delayed.
+    while (wal_compactor_run) {
+        nanosleep(&period, NULL);
+        elapsed += 100;
+        if (elapsed < WAL_COMPACT_PERIOD_MS) continue;
+        elapsed = 0;
+        wal_compact(message_log);
+    }
 
-    struct timespec target;     // Target time for next timeout.
-    struct timespec cur_time;   // Current time.
-    struct timespec diff;       // Difference between current time and target.
+    pthread_exit(0);
+}
 
-    long cur_rate = specs->max_rate;
 
-    // Set first target to current time plus a period.
-    clock_gettime(CLOCK_MONOTONIC, &target);
-    timespec_add(&target, &target, &period_spec);
+/**
+ * Holds a message replayed from write-ahead log for its destination. Limits
+ * of the store are ignored, so nothing logged is lost.
+ */
+void
+_replay_message(message_t *m, uint64_t id, void *arg)
+{
+    hold_queue_put(held_messages, m, id, (struct timespec *) arg, 1);
+}
 
-    while (speed_limiter_run) {
-        // Calculate the difference between current time and target.
-        clock_gettime(CLOCK_MONOTONIC, &cur_time);
-        timespec_subtract(&diff, &target, &cur_time);
 
-        if (diff.tv_sec >= 0 && diff.tv_nsec >= 0) {
-            // Sleep for calculated diff time.
-            int rc = nanosleep(&diff, NULL);
-            if (rc != 0) {
-                perror("Nanosleep not completed properly.\n");
-            }
-        }
+/**
+ * Marks message of given id on write-ahead log as delivered, if it's logged.
+ */
+void
+_log_delivered(uint64_t id)
+{
+    if (message_log && id) wal_mark(message_log, &id, 1);
+}
 
-        cur_rate -= specs->rate_step;
-        if (cur_rate < specs->min_rate) cur_rate = specs->max_rate;
-        message_sending_period.tv_sec = 1 / cur_rate;
-        message_sending_period.tv_nsec = (1000000000 / cur_rate) % 1000000000;
 
-        // Set next target. Everything is integral, so no error accumulation.
-        timespec_add(&target, &target, &period_spec);
+int
+init_thread_attr(pthread_attr_t *attr, uint64_t cpus)
+{
+    int rc = pthread_attr_init(attr);
+    if (rc) {
+        errno = rc;
+        return -1;
+    }
+    if (!cpus) return 0;
+
+    // A CPU the process can't run on would only fail thread creation.
+    cpu_set_t usable;
+    if (sched_getaffinity(0, sizeof(usable), &usable)) rc = errno;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int i = 0; i < 64 && !rc; i++) {
+        if (!(cpus >> i & 1)) continue;
+        if (!CPU_ISSET(i, &usable)) rc = EINVAL;
+        CPU_SET(i, &set);
+    }
+    if (!rc) rc = pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+    if (rc) {
+        pthread_attr_destroy(attr);
+        errno = rc;
+        return -1;
     }
+    return 0;
+}
 
-    pthread_exit(0);
+
+/**
+ * Returns the number of CPUs a thread placed on given CPUs can run on. When
+ * no CPUs are given, it's the CPUs the process can run on.
+ */
+int
+_usable_cpus(uint64_t cpus)
+{
+    if (cpus) return __builtin_popcountll(cpus);
+
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set)) return 1;
+    return CPU_COUNT(&set);
 }
 
 
@@ -830,3 +3934,15 @@ timespec_subtract(struct timespec *res, struct timespec *a, struct timespec *b)
         res->tv_sec = a->tv_sec - b->tv_sec;
     }
 }
+
+
+/**
+ * Returns current time of monotonic clock in nanoseconds.
+ */
+uint64_t
+_monotonic_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
@@ -16,17 +16,29 @@
  *   client_create(int socket_fd)
  *  -void
  *   client_destroy(client_t *client)
+ *  -int
+ *   client_get(client_t *client)
+ *  -void
+ *   client_put(client_t *client)
  *  -void
  *   init_svc()
  *  -void
  *   stop_svc()
  *  -void
+ *   dump_svc_trace()
+ *  -int
+ *   init_thread_attr(pthread_attr_t *attr, uint64_t cpus)
+ *  -void
  *   handle_client(int socket_fd)
+ *  -int
+ *   handle_client_async(int socket_fd)
+ *  -int
+ *   handle_client_pooled(int socket_fd)
  *  -void *
  *   start_sending_unit(void *args)
  *  -void
  *   NACK_message(message_t *m, uint8_t error_code)
- *  -void
+ *  -int
  *   send_message(message_t *m)
  *
  * Version: 0.1
@@ -38,52 +50,251 @@
 
 #include <stdint.h>
 #include <sys/types.h>
+#include <pthread.h>
 #include "message.h"
 #include "linked_list.h"
+#include "event_loop.h"
+#include "spsc_ring.h"
+#include "drr.h"
+#include "token_bucket.h"
+#include "hold_queue.h"
+#include "wal.h"
+#include "group_table.h"
+#include "sock_tuning.h"
+
+
+// Max number of messages that can be sent to a destination by a single
+// syscall (IOV_MAX on Linux).
+#define SEND_BATCH_LIMIT 1024
+// Number of batch size buckets counted by sending unit.
+#define SEND_BATCH_BUCKETS 11
+
+
+struct group_frame;
+
+// A message on the sending buffer of a client, timed until it's written.
+struct out_mark {
+    uint64_t end;       // Offset message ends at, counting every byte ever
+                        // buffered for the client.
+    uint64_t received;  // Monotonic time in ns message was received.
+};
 
 
 typedef struct {
     int socket_fd;                // File descriptor of the connected socket to client.
     uint32_t address;             // IPv4 address of the client.
     uint16_t port;                // Port number of the client to send messages.
-    linked_list_t *out_messages;  // A list with pending messages to be sent.
-    pthread_mutex_t *out_mutex;   // A mutex for out_messages list synchronization.
-    // Condition for signaling removal of out message.
-    pthread_cond_t *out_message_removed;
+    // Pending messages to be sent, one queue per priority class. Receiver of
+    // the client is the only producer and sending unit the only consumer. A
+    // message is released by sending unit only after it has been sent.
+    spsc_ring_t *out_messages[MESSAGE_PRIORITY_CLASSES];
+    // Set while a class of the client is contained in active clients.
+    int scheduled[MESSAGE_PRIORITY_CLASSES];
+    // Next flow on the list of newly scheduled flows, per class.
+    drr_flow_t *scheduled_next[MESSAGE_PRIORITY_CLASSES];
+    // Share of the client on sending unit, per class. Accessed only by
+    // sending unit.
+    drr_flow_t flow[MESSAGE_PRIORITY_CLASSES];
+    // Limits the rate of messages sent to the client, when per destination
+    // rate limiting is enabled. Accessed only by sending unit.
+    token_bucket_t rate_bucket;
     pthread_mutex_t *sock_wr_mutex;  // Mutex for synchronizing socket writing.
+    // ---- Sending state (guarded by sock_wr_mutex) ----
+    char *out;         // Buffer of serialized data to be written to socket.
+    size_t out_off;    // Offset of the first byte not yet written.
+    size_t out_len;    // Number of bytes held in sending buffer.
+    int out_closed;    // Connection closed, so no more data is buffered.
+    uint64_t out_total;  // Bytes ever buffered, so written ones are known.
+    // Messages on sending buffer timed until written, in a circular queue.
+    // Allocated only if latency is tracked.
+    struct out_mark *out_marks;
+    int out_marks_head;
+    int out_marks_size;
+    // Flows of active clients waiting for space in sending buffer, holding a
+    // reference to their clients.
+    linked_list_t *out_waiters;
+    // Copies of NACKs that found sending buffer full, waiting for space, in
+    // a circular queue of CLIENT_NACK_BACKLOG slots.
+    message_t *out_nacks;
+    int out_nacks_head;
+    int out_nacks_size;
+    // Set while messages held for the client, or frames of its groups, wait
+    // for space in sending buffer, holding a reference to the client.
+    int forward_blocked;
+    // Set while messages held for the client, or frames of its groups, are
+    // to be forwarded by sending unit.
+    int forward_scheduled;
+    // Frames of groups pending for the client, in a circular queue. Accessed
+    // only by sending unit. Forwarding is scheduled while any is pending.
+    struct group_frame **group_frames;
+    int group_head;
+    int group_size;
+    // Fan-out that last queued a frame for the client, so a subscriber
+    // matched by many filters of a topic gets the frame once. Accessed only
+    // by sending unit.
+    unsigned long fanout_seq;
+    // Number of references to the client object. Object is destroyed when
+    // the last one is released.
+    int refs;
+    // ---- Receiving state ----
+    char *in;            // Buffer for incoming messages in network order.
+    size_t in_len;       // Number of bytes held in receiving buffer.
+    message_t *mspace;   // Workspace memory for storing outgoing messages.
+    // Next slot of mspace to be used, per class.
+    int mspace_i[MESSAGE_PRIORITY_CLASSES];
+    // Ids of messages in mspace slots on the write-ahead log, if enabled.
+    uint64_t *wal_ids;
+    // Monotonic time in nanoseconds messages in mspace slots were received,
+    // if their latency is tracked.
+    uint64_t *received_ns;
+    uint16_t counter;    // Count of the last successfully received message.
+    uint8_t first_message;  // Flag for first message to ignore counter.
+    // ---- Event loop state (valid only on event loop mode) ----
+    struct Svc_Loop *owner;  // Event loop handling this client.
+    node_t *owner_ref;       // Node of the client in owner's clients list.
+    // Watcher of client's socket. On thread mode, it's used by flush loop.
+    event_watcher_t watcher;
+    int rx_paused;  // Reading paused until sending unit frees an out slot.
+    int closing;    // Connection has been closed.
 } client_t;
 
 
+// Weight of clients matching an endpoint, on sending unit.
+struct client_weight {
+    uint32_t address;  // IPv4 address of clients in host byte order.
+    uint16_t port;     // Port of clients in host byte order, or 0 for any.
+    int weight;        // Share of matching clients, relative to others.
+};
+
 struct svc_cfg {
     int enable_logger;  // Boolean flag for enabling logging.
     char *log_fn;       // Path to logfile (valid only if enable_logger == 1).
-    int enable_speed_limiter;  // Boolean flag for enabling speed limiter.
+    // Period of logger in ms. When 0, a default of 1000 ms is used.
+    long log_interval;
+    // Boolean flag for enabling a global token-bucket limit on the rate of
+    // messages sent. Rate starts at max_rate and is reduced by rate_step
+    // every time_of_step ms. When it drops below min_rate, it starts again
+    // from max_rate. A rate_step or time_of_step of 0 keeps it constant.
+    int enable_speed_limiter;
     long time_of_step;  // Step in ms to reduce message rate by rate_step
     long max_rate;   // Max messagge rate allowed (messages/sec).
     long min_rate;   // Min message rate allowed (messages/sec).
     long rate_step;  // Step of rate reduction (messages/sec).
+    // Max number of messages sent at once by global limiter, after being
+    // idle. When 0, it's the max size of a batch.
+    long rate_burst;
+    // Max rate of messages sent to each destination (messages/sec). When 0,
+    // destinations are not limited.
+    long dest_rate;
+    // Max number of messages sent at once to a destination. When 0, it's
+    // the max size of a batch.
+    long dest_burst;
+    // Time in ms messages for offline destinations are held, waiting for
+    // their destinations to connect again, before being NACKed. When 0,
+    // such messages are NACKed immediately.
+    long hold_ttl;
+    // Max memory in bytes used by held messages. When 0, a default is used.
+    long hold_max_bytes;
+    // Max number of messages held for a destination. When 0, a default is
+    // used.
+    int hold_dest_max;
+    // Directory of write-ahead log of accepted messages, or NULL to disable
+    // it. Messages still undelivered on restart are replayed and held for
+    // their destinations, so holding is implied.
+    char *wal_dir;
+    // Size of segment files of the log. When 0, a default is used.
+    long wal_segment_size;
+    // Number of epoll event loops multiplexing client sockets. When 0,
+    // each client is expected to be handled on its own thread through
+    // handle_client().
+    int event_loops;
+    // Number of pooled workers handling a client each, when event loops are
+    // disabled. Accepted connections are then passed by
+    // handle_client_pooled() and wait while all workers are busy, so it
+    // should be at least the number of clients expected at once. When 0,
+    // each client is expected to be handled on a thread of the caller.
+    int handler_workers;
+    // Stack size in bytes of pooled workers. When 0, the default of the
+    // system is used.
+    long handler_stack_size;
+    // CPUs threads of the service are placed on, as bit masks where bit i
+    // stands for CPU i. Sending unit, threads handling clients (event loops,
+    // pooled workers and the loop flushing their output) and housekeeping
+    // threads (logger, compactor of write-ahead log and metrics exporter)
+    // are placed separately. When 0, threads may run on any CPU.
+    uint64_t sending_cpus;
+    uint64_t handler_cpus;
+    uint64_t housekeeping_cpus;
+    // Number of pending outgoing messages buffered for each client, per
+    // priority class. It is rounded up to a power of 2. When 0, a default
+    // depth is used.
+    int out_queue_depth;
+    // Wire format of messages exchanged with clients. One of the
+    // MESSAGE_FORMAT_* formats defined in message.h.
+    int wire_format;
+    // Max number of pending messages sent to a destination by a single
+    // syscall. When 0, a default is used. It's capped to SEND_BATCH_LIMIT.
+    int send_batch_max;
+    // Max time in microseconds sending unit waits for more messages to fill
+    // a batch. When 0, messages are sent as soon as they are available.
+    long send_batch_delay;
+    // Max time in microseconds sending unit busy-polls for new messages once
+    // idle, before it sleeps until woken. Spinning saves the wake-up of a
+    // sleeping thread on the first message after an idle gap, at the cost
+    // of a CPU kept busy meanwhile. When 0, sending unit sleeps at once.
+    long sending_spin;
+    // Bytes a client with a weight of 1 may send on every round of sending
+    // unit. When 0, it is the size of the largest message.
+    long send_quantum;
+    // Weights of clients, matched when they connect. A client gets a share
+    // of sending unit proportional to its weight. Unmatched clients have a
+    // weight of 1.
+    struct client_weight *weights;
+    int weights_num;
+    // Max number of consecutive batches sending unit may collect without
+    // serving pending messages of the lowest priority class. When exceeded,
+    // lowest class is served first on next batch. When 0, a default is used.
+    int starvation_limit;
+    // Endpoint serving metrics of the service in Prometheus text format,
+    // either a TCP port on local host or a path of a unix socket. When NULL,
+    // metrics are not served.
+    char *metrics_endpoint;
+    // File of the flight recorder, holding the latest events of every
+    // thread, or NULL to disable it. See trace.h.
+    char *trace_path;
+    // Tuning of sockets of clients, applied once accepted. It should match
+    // the tuning of the listener they're accepted on. See sock_tuning.h.
+    struct sock_tuning sock;
 };
 
 
 /**
  * Creates a client object for the client connected to the given socket.
  *
- * Connection should be TCP IPv4 based.
+ * Connection should be either TCP IPv4 based, or a unix socket connection of
+ * a local client, identified by MESSAGE_LOCAL_ADDR and the port in the name
+ * its socket is bound to.
  *
  * Parameters:
  *  -socket_fd : The socket file descriptor of a connected socket to the client.
+ *          On success, socket is owned by the client object and gets closed
+ *          upon its destruction.
  *
  * Returns:
  *  On success, a new and fully initialized client object that can be used for
- *  exchanging messages. Upon failure, it returns NULL.
+ *  exchanging messages, holding a single reference for the caller. Upon
+ *  failure, it returns NULL.
  */
 client_t *
 client_create(int socket_fd);
 
 /**
- * Destroys a given client object, by releasing all its resources.
+ * Destroys a given client object, by closing its socket.
  *
- * A destroyed client object should never be used again.
+ * It is called when the last reference to the client is released, so it
+ * shouldn't normally be called directly. Memory of the object is recycled for
+ * future clients, so lockless lookups never dereference freed memory. Still,
+ * a destroyed client object should never be used again.
  *
  * Parameters:
  *  -client : A client object to destroy.
@@ -91,6 +302,29 @@ client_create(int socket_fd);
 void
 client_destroy(client_t *client);
 
+/**
+ * Acquires a new reference to given client object.
+ *
+ * Parameters:
+ *  -client : Client object to acquire a reference to.
+ *
+ * Returns:
+ *  0 on success. If client has already been destroyed, no reference is
+ *  acquired and a non-zero integer is returned.
+ */
+int
+client_get(client_t *client);
+
+/**
+ * Releases a reference to given client object, destroying it when no other
+ * references exist.
+ *
+ * Parameters:
+ *  -client : Client object to release a reference to.
+ */
+void
+client_put(client_t *client);
+
 /**
 * Initializes messaging service.
 */
@@ -100,6 +334,9 @@ init_svc(struct svc_cfg *options);
 /**
  * Entry point for handling new connections (clients).
  *
+ * It returns when the connection terminates. Socket is closed by the service,
+ * once all pending messages of the client have been handled.
+ *
  * Parameters:
  *  -socket_fd : File descriptor for a connected TCP socket to the client to be
  *          handled.
@@ -107,14 +344,81 @@ init_svc(struct svc_cfg *options);
 void
 handle_client(int socket_fd);
 
+/**
+ * Entry point for new connections when service runs on event loop mode.
+ *
+ * Client is handed over to one of the event loops of the service and the
+ * routine returns immediately. Ownership of the socket passes to the service,
+ * which closes it when the connection terminates.
+ *
+ * Parameters:
+ *  -socket_fd : File descriptor for a connected TCP socket to the client to be
+ *          handled.
+ *
+ * Returns:
+ *  0 on success. On failure a non-zero integer is returned and socket remains
+ *  owned by the caller.
+ */
+int
+handle_client_async(int socket_fd);
+
+/**
+ * Entry point for new connections when service runs a pool of handler
+ * workers.
+ *
+ * Socket is queued for the next free worker, which handles it as
+ * handle_client() does. While the queue is full, routine blocks, so
+ * connections not yet accepted are left to the kernel. Ownership of the
+ * socket passes to the service, which closes it when the connection
+ * terminates.
+ *
+ * Parameters:
+ *  -socket_fd : File descriptor for a connected TCP socket to the client to be
+ *          handled.
+ *
+ * Returns:
+ *  0 on success. On failure a non-zero integer is returned and socket remains
+ *  owned by the caller.
+ */
+int
+handle_client_pooled(int socket_fd);
+
 /**
  * Stops messaging service.
  */
 void
 stop_svc();
 
+/**
+ * Dumps the flight recorder of the service to "<trace_path>.dump", if it's
+ * enabled. It's async-signal-safe, so it can be called from a signal handler.
+ */
+void
+dump_svc_trace();
+
+/**
+ * Initializes given attributes of a thread, placing it on given CPUs.
+ *
+ * Parameters:
+ *  -attr : Attributes to initialize.
+ *  -cpus : Bit mask of CPUs, where bit i stands for CPU i. When 0, thread may
+ *          run on any CPU.
+ *
+ * Returns:
+ *  0 on success. Otherwise -1, with errno set, e.g. to EINVAL when the
+ *  process can't run on any of given CPUs.
+ */
+int
+init_thread_attr(pthread_attr_t *attr, uint64_t cpus);
+
 /**
  * Starts message sending unit.
+ *
+ * On each pass, sending unit takes pending messages from active clients, up
+ * to a batch, and sends all messages with a common destination using a
+ * single syscall. Active clients are served in deficit round-robin order,
+ * so each one gets a share of sent bytes proportional to its weight,
+ * regardless of the size of its messages.
  */
 void *
 start_sending_unit(void *args);
@@ -137,13 +441,22 @@ NACK_message(message_t *m, uint8_t error_code);
 /**
  * Sends message to its recepient.
  *
+ * Message is appended to the output buffer of the recepient and written to
+ * its socket without blocking. Data the socket doesn't accept is written
+ * when the socket becomes writable, so a slow recepient never blocks the
+ * caller.
+ *
  * If recepient of the message is offine, the message is automatically NACked
  * to its sender.
  *
  * Parameters:
  *  -m: Message to be send.
+ *
+ * Returns:
+ *  0 if message was sent or NACKed. A non-zero integer if output buffer of
+ *  the recepient is full, in which case message should be sent again later.
  */
-void
+int
 send_message(message_t *m);
 
 
@@ -0,0 +1,378 @@
+/**
+ * metrics.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * An implementation of routines defined in metrics.h.
+ *
+ * Version: 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "metrics.h"
+
+
+#define CACHE_LINE 64
+#define METRICS_PAGE_LEN 16384     // Max size of the text served.
+#define METRICS_REQUEST_LEN 1024   // Max size of a request read.
+#define METRICS_TIMEOUT_MS 1000    // Max time a scrape may take.
+
+
+struct metrics_shard *
+_metrics_shard(metrics_t *m, int i);
+struct metrics_shard *
+_metrics_acquire_shard(metrics_t *m);
+void
+_metrics_release_shard(void *shard);
+int
+_metrics_listen(metrics_t *m, const char *endpoint);
+void *
+_metrics_exporter_work(void *arg);
+void
+_metrics_respond(metrics_t *m, int fd);
+int
+_metrics_write(int fd, const char *buf, size_t len);
+
+
+metrics_t *
+metrics_create(const struct metric_def *defs, int defs_num)
+{
+    metrics_t *m = (metrics_t *) calloc(1, sizeof(metrics_t));
+    if (!m) return NULL;
+
+    m->defs = defs;
+    m->defs_num = defs_num;
+    m->listen_fd = -1;
+
+    size_t size = sizeof(struct metrics_shard) + sizeof(int64_t) * defs_num;
+    m->shard_size = (size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    m->shards = (char *) aligned_alloc(
+        CACHE_LINE, m->shard_size * (METRICS_SHARDS + 1));
+    if (!m->shards) goto error;
+    memset(m->shards, 0, m->shard_size * (METRICS_SHARDS + 1));
+    _metrics_shard(m, METRICS_SHARDS)->owned = -1;  // Never acquired.
+
+    if (pthread_key_create(&m->key, _metrics_release_shard)) goto error;
+
+    return m;
+
+error:
+    free(m->shards);
+    free(m);
+    return NULL;
+}
+
+
+void
+metrics_destroy(metrics_t *m)
+{
+    if (!m) return;
+
+    if (m->listen_fd >= 0) {
+        // Wakes up exporter blocked on accept().
+        shutdown(m->listen_fd, SHUT_RDWR);
+        pthread_join(m->exporter_tid, NULL);
+        close(m->listen_fd);
+        if (m->unix_path) unlink(m->unix_path);
+    }
+
+    pthread_key_delete(m->key);
+    free(m->unix_path);
+    free(m->page);
+    free(m->shards);
+    free(m);
+}
+
+
+void
+metrics_add(metrics_t *m, int id, int64_t delta)
+{
+    struct metrics_shard *s =
+        (struct metrics_shard *) pthread_getspecific(m->key);
+    if (!s) s = _metrics_acquire_shard(m);
+
+    if (s == _metrics_shard(m, METRICS_SHARDS)) {
+        __atomic_fetch_add(&s->values[id], delta, __ATOMIC_RELAXED);
+    } else {
+        // Only owner writes to its shard, so a plain increment is enough.
+        // It's still atomic, so readers never see a torn value.
+        int64_t v = __atomic_load_n(&s->values[id], __ATOMIC_RELAXED);
+        __atomic_store_n(&s->values[id], v + delta, __ATOMIC_RELAXED);
+    }
+}
+
+
+int64_t
+metrics_value(metrics_t *m, int id)
+{
+    int64_t sum = 0;
+    for (int i = 0; i <= METRICS_SHARDS; i++) {
+        struct metrics_shard *s = _metrics_shard(m, i);
+        sum += __atomic_load_n(&s->values[id], __ATOMIC_RELAXED);
+    }
+    return sum;
+}
+
+
+size_t
+metrics_format(metrics_t *m, char *buf, size_t size)
+{
+    size_t len = 0;
+
+    for (int id = 0; id < m->defs_num; id++) {
+        const struct metric_def *d = m->defs + id;
+        char *out = len < size ? buf + len : NULL;
+        size_t left = len < size ? size - len : 0;
+        int n = 0;
+
+        // Metrics sharing a name are described once.
+        if (!id || strcmp(d->name, m->defs[id - 1].name)) {
+            n = snprintf(out, left, "# HELP %s %s\n# TYPE %s %s\n",
+                         d->name, d->help, d->name,
+                         d->type == METRIC_GAUGE ? "gauge" : "counter");
+            len += n;
+            out = len < size ? buf + len : NULL;
+            left = len < size ? size - len : 0;
+        }
+
+        if (d->labels) {
+            n = snprintf(out, left, "%s{%s} %lld\n", d->name, d->labels,
+                         (long long) metrics_value(m, id));
+        } else {
+            n = snprintf(out, left, "%s %lld\n", d->name,
+                         (long long) metrics_value(m, id));
+        }
+        len += n;
+    }
+
+    if (!m->defs_num && size) buf[0] = '\0';
+    return len;
+}
+
+
+int
+metrics_serve(metrics_t *m, const char *endpoint, const pthread_attr_t *attr)
+{
+    if (m->listen_fd >= 0) return -1;  // Already serving.
+
+    m->page = (char *) malloc(METRICS_PAGE_LEN);
+    if (!m->page) return -1;
+
+    if (_metrics_listen(m, endpoint)) {
+        perror("Failed to listen for metrics scrapes");
+        goto error;
+    }
+
+    if (pthread_create(&m->exporter_tid, attr, _metrics_exporter_work, m)) {
+        perror("Failed to start metrics exporter");
+        goto error;
+    }
+
+    return 0;
+
+error:
+    if (m->listen_fd >= 0) close(m->listen_fd);
+    m->listen_fd = -1;
+    if (m->unix_path) unlink(m->unix_path);
+    free(m->unix_path);
+    m->unix_path = NULL;
+    free(m->page);
+    m->page = NULL;
+    return -1;
+}
+
+
+/**
+ * Returns the shard of given index.
+ */
+struct metrics_shard *
+_metrics_shard(metrics_t *m, int i)
+{
+    return (struct metrics_shard *) (m->shards + i * m->shard_size);
+}
+
+
+/**
+ * Acquires a free shard for calling thread, or the shared one if all are
+ * owned.
+ */
+struct metrics_shard *
+_metrics_acquire_shard(metrics_t *m)
+{
+    struct metrics_shard *s = _metrics_shard(m, METRICS_SHARDS);
+
+    for (int i = 0; i < METRICS_SHARDS; i++) {
+        struct metrics_shard *free_shard = _metrics_shard(m, i);
+        int owned = 0;
+        // Pairs with the release of a previous owner, so its last updates
+        // are visible to the new one.
+        if (__atomic_compare_exchange_n(&free_shard->owned, &owned, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            s = free_shard;
+            break;
+        }
+    }
+
+    pthread_setspecific(m->key, s);
+    return s;
+}
+
+
+/**
+ * Gives back the shard of an exiting thread, unless it's the shared one. Its
+ * values are kept, so the next owner keeps adding to them.
+ */
+void
+_metrics_release_shard(void *shard)
+{
+    struct metrics_shard *s = (struct metrics_shard *) shard;
+    if (s->owned > 0) __atomic_store_n(&s->owned, 0, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Creates the socket exporter listens on, for given endpoint.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int
+_metrics_listen(metrics_t *m, const char *endpoint)
+{
+    char *end;
+    long port = strtol(endpoint, &end, 10);
+    int is_port = *endpoint && !*end && port > 0 && port < 65536;
+
+    if (is_port) {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        m->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (m->listen_fd < 0) return -1;
+        int on = 1;
+        setsockopt(m->listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(m->listen_fd, (struct sockaddr *) &addr, sizeof(addr)))
+            return -1;
+
+    } else {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(endpoint) >= sizeof(addr.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        strcpy(addr.sun_path, endpoint);
+
+        m->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (m->listen_fd < 0) return -1;
+        unlink(endpoint);
+        if (bind(m->listen_fd, (struct sockaddr *) &addr, sizeof(addr)))
+            return -1;
+        m->unix_path = strdup(endpoint);
+        if (!m->unix_path) return -1;
+    }
+
+    return listen(m->listen_fd, 16);
+}
+
+
+/**
+ * Routine of exporter thread, answering scrapes one at a time until the
+ * listening socket is shut down.
+ */
+void *
+_metrics_exporter_work(void *arg)
+{
+    metrics_t *m = (metrics_t *) arg;
+
+    while (1) {
+        int fd = accept(m->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;  // Socket has been shut down.
+        }
+        _metrics_respond(m, fd);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Reads a request from given connection and answers it.
+ */
+void
+_metrics_respond(metrics_t *m, int fd)
+{
+    char request[METRICS_REQUEST_LEN];
+    size_t len = 0;
+    char header[128];
+
+    // A stalled scraper shouldn't hold exporter forever.
+    struct timeval timeout = {
+        METRICS_TIMEOUT_MS / 1000, (METRICS_TIMEOUT_MS % 1000) * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    // Only the request line matters, but the whole header is consumed.
+    while (len < sizeof(request) - 1) {
+        ssize_t n = recv(fd, request + len, sizeof(request) - 1 - len, 0);
+        if (n <= 0) break;
+        len += n;
+        request[len] = '\0';
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) break;
+    }
+    request[len] = '\0';
+
+    if (strncmp(request, "GET ", 4)) {
+        const char *bad = "HTTP/1.0 405 Method Not Allowed\r\n"
+                          "Content-Length: 0\r\n\r\n";
+        _metrics_write(fd, bad, strlen(bad));
+        return;
+    }
+
+    size_t body = metrics_format(m, m->page, METRICS_PAGE_LEN);
+    if (body >= METRICS_PAGE_LEN) body = METRICS_PAGE_LEN - 1;
+    int n = snprintf(header, sizeof(header),
+                     "HTTP/1.0 200 OK\r\n"
+                     "Content-Type: text/plain; version=0.0.4\r\n"
+                     "Content-Length: %zu\r\n\r\n", body);
+    if (!_metrics_write(fd, header, n)) _metrics_write(fd, m->page, body);
+}
+
+
+/**
+ * Writes all given bytes to given socket.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int
+_metrics_write(int fd, const char *buf, size_t len)
+{
+    while (len) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
@@ -0,0 +1,155 @@
+/**
+ * metrics.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header defining a registry of runtime metrics, i.e. counters and gauges,
+ * that can be exported in Prometheus text format.
+ *
+ * Metrics are updated on hot paths by many threads, so every thread updates
+ * its own shard of values, which occupies cache lines of its own. Updates
+ * never share a cache line with another thread, nor use atomic
+ * read-modify-write instructions. Values are only summed over all shards
+ * when read. A gauge is a sum of deltas too, so it may be raised by one
+ * thread and lowered by another.
+ *
+ * A thread gets a shard on its first update and gives it back when it exits,
+ * so a later thread keeps adding to the same sums. Once all shards are
+ * taken, remaining threads share an extra shard, updated atomically.
+ *
+ * Registry can serve its metrics over HTTP, on a TCP port of local host or
+ * on a unix socket, from a thread of its own. Serving only reads shards, so
+ * scraping never blocks threads updating metrics.
+ *
+ * Types defined in metrics.h:
+ *  -metrics_t
+ *  -struct metric_def
+ *
+ * Routines defined in metrics.h:
+ *  -metrics_t *
+ *   metrics_create(const struct metric_def *defs, int defs_num)
+ *  -void
+ *   metrics_destroy(metrics_t *m)
+ *  -void
+ *   metrics_add(metrics_t *m, int id, int64_t delta)
+ *  -int64_t
+ *   metrics_value(metrics_t *m, int id)
+ *  -size_t
+ *   metrics_format(metrics_t *m, char *buf, size_t size)
+ *  -int
+ *   metrics_serve(metrics_t *m, const char *endpoint,
+ *                 const pthread_attr_t *attr)
+ *
+ * Version: 0.1
+ */
+
+#ifndef __metrics_h__
+#define __metrics_h__
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+
+#define METRIC_COUNTER 0  // Value that only increases.
+#define METRIC_GAUGE 1    // Value that goes up and down.
+
+#define METRICS_SHARDS 64  // Shards owned by threads, plus a shared one.
+
+
+struct metric_def {
+    const char *name;    // Name of metric, e.g. "mtl_messages_sent_total".
+    const char *help;    // Description of metric.
+    int type;            // One of METRIC_* types.
+    // Labels of metric, e.g. "code=\"target_down\"", or NULL. Metrics with
+    // the same name and different labels should be defined consecutively.
+    const char *labels;
+};
+
+struct metrics_shard {
+    int owned;           // Set while a thread owns the shard, or -1 if
+                         // it's shared.
+    int64_t values[];    // Value of every metric, as updated by the shard.
+};
+
+typedef struct {
+    const struct metric_def *defs;
+    int defs_num;
+    size_t shard_size;   // Bytes of a shard, a multiple of cache line size.
+    char *shards;        // METRICS_SHARDS + 1 shards, the last one shared.
+    pthread_key_t key;   // Shard owned by each thread.
+    // ---- Exporter ----
+    int listen_fd;       // Socket exporter accepts scrapes on, or -1.
+    char *unix_path;     // Path of unix socket, or NULL if on TCP port.
+    pthread_t exporter_tid;
+    char *page;          // Buffer of the text served, used by exporter.
+} metrics_t;
+
+
+/**
+ * Creates a new registry of given metrics, all starting from 0.
+ *
+ * Parameters:
+ *  -defs : Definitions of metrics, kept by the registry. Metrics are
+ *          identified by their index in this array.
+ *  -defs_num : Number of metrics.
+ *
+ * Returns:
+ *  On success, a new registry. On failure, NULL.
+ */
+metrics_t *
+metrics_create(const struct metric_def *defs, int defs_num);
+
+/**
+ * Stops serving and destroys given registry. Threads shouldn't update it
+ * after it's destroyed.
+ */
+void
+metrics_destroy(metrics_t *m);
+
+/**
+ * Adds given delta to the metric of given id, on the shard of calling
+ * thread.
+ */
+void
+metrics_add(metrics_t *m, int id, int64_t delta);
+
+/**
+ * Returns the current value of the metric of given id, i.e. the sum of its
+ * values over all shards.
+ */
+int64_t
+metrics_value(metrics_t *m, int id);
+
+/**
+ * Writes all metrics in Prometheus text exposition format to given buffer,
+ * null-terminated.
+ *
+ * Returns:
+ *  The number of characters written, or that would have been written if
+ *  buffer was large enough, as by snprintf().
+ */
+size_t
+metrics_format(metrics_t *m, char *buf, size_t size);
+
+/**
+ * Starts serving metrics over HTTP, on given endpoint. Any GET request is
+ * answered with all metrics.
+ *
+ * Parameters:
+ *  -endpoint : Either a TCP port, bound on local host, or a path of a unix
+ *          socket, which is replaced if it exists.
+ *  -attr : Attributes of the thread answering requests, or NULL for the
+ *          default ones.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int
+metrics_serve(metrics_t *m, const char *endpoint, const pthread_attr_t *attr);
+
+
+#endif
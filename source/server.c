@@ -18,8 +18,135 @@
  * it doesn't drop below <min_rate>. When <min_rate> is exceeded, then MTL
  * jumps back at <max_rate> and starts decreasing it again.
  *
- * Usage: ./exec_name <port> [<log_file> [<min_rate> <step> <max_rate> <period>]]
+ * Clients are handled either by a dedicated thread each (default), or by a
+ * fixed set of epoll event loops when -e option is provided. Instead of a new
+ * thread per connection, a fixed pool of handler threads can be spawned
+ * upfront by -p option, reused across connections. Stack size of handler
+ * threads can be set by -S option.
+ *
+ * Threads can be placed on sets of CPUs by -c option, which may be repeated,
+ * separately for the sending unit, the threads handling clients, i.e. event
+ * loops or handler threads, and housekeeping threads of MTL. Threads are
+ * created on their CPUs by pthread_attr_setaffinity_np(). Acceptors are not
+ * placed.
+ *
+ * Connections are accepted by a single thread, unless more acceptors are
+ * requested by -a option. Every acceptor then listens on a socket of its own,
+ * bound to the same port by SO_REUSEPORT, so the kernel spreads incoming
+ * connections over them. Length of queue of pending connections of every
+ * socket can be set by -L option, so bursts of reconnecting clients are not
+ * dropped.
+ *
+ * Sockets are tuned by the profile given by -o option, applied to listeners
+ * and to accepted sockets: "latency" sends small messages at once, instead
+ * of letting Nagle's algorithm wait for delayed acks, while "bulk" coalesces
+ * them and enlarges socket buffers. By default, kernel defaults are kept.
+ *
+ * Clients on the same host can also connect through a unix socket, at the
+ * path given by -u option, skipping the TCP/IP stack. It's served by an
+ * acceptor of its own. Such clients are identified by MESSAGE_LOCAL_ADDR and
+ * the port in the abstract name they bind their socket to, so they exchange
+ * messages with TCP clients as usual.
+ *
+ * Messages are exchanged as variable-length frames, carrying only the used
+ * bytes of data. Legacy fixed-size messages can be selected by -l option, for
+ * clients that don't support framing.
+ *
+ * Sending unit sends pending messages in batches, using a single syscall for
+ * all messages of a batch with a common destination. Size of batches and the
+ * time spent waiting for a batch to fill can be capped by -b and -d options.
+ * Once idle, sending unit sleeps until new messages arrive, unless -s option
+ * is given. Then it busy-polls for up to spin_us first, trading CPU time for
+ * the latency of waking up.
+ *
+ * Sending unit shares bandwidth among clients by deficit round-robin over the
+ * bytes they send. Clients get equal shares, unless a weight is assigned to
+ * their endpoint by -w option, which may be repeated.
+ *
+ * Rate of messages sent can be limited by token buckets, globally by -r
+ * option and per destination by -R option.
+ *
+ * Messages for offline destinations are NACKed, unless -t option is given.
+ * Then they're held for up to hold_ttl and forwarded in order once their
+ * destinations connect again.
+ *
+ * Accepted messages can be logged to a write-ahead log by -j option, so
+ * messages still undelivered survive a restart. They're replayed on startup
+ * and held for their destinations.
+ *
+ * When log_file is given, a binary record is logged every second, or every
+ * log_interval ms given by -i option. It can be converted to text by
+ * log_convert.
+ *
+ * Metrics of the server can be scraped in Prometheus text format, from the
+ * TCP port on local host or the unix socket given by -M option.
+ *
+ * The latest events of every message, e.g. received, queued, sent or NACKed,
+ * are kept on the flight recorder file given by -T option, which survives a
+ * crash. It's dumped to <trace_file>.dump on SIGUSR1, and converted to
+ * Chrome trace JSON by trace_decode.
+ *
+ * Usage: ./exec_name [-e <event_loops>] [-q <queue_depth>] [-l]
+ *                    [-b <batch_max>] [-d <batch_delay>] [-s <spin_us>]
+ *                    [-w <ip>[:<port>]=<weight> ...]
+ *                    [-r <rate>[:<burst>]] [-R <rate>[:<burst>]]
+ *                    [-t <hold_ttl>] [-m <hold_mem>] [-j <wal_dir>]
+ *                    [-M <metrics_port>|<metrics_path>] [-i <log_interval>]
+ *                    [-T <trace_file>] [-a <acceptors>] [-L <backlog>]
+ *                    [-p <handler_workers>] [-S <stack_kb>]
+ *                    [-c <threads>=<cpus> ...] [-o <socket_profile>]
+ *                    [-u <unix_path>] <port>
+ *                    [<log_file> [<min_rate> <step> <max_rate> <period>]]
  *  where:
+ *      -event_loops [optional] : Number of event loop threads that multiplex
+ *              all client sockets. When omitted, a thread is spawned for
+ *              every client.
+ *      -queue_depth [optional] : Number of pending outgoing messages buffered
+ *              for each client. Rounded up to a power of 2.
+ *      -l [optional] : Use legacy fixed-size wire format.
+ *      -batch_max [optional] : Max number of messages sent to a destination
+ *              by a single syscall (default 32). 1 disables batching.
+ *      -batch_delay [optional] : Max time in microseconds a batch waits for
+ *              more messages before being sent (default 0).
+ *      -spin_us [optional] : Max time in microseconds idle sending unit
+ *              busy-polls for new messages, before sleeping (default 0).
+ *      -ip:port=weight [optional] : Share of bandwidth given to clients
+ *              connecting from ip (and port, if given), relative to the
+ *              default weight of 1.
+ *      -rate:burst [optional, -r] : Max rate of all messages sent, in
+ *              messages/sec, and max number of messages sent at once after
+ *              being idle (default batch_max).
+ *      -rate:burst [optional, -R] : Max rate of messages sent to each
+ *              destination and its burst, as above.
+ *      -hold_ttl [optional] : Time in milliseconds messages for offline
+ *              destinations are held, before being NACKed.
+ *      -hold_mem [optional, requires hold_ttl] : Max memory in KB used by
+ *              held messages (default 16384).
+ *      -wal_dir [optional] : Directory of write-ahead log of accepted
+ *              messages. Implies holding, for 60000 ms unless -t is given.
+ *      -metrics_port|metrics_path [optional] : TCP port on local host, or
+ *              path of a unix socket, where metrics are served over HTTP.
+ *      -log_interval [optional, requires log_file] : Period of logger in
+ *              milliseconds (default 1000).
+ *      -trace_file [optional] : File of flight recorder. A recording left by
+ *              a previous run is kept as <trace_file>.prev.
+ *      -acceptors [optional] : Number of threads accepting connections
+ *              (default 1).
+ *      -backlog [optional] : Max number of connections pending on each
+ *              listening socket (default 1024), capped by the kernel to
+ *              net.core.somaxconn.
+ *      -handler_workers [optional, not with -e] : Number of pooled threads
+ *              handling a client each. Connections beyond it wait until a
+ *              client disconnects.
+ *      -stack_kb [optional, not with -e] : Stack size of handler threads
+ *              in KB.
+ *      -threads=cpus [optional] : CPUs, as a list of numbers and ranges,
+ *              e.g. 0,2-3, that threads are placed on. Threads are either
+ *              "sender", "handlers" or "housekeeping".
+ *      -socket_profile [optional] : Tuning of sockets, either "default",
+ *              "latency" or "bulk" (default "default").
+ *      -unix_path [optional] : Path of a unix socket local clients connect
+ *              to, besides the TCP port.
  *      -port : Port to be used by server.
  *      -log_file [optional] : Path to a file that will be used for log data.
  *      -min_rate [optional, requires log_file] : Minimum sending rate of MTL.
@@ -27,17 +154,26 @@
  *              rate of MTL.
  *      -max_rate [optional, requires step] : Max sending rate of MTL.
  *      -period : Period of rate limiter in milliseconds (ms) to reduce rate
- *              by <step>.
+ *              by <step>. Burst is set by -r option.
  */
 
+#define _GNU_SOURCE  // accept4()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
 #include <unistd.h>
 #include <signal.h>
+#include <getopt.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <pthread.h>
 #include "linked_list.h"
 #include "message_svc.h"
@@ -55,29 +191,214 @@ typedef struct {
 } handler_t;
 
 
-int init_listener(int port);
+int init_listener(int port, int reuse_port, const struct sock_tuning *t);
+int init_unix_listener(const char *path, const struct sock_tuning *t);
 void start_listener(int socket_fd);
+void *start_acceptor(void *args);
+void stop_listener(int socket_fd);
 void destroy_listener(int socket_fd);
-void create_handler(int client_fd, struct sockaddr_in client_addr);
+int create_handler(int client_fd, struct sockaddr_in client_addr);
 void *start_handler(void *args);
 void error(const char *msg);
+void usage(const char *exec_name);
+int parse_weight(const char *arg, struct client_weight *w);
+int parse_rate(const char *arg, long *rate, long *burst);
+int parse_placement(const char *arg, struct svc_cfg *options);
+int parse_cpus(const char *arg, uint64_t *cpus);
 void terminate_server(int signum);
+void dump_trace(int signum);
 
 
 const int TERM_SIGNAL = SIGINT;  // Signal for requesting server termination.
+const int DUMP_SIGNAL = SIGUSR1;  // Signal for dumping flight recorder.
+const int BACKLOG_DEFAULT = 1024;  // Default length of queue of connections.
+const int ACCEPT_RETRY_US = 10000;  // Pause of acceptor out of descriptors.
 
 linked_list_t *handler_fds;   // Storage for info of active handlers.
-int listener_fd;              // Socket descriptor of listener.
+int *listener_fds;            // Socket descriptors of listeners.
+int listeners_num;            // Number of listeners, one per acceptor.
+char *unix_path;              // Path of unix socket listener, if any.
+int backlog;                  // Length of queue of each listener.
 pthread_mutex_t *list_mutex;  // A mutex used for list operations.
 pthread_cond_t *list_size_cond;  // Condition to be used for tracking handlers num.
+int event_loop_mode;          // Clients are handled by MTL event loops.
+int pool_mode;                // Clients are handled by a pool of MTL.
+long handler_stack_size;      // Stack size of handlers, or 0 for default.
+uint64_t handler_cpus;        // CPUs of handlers, or 0 for any.
 
 
 int main(int argc, char *argv[])
 {
+    struct svc_cfg options;
+    memset(&options, 0, sizeof(options));
+    char *exec_name = argv[0];
+
+    // Parse optional flags. Positional args follow them.
+    int opt;
+    while ((opt = getopt(argc, argv, "e:q:lb:d:s:w:r:R:t:m:j:M:i:T:a:L:p:S:c:o:u:")) != -1) {
+        switch (opt) {
+        case 'e':
+            options.event_loops = atoi(optarg);
+            if (options.event_loops < 1) {
+                fprintf(stderr, "ERROR: Invalid number of event loops.\n");
+                exit(1);
+            }
+            break;
+        case 'q':
+            options.out_queue_depth = atoi(optarg);
+            if (options.out_queue_depth < 1) {
+                fprintf(stderr, "ERROR: Invalid queue depth.\n");
+                exit(1);
+            }
+            break;
+        case 'l':
+            options.wire_format = MESSAGE_FORMAT_LEGACY;
+            break;
+        case 'b':
+            options.send_batch_max = atoi(optarg);
+            if (options.send_batch_max < 1 ||
+                options.send_batch_max > SEND_BATCH_LIMIT) {
+                fprintf(stderr, "ERROR: Batch size should be in [1, %d].\n",
+                        SEND_BATCH_LIMIT);
+                exit(1);
+            }
+            break;
+        case 'd':
+            options.send_batch_delay = atol(optarg);
+            if (options.send_batch_delay < 0) {
+                fprintf(stderr, "ERROR: Invalid batch delay.\n");
+                exit(1);
+            }
+            break;
+        case 's':
+            options.sending_spin = atol(optarg);
+            if (options.sending_spin < 0) {
+                fprintf(stderr, "ERROR: Invalid spin time.\n");
+                exit(1);
+            }
+            break;
+        case 'w': {
+            struct client_weight *weights = (struct client_weight *) realloc(
+                options.weights,
+                (options.weights_num + 1) * sizeof(struct client_weight));
+            if (!weights) error("ERROR: Failed to store client weights");
+            options.weights = weights;
+            if (parse_weight(optarg, &options.weights[options.weights_num])) {
+                fprintf(stderr, "ERROR: Invalid client weight %s.\n", optarg);
+                exit(1);
+            }
+            options.weights_num++;
+            break;
+        }
+        case 'c':
+            if (parse_placement(optarg, &options)) {
+                fprintf(stderr, "ERROR: Invalid placement of threads %s.\n",
+                        optarg);
+                exit(1);
+            }
+            break;
+        case 'o':
+            if (sock_tuning_profile(&options.sock, optarg)) {
+                fprintf(stderr, "ERROR: Invalid socket profile %s.\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'u':
+            unix_path = optarg;
+            break;
+        case 'r':
+            if (parse_rate(optarg, &options.max_rate, &options.rate_burst)) {
+                fprintf(stderr, "ERROR: Invalid rate %s.\n", optarg);
+                exit(1);
+            }
+            options.min_rate = options.max_rate;
+            options.enable_speed_limiter = 1;
+            break;
+        case 'R':
+            if (parse_rate(optarg, &options.dest_rate, &options.dest_burst)) {
+                fprintf(stderr, "ERROR: Invalid rate %s.\n", optarg);
+                exit(1);
+            }
+            break;
+        case 't':
+            options.hold_ttl = atol(optarg);
+            if (options.hold_ttl < 1) {
+                fprintf(stderr, "ERROR: Hold TTL should be positive.\n");
+                exit(1);
+            }
+            break;
+        case 'm':
+            options.hold_max_bytes = atol(optarg) * 1024;
+            if (options.hold_max_bytes < 1) {
+                fprintf(stderr, "ERROR: Hold memory should be positive.\n");
+                exit(1);
+            }
+            break;
+        case 'j':
+            options.wal_dir = optarg;
+            break;
+        case 'M':
+            options.metrics_endpoint = optarg;
+            break;
+        case 'i':
+            options.log_interval = atol(optarg);
+            if (options.log_interval < 1) {
+                fprintf(stderr, "ERROR: Log interval should be positive.\n");
+                exit(1);
+            }
+            break;
+        case 'T':
+            options.trace_path = optarg;
+            break;
+        case 'a':
+            listeners_num = atoi(optarg);
+            if (listeners_num < 1) {
+                fprintf(stderr, "ERROR: Invalid number of acceptors.\n");
+                exit(1);
+            }
+            break;
+        case 'L':
+            backlog = atoi(optarg);
+            if (backlog < 1) {
+                fprintf(stderr, "ERROR: Backlog should be positive.\n");
+                exit(1);
+            }
+            break;
+        case 'p':
+            options.handler_workers = atoi(optarg);
+            if (options.handler_workers < 1) {
+                fprintf(stderr, "ERROR: Invalid number of handler workers.\n");
+                exit(1);
+            }
+            break;
+        case 'S':
+            handler_stack_size = atol(optarg) * 1024;
+            if (handler_stack_size < PTHREAD_STACK_MIN) {
+                fprintf(stderr, "ERROR: Stack size should be at least %ld KB.\n",
+                        (long) PTHREAD_STACK_MIN / 1024);
+                exit(1);
+            }
+            break;
+        default:
+            usage(exec_name);
+            exit(1);
+        }
+    }
+    event_loop_mode = options.event_loops > 0;
+    pool_mode = options.handler_workers > 0;
+    if (event_loop_mode && (pool_mode || handler_stack_size)) {
+        fprintf(stderr, "ERROR: Handler threads are not used by event loops.\n");
+        exit(1);
+    }
+    options.handler_stack_size = handler_stack_size;
+    handler_cpus = options.handler_cpus;
+    argc -= optind - 1;
+    argv += optind - 1;
+
     // Listening port should be provided by caller.
     if (argc < 2) {
         fprintf(stderr, "ERROR: No listening port provided.\n");
-        fprintf(stdout, "Usage: %s <port> [<log_file>]\n", argv[0]);
+        usage(exec_name);
         exit(1);
     }
 
@@ -88,12 +409,20 @@ int main(int argc, char *argv[])
 	list_size_cond = (pthread_cond_t *) malloc(sizeof(pthread_cond_t));
 	pthread_cond_init(list_size_cond, NULL);
 
+    // Every acceptor has a listener of its own on the same port. Unix socket
+    // gets one more acceptor.
     int port = atoi(argv[1]); // Listening port.
-    listener_fd = init_listener(port);
+    if (!listeners_num) listeners_num = 1;
+    if (!backlog) backlog = BACKLOG_DEFAULT;
+    listener_fds = (int *) malloc(sizeof(int) * (listeners_num + 1));
+    if (!listener_fds) error("ERROR: Failed to allocate listeners");
+    for (int i = 0; i < listeners_num; i++)
+        listener_fds[i] = init_listener(port, listeners_num > 1, &options.sock);
+    if (unix_path)
+        listener_fds[listeners_num++] = init_unix_listener(unix_path,
+                                                           &options.sock);
 
     // Init Message Transport Layer service.
-    struct svc_cfg options;
-    memset(&options, 0, sizeof(options));
     if (argc > 2) {
         options.enable_logger = 1;
         options.log_fn = argv[2];
@@ -107,15 +436,39 @@ int main(int argc, char *argv[])
         }
     }
     init_svc(&options);
+    free(options.weights);  // Service keeps its own copy.
 
     struct sigaction act;
     memset(&act, 0, sizeof(act));
     act.sa_handler = terminate_server;
     sigaction(TERM_SIGNAL, &act, NULL);
+    if (options.trace_path) {
+        act.sa_handler = dump_trace;
+        act.sa_flags = SA_RESTART;  // Server keeps running undisturbed.
+        sigaction(DUMP_SIGNAL, &act, NULL);
+    }
     printf("Use CTRL+C to terminate.\n");
 
-    // Use current thread for the listener.
-    start_listener(listener_fd);
+    // Use current thread for the first listener, and a new one for each of
+    // the rest.
+    pthread_t *acceptor_tids = NULL;
+    if (listeners_num > 1) {
+        acceptor_tids = (pthread_t *) malloc(
+            sizeof(pthread_t) * (listeners_num - 1));
+        if (!acceptor_tids) error("ERROR: Failed to allocate acceptors");
+    }
+    for (int i = 1; i < listeners_num; i++) {
+        if (pthread_create(acceptor_tids + i - 1, NULL, start_acceptor,
+                           listener_fds + i))
+            error("ERROR: Failed to start acceptor");
+    }
+    start_listener(listener_fds[0]);
+    for (int i = 1; i < listeners_num; i++)
+        pthread_join(acceptor_tids[i - 1], NULL);
+    free(acceptor_tids);
+    for (int i = 0; i < listeners_num; i++) destroy_listener(listener_fds[i]);
+    free(listener_fds);
+    if (unix_path) unlink(unix_path);
 
     printf("\nServer terminating...\n");
 
@@ -159,6 +512,146 @@ void error(const char *msg)
     exit(1);
 }
 
+/**
+ * Prints usage instructions of the server.
+ */
+void usage(const char *exec_name)
+{
+    fprintf(stdout,
+            "Usage: %s [-e <event_loops>] [-q <queue_depth>] [-l] "
+            "[-b <batch_max>] [-d <batch_delay>] [-s <spin_us>] "
+            "[-w <ip>[:<port>]=<weight> ...] "
+            "[-r <rate>[:<burst>]] [-R <rate>[:<burst>]] "
+            "[-t <hold_ttl>] [-m <hold_mem>] [-j <wal_dir>] "
+            "[-M <metrics_port>|<metrics_path>] [-i <log_interval>] "
+            "[-T <trace_file>] [-a <acceptors>] [-L <backlog>] "
+            "[-p <handler_workers>] [-S <stack_kb>] "
+            "[-c <threads>=<cpus> ...] [-o <socket_profile>] "
+            "[-u <unix_path>] <port> "
+            "[<log_file> [<min_rate> <step> <max_rate> <period>]]\n",
+            exec_name);
+}
+
+/**
+ * Parses a client weight given as ip[:port]=weight.
+ *
+ * Parameters:
+ *  -arg : String to be parsed.
+ *  -w : Storage for parsed weight.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int parse_weight(const char *arg, struct client_weight *w)
+{
+    char ip[INET_ADDRSTRLEN];
+    const char *eq = strchr(arg, '=');
+    if (!eq) return -1;
+
+    const char *colon = memchr(arg, ':', eq - arg);
+    const char *ip_end = colon ? colon : eq;
+    if (ip_end - arg >= INET_ADDRSTRLEN) return -1;
+    memcpy(ip, arg, ip_end - arg);
+    ip[ip_end - arg] = '\0';
+
+    struct in_addr addr;
+    if (inet_pton(AF_INET, ip, &addr) != 1) return -1;
+    w->address = ntohl(addr.s_addr);
+
+    w->port = 0;
+    if (colon) {
+        int port = atoi(colon + 1);
+        if (port < 1 || port > 65535) return -1;
+        w->port = (uint16_t) port;
+    }
+
+    w->weight = atoi(eq + 1);
+    return w->weight < 1 ? -1 : 0;
+}
+
+/**
+ * Parses a rate limit given as rate[:burst].
+ *
+ * Parameters:
+ *  -arg : String to be parsed.
+ *  -rate : Storage for parsed rate.
+ *  -burst : Storage for parsed burst, or 0 when not given.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int parse_rate(const char *arg, long *rate, long *burst)
+{
+    char *end;
+
+    *rate = strtol(arg, &end, 10);
+    *burst = 0;
+    if (*end == ':') *burst = strtol(end + 1, &end, 10);
+
+    return *end || *rate < 1 || *burst < 0 ? -1 : 0;
+}
+
+/**
+ * Parses a placement of threads given as threads=cpus, where threads is
+ * either sender, handlers or housekeeping.
+ *
+ * Parameters:
+ *  -arg : String to be parsed.
+ *  -options : Configuration where parsed CPUs are stored.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int parse_placement(const char *arg, struct svc_cfg *options)
+{
+    const char *eq = strchr(arg, '=');
+    if (!eq) return -1;
+
+    size_t len = eq - arg;
+    uint64_t *cpus;
+    if (len == 6 && !strncmp(arg, "sender", len))
+        cpus = &options->sending_cpus;
+    else if (len == 8 && !strncmp(arg, "handlers", len))
+        cpus = &options->handler_cpus;
+    else if (len == 12 && !strncmp(arg, "housekeeping", len))
+        cpus = &options->housekeeping_cpus;
+    else return -1;
+
+    return parse_cpus(eq + 1, cpus);
+}
+
+/**
+ * Parses a list of CPUs and ranges of them, e.g. 0,2-3, to a bit mask.
+ *
+ * Parameters:
+ *  -arg : String to be parsed.
+ *  -cpus : Storage for parsed mask, where bit i stands for CPU i.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int parse_cpus(const char *arg, uint64_t *cpus)
+{
+    char *end;
+
+    *cpus = 0;
+    do {
+        long first = strtol(arg, &end, 10);
+        long last = first;
+        if (end == arg) return -1;
+        if (*end == '-') {
+            arg = end + 1;
+            last = strtol(arg, &end, 10);
+            if (end == arg) return -1;
+        }
+        if (first < 0 || last < first || last > 63) return -1;
+        for (long i = first; i <= last; i++) *cpus |= (uint64_t) 1 << i;
+        arg = end + 1;
+    } while (*end == ',');
+
+    return *end ? -1 : 0;
+}
+
 /**
  * Ask server to terminate normally completing any critical unhandled task.
  *
@@ -166,13 +659,26 @@ void error(const char *msg)
  */
 void terminate_server(int signum)
 {
-    if (signum == TERM_SIGNAL) destroy_listener(listener_fd);
+    if (signum != TERM_SIGNAL) return;
+    for (int i = 0; i < listeners_num; i++) stop_listener(listener_fds[i]);
+}
+
+/**
+ * Dumps flight recorder of MTL, without stopping it.
+ *
+ * This is a signal handler, that should be connected to DUMP_SIGNAL.
+ */
+void dump_trace(int signum)
+{
+    if (signum == DUMP_SIGNAL) dump_svc_trace();
 }
 
 /**
- * Initialize a listener on the given port.
+ * Initialize a listener on the given port. When reuse_port is set, many
+ * listeners can be bound to the same port. Listener is tuned by given
+ * tuning, so accepted sockets start with its buffers.
  */
-int init_listener(int port)
+int init_listener(int port, int reuse_port, const struct sock_tuning *t)
 {
     int socket_fd;                 // Listener's file descriptor.
     struct sockaddr_in serv_addr;  // Server's local address.
@@ -180,6 +686,12 @@ int init_listener(int port)
     socket_fd = socket(AF_INET, SOCK_STREAM, 0);  // IPv4 TCP socket.
     if (socket_fd < 0) error("ERROR: Opening of socket failed");
 
+    int one = 1;
+    if (reuse_port &&
+        setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)))
+        error("ERROR: Failed to share listening port");
+    if (sock_tuning_apply(socket_fd, t)) error("ERROR: Failed to tune socket");
+
     // Create a sockaddr object with local IP and listening port.
     memset((void *) &serv_addr, 0, sizeof(serv_addr));
     serv_addr.sin_family = AF_INET;
@@ -195,27 +707,112 @@ int init_listener(int port)
 }
 
 /**
- * Converts current thread into a listener on given socket.
+ * Initialize a listener on a unix socket at the given path, replacing any
+ * socket left there by a previous run. Server fails if anything other than
+ * a socket exists at that path, so it never deletes a file given by
+ * mistake. Only buffer sizes of given tuning apply to it.
+ */
+int init_unix_listener(const char *path, const struct sock_tuning *t)
+{
+    int socket_fd;                 // Listener's file descriptor.
+    struct sockaddr_un serv_addr;  // Server's local address.
+
+    if (strlen(path) >= sizeof(serv_addr.sun_path)) {
+        fprintf(stderr, "ERROR: Path of unix socket is too long.\n");
+        exit(1);
+    }
+
+    socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socket_fd < 0) error("ERROR: Opening of unix socket failed");
+
+    struct sock_tuning local = *t;
+    sock_tuning_local(&local);
+    if (sock_tuning_apply(socket_fd, &local))
+        error("ERROR: Failed to tune socket");
+
+    memset((void *) &serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sun_family = AF_UNIX;
+    strcpy(serv_addr.sun_path, path);
+
+    struct stat st;
+    if (!lstat(path, &st)) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "ERROR: %s exists and is not a unix socket.\n",
+                    path);
+            exit(1);
+        }
+        if (unlink(path)) error("ERROR: Failed to remove stale unix socket");
+    } else if (errno != ENOENT) {
+        error("ERROR: Failed to check path of unix socket");
+    }
+
+    if (bind(socket_fd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
+        error("ERROR: Binding of unix socket failed");
+    }
+
+    return socket_fd;
+}
+
+/**
+ * Converts current thread into a listener on given socket, until the
+ * listener is stopped.
  */
 void start_listener(int socket_fd)
 {
-    int rc = listen(socket_fd, 8);  // Mark socket as listener.
+    int rc = listen(socket_fd, backlog);  // Mark socket as listener.
     if (rc < 0) error("ERROR: Failed to listen on given socket");
 
     int in_fd;  // File descriptor for incoming connection.
     struct sockaddr_in client_addr;  // Address object of the client.
-    socklen_t sock_size = sizeof(client_addr);
+    socklen_t sock_size;
+
+    // Sockets of event loops are only used without blocking, so they're
+    // created non-blocking, without another syscall.
+    int flags = SOCK_CLOEXEC | (event_loop_mode ? SOCK_NONBLOCK : 0);
+
+    while (1) {
+        sock_size = sizeof(client_addr);
+        in_fd = accept4(socket_fd, (struct sockaddr *) &client_addr,
+                        &sock_size, flags);
+        if (in_fd < 0) {
+            if (errno == EINVAL || errno == EBADF) break;  // Stopped.
+            if (errno == EMFILE || errno == ENFILE) {
+                // Pending connections wait until clients disconnect.
+                perror("ERROR: Failed to accept connection");
+                usleep(ACCEPT_RETRY_US);
+            }
+            continue;  // Otherwise, connection was aborted or interrupted.
+        }
 
-    while ((in_fd = accept(socket_fd,
-                           (struct sockaddr *) &client_addr,
-                           &sock_size)) > -1)
-    {
-        create_handler(in_fd, client_addr);
+        if (event_loop_mode) {
+            if (handle_client_async(in_fd)) close(in_fd);
+        } else if (pool_mode) {
+            if (handle_client_pooled(in_fd)) close(in_fd);
+        } else if (create_handler(in_fd, client_addr)) close(in_fd);
     }
 }
 
 /**
- * Properly terminates a listener on the given socket.
+ * Entry point for the thread of an additional acceptor, listening on the
+ * socket pointed by args.
+ */
+void *start_acceptor(void *args)
+{
+    start_listener(*(int *) args);
+    return NULL;
+}
+
+/**
+ * Stops the listener on the given socket. Acceptor blocked on it returns
+ * from start_listener(). It's async-signal-safe.
+ */
+void stop_listener(int socket_fd)
+{
+    shutdown(socket_fd, SHUT_RDWR);
+}
+
+/**
+ * Properly terminates a listener on the given socket, once stopped.
  */
 void destroy_listener(int socket_fd)
 {
@@ -224,17 +821,25 @@ void destroy_listener(int socket_fd)
 
 /**
  * Create a handler on a new thread for the given client connection.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer, in which case connection
+ *  remains owned by the caller.
  */
-void create_handler(int client_fd, struct sockaddr_in client_addr)
+int create_handler(int client_fd, struct sockaddr_in client_addr)
 {
-    handler_args_t *args = (handler_args_t *) malloc(sizeof(handler_args_t));
-    args->socket_fd = client_fd;
-    args->addr = client_addr;
-
     // New thread should be detached, since it's not gonna be joined.
     pthread_attr_t attr;
-    pthread_attr_init(&attr);
+    if (init_thread_attr(&attr, handler_cpus)) {
+        perror("ERROR: Failed to place handler");
+        return -1;
+    }
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (handler_stack_size) pthread_attr_setstacksize(&attr, handler_stack_size);
+
+    handler_args_t *args = (handler_args_t *) malloc(sizeof(handler_args_t));
+    args->socket_fd = client_fd;
+    args->addr = client_addr;
 
 	pthread_mutex_lock(list_mutex);
 
@@ -247,15 +852,27 @@ void create_handler(int client_fd, struct sockaddr_in client_addr)
 
 	// Create new handler thread.
     pthread_t tid;
-    pthread_create(&tid, &attr, start_handler, (void *) args);
-
-	// Actually fill the handler object with tid value.
-    handler->tid = tid;
-    handler->fd = client_fd;
+    int rc = pthread_create(&tid, &attr, start_handler, (void *) args);
+    if (rc) {
+        linked_list_remove(handler_fds, node);
+        free(handler);
+        free(args);
+    } else {
+        // Actually fill the handler object with tid value.
+        handler->tid = tid;
+        handler->fd = client_fd;
+    }
 
 	pthread_mutex_unlock(list_mutex);
 
     pthread_attr_destroy(&attr);
+
+    if (rc) {
+        errno = rc;
+        perror("ERROR: Failed to create handler");
+        return -1;
+    }
+    return 0;
 }
 
 /**
@@ -276,9 +893,6 @@ void *start_handler(void *args)
 	pthread_cond_signal(list_size_cond);
 	pthread_mutex_unlock(list_mutex);
 
-    // Finally, close the connection to the client.
-    close(h_args->socket_fd);
-
     // Free local resources.
     free(args);
 
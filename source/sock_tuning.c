@@ -0,0 +1,66 @@
+/**
+ * sock_tuning.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * An implementation of routines defined in sock_tuning.h.
+ *
+ * Version: 0.1
+ */
+
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "sock_tuning.h"
+
+
+int
+sock_tuning_profile(struct sock_tuning *t, const char *profile)
+{
+    memset(t, 0, sizeof(struct sock_tuning));
+
+    if (!strcmp(profile, "default")) return 0;
+    if (!strcmp(profile, "latency")) {
+        t->nodelay = 1;
+        t->quickack = 1;
+        return 0;
+    }
+    if (!strcmp(profile, "bulk")) {
+        t->sndbuf = SOCK_BULK_BUF_SIZE;
+        t->rcvbuf = SOCK_BULK_BUF_SIZE;
+        return 0;
+    }
+    return -1;
+}
+
+
+int
+sock_tuning_apply(int fd, const struct sock_tuning *t)
+{
+    int one = 1;
+    int rc = 0;
+
+    if (t->nodelay)
+        rc |= setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (t->quickack)
+        rc |= setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+    if (t->sndbuf)
+        rc |= setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &t->sndbuf,
+                         sizeof(t->sndbuf));
+    if (t->rcvbuf)
+        rc |= setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &t->rcvbuf,
+                         sizeof(t->rcvbuf));
+
+    return rc;
+}
+
+
+void
+sock_tuning_local(struct sock_tuning *t)
+{
+    t->nodelay = 0;
+    t->quickack = 0;
+}
@@ -0,0 +1,83 @@
+/**
+ * sock_tuning.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header defining tuning of TCP sockets, applied by server to its
+ * listeners and accepted sockets, and by clients to their sockets.
+ *
+ * Tuning is usually picked from a profile:
+ *  -default : Options are left to the kernel.
+ *  -latency : Nagle's algorithm is disabled, so a small message is sent at
+ *          once, instead of waiting for the ack of the previous one, which
+ *          a peer may delay for tens of milliseconds. Quick acks are also
+ *          requested, though the kernel may fall back to delayed acks later.
+ *  -bulk : Nagle's algorithm is kept, so small writes are coalesced into
+ *          full segments, and buffers are enlarged to keep a long pipe full.
+ *
+ * Buffer sizes should be applied before a socket listens or connects, so
+ * they're taken into account by the window advertised to the peer. Only
+ * buffer sizes apply to unix sockets.
+ *
+ * Types defined in sock_tuning.h:
+ *  -struct sock_tuning
+ *
+ * Routines defined in sock_tuning.h:
+ *  -int
+ *   sock_tuning_profile(struct sock_tuning *t, const char *profile)
+ *  -int
+ *   sock_tuning_apply(int fd, const struct sock_tuning *t)
+ *  -void
+ *   sock_tuning_local(struct sock_tuning *t)
+ *
+ * Version: 0.1
+ */
+
+#ifndef __sock_tuning_h__
+#define __sock_tuning_h__
+
+
+#define SOCK_BULK_BUF_SIZE (1 << 20)  // Buffer sizes of bulk profile.
+
+
+struct sock_tuning {
+    int nodelay;   // Set to disable Nagle's algorithm (TCP_NODELAY).
+    int quickack;  // Set to request acks to be sent at once (TCP_QUICKACK).
+    // Sizes of sending and receiving buffers in bytes (SO_SNDBUF and
+    // SO_RCVBUF). When 0, kernel defaults and auto-tuning are kept.
+    int sndbuf;
+    int rcvbuf;
+};
+
+
+/**
+ * Fills given tuning from the profile of given name, i.e. "default",
+ * "latency" or "bulk".
+ *
+ * Returns:
+ *  0 on success, or a non-zero integer if profile is unknown.
+ */
+int
+sock_tuning_profile(struct sock_tuning *t, const char *profile);
+
+/**
+ * Applies given tuning to given TCP socket. Options left zeroed are not
+ * touched.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer, with errno set.
+ */
+int
+sock_tuning_apply(int fd, const struct sock_tuning *t);
+
+/**
+ * Clears options of given tuning that only apply to TCP, so it can be
+ * applied to a unix socket.
+ */
+void
+sock_tuning_local(struct sock_tuning *t);
+
+
+#endif
@@ -0,0 +1,162 @@
+/**
+ * spsc_ring.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * An implementation of routines defined in spsc_ring.h.
+ *
+ * Version: 0.1
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "spsc_ring.h"
+
+
+void
+_spsc_ring_wait_space(spsc_ring_t *ring, size_t space);
+
+
+spsc_ring_t *
+spsc_ring_create(size_t capacity)
+{
+    size_t slots = 1;
+    while (slots < capacity) slots <<= 1;
+
+    spsc_ring_t *ring;
+    if (posix_memalign((void **) &ring, CACHE_LINE_SIZE, sizeof(spsc_ring_t)))
+        return NULL;
+    memset(ring, 0, sizeof(spsc_ring_t));
+
+    ring->mask = slots - 1;
+    ring->slots = (void **) calloc(slots, sizeof(void *));
+    ring->wait_mutex = (pthread_mutex_t *) malloc(sizeof(pthread_mutex_t));
+    ring->space_cond = (pthread_cond_t *) malloc(sizeof(pthread_cond_t));
+    if (!ring->slots || !ring->wait_mutex || !ring->space_cond ||
+        pthread_mutex_init(ring->wait_mutex, NULL) ||
+        pthread_cond_init(ring->space_cond, NULL)) {
+        free(ring->slots);
+        free(ring->wait_mutex);
+        free(ring->space_cond);
+        free(ring);
+        return NULL;
+    }
+
+    return ring;
+}
+
+
+void
+spsc_ring_destroy(spsc_ring_t *ring)
+{
+    if (!ring) return;
+    pthread_mutex_destroy(ring->wait_mutex);
+    pthread_cond_destroy(ring->space_cond);
+    free(ring->wait_mutex);
+    free(ring->space_cond);
+    free(ring->slots);
+    free(ring);
+}
+
+
+int
+spsc_ring_push(spsc_ring_t *ring, void *item)
+{
+    size_t tail = ring->tail;
+
+    if (tail - ring->head_cache > ring->mask) {
+        ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (tail - ring->head_cache > ring->mask) return -1;  // Full.
+    }
+
+    ring->slots[tail & ring->mask] = item;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+void
+spsc_ring_push_wait(spsc_ring_t *ring, void *item)
+{
+    while (spsc_ring_push(ring, item)) _spsc_ring_wait_space(ring, 1);
+}
+
+
+void *
+spsc_ring_peek(spsc_ring_t *ring, size_t i)
+{
+    size_t pos = ring->head + i;
+
+    if (pos >= ring->tail_cache) {
+        ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (pos >= ring->tail_cache) return NULL;
+    }
+
+    return ring->slots[pos & ring->mask];
+}
+
+
+void
+spsc_ring_release(spsc_ring_t *ring, size_t n)
+{
+    __atomic_store_n(&ring->head, ring->head + n, __ATOMIC_RELEASE);
+
+    // Pairs with the fence of a producer going to sleep. Either producer
+    // sees the new head, or we see that it waits.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->producer_waiting, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(ring->wait_mutex);
+        pthread_cond_signal(ring->space_cond);
+        pthread_mutex_unlock(ring->wait_mutex);
+    }
+}
+
+
+void *
+spsc_ring_pop(spsc_ring_t *ring)
+{
+    void *item = spsc_ring_peek(ring, 0);
+    if (item) spsc_ring_release(ring, 1);
+    return item;
+}
+
+
+void
+spsc_ring_wait_empty(spsc_ring_t *ring)
+{
+    _spsc_ring_wait_space(ring, ring->mask + 1);
+}
+
+
+size_t
+spsc_ring_size(spsc_ring_t *ring)
+{
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    return tail - head;
+}
+
+
+size_t
+spsc_ring_capacity(spsc_ring_t *ring)
+{
+    return ring->mask + 1;
+}
+
+
+/**
+ * Blocks producer until ring has at least given number of free slots.
+ */
+void
+_spsc_ring_wait_space(spsc_ring_t *ring, size_t space)
+{
+    pthread_mutex_lock(ring->wait_mutex);
+    __atomic_store_n(&ring->producer_waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    while (ring->mask + 1 - spsc_ring_size(ring) < space)
+        pthread_cond_wait(ring->space_cond, ring->wait_mutex);
+    __atomic_store_n(&ring->producer_waiting, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(ring->wait_mutex);
+}
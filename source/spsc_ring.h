@@ -0,0 +1,158 @@
+/**
+ * spsc_ring.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header defining a lock-free, fixed-capacity, single-producer
+ * single-consumer ring buffer of pointers.
+ *
+ * Producer and consumer indices live on separate cache lines, and each side
+ * keeps a cached copy of the other side's index, so shared cache lines are
+ * only touched when the cached view is exhausted. No allocation or locking
+ * happens on push or pop. A producer may optionally block while the ring is
+ * full, in which case the consumer wakes it up as soon as space is released.
+ *
+ * Consumer can peek at items and release them later, so an item is still
+ * considered to occupy the ring while it's being processed.
+ *
+ * Types defined in spsc_ring.h:
+ *  -spsc_ring_t
+ *
+ * Routines defined in spsc_ring.h:
+ *  -spsc_ring_t *
+ *   spsc_ring_create(size_t capacity)
+ *  -void
+ *   spsc_ring_destroy(spsc_ring_t *ring)
+ *  -int
+ *   spsc_ring_push(spsc_ring_t *ring, void *item)
+ *  -void
+ *   spsc_ring_push_wait(spsc_ring_t *ring, void *item)
+ *  -void *
+ *   spsc_ring_peek(spsc_ring_t *ring, size_t i)
+ *  -void
+ *   spsc_ring_release(spsc_ring_t *ring, size_t n)
+ *  -void *
+ *   spsc_ring_pop(spsc_ring_t *ring)
+ *  -void
+ *   spsc_ring_wait_empty(spsc_ring_t *ring)
+ *  -size_t
+ *   spsc_ring_size(spsc_ring_t *ring)
+ *  -size_t
+ *   spsc_ring_capacity(spsc_ring_t *ring)
+ *
+ * Version: 0.1
+ */
+
+#ifndef __spsc_ring_h__
+#define __spsc_ring_h__
+
+
+#include <stddef.h>
+#include <pthread.h>
+
+
+#define CACHE_LINE_SIZE 64
+
+
+typedef struct {
+    // ---- Consumer side ----
+    size_t head __attribute__((aligned(CACHE_LINE_SIZE)));  // Next to consume.
+    size_t tail_cache;  // Last value of tail seen by consumer.
+    // ---- Producer side ----
+    size_t tail __attribute__((aligned(CACHE_LINE_SIZE)));  // Next to fill.
+    size_t head_cache;  // Last value of head seen by producer.
+    int producer_waiting;  // Set while producer blocks for free space.
+    // ---- Read-only after creation ----
+    size_t mask __attribute__((aligned(CACHE_LINE_SIZE)));  // Capacity - 1.
+    void **slots;
+    pthread_mutex_t *wait_mutex;  // Used only by a blocked producer.
+    pthread_cond_t *space_cond;   // Signaled when space is released.
+} spsc_ring_t;
+
+
+/**
+ * Creates a new ring.
+ *
+ * Parameters:
+ *  -capacity : Number of items the ring can hold. It is rounded up to the
+ *          next power of 2.
+ *
+ * Returns:
+ *  On success, a new and empty ring. On failure, NULL.
+ */
+spsc_ring_t *
+spsc_ring_create(size_t capacity);
+
+/**
+ * Destroys given ring. Items still contained are not touched.
+ */
+void
+spsc_ring_destroy(spsc_ring_t *ring);
+
+/**
+ * Pushes an item to the ring. Should only be called by the producer.
+ *
+ * Returns:
+ *  0 on success, or a non-zero integer if ring is full.
+ */
+int
+spsc_ring_push(spsc_ring_t *ring, void *item);
+
+/**
+ * Pushes an item to the ring, blocking while the ring is full. Should only
+ * be called by the producer.
+ */
+void
+spsc_ring_push_wait(spsc_ring_t *ring, void *item);
+
+/**
+ * Returns the i-th item from the head of the ring, without consuming it.
+ * Should only be called by the consumer.
+ *
+ * Returns:
+ *  The requested item, or NULL if ring holds i items or less.
+ */
+void *
+spsc_ring_peek(spsc_ring_t *ring, size_t i);
+
+/**
+ * Consumes n items from the head of the ring, freeing their slots for the
+ * producer. Should only be called by the consumer, for items already peeked.
+ */
+void
+spsc_ring_release(spsc_ring_t *ring, size_t n);
+
+/**
+ * Removes and returns the item at the head of the ring. Should only be called
+ * by the consumer.
+ *
+ * Returns:
+ *  The removed item, or NULL if ring is empty.
+ */
+void *
+spsc_ring_pop(spsc_ring_t *ring);
+
+/**
+ * Blocks until consumer has released every item of the ring. Should only be
+ * called by the producer.
+ */
+void
+spsc_ring_wait_empty(spsc_ring_t *ring);
+
+/**
+ * Returns the number of items in the ring. When called by a thread other
+ * than producer and consumer, result is just a snapshot.
+ */
+size_t
+spsc_ring_size(spsc_ring_t *ring);
+
+/**
+ * Returns the number of items the ring can hold.
+ */
+size_t
+spsc_ring_capacity(spsc_ring_t *ring);
+
+
+#endif
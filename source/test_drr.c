@@ -0,0 +1,175 @@
+/**
+ * test_drr.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A synthetic test of byte fairness of the DRR scheduler used by sending unit.
+ *
+ * A number of always backlogged flows send framed messages of different
+ * payload sizes. The test checks that flows of equal weight get equal byte
+ * shares regardless of their message sizes, and that weighted flows get
+ * shares in proportion to their weights. One-message round-robin, previously
+ * used by sending unit, is also run for comparison.
+ *
+ * Version: 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "drr.h"
+#include "message.h"
+
+
+#define FLOWS_NUM 3
+#define ROUNDS 10000
+
+
+typedef struct {
+    drr_flow_t flow;
+    int payload;            // Data bytes of every message of the flow.
+    int weight;
+    unsigned long bytes;    // Bytes sent so far.
+} test_flow_t;
+
+
+unsigned long wire_size(int payload);
+int run_drr(test_flow_t *flows, int flows_num, int rounds);
+void run_round_robin(test_flow_t *flows, int flows_num, int rounds);
+int check_shares(const char *name, test_flow_t *flows, int flows_num);
+void print_shares(const char *name, test_flow_t *flows, int flows_num);
+
+
+const int payloads[FLOWS_NUM] = { 20, 120, MESSAGE_DATA_LENGTH };
+
+
+int main()
+{
+    test_flow_t flows[FLOWS_NUM];
+    int failed = 0;
+
+    // Equal weights: every flow should get the same number of bytes.
+    for (int i = 0; i < FLOWS_NUM; i++) {
+        flows[i].payload = payloads[i];
+        flows[i].weight = 1;
+    }
+    run_round_robin(flows, FLOWS_NUM, ROUNDS);
+    print_shares("round-robin, equal weights", flows, FLOWS_NUM);
+    failed |= run_drr(flows, FLOWS_NUM, ROUNDS);
+    failed |= check_shares("drr, equal weights", flows, FLOWS_NUM);
+
+    // Weights 1:2:4, with the heaviest weight on the smallest messages.
+    for (int i = 0; i < FLOWS_NUM; i++) {
+        flows[i].payload = payloads[FLOWS_NUM - 1 - i];
+        flows[i].weight = 1 << i;
+    }
+    failed |= run_drr(flows, FLOWS_NUM, ROUNDS);
+    failed |= check_shares("drr, weights 1:2:4", flows, FLOWS_NUM);
+
+    printf(failed ? "FAILED\n" : "PASSED\n");
+    return failed;
+}
+
+/**
+ * Returns bytes occupied on the wire by a framed message of given payload.
+ */
+unsigned long wire_size(int payload)
+{
+    message_t m;
+    m.len = payload;
+    return message_wire_size(&m, MESSAGE_FORMAT_FRAMED);
+}
+
+/**
+ * Serves always backlogged flows by DRR, the way sending unit does, for
+ * given number of rounds.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int run_drr(test_flow_t *flows, int flows_num, int rounds)
+{
+    drr_t *drr = drr_create(MESSAGE_FRAME_MAX);
+    if (!drr) {
+        fprintf(stderr, "ERROR: Failed to create scheduler.\n");
+        return 1;
+    }
+
+    for (int i = 0; i < flows_num; i++) {
+        drr_flow_init(drr, &flows[i].flow, flows[i].weight, &flows[i]);
+        drr_enqueue(drr, &flows[i].flow);
+        flows[i].bytes = 0;
+    }
+
+    for (int r = 0; r < rounds * flows_num; r++) {
+        drr_flow_t *flow = drr_next(drr);
+        test_flow_t *f = (test_flow_t *) flow->owner;
+        unsigned long size = wire_size(f->payload);
+        while (!drr_charge(flow, size)) f->bytes += size;
+        drr_enqueue(drr, flow);
+    }
+
+    // Flows never run out of messages, so scheduler stays full.
+    int failed = drr_size(drr) != flows_num;
+    while (drr_next(drr));
+    drr_destroy(drr);
+    return failed;
+}
+
+/**
+ * Serves always backlogged flows by sending one message of each flow per
+ * round, for given number of rounds.
+ */
+void run_round_robin(test_flow_t *flows, int flows_num, int rounds)
+{
+    for (int i = 0; i < flows_num; i++)
+        flows[i].bytes = wire_size(flows[i].payload) * rounds;
+}
+
+/**
+ * Checks that bytes sent by every flow, normalized by its weight, differ by
+ * at most the size of a message per round from the mean. Anything more is
+ * systematic unfairness, as DRR only carries less than a message of deficit
+ * from round to round.
+ *
+ * Returns:
+ *  0 if shares are fair, otherwise a non-zero integer.
+ */
+int check_shares(const char *name, test_flow_t *flows, int flows_num)
+{
+    double mean = 0;
+    for (int i = 0; i < flows_num; i++)
+        mean += (double) flows[i].bytes / flows[i].weight;
+    mean /= flows_num;
+
+    print_shares(name, flows, flows_num);
+
+    for (int i = 0; i < flows_num; i++) {
+        double normalized = (double) flows[i].bytes / flows[i].weight;
+        double diff = normalized > mean ? normalized - mean : mean - normalized;
+        if (diff > MESSAGE_FRAME_MAX) {
+            fprintf(stderr, "ERROR: %s: flow %d got %lu bytes, expected %.0f.\n",
+                    name, i, flows[i].bytes, mean * flows[i].weight);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Prints the share of total bytes every flow got.
+ */
+void print_shares(const char *name, test_flow_t *flows, int flows_num)
+{
+    unsigned long total = 0;
+    for (int i = 0; i < flows_num; i++) total += flows[i].bytes;
+
+    printf("%s:\n", name);
+    for (int i = 0; i < flows_num; i++) {
+        printf("  payload %3d, weight %d : %10lu bytes (%5.2f%%)\n",
+               flows[i].payload, flows[i].weight, flows[i].bytes,
+               100.0 * flows[i].bytes / total);
+    }
+}
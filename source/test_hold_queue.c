@@ -0,0 +1,283 @@
+/**
+ * test_hold_queue.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A test of the store of messages held for offline destinations.
+ *
+ * The test checks that messages are handed back per destination in the
+ * order they were held, that they expire in order once their TTL passes,
+ * that memory cap and bound per destination reject messages unless forced,
+ * and that only 'len' data bytes are kept. Time is given explicitly, so the
+ * test never sleeps.
+ *
+ * Version: 0.1
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "hold_queue.h"
+#include "message.h"
+
+
+#define TTL 100             // Time-to-live of held messages in ms.
+#define DEST_MAX 4          // Max messages held per destination.
+#define DESTS_NUM 3
+
+
+int test_order();
+int test_expiry();
+int test_limits();
+int test_length();
+void fill(message_t *m, uint32_t address, uint16_t port, uint16_t count);
+size_t entry_size();
+struct timespec at(long ms);
+
+
+int main()
+{
+    int failed = 0;
+
+    failed |= test_order();
+    failed |= test_expiry();
+    failed |= test_limits();
+    failed |= test_length();
+
+    printf(failed ? "FAILED\n" : "PASSED\n");
+    return failed;
+}
+
+/**
+ * Holds messages for interleaved destinations, then checks every destination
+ * gets back its own messages in order, along with their tags.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int test_order()
+{
+    hold_queue_t *q = hold_queue_create(TTL, 1 << 20, DEST_MAX, 0);
+    if (!q) {
+        fprintf(stderr, "ERROR: Failed to create store.\n");
+        return 1;
+    }
+
+    message_t m;
+    struct timespec now = at(0);
+    for (int i = 0; i < DEST_MAX; i++) {
+        for (int d = 0; d < DESTS_NUM; d++) {
+            fill(&m, 0x0a000001, 5000 + d, i);
+            if (hold_queue_put(q, &m, d * 100 + i, &now, 0)) {
+                fprintf(stderr, "ERROR: order: message %d of %d rejected.\n",
+                        i, d);
+                hold_queue_destroy(q);
+                return 1;
+            }
+        }
+    }
+
+    int failed = hold_queue_size(q) != DEST_MAX * DESTS_NUM;
+    for (int d = 0; d < DESTS_NUM && !failed; d++) {
+        failed |= hold_queue_count(q, 0x0a000001, 5000 + d) != DEST_MAX;
+        for (int i = 0; i < DEST_MAX && !failed; i++) {
+            message_t *held = hold_queue_peek(q, 0x0a000001, 5000 + d);
+            if (!held || held->count != i ||
+                hold_queue_tag(held) != (uint64_t) (d * 100 + i)) {
+                fprintf(stderr, "ERROR: order: message %d of %d out of "
+                        "order.\n", i, d);
+                failed = 1;
+                break;
+            }
+            hold_queue_pop(q, 0x0a000001, 5000 + d);
+        }
+        // Destination is forgotten once it's drained.
+        failed |= hold_queue_peek(q, 0x0a000001, 5000 + d) != NULL;
+    }
+    failed |= hold_queue_size(q) != 0;
+
+    printf("order: %s\n", failed ? "failed" : "ok");
+    hold_queue_destroy(q);
+    return failed;
+}
+
+/**
+ * Holds messages at successive times, then checks they expire in the order
+ * they were held, only once their TTL has passed.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int test_expiry()
+{
+    hold_queue_t *q = hold_queue_create(TTL, 1 << 20, DEST_MAX, 0);
+    if (!q) {
+        fprintf(stderr, "ERROR: Failed to create store.\n");
+        return 1;
+    }
+
+    message_t m;
+    int failed = 0;
+    for (int i = 0; i < DESTS_NUM; i++) {
+        struct timespec now = at(i * 10);
+        fill(&m, 0x0a000001, 5000 + i, i);
+        failed |= hold_queue_put(q, &m, 0, &now, 0);
+    }
+
+    struct timespec expiry;
+    struct timespec now = at(TTL - 1);
+    failed |= hold_queue_next_expiry(q, &expiry);
+    failed |= expiry.tv_sec != at(TTL).tv_sec ||
+              expiry.tv_nsec != at(TTL).tv_nsec;
+    failed |= hold_queue_expire(q, &now) != NULL;
+
+    for (int i = 0; i < DESTS_NUM && !failed; i++) {
+        now = at(TTL + i * 10);
+        message_t *expired = hold_queue_expire(q, &now);
+        if (!expired || expired->count != i) {
+            fprintf(stderr, "ERROR: expiry: message %d didn't expire in "
+                    "order.\n", i);
+            failed = 1;
+        }
+        hold_queue_release(expired);
+        // Next message is still within its TTL.
+        failed |= hold_queue_expire(q, &now) != NULL;
+    }
+    failed |= hold_queue_next_expiry(q, &expiry) == 0;
+
+    printf("expiry: %s\n", failed ? "failed" : "ok");
+    hold_queue_destroy(q);
+    return failed;
+}
+
+/**
+ * Checks that bound per destination and memory cap reject messages, unless
+ * they are forced.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int test_limits()
+{
+    message_t m;
+    struct timespec now = at(0);
+    int failed = 0;
+
+    // Bound per destination only affects the destination that hit it.
+    hold_queue_t *q = hold_queue_create(TTL, 1 << 20, DEST_MAX, 0);
+    if (!q) {
+        fprintf(stderr, "ERROR: Failed to create store.\n");
+        return 1;
+    }
+    fill(&m, 0x0a000001, 5000, 0);
+    for (int i = 0; i < DEST_MAX; i++)
+        failed |= hold_queue_put(q, &m, 0, &now, 0);
+    failed |= hold_queue_put(q, &m, 0, &now, 0) == 0;
+    failed |= hold_queue_put(q, &m, 0, &now, 1);
+    failed |= hold_queue_count(q, 0x0a000001, 5000) != DEST_MAX + 1;
+    fill(&m, 0x0a000001, 5001, 0);
+    failed |= hold_queue_put(q, &m, 0, &now, 0);
+    hold_queue_destroy(q);
+
+    // Memory cap fits exactly two messages.
+    q = hold_queue_create(TTL, 2 * entry_size(), DEST_MAX, 0);
+    if (!q) {
+        fprintf(stderr, "ERROR: Failed to create store.\n");
+        return 1;
+    }
+    for (int i = 0; i < 2; i++) {
+        fill(&m, 0x0a000001, 5000 + i, 0);
+        failed |= hold_queue_put(q, &m, 0, &now, 0);
+    }
+    fill(&m, 0x0a000001, 5002, 0);
+    failed |= hold_queue_put(q, &m, 0, &now, 0) == 0;
+    // A rejected message leaves no trace of its destination.
+    failed |= hold_queue_count(q, 0x0a000001, 5002) != 0;
+    failed |= hold_queue_put(q, &m, 0, &now, 1);
+    failed |= hold_queue_size(q) != 3;
+    hold_queue_destroy(q);
+
+    printf("limits: %s\n", failed ? "failed" : "ok");
+    return failed;
+}
+
+/**
+ * Checks that only 'len' data bytes are kept, unless whole data is asked
+ * for, and that a 'len' beyond data is clamped.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int test_length()
+{
+    message_t m;
+    struct timespec now = at(0);
+    int failed = 0;
+
+    hold_queue_t *q = hold_queue_create(TTL, 1 << 20, DEST_MAX, 0);
+    hold_queue_t *whole = hold_queue_create(TTL, 1 << 20, DEST_MAX, 1);
+    if (!q || !whole) {
+        fprintf(stderr, "ERROR: Failed to create store.\n");
+        hold_queue_destroy(q);
+        hold_queue_destroy(whole);
+        return 1;
+    }
+
+    fill(&m, 0x0a000001, 5000, 0);
+    m.len = 10;
+    failed |= hold_queue_put(q, &m, 0, &now, 0);
+    failed |= hold_queue_put(whole, &m, 0, &now, 0);
+    fill(&m, 0x0a000001, 5001, 0);
+    m.len = MESSAGE_DATA_LENGTH + 1;
+    failed |= hold_queue_put(q, &m, 0, &now, 0);
+
+    message_t *held = hold_queue_peek(q, 0x0a000001, 5000);
+    failed |= !held || held->len != 10 || memcmp(held->data, m.data, 10);
+    held = hold_queue_peek(q, 0x0a000001, 5001);
+    failed |= !held || held->len != MESSAGE_DATA_LENGTH;
+    // Whole data is kept along with 'len' the message was sent with.
+    held = hold_queue_peek(whole, 0x0a000001, 5000);
+    failed |= !held || held->len != 10 ||
+              memcmp(held->data, m.data, MESSAGE_DATA_LENGTH);
+
+    printf("length: %s\n", failed ? "failed" : "ok");
+    hold_queue_destroy(q);
+    hold_queue_destroy(whole);
+    return failed;
+}
+
+/**
+ * Fills given message for given destination, with all its data bytes set.
+ */
+void fill(message_t *m, uint32_t address, uint16_t port, uint16_t count)
+{
+    memset(m, 0, sizeof(message_t));
+    m->src_addr = 0x0a000002;
+    m->src_port = 6000;
+    m->dest_addr = address;
+    m->dest_port = port;
+    m->count = count;
+    m->len = MESSAGE_DATA_LENGTH;
+    for (int i = 0; i < MESSAGE_DATA_LENGTH; i++) m->data[i] = (char) i;
+}
+
+/**
+ * Returns memory accounted for a held message carrying all its data bytes.
+ */
+size_t entry_size()
+{
+    return sizeof(hold_entry_t) + offsetof(message_t, data) +
+           MESSAGE_DATA_LENGTH;
+}
+
+/**
+ * Returns a time of CLOCK_MONOTONIC, given milliseconds after an epoch.
+ */
+struct timespec at(long ms)
+{
+    struct timespec t;
+    t.tv_sec = 1000 + ms / 1000;
+    t.tv_nsec = (ms % 1000) * 1000000;
+    return t;
+}
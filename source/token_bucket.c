@@ -0,0 +1,86 @@
+/**
+ * token_bucket.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * An implementation of routines defined in token_bucket.h.
+ *
+ * Version: 0.1
+ */
+
+#include "token_bucket.h"
+
+
+void
+_token_bucket_refill(token_bucket_t *tb, struct timespec *now);
+
+
+void
+token_bucket_init(token_bucket_t *tb, double rate, double burst,
+                  struct timespec *now)
+{
+    tb->rate = rate;
+    tb->burst = burst < 1 ? 1 : burst;
+    tb->tokens = tb->burst;
+    tb->last = *now;
+}
+
+
+void
+token_bucket_set_rate(token_bucket_t *tb, double rate, struct timespec *now)
+{
+    _token_bucket_refill(tb, now);
+    tb->rate = rate;
+}
+
+
+long
+token_bucket_available(token_bucket_t *tb, struct timespec *now)
+{
+    _token_bucket_refill(tb, now);
+    return (long) tb->tokens;
+}
+
+
+int
+token_bucket_take(token_bucket_t *tb, long n, struct timespec *now)
+{
+    if (tb->tokens < n) _token_bucket_refill(tb, now);
+    if (tb->tokens < n) return -1;
+    tb->tokens -= n;
+    return 0;
+}
+
+
+void
+token_bucket_consume(token_bucket_t *tb, long n)
+{
+    tb->tokens -= n;
+}
+
+
+long
+token_bucket_delay(token_bucket_t *tb, long n)
+{
+    if (tb->tokens >= n) return 0;
+    if (tb->rate <= 0) return 1000000000L;
+    return (long) ((n - tb->tokens) * 1e9 / tb->rate) + 1;
+}
+
+
+/**
+ * Adds tokens earned since last refill, up to the burst of the bucket.
+ */
+void
+_token_bucket_refill(token_bucket_t *tb, struct timespec *now)
+{
+    double elapsed = (now->tv_sec - tb->last.tv_sec) +
+                     (now->tv_nsec - tb->last.tv_nsec) / 1e9;
+    if (elapsed <= 0) return;
+
+    tb->tokens += elapsed * tb->rate;
+    if (tb->tokens > tb->burst) tb->tokens = tb->burst;
+    tb->last = *now;
+}
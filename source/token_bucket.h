@@ -0,0 +1,108 @@
+/**
+ * token_bucket.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header defining a token-bucket rate limiter.
+ *
+ * Bucket fills with tokens at a constant rate, up to a capacity called
+ * burst. Every unit of work (e.g. a message) consumes a token, so work is
+ * done on average at the rate of the bucket, while up to burst units may
+ * be done at once after an idle period. Tokens are refilled lazily, based on
+ * timestamps provided by the caller, so no timer or thread is needed.
+ *
+ * Bucket does no locking. Callers should serialize access to a bucket.
+ *
+ * Types defined in token_bucket.h:
+ *  -token_bucket_t
+ *
+ * Routines defined in token_bucket.h:
+ *  -void
+ *   token_bucket_init(token_bucket_t *tb, double rate, double burst,
+ *                     struct timespec *now)
+ *  -void
+ *   token_bucket_set_rate(token_bucket_t *tb, double rate,
+ *                         struct timespec *now)
+ *  -long
+ *   token_bucket_available(token_bucket_t *tb, struct timespec *now)
+ *  -int
+ *   token_bucket_take(token_bucket_t *tb, long n, struct timespec *now)
+ *  -void
+ *   token_bucket_consume(token_bucket_t *tb, long n)
+ *  -long
+ *   token_bucket_delay(token_bucket_t *tb, long n)
+ *
+ * Version: 0.1
+ */
+
+#ifndef __token_bucket_h__
+#define __token_bucket_h__
+
+
+#include <time.h>
+
+
+typedef struct {
+    double rate;    // Tokens added per second.
+    double burst;   // Max number of tokens held.
+    double tokens;  // Tokens currently held.
+    struct timespec last;  // Time of last refill.
+} token_bucket_t;
+
+
+/**
+ * Initializes a full bucket.
+ *
+ * Parameters:
+ *  -tb : Bucket to initialize.
+ *  -rate : Tokens added per second.
+ *  -burst : Max number of tokens held. Values below 1 are set to 1.
+ *  -now : Current time of CLOCK_MONOTONIC.
+ */
+void
+token_bucket_init(token_bucket_t *tb, double rate, double burst,
+                  struct timespec *now);
+
+/**
+ * Changes the rate of given bucket. Tokens earned until now are added on
+ * the previous rate.
+ */
+void
+token_bucket_set_rate(token_bucket_t *tb, double rate, struct timespec *now);
+
+/**
+ * Refills given bucket up to now.
+ *
+ * Returns:
+ *  The number of whole tokens available.
+ */
+long
+token_bucket_available(token_bucket_t *tb, struct timespec *now);
+
+/**
+ * Refills given bucket up to now and takes n tokens, if available.
+ *
+ * Returns:
+ *  0 if tokens were taken, otherwise a non-zero integer.
+ */
+int
+token_bucket_take(token_bucket_t *tb, long n, struct timespec *now);
+
+/**
+ * Removes n tokens from given bucket, without refilling it. It's meant for
+ * consuming tokens found available by token_bucket_available().
+ */
+void
+token_bucket_consume(token_bucket_t *tb, long n);
+
+/**
+ * Returns the time in nanoseconds, since last refill, until given bucket
+ * holds n tokens. Returns 0 if it already does.
+ */
+long
+token_bucket_delay(token_bucket_t *tb, long n);
+
+
+#endif
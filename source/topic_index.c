@@ -0,0 +1,549 @@
+/**
+ * topic_index.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * An implementation of routines defined in topic_index.h.
+ *
+ * Version: 0.1
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "topic_index.h"
+
+
+#define TOPIC_LEVELS_CAP_INITIAL 64
+
+
+// A level string, interned once for all nodes using it.
+struct topic_level {
+    uint32_t id;
+    uint32_t hash;
+    int refs;                   // Nodes using the level.
+    struct topic_level *next;   // Next level of the same bucket.
+    size_t len;
+    char name[];
+};
+
+
+uint32_t
+_topic_hash(const char *s, size_t len);
+struct topic_level *
+_topic_level_find(topic_index_t *t, const char *s, size_t len);
+struct topic_level *
+_topic_level_intern(topic_index_t *t, const char *s, size_t len);
+void
+_topic_level_release(topic_index_t *t, struct topic_level *level);
+int
+_topic_node_child(struct topic_node *node, uint32_t id);
+struct topic_node *
+_topic_node_walk(topic_index_t *t, const char *filter, size_t len,
+                 int create, int *wildcard);
+void
+_topic_node_prune(topic_index_t *t, struct topic_node *node);
+void
+_topic_node_unlink(topic_index_t *t, struct topic_node *node);
+void
+_topic_node_free(topic_index_t *t, struct topic_node *node,
+                 void (*release) (void *member));
+int
+_topic_node_remove_member(topic_index_t *t, struct topic_node *node,
+                          void *member);
+int
+_topic_members_find(struct topic_members *s, void *member);
+int
+_topic_members_add(struct topic_members *s, void *member);
+int
+_topic_members_visit(struct topic_members *s,
+                     void (*callback) (void *member, void *arg), void *arg);
+
+
+topic_index_t *
+topic_index_create()
+{
+    topic_index_t *t = (topic_index_t *) calloc(1, sizeof(topic_index_t));
+    if (!t) return NULL;
+
+    t->levels = (struct topic_level **) calloc(
+        TOPIC_LEVELS_CAP_INITIAL, sizeof(struct topic_level *));
+    t->levels_cap = TOPIC_LEVELS_CAP_INITIAL;
+    t->lock = (pthread_rwlock_t *) malloc(sizeof(pthread_rwlock_t));
+    if (!t->levels || !t->lock) goto error;
+
+    // Publishers match all the time, so subscribing shouldn't wait for them.
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(
+        &attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    int rc = pthread_rwlock_init(t->lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    if (rc) goto error;
+
+    return t;
+
+error:
+    free(t->lock);
+    free(t->levels);
+    free(t);
+    return NULL;
+}
+
+
+void
+topic_index_destroy(topic_index_t *t, void (*release) (void *member))
+{
+    if (!t) return;
+
+    _topic_node_free(t, &t->root, release);
+    free(t->levels);
+    pthread_rwlock_destroy(t->lock);
+    free(t->lock);
+    free(t);
+}
+
+
+int
+topic_index_subscribe(topic_index_t *t, const char *filter, size_t len,
+                      void *member)
+{
+    int rc = -1;
+    int wildcard;
+
+    pthread_rwlock_wrlock(t->lock);
+
+    struct topic_node *node = _topic_node_walk(t, filter, len, 1, &wildcard);
+    if (node) {
+        struct topic_members *s = wildcard ? &node->prefix : &node->exact;
+        if (_topic_members_find(s, member) >= 0) rc = 1;
+        else rc = _topic_members_add(s, member);
+        if (rc < 0) _topic_node_prune(t, node);
+    }
+
+    pthread_rwlock_unlock(t->lock);
+    return rc;
+}
+
+
+int
+topic_index_unsubscribe(topic_index_t *t, const char *filter, size_t len,
+                        void *member)
+{
+    int rc = -1;
+    int wildcard;
+
+    pthread_rwlock_wrlock(t->lock);
+
+    struct topic_node *node = _topic_node_walk(t, filter, len, 0, &wildcard);
+    if (node) {
+        struct topic_members *s = wildcard ? &node->prefix : &node->exact;
+        int k = _topic_members_find(s, member);
+        if (k >= 0) {
+            // Order of members doesn't matter, so the last one fills the gap.
+            s->items[k] = s->items[--s->num];
+            _topic_node_prune(t, node);
+            rc = 0;
+        }
+    }
+
+    pthread_rwlock_unlock(t->lock);
+    return rc;
+}
+
+
+int
+topic_index_remove_member(topic_index_t *t, void *member)
+{
+    pthread_rwlock_wrlock(t->lock);
+    int removed = _topic_node_remove_member(t, &t->root, member);
+    pthread_rwlock_unlock(t->lock);
+    return removed;
+}
+
+
+int
+topic_index_for_each(topic_index_t *t, const char *topic, size_t len,
+                     void (*callback) (void *member, void *arg), void *arg)
+{
+    int visited = 0;
+
+    pthread_rwlock_rdlock(t->lock);
+
+    struct topic_node *node = &t->root;
+    visited += _topic_members_visit(&node->prefix, callback, arg);
+
+    size_t start = 0;
+    while (1) {
+        const char *sep = memchr(topic + start, TOPIC_LEVEL_SEPARATOR,
+                                 len - start);
+        size_t end = sep ? (size_t) (sep - topic) : len;
+        struct topic_level *level =
+            _topic_level_find(t, topic + start, end - start);
+        int k = level ? _topic_node_child(node, level->id) : -1;
+        if (k < 0) break;
+        node = node->children[k];
+
+        visited += _topic_members_visit(&node->prefix, callback, arg);
+        if (end == len) {
+            visited += _topic_members_visit(&node->exact, callback, arg);
+            break;
+        }
+        start = end + 1;
+    }
+
+    pthread_rwlock_unlock(t->lock);
+    return visited;
+}
+
+
+/**
+ * Returns FNV-1a hash of given string.
+ */
+uint32_t
+_topic_hash(const char *s, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+
+/**
+ * Finds the interned level of given string.
+ *
+ * Returns:
+ *  The level, or NULL if no node uses it.
+ */
+struct topic_level *
+_topic_level_find(topic_index_t *t, const char *s, size_t len)
+{
+    uint32_t h = _topic_hash(s, len);
+    struct topic_level *level = t->levels[h & (t->levels_cap - 1)];
+    while (level && (level->hash != h || level->len != len ||
+                     memcmp(level->name, s, len)))
+        level = level->next;
+    return level;
+}
+
+
+/**
+ * Interns given level string, taking a reference to it. Should be called
+ * with lock acquired for writing.
+ *
+ * Returns:
+ *  The interned level, or NULL on failure.
+ */
+struct topic_level *
+_topic_level_intern(topic_index_t *t, const char *s, size_t len)
+{
+    struct topic_level *level = _topic_level_find(t, s, len);
+    if (level) {
+        level->refs++;
+        return level;
+    }
+
+    // Table is doubled once it holds as many levels as buckets.
+    if (t->levels_num == t->levels_cap) {
+        int cap = t->levels_cap * 2;
+        struct topic_level **levels = (struct topic_level **) calloc(
+            cap, sizeof(struct topic_level *));
+        if (!levels) return NULL;
+        for (int i = 0; i < t->levels_cap; i++) {
+            struct topic_level *l = t->levels[i];
+            while (l) {
+                struct topic_level *next = l->next;
+                l->next = levels[l->hash & (cap - 1)];
+                levels[l->hash & (cap - 1)] = l;
+                l = next;
+            }
+        }
+        free(t->levels);
+        t->levels = levels;
+        t->levels_cap = cap;
+    }
+
+    level = (struct topic_level *) malloc(sizeof(struct topic_level) + len);
+    if (!level) return NULL;
+    level->id = t->next_level_id++;
+    level->hash = _topic_hash(s, len);
+    level->refs = 1;
+    level->len = len;
+    memcpy(level->name, s, len);
+
+    struct topic_level **bucket = t->levels + (level->hash & (t->levels_cap - 1));
+    level->next = *bucket;
+    *bucket = level;
+    t->levels_num++;
+
+    return level;
+}
+
+
+/**
+ * Releases a reference to given level, freeing it when no node uses it.
+ */
+void
+_topic_level_release(topic_index_t *t, struct topic_level *level)
+{
+    if (--level->refs) return;
+
+    struct topic_level **p = t->levels + (level->hash & (t->levels_cap - 1));
+    while (*p != level) p = &(*p)->next;
+    *p = level->next;
+    t->levels_num--;
+    free(level);
+}
+
+
+/**
+ * Finds the child of given node, reached by the level of given id.
+ *
+ * Returns:
+ *  Index of child, or -(i+1) if no child exists, where i is the index it
+ *  should be inserted at.
+ */
+int
+_topic_node_child(struct topic_node *node, uint32_t id)
+{
+    int lo = 0;
+    int hi = node->children_num;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        uint32_t mid_id = node->children[mid]->level->id;
+        if (mid_id == id) return mid;
+        if (mid_id < id) lo = mid + 1;
+        else hi = mid;
+    }
+    return -(lo + 1);
+}
+
+
+/**
+ * Finds the node of given filter, i.e. the node of its topic, or of its
+ * prefix when it ends with a wildcard. Should be called with lock acquired
+ * for writing.
+ *
+ * Parameters:
+ *  -create : When non-zero, missing nodes are created.
+ *  -wildcard : Set to 1 if filter ends with a wildcard, otherwise to 0.
+ *
+ * Returns:
+ *  The node, or NULL if filter is invalid, node doesn't exist or on failure.
+ */
+struct topic_node *
+_topic_node_walk(topic_index_t *t, const char *filter, size_t len,
+                 int create, int *wildcard)
+{
+    struct topic_node *node = &t->root;
+    size_t wildcard_len = strlen(TOPIC_WILDCARD);
+    size_t start = 0;
+
+    *wildcard = 0;
+    while (1) {
+        const char *sep = memchr(filter + start, TOPIC_LEVEL_SEPARATOR,
+                                 len - start);
+        size_t end = sep ? (size_t) (sep - filter) : len;
+
+        if (end - start == wildcard_len &&
+            !memcmp(filter + start, TOPIC_WILDCARD, wildcard_len)) {
+            if (end != len) break;  // Wildcard is only valid as last level.
+            *wildcard = 1;
+            return node;
+        }
+
+        struct topic_level *level = _topic_level_find(t, filter + start,
+                                                      end - start);
+        int k = level ? _topic_node_child(node, level->id) : -1;
+        if (k >= 0) {
+            node = node->children[k];
+        } else {
+            if (!create) break;
+
+            struct topic_node *child =
+                (struct topic_node *) calloc(1, sizeof(struct topic_node));
+            if (!child) break;
+            child->level = _topic_level_intern(t, filter + start, end - start);
+            if (!child->level) {
+                free(child);
+                break;
+            }
+            k = _topic_node_child(node, child->level->id);
+            k = -k - 1;
+
+            if (node->children_num == node->children_cap) {
+                int cap = node->children_cap ? node->children_cap * 2 : 4;
+                struct topic_node **children = (struct topic_node **) realloc(
+                    node->children, cap * sizeof(struct topic_node *));
+                if (!children) {
+                    _topic_level_release(t, child->level);
+                    free(child);
+                    break;
+                }
+                node->children = children;
+                node->children_cap = cap;
+            }
+            memmove(node->children + k + 1, node->children + k,
+                    (node->children_num - k) * sizeof(struct topic_node *));
+            node->children[k] = child;
+            node->children_num++;
+            child->parent = node;
+            node = child;
+        }
+
+        if (end == len) return node;
+        start = end + 1;
+    }
+
+    // Nodes created for a filter that turned out invalid are removed.
+    if (create) _topic_node_prune(t, node);
+    return NULL;
+}
+
+
+/**
+ * Frees given node and its ancestors, as long as they have neither
+ * subscribers nor children. Root is never freed.
+ */
+void
+_topic_node_prune(topic_index_t *t, struct topic_node *node)
+{
+    while (node != &t->root && !node->children_num &&
+           !node->exact.num && !node->prefix.num) {
+        struct topic_node *parent = node->parent;
+        _topic_node_unlink(t, node);
+        node = parent;
+    }
+}
+
+
+/**
+ * Unlinks given node from its parent and frees it.
+ */
+void
+_topic_node_unlink(topic_index_t *t, struct topic_node *node)
+{
+    struct topic_node *parent = node->parent;
+    int k = _topic_node_child(parent, node->level->id);
+    memmove(parent->children + k, parent->children + k + 1,
+            (parent->children_num - k - 1) * sizeof(struct topic_node *));
+    parent->children_num--;
+
+    _topic_level_release(t, node->level);
+    free(node->children);
+    free(node->exact.items);
+    free(node->prefix.items);
+    free(node);
+}
+
+
+/**
+ * Frees given subtree, releasing all its subscriptions.
+ */
+void
+_topic_node_free(topic_index_t *t, struct topic_node *node,
+                 void (*release) (void *member))
+{
+    for (int i = 0; i < node->children_num; i++)
+        _topic_node_free(t, node->children[i], release);
+    for (int i = 0; release && i < node->exact.num; i++)
+        release(node->exact.items[i]);
+    for (int i = 0; release && i < node->prefix.num; i++)
+        release(node->prefix.items[i]);
+
+    free(node->children);
+    free(node->exact.items);
+    free(node->prefix.items);
+    if (node != &t->root) {
+        _topic_level_release(t, node->level);
+        free(node);
+    }
+}
+
+
+/**
+ * Removes subscriptions of given member from given subtree, freeing the
+ * descendants left unused. Given node is left to its caller.
+ *
+ * Returns:
+ *  The number of removed subscriptions.
+ */
+int
+_topic_node_remove_member(topic_index_t *t, struct topic_node *node,
+                          void *member)
+{
+    int removed = 0;
+
+    // Children are visited backwards, as unlinking one shifts the next ones.
+    for (int i = node->children_num - 1; i >= 0; i--) {
+        struct topic_node *child = node->children[i];
+        removed += _topic_node_remove_member(t, child, member);
+        if (!child->children_num && !child->exact.num && !child->prefix.num)
+            _topic_node_unlink(t, child);
+    }
+
+    int k = _topic_members_find(&node->exact, member);
+    if (k >= 0) {
+        node->exact.items[k] = node->exact.items[--node->exact.num];
+        removed++;
+    }
+    k = _topic_members_find(&node->prefix, member);
+    if (k >= 0) {
+        node->prefix.items[k] = node->prefix.items[--node->prefix.num];
+        removed++;
+    }
+
+    return removed;
+}
+
+
+/**
+ * Returns the index of given member in given set, or -1.
+ */
+int
+_topic_members_find(struct topic_members *s, void *member)
+{
+    for (int k = 0; k < s->num; k++)
+        if (s->items[k] == member) return k;
+    return -1;
+}
+
+
+/**
+ * Adds given member to given set.
+ *
+ * Returns:
+ *  0 on success, or -1 on failure.
+ */
+int
+_topic_members_add(struct topic_members *s, void *member)
+{
+    if (s->num == s->cap) {
+        int cap = s->cap ? s->cap * 2 : 4;
+        void **items = (void **) realloc(s->items, cap * sizeof(void *));
+        if (!items) return -1;
+        s->items = items;
+        s->cap = cap;
+    }
+    s->items[s->num++] = member;
+    return 0;
+}
+
+
+/**
+ * Calls given routine with every member of given set.
+ *
+ * Returns:
+ *  The number of members.
+ */
+int
+_topic_members_visit(struct topic_members *s,
+                     void (*callback) (void *member, void *arg), void *arg)
+{
+    for (int k = 0; k < s->num; k++) callback(s->items[k], arg);
+    return s->num;
+}
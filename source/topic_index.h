@@ -0,0 +1,163 @@
+/**
+ * topic_index.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header defining an index of subscriptions to topics, that resolves the
+ * subscribers of a published topic.
+ *
+ * Topics are strings of levels separated by '/', e.g. "sensors/3/temp". A
+ * subscription is made with a filter, which is either a topic, matching only
+ * that topic, or a prefix of levels ending with a "#" level, e.g.
+ * "sensors/#", matching that prefix and every topic below it. A single "#"
+ * matches every topic.
+ *
+ * Index is a trie with a node per level. Every distinct level string is
+ * interned to an integer id once, so children of a node are kept sorted by
+ * id and a level is found by a binary search, without comparing strings.
+ * Matching a topic only takes the lock of the index for reading, so many
+ * publishers can match concurrently, while subscribing takes it for writing.
+ * Index has its own lock, so matching never waits for unrelated state.
+ *
+ * Types defined in topic_index.h:
+ *  -topic_index_t
+ *
+ * Routines defined in topic_index.h:
+ *  -topic_index_t *
+ *   topic_index_create()
+ *  -void
+ *   topic_index_destroy(topic_index_t *t, void (*release) (void *member))
+ *  -int
+ *   topic_index_subscribe(topic_index_t *t, const char *filter, size_t len,
+ *                         void *member)
+ *  -int
+ *   topic_index_unsubscribe(topic_index_t *t, const char *filter,
+ *                           size_t len, void *member)
+ *  -int
+ *   topic_index_remove_member(topic_index_t *t, void *member)
+ *  -int
+ *   topic_index_for_each(topic_index_t *t, const char *topic, size_t len,
+ *                        void (*callback) (void *member, void *arg),
+ *                        void *arg)
+ *
+ * Version: 0.1
+ */
+
+#ifndef __topic_index_h__
+#define __topic_index_h__
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+
+#define TOPIC_LEVEL_SEPARATOR '/'
+#define TOPIC_WILDCARD "#"  // Last level of a filter matching a whole prefix.
+
+
+struct topic_level;
+
+// A set of subscribers, kept in an array.
+struct topic_members {
+    void **items;
+    int num;
+    int cap;
+};
+
+struct topic_node {
+    struct topic_level *level;      // Interned level leading to this node.
+    struct topic_node *parent;
+    struct topic_node **children;   // Children sorted by id of their level.
+    int children_num;
+    int children_cap;
+    struct topic_members exact;     // Subscribers to the topic of this node.
+    struct topic_members prefix;    // Subscribers to every topic below it.
+};
+
+typedef struct {
+    struct topic_node root;
+    struct topic_level **levels;    // Hash table of interned levels.
+    int levels_cap;                 // Buckets of table, a power of 2.
+    int levels_num;
+    uint32_t next_level_id;
+    pthread_rwlock_t *lock;
+} topic_index_t;
+
+
+/**
+ * Creates a new index with no subscriptions.
+ *
+ * Returns:
+ *  On success, a new index. On failure, NULL.
+ */
+topic_index_t *
+topic_index_create();
+
+/**
+ * Destroys given index.
+ *
+ * Parameters:
+ *  -release : If not NULL, routine called once for every subscription, with
+ *          its subscriber.
+ */
+void
+topic_index_destroy(topic_index_t *t, void (*release) (void *member));
+
+/**
+ * Subscribes given member with given filter.
+ *
+ * Parameters:
+ *  -filter : Filter of topics, not necessarily null-terminated.
+ *  -len : Length of filter in bytes.
+ *
+ * Returns:
+ *  0 if member subscribed, 1 if it was already subscribed with the same
+ *  filter, or -1 if filter is invalid or on failure.
+ */
+int
+topic_index_subscribe(topic_index_t *t, const char *filter, size_t len,
+                      void *member);
+
+/**
+ * Removes the subscription of given member with given filter.
+ *
+ * Returns:
+ *  0 if subscription was removed, or a non-zero integer if it didn't exist.
+ */
+int
+topic_index_unsubscribe(topic_index_t *t, const char *filter, size_t len,
+                        void *member);
+
+/**
+ * Removes all subscriptions of given member.
+ *
+ * Returns:
+ *  The number of removed subscriptions.
+ */
+int
+topic_index_remove_member(topic_index_t *t, void *member);
+
+/**
+ * Calls given routine with every subscriber of given topic, with the lock of
+ * the index acquired for reading. A member subscribed with many filters
+ * matching the topic is visited once for each of them. Routine shouldn't
+ * call other routines of the index.
+ *
+ * Parameters:
+ *  -topic : Published topic, not necessarily null-terminated.
+ *  -len : Length of topic in bytes.
+ *  -callback : Routine called with a subscriber and given argument.
+ *  -arg : Argument passed to callback.
+ *
+ * Returns:
+ *  The number of visited subscribers.
+ */
+int
+topic_index_for_each(topic_index_t *t, const char *topic, size_t len,
+                     void (*callback) (void *member, void *arg), void *arg);
+
+
+#endif
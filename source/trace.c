@@ -0,0 +1,236 @@
+/**
+ * trace.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * An implementation of routines defined in trace.h.
+ *
+ * Version: 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "trace.h"
+
+
+#define RING_SIZE (sizeof(struct trace_ring) + \
+                   TRACE_RING_EVENTS * sizeof(struct trace_event))
+
+
+struct trace_ring *
+_trace_ring(trace_t *t, int i);
+struct trace_ring *
+_trace_acquire_ring(trace_t *t);
+void
+_trace_release_ring(void *ring);
+char *
+_trace_path(const char *path, const char *suffix);
+
+
+trace_t *
+trace_open(const char *path)
+{
+    trace_t *t = (trace_t *) calloc(1, sizeof(trace_t));
+    if (!t) return NULL;
+    t->fd = -1;
+    t->map = MAP_FAILED;
+    t->size = sizeof(struct trace_header) + (TRACE_RINGS + 1) * RING_SIZE;
+
+    // Recording of a previous run may tell why it ended.
+    char *prev_path = _trace_path(path, ".prev");
+    t->dump_path = _trace_path(path, ".dump");
+    if (!prev_path || !t->dump_path) goto error;
+    if (rename(path, prev_path) && errno != ENOENT) {
+        perror("Failed to keep previous trace");
+    }
+    free(prev_path);
+    prev_path = NULL;
+
+    t->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (t->fd < 0 || ftruncate(t->fd, t->size)) {
+        perror("Failed to create trace file");
+        goto error;
+    }
+    t->map = mmap(NULL, t->size, PROT_READ | PROT_WRITE, MAP_SHARED, t->fd, 0);
+    if (t->map == MAP_FAILED) {
+        perror("Failed to map trace file");
+        goto error;
+    }
+
+    // File is created zeroed, so only the header needs to be written.
+    struct trace_header *h = (struct trace_header *) t->map;
+    h->magic = TRACE_MAGIC;
+    h->version = TRACE_VERSION;
+    h->rings = TRACE_RINGS + 1;
+    h->ring_events = TRACE_RING_EVENTS;
+    h->event_size = sizeof(struct trace_event);
+    h->ring_size = RING_SIZE;
+    _trace_ring(t, TRACE_RINGS)->owned = -1;  // Never acquired.
+    strcpy(_trace_ring(t, TRACE_RINGS)->name, "shared");
+
+    if (pthread_key_create(&t->key, _trace_release_ring)) goto error;
+
+    return t;
+
+error:
+    free(prev_path);
+    if (t->map != MAP_FAILED) munmap(t->map, t->size);
+    if (t->fd >= 0) close(t->fd);
+    free(t->dump_path);
+    free(t);
+    return NULL;
+}
+
+
+void
+trace_close(trace_t *t)
+{
+    if (!t) return;
+    pthread_key_delete(t->key);
+    msync(t->map, t->size, MS_ASYNC);
+    munmap(t->map, t->size);
+    close(t->fd);
+    free(t->dump_path);
+    free(t);
+}
+
+
+void
+trace_record(trace_t *t, int type, uint16_t arg, uint32_t value,
+             uint32_t src_addr, uint16_t src_port,
+             uint32_t dest_addr, uint16_t dest_port)
+{
+    struct trace_ring *r = (struct trace_ring *) pthread_getspecific(t->key);
+    if (!r) r = _trace_acquire_ring(t);
+
+    uint64_t head;
+    if (r == _trace_ring(t, TRACE_RINGS)) {
+        head = __atomic_fetch_add(&r->head, 1, __ATOMIC_RELAXED);
+    } else {
+        head = r->head;  // Only owner writes to its ring.
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    struct trace_event *events = (struct trace_event *) (r + 1);
+    struct trace_event *e = events + (head & (TRACE_RING_EVENTS - 1));
+    e->ts = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+    e->type = type;
+    e->arg = arg;
+    e->value = value;
+    e->src_addr = src_addr;
+    e->dest_addr = dest_addr;
+    e->src_port = src_port;
+    e->dest_port = dest_port;
+    e->tid = r->tid;
+
+    // Event is complete before the ring shows it, to a dump taken meanwhile.
+    if (r != _trace_ring(t, TRACE_RINGS))
+        __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+
+void
+trace_name_thread(trace_t *t, const char *name)
+{
+    struct trace_ring *r = (struct trace_ring *) pthread_getspecific(t->key);
+    if (!r) r = _trace_acquire_ring(t);
+    if (r == _trace_ring(t, TRACE_RINGS)) return;  // Shared ring keeps its.
+
+    strncpy(r->name, name, TRACE_NAME_LEN - 1);
+    r->name[TRACE_NAME_LEN - 1] = '\0';
+}
+
+
+int
+trace_dump(trace_t *t)
+{
+    // Only async-signal-safe calls are made.
+    int fd = open(t->dump_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+
+    size_t written = 0;
+    while (written < t->size) {
+        ssize_t n = write(fd, t->map + written, t->size - written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        written += n;
+    }
+    close(fd);
+
+    return written != t->size;
+}
+
+
+/**
+ * Returns the ring of given index.
+ */
+struct trace_ring *
+_trace_ring(trace_t *t, int i)
+{
+    return (struct trace_ring *)
+        (t->map + sizeof(struct trace_header) + i * RING_SIZE);
+}
+
+
+/**
+ * Acquires a free ring for calling thread, or the shared one if all are
+ * owned. Events of a previous owner are kept until overwritten.
+ */
+struct trace_ring *
+_trace_acquire_ring(trace_t *t)
+{
+    struct trace_ring *r = _trace_ring(t, TRACE_RINGS);
+
+    for (int i = 0; i < TRACE_RINGS; i++) {
+        struct trace_ring *free_ring = _trace_ring(t, i);
+        int32_t owned = 0;
+        if (__atomic_compare_exchange_n(&free_ring->owned, &owned, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            r = free_ring;
+            r->tid = (int32_t) syscall(SYS_gettid);
+            r->name[0] = '\0';
+            break;
+        }
+    }
+
+    pthread_setspecific(t->key, r);
+    return r;
+}
+
+
+/**
+ * Gives back the ring of an exiting thread, unless it's the shared one.
+ */
+void
+_trace_release_ring(void *ring)
+{
+    struct trace_ring *r = (struct trace_ring *) ring;
+    if (r->owned > 0) __atomic_store_n(&r->owned, 0, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Returns a new string of given path followed by given suffix, to be freed
+ * by caller, or NULL on failure.
+ */
+char *
+_trace_path(const char *path, const char *suffix)
+{
+    size_t len = strlen(path);
+    char *p = (char *) malloc(len + strlen(suffix) + 1);
+    if (!p) return NULL;
+    strcpy(p, path);
+    strcpy(p + len, suffix);
+    return p;
+}
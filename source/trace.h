@@ -0,0 +1,162 @@
+/**
+ * trace.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header defining a flight recorder of events of messaging service, e.g.
+ * a message received, queued, taken by sending unit, written or NACKed.
+ *
+ * Recorder is a memory-mapped file holding a ring of the latest events of
+ * every thread. A thread records events on a ring of its own, without locks
+ * or atomic read-modify-write instructions, so recording is always on at
+ * the cost of reading the clock and filling a 32-byte event. Once all
+ * rings are taken, remaining threads share an extra ring, updated
+ * atomically. Exiting threads give their rings back, to be reused.
+ *
+ * Events reach the page cache as soon as they are written, so the file
+ * holds the latest events even after a crash of the process. A recording
+ * left by a previous run is kept as "<path>.prev". Recorder can also be
+ * dumped at any time, e.g. from a signal handler, to "<path>.dump".
+ *
+ * File starts with a header, followed by the rings. Every ring has a header
+ * of a cache line, followed by its events. Fields are in host byte order.
+ *
+ * Types defined in trace.h:
+ *  -trace_t
+ *  -struct trace_header
+ *  -struct trace_ring
+ *  -struct trace_event
+ *
+ * Routines defined in trace.h:
+ *  -trace_t *
+ *   trace_open(const char *path)
+ *  -void
+ *   trace_close(trace_t *t)
+ *  -void
+ *   trace_record(trace_t *t, int type, uint16_t arg, uint32_t value,
+ *                uint32_t src_addr, uint16_t src_port,
+ *                uint32_t dest_addr, uint16_t dest_port)
+ *  -void
+ *   trace_name_thread(trace_t *t, const char *name)
+ *  -int
+ *   trace_dump(trace_t *t)
+ *
+ * Version: 0.1
+ */
+
+#ifndef __trace_h__
+#define __trace_h__
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+
+#define TRACE_MAGIC 0x4d544c54  // "MTLT"
+#define TRACE_VERSION 1
+#define TRACE_RINGS 32          // Rings owned by threads, plus a shared one.
+#define TRACE_RING_EVENTS 4096  // Events per ring. Power of 2.
+#define TRACE_NAME_LEN 16
+
+// Types of events.
+#define TRACE_RECV 1        // Bytes read from socket of a client.
+#define TRACE_ENQUEUE 2     // Message queued for sending unit.
+#define TRACE_DEQUEUE 3     // Message taken by sending unit.
+#define TRACE_SEND 4        // Bytes written to socket of a client.
+#define TRACE_NACK 5        // Message NACKed to its source.
+#define TRACE_CONNECT 6     // Client connected.
+#define TRACE_DISCONNECT 7  // Client disconnected.
+
+
+struct trace_header {
+    uint32_t magic;         // TRACE_MAGIC.
+    uint32_t version;       // TRACE_VERSION.
+    uint32_t rings;         // Number of rings, including the shared one.
+    uint32_t ring_events;   // Events per ring.
+    uint32_t event_size;    // Size of an event in bytes.
+    uint32_t ring_size;     // Size of a ring, with its header, in bytes.
+    char padding[40];
+};
+
+struct trace_ring {
+    uint64_t head;     // Number of events ever recorded on the ring.
+    int32_t owned;     // Set while a thread owns the ring, or -1 if shared.
+    int32_t tid;       // Kernel id of the last owner.
+    char name[TRACE_NAME_LEN];  // Name of the last owner, if given.
+    char padding[32];
+};
+
+struct trace_event {
+    uint64_t ts;          // Monotonic time in nanoseconds.
+    uint16_t type;        // One of TRACE_* types.
+    uint16_t arg;         // Count of message, or error code of a NACK.
+    uint32_t value;       // Bytes read or written, or length of message.
+    uint32_t src_addr;    // Source of message, or client of the event.
+    uint32_t dest_addr;   // Destination of message.
+    uint16_t src_port;
+    uint16_t dest_port;
+    int32_t tid;          // Kernel id of recording thread.
+};
+
+typedef struct {
+    char *map;         // Mapping of the whole file.
+    size_t size;
+    int fd;
+    char *dump_path;
+    pthread_key_t key;  // Ring owned by each thread.
+} trace_t;
+
+
+/**
+ * Creates a new recorder on given file. If file exists, it's kept as
+ * "<path>.prev".
+ *
+ * Returns:
+ *  On success, a new recorder. On failure, NULL.
+ */
+trace_t *
+trace_open(const char *path);
+
+/**
+ * Closes given recorder. Its file is kept. Threads shouldn't record events
+ * after it's closed.
+ */
+void
+trace_close(trace_t *t);
+
+/**
+ * Records an event of calling thread.
+ *
+ * Parameters:
+ *  -type : One of TRACE_* types.
+ *  -arg : Count of message, or error code of a NACK, if any.
+ *  -value : Bytes read or written, or length of message, if any.
+ *  -src_addr, src_port : Source of message, or client of the event.
+ *  -dest_addr, dest_port : Destination of message, if any.
+ */
+void
+trace_record(trace_t *t, int type, uint16_t arg, uint32_t value,
+             uint32_t src_addr, uint16_t src_port,
+             uint32_t dest_addr, uint16_t dest_port);
+
+/**
+ * Names the ring of calling thread, e.g. "sending unit".
+ */
+void
+trace_name_thread(trace_t *t, const char *name);
+
+/**
+ * Writes all rings to "<path>.dump", replacing it. It's async-signal-safe,
+ * so it can be called from a signal handler.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int
+trace_dump(trace_t *t);
+
+
+#endif
@@ -0,0 +1,280 @@
+/**
+ * trace_decode.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A tool converting flight recorder files of server, or their dumps, to
+ * Chrome trace event JSON on stdout, which can be opened by Perfetto or by
+ * chrome://tracing.
+ *
+ * Every thread of server becomes a track, named after its role when known.
+ * Every event is a slice of zero duration, with time in microseconds since
+ * the earliest event of the file. Enqueue and dequeue events of a message
+ * are linked by a flow arrow, showing the time it waited for sending unit.
+ *
+ * Recordings of a host with different byte order are converted too.
+ *
+ * Usage: ./trace_decode <trace_file>
+ *
+ * Version: 0.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <byteswap.h>
+#include <arpa/inet.h>
+#include "trace.h"
+
+
+char *read_file(const char *path, size_t *len);
+int read_header(const char *buf, size_t len, struct trace_header *h,
+                int *swapped);
+void read_ring(const char *buf, struct trace_ring *r, int swapped);
+void read_event(const char *buf, struct trace_event *e, int swapped);
+void print_thread(struct trace_ring *r);
+void print_event(struct trace_event *e, uint64_t start);
+void print_endpoint(const char *name, uint32_t addr, uint16_t port);
+void begin_entry();
+
+const char *event_names[] = {
+    NULL, "recv", "enqueue", "dequeue", "send", "nack", "connect",
+    "disconnect"
+};
+
+int entries;  // Number of entries written to the array of events.
+
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <trace_file>\n", argv[0]);
+        return 1;
+    }
+
+    size_t len;
+    char *buf = read_file(argv[1], &len);
+    if (!buf) {
+        perror("ERROR: Failed to read trace file");
+        return 1;
+    }
+
+    struct trace_header h;
+    int swapped;
+    if (read_header(buf, len, &h, &swapped)) {
+        fprintf(stderr, "ERROR: Not a trace file of a supported version.\n");
+        free(buf);
+        return 1;
+    }
+
+    // Events of all rings are timed from the earliest one.
+    uint64_t start = UINT64_MAX;
+    struct trace_ring r;
+    struct trace_event e;
+    for (uint32_t i = 0; i < h.rings; i++) {
+        const char *ring = buf + sizeof(h) + i * h.ring_size;
+        read_ring(ring, &r, swapped);
+        uint64_t n = r.head < h.ring_events ? r.head : h.ring_events;
+        for (uint64_t k = r.head - n; k < r.head; k++) {
+            read_event(ring + sizeof(r) + (k % h.ring_events) * h.event_size,
+                       &e, swapped);
+            if (e.ts && e.ts < start) start = e.ts;
+        }
+    }
+
+    printf("{\"traceEvents\":[");
+    for (uint32_t i = 0; i < h.rings; i++) {
+        const char *ring = buf + sizeof(h) + i * h.ring_size;
+        read_ring(ring, &r, swapped);
+        if (!r.head) continue;
+        print_thread(&r);
+
+        uint64_t n = r.head < h.ring_events ? r.head : h.ring_events;
+        for (uint64_t k = r.head - n; k < r.head; k++) {
+            read_event(ring + sizeof(r) + (k % h.ring_events) * h.event_size,
+                       &e, swapped);
+            // Events of shared ring may still be written when it's dumped.
+            if (!e.ts || !e.type || e.type > TRACE_DISCONNECT) continue;
+            print_event(&e, start);
+        }
+    }
+    printf("\n],\"displayTimeUnit\":\"ns\"}\n");
+
+    free(buf);
+    return 0;
+}
+
+/**
+ * Reads the whole file of given path to memory.
+ *
+ * Returns:
+ *  A buffer holding file, to be freed by caller, or NULL on failure.
+ */
+char *read_file(const char *path, size_t *len)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) return NULL;
+
+    size_t cap = 1 << 22;
+    char *buf = (char *) malloc(cap);
+    *len = 0;
+    while (buf) {
+        *len += fread(buf + *len, 1, cap - *len, f);
+        if (*len < cap) break;
+        cap *= 2;
+        char *larger = (char *) realloc(buf, cap);
+        if (!larger) free(buf);
+        buf = larger;
+    }
+
+    if (buf && ferror(f)) {
+        free(buf);
+        buf = NULL;
+    }
+    fclose(f);
+    return buf;
+}
+
+/**
+ * Reads the header of a trace file of given length and checks that the
+ * whole file is present.
+ *
+ * Parameters:
+ *  -swapped : Set if file was recorded on a host of different byte order.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int read_header(const char *buf, size_t len, struct trace_header *h,
+                int *swapped)
+{
+    if (len < sizeof(struct trace_header)) return -1;
+    memcpy(h, buf, sizeof(struct trace_header));
+
+    *swapped = h->magic == bswap_32(TRACE_MAGIC);
+    if (*swapped) {
+        h->magic = bswap_32(h->magic);
+        h->version = bswap_32(h->version);
+        h->rings = bswap_32(h->rings);
+        h->ring_events = bswap_32(h->ring_events);
+        h->event_size = bswap_32(h->event_size);
+        h->ring_size = bswap_32(h->ring_size);
+    }
+
+    if (h->magic != TRACE_MAGIC || h->version != TRACE_VERSION ||
+        h->event_size != sizeof(struct trace_event) || !h->ring_events ||
+        h->ring_size != sizeof(struct trace_ring) +
+                        (uint64_t) h->ring_events * h->event_size)
+        return -1;
+    return len < sizeof(struct trace_header) +
+                 (uint64_t) h->rings * h->ring_size;
+}
+
+/**
+ * Reads the header of a ring.
+ */
+void read_ring(const char *buf, struct trace_ring *r, int swapped)
+{
+    memcpy(r, buf, sizeof(struct trace_ring));
+    r->name[TRACE_NAME_LEN - 1] = '\0';
+    if (swapped) {
+        r->head = bswap_64(r->head);
+        r->owned = bswap_32(r->owned);
+        r->tid = bswap_32(r->tid);
+    }
+}
+
+/**
+ * Reads an event of a ring.
+ */
+void read_event(const char *buf, struct trace_event *e, int swapped)
+{
+    memcpy(e, buf, sizeof(struct trace_event));
+    if (swapped) {
+        e->ts = bswap_64(e->ts);
+        e->type = bswap_16(e->type);
+        e->arg = bswap_16(e->arg);
+        e->value = bswap_32(e->value);
+        e->src_addr = bswap_32(e->src_addr);
+        e->dest_addr = bswap_32(e->dest_addr);
+        e->src_port = bswap_16(e->src_port);
+        e->dest_port = bswap_16(e->dest_port);
+        e->tid = bswap_32(e->tid);
+    }
+}
+
+/**
+ * Prints the name of the thread that last owned given ring.
+ */
+void print_thread(struct trace_ring *r)
+{
+    begin_entry();
+    printf("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+           "\"args\":{\"name\":\"%s\"}}",
+           r->tid, r->name[0] ? r->name : "thread");
+}
+
+/**
+ * Prints given event as a slice of zero duration, followed by the start or
+ * end of the flow of its message, if any.
+ */
+void print_event(struct trace_event *e, uint64_t start)
+{
+    double ts = (e->ts - start) / 1000.0;
+
+    begin_entry();
+    printf("{\"name\":\"%s\",\"cat\":\"mtl\",\"ph\":\"X\",\"dur\":0,"
+           "\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"args\":{",
+           event_names[e->type], e->tid, ts);
+    switch (e->type) {
+    case TRACE_RECV:
+    case TRACE_SEND:
+        print_endpoint("client", e->src_addr, e->src_port);
+        printf(",\"bytes\":%u", e->value);
+        break;
+    case TRACE_CONNECT:
+    case TRACE_DISCONNECT:
+        print_endpoint("client", e->src_addr, e->src_port);
+        break;
+    default:
+        print_endpoint("src", e->src_addr, e->src_port);
+        printf(",");
+        print_endpoint("dest", e->dest_addr, e->dest_port);
+        if (e->type == TRACE_NACK) printf(",\"code\":%u", e->arg);
+        else printf(",\"count\":%u", e->arg);
+        printf(",\"len\":%u", e->value);
+    }
+    printf("}}");
+
+    // A message is identified by its source and count, until count wraps.
+    if (e->type != TRACE_ENQUEUE && e->type != TRACE_DEQUEUE) return;
+    uint64_t id = (uint64_t) e->src_addr << 32 |
+                  (uint64_t) e->src_port << 16 | e->arg;
+    begin_entry();
+    printf("{\"name\":\"queued\",\"cat\":\"mtl\",\"ph\":\"%s\","
+           "\"id\":\"0x%llx\",\"pid\":1,\"tid\":%d,\"ts\":%.3f}",
+           e->type == TRACE_ENQUEUE ? "s" : "f\",\"bp\":\"e",
+           (unsigned long long) id, e->tid, ts);
+}
+
+/**
+ * Prints an argument of given name, holding an endpoint as ip:port.
+ */
+void print_endpoint(const char *name, uint32_t addr, uint16_t port)
+{
+    char ip[INET_ADDRSTRLEN];
+    struct in_addr a;
+    a.s_addr = htonl(addr);
+    inet_ntop(AF_INET, &a, ip, INET_ADDRSTRLEN);
+    printf("\"%s\":\"%s:%u\"", name, ip, port);
+}
+
+/**
+ * Separates a new entry of the array of events from the previous one.
+ */
+void begin_entry()
+{
+    printf(entries++ ? ",\n" : "\n");
+}
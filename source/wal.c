@@ -0,0 +1,580 @@
+/**
+ * wal.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * An implementation of routines defined in wal.h.
+ *
+ * Every segment starts with a header holding a magic number and its sequence
+ * number, followed by 8-byte aligned records. Every record starts with its
+ * size, type and number of items. An append record holds a message in the
+ * framed wire format, and its id is made of the sequence number of its
+ * segment and its offset in the segment. A mark record holds ids of
+ * delivered messages.
+ *
+ * Version: 0.1
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "wal.h"
+
+
+#define WAL_MAGIC 0x31304c41574c544dULL  // "MTLWAL01"
+#define WAL_HEADER_SIZE 16
+#define WAL_RECORD_APPEND 1
+#define WAL_RECORD_MARK 2
+#define WAL_MARK_MAX 4096     // Max number of ids in a mark record.
+#define WAL_SEGMENT_MAX (1UL << 32)  // Offsets in ids are 32-bit.
+
+
+typedef struct {
+    uint32_t size;      // Bytes of record, including header and padding.
+    uint16_t type;
+    uint16_t count;     // Number of items in record.
+} wal_record_t;
+
+
+struct wal_segment *
+_wal_segment_open(wal_t *w, uint64_t seq, int create);
+void
+_wal_segment_close(struct wal_segment *s, int sync);
+void
+_wal_segment_path(wal_t *w, uint64_t seq, char *path, size_t size);
+int
+_wal_segment_add(wal_t *w, struct wal_segment *s);
+struct wal_segment *
+_wal_segment_of(wal_t *w, uint64_t id);
+int
+_wal_rotate(wal_t *w);
+void *
+_wal_reserve(wal_t *w, size_t size, uint64_t *id);
+void
+_wal_commit(void *record, size_t size, uint16_t type, uint16_t count);
+wal_record_t *
+_wal_next(struct wal_segment *s, size_t size, size_t *offset);
+int
+_wal_seq_cmp(const void *a, const void *b);
+
+uint64_t *
+_id_set_create(size_t n, size_t *capacity);
+void
+_id_set_add(uint64_t *set, size_t capacity, uint64_t id);
+int
+_id_set_contains(uint64_t *set, size_t capacity, uint64_t id);
+
+
+wal_t *
+wal_open(const char *dir, size_t segment_size)
+{
+    wal_t *w = (wal_t *) calloc(1, sizeof(wal_t));
+    if (!w) return NULL;
+
+    if (!segment_size) segment_size = WAL_SEGMENT_SIZE_DEFAULT;
+    if (segment_size >= WAL_SEGMENT_MAX) segment_size = WAL_SEGMENT_MAX - 8;
+    w->segment_size = segment_size & ~7UL;
+    w->dir = strdup(dir);
+    w->mutex = (pthread_mutex_t *) malloc(sizeof(pthread_mutex_t));
+    if (!w->dir || !w->mutex || pthread_mutex_init(w->mutex, NULL)) {
+        free(w->dir);
+        free(w->mutex);
+        free(w);
+        return NULL;
+    }
+
+    if (mkdir(dir, 0755) && errno != EEXIST) {
+        perror("Failed to create WAL directory");
+        goto error;
+    }
+
+    // Existing segments are opened in order, for replaying.
+    DIR *d = opendir(dir);
+    if (!d) {
+        perror("Failed to open WAL directory");
+        goto error;
+    }
+    struct dirent *e;
+    unsigned long long seq;
+    char suffix;
+    while ((e = readdir(d))) {
+        if (sscanf(e->d_name, "wal-%16llx.lo%c", &seq, &suffix) != 2 ||
+            suffix != 'g') continue;
+        struct wal_segment *s = _wal_segment_open(w, seq, 0);
+        if (!s) continue;  // Not a segment, or unreadable.
+        if (_wal_segment_add(w, s)) {
+            _wal_segment_close(s, 0);
+            closedir(d);
+            goto error;
+        }
+    }
+    closedir(d);
+    qsort(w->segments, w->segments_num, sizeof(struct wal_segment *),
+          _wal_seq_cmp);
+
+    if (_wal_rotate(w)) goto error;
+
+    return w;
+
+error:
+    wal_close(w);
+    return NULL;
+}
+
+
+void
+wal_close(wal_t *w)
+{
+    if (!w) return;
+
+    for (int i = 0; i < w->segments_num; i++)
+        _wal_segment_close(w->segments[i], 1);
+    free(w->segments);
+    pthread_mutex_destroy(w->mutex);
+    free(w->mutex);
+    free(w->dir);
+    free(w);
+}
+
+
+int
+wal_replay(wal_t *w, void (*handler)(message_t *, uint64_t, void *),
+           void *arg)
+{
+    int old_num = w->segments_num - 1;  // Newest segment is still empty.
+    size_t marks = 0;
+    size_t offset;
+    wal_record_t *r;
+    message_t m;
+    int replayed = 0;
+
+    // Marks may follow their messages in any newer segment, so all of them
+    // are collected first.
+    for (int i = 0; i < old_num; i++) {
+        struct wal_segment *s = w->segments[i];
+        offset = WAL_HEADER_SIZE;
+        while ((r = _wal_next(s, s->used, &offset)))
+            if (r->type == WAL_RECORD_MARK) marks += r->count;
+    }
+
+    size_t capacity;
+    uint64_t *marked = _id_set_create(marks, &capacity);
+    if (!marked) return -1;
+
+    for (int i = 0; i < old_num; i++) {
+        struct wal_segment *s = w->segments[i];
+        offset = WAL_HEADER_SIZE;
+        while ((r = _wal_next(s, s->used, &offset))) {
+            if (r->type != WAL_RECORD_MARK) continue;
+            uint64_t *ids = (uint64_t *) (r + 1);
+            for (int k = 0; k < r->count; k++)
+                _id_set_add(marked, capacity, ids[k]);
+        }
+    }
+
+    for (int i = 0; i < old_num; i++) {
+        struct wal_segment *s = w->segments[i];
+        offset = WAL_HEADER_SIZE;
+        s->live = 0;
+        while ((r = _wal_next(s, s->used, &offset))) {
+            if (r->type != WAL_RECORD_APPEND) continue;
+            uint64_t id = (s->seq << 32) | ((char *) r - s->map);
+            if (_id_set_contains(marked, capacity, id)) continue;
+            message_deserialize(r + 1, &m, MESSAGE_FORMAT_FRAMED);
+            s->live++;
+            replayed++;
+            handler(&m, id, arg);
+        }
+    }
+
+    free(marked);
+    return replayed;
+}
+
+
+uint64_t
+wal_append(wal_t *w, message_t *m)
+{
+    uint16_t len = m->len > MESSAGE_DATA_LENGTH ? MESSAGE_DATA_LENGTH : m->len;
+    size_t size = sizeof(wal_record_t) + MESSAGE_HEADER_LENGTH + len;
+    uint64_t id = 0;
+
+    pthread_mutex_lock(w->mutex);
+    void *record = _wal_reserve(w, size, &id);
+    if (record) {
+        message_serialize(m, (wal_record_t *) record + 1, MESSAGE_FORMAT_FRAMED);
+        _wal_commit(record, size, WAL_RECORD_APPEND, 1);
+        w->segments[w->segments_num - 1]->live++;
+    }
+    pthread_mutex_unlock(w->mutex);
+
+    return id;
+}
+
+
+void
+wal_mark(wal_t *w, uint64_t *ids, int n)
+{
+    pthread_mutex_lock(w->mutex);
+
+    while (n > 0) {
+        int count = 0;
+        uint64_t batch[WAL_MARK_MAX];
+        while (n > 0 && count < WAL_MARK_MAX) {
+            uint64_t id = *ids++;
+            n--;
+            struct wal_segment *s = id ? _wal_segment_of(w, id) : NULL;
+            if (!s) continue;
+            s->live--;
+            batch[count++] = id;
+        }
+        if (!count) break;
+
+        size_t size = sizeof(wal_record_t) + count * sizeof(uint64_t);
+        uint64_t unused;
+        void *record = _wal_reserve(w, size, &unused);
+        if (!record) break;  // Messages will just be replayed again.
+        memcpy((wal_record_t *) record + 1, batch, count * sizeof(uint64_t));
+        _wal_commit(record, size, WAL_RECORD_MARK, count);
+    }
+
+    pthread_mutex_unlock(w->mutex);
+}
+
+
+int
+wal_compact(wal_t *w)
+{
+    struct wal_segment *removed[64];
+    int n = 0;
+
+    pthread_mutex_lock(w->mutex);
+    while (n < 64 && n < w->segments_num - 1 && !w->segments[n]->live) {
+        removed[n] = w->segments[n];
+        n++;
+    }
+    if (n) {
+        w->segments_num -= n;
+        memmove(w->segments, w->segments + n,
+                w->segments_num * sizeof(struct wal_segment *));
+    }
+    pthread_mutex_unlock(w->mutex);
+
+    // Files are removed outside the lock, so appending is not blocked.
+    char path[4096];
+    for (int i = 0; i < n; i++) {
+        _wal_segment_path(w, removed[i]->seq, path, sizeof(path));
+        _wal_segment_close(removed[i], 0);
+        if (unlink(path)) perror("Failed to remove WAL segment");
+    }
+
+    return n;
+}
+
+
+/**
+ * Opens and maps the segment of given sequence number.
+ *
+ * Parameters:
+ *  -create : If non-zero, a new and empty segment is created.
+ *
+ * Returns:
+ *  On success, the segment. On failure, NULL.
+ */
+struct wal_segment *
+_wal_segment_open(wal_t *w, uint64_t seq, int create)
+{
+    char path[4096];
+    struct stat st;
+
+    _wal_segment_path(w, seq, path, sizeof(path));
+    int fd = open(path, O_RDWR | (create ? O_CREAT | O_EXCL : 0), 0644);
+    if (fd < 0) {
+        perror("Failed to open WAL segment");
+        return NULL;
+    }
+
+    size_t size = w->segment_size;
+    if (create && ftruncate(fd, size)) {
+        perror("Failed to allocate WAL segment");
+        goto error;
+    }
+    if (!create) {
+        if (fstat(fd, &st) || st.st_size < WAL_HEADER_SIZE ||
+            (unsigned long) st.st_size >= WAL_SEGMENT_MAX) goto error;
+        size = st.st_size;
+    }
+
+    char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("Failed to map WAL segment");
+        goto error;
+    }
+
+    uint64_t *header = (uint64_t *) map;
+    if (create) {
+        header[0] = WAL_MAGIC;
+        header[1] = seq;
+    } else if (header[0] != WAL_MAGIC || header[1] != seq) {
+        munmap(map, size);
+        goto error;
+    }
+
+    struct wal_segment *s =
+        (struct wal_segment *) malloc(sizeof(struct wal_segment));
+    if (!s) {
+        munmap(map, size);
+        goto error;
+    }
+    s->seq = seq;
+    s->fd = fd;
+    s->map = map;
+    // Size of an old segment is the size of its file. Until it's replayed,
+    // it counts as live, so it's never removed unseen.
+    s->used = create ? WAL_HEADER_SIZE : size;
+    s->live = create ? 0 : 1;
+    return s;
+
+error:
+    close(fd);
+    return NULL;
+}
+
+
+/**
+ * Unmaps and closes given segment.
+ *
+ * Parameters:
+ *  -sync : If non-zero, segment is written to disk first.
+ */
+void
+_wal_segment_close(struct wal_segment *s, int sync)
+{
+    size_t size = s->used;
+    struct stat st;
+    if (!fstat(s->fd, &st)) size = st.st_size;
+
+    if (sync) msync(s->map, size, MS_SYNC);
+    munmap(s->map, size);
+    close(s->fd);
+    free(s);
+}
+
+
+/**
+ * Writes the path of the segment of given sequence number.
+ */
+void
+_wal_segment_path(wal_t *w, uint64_t seq, char *path, size_t size)
+{
+    snprintf(path, size, "%s/wal-%016llx.log", w->dir,
+             (unsigned long long) seq);
+}
+
+
+/**
+ * Adds given segment after the newest segment of given log.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int
+_wal_segment_add(wal_t *w, struct wal_segment *s)
+{
+    if (w->segments_num == w->segments_cap) {
+        int cap = w->segments_cap ? w->segments_cap * 2 : 16;
+        struct wal_segment **segments = (struct wal_segment **) realloc(
+            w->segments, cap * sizeof(struct wal_segment *));
+        if (!segments) return -1;
+        w->segments = segments;
+        w->segments_cap = cap;
+    }
+    w->segments[w->segments_num++] = s;
+    return 0;
+}
+
+
+/**
+ * Returns the segment holding the message of given id, or NULL if it has
+ * been removed. Only the oldest segments are removed, so sequence numbers of
+ * segments are consecutive. Should be called with mutex acquired.
+ */
+struct wal_segment *
+_wal_segment_of(wal_t *w, uint64_t id)
+{
+    uint64_t seq = id >> 32;
+    if (!w->segments_num || seq < w->segments[0]->seq) return NULL;
+
+    uint64_t i = seq - w->segments[0]->seq;
+    if (i < (uint64_t) w->segments_num && w->segments[i]->seq == seq)
+        return w->segments[i];
+
+    // Gaps are only possible among segments found on startup.
+    for (int k = 0; k < w->segments_num; k++)
+        if (w->segments[k]->seq == seq) return w->segments[k];
+    return NULL;
+}
+
+
+/**
+ * Starts a new segment for appending. Writeback of the previous one is
+ * initiated, without waiting for it. Should be called with mutex acquired,
+ * unless log is being opened.
+ *
+ * Returns:
+ *  0 on success, otherwise a non-zero integer.
+ */
+int
+_wal_rotate(wal_t *w)
+{
+    uint64_t seq = 1;
+    if (w->segments_num) {
+        struct wal_segment *last = w->segments[w->segments_num - 1];
+        seq = last->seq + 1;
+        msync(last->map, last->used, MS_ASYNC);
+    }
+
+    struct wal_segment *s = _wal_segment_open(w, seq, 1);
+    if (!s) return -1;
+    if (_wal_segment_add(w, s)) {
+        _wal_segment_close(s, 0);
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * Reserves space for a record of given size at the end of the log, starting
+ * a new segment if needed. Should be called with mutex acquired.
+ *
+ * Parameters:
+ *  -size : Bytes of the record, before padding.
+ *  -id : Storage for the id of the record.
+ *
+ * Returns:
+ *  Start of the reserved record, or NULL on failure.
+ */
+void *
+_wal_reserve(wal_t *w, size_t size, uint64_t *id)
+{
+    struct wal_segment *s = w->segments[w->segments_num - 1];
+    size = (size + 7) & ~7UL;
+
+    if (s->used + size > w->segment_size) {
+        if (size > w->segment_size - WAL_HEADER_SIZE || _wal_rotate(w))
+            return NULL;
+        s = w->segments[w->segments_num - 1];
+    }
+
+    void *record = s->map + s->used;
+    *id = (s->seq << 32) | s->used;
+    s->used += size;
+    return record;
+}
+
+
+/**
+ * Completes a record whose payload has been written. Size is stored last,
+ * so a record torn by a crash is never read.
+ */
+void
+_wal_commit(void *record, size_t size, uint16_t type, uint16_t count)
+{
+    wal_record_t *r = (wal_record_t *) record;
+    r->type = type;
+    r->count = count;
+    __atomic_store_n(&r->size, (size + 7) & ~7UL, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Returns the record at given offset of given segment and advances offset to
+ * the next record. Returns NULL at the end of records.
+ *
+ * Parameters:
+ *  -size : Bytes of segment that may hold records.
+ */
+wal_record_t *
+_wal_next(struct wal_segment *s, size_t size, size_t *offset)
+{
+    if (*offset + sizeof(wal_record_t) > size) return NULL;
+
+    wal_record_t *r = (wal_record_t *) (s->map + *offset);
+    uint32_t rsize = __atomic_load_n(&r->size, __ATOMIC_ACQUIRE);
+    if (rsize < sizeof(wal_record_t) || rsize % 8 || rsize > size - *offset)
+        return NULL;
+    if (r->type == WAL_RECORD_MARK &&
+        sizeof(wal_record_t) + r->count * sizeof(uint64_t) > rsize)
+        return NULL;
+    if (r->type == WAL_RECORD_APPEND &&
+        (rsize < sizeof(wal_record_t) + MESSAGE_HEADER_LENGTH ||
+         message_frame_size(r + 1, rsize - sizeof(wal_record_t),
+                            MESSAGE_FORMAT_FRAMED) + sizeof(wal_record_t) >
+         rsize))
+        return NULL;
+
+    *offset += rsize;
+    return r;
+}
+
+
+/**
+ * Compares segments by sequence number, for qsort().
+ */
+int
+_wal_seq_cmp(const void *a, const void *b)
+{
+    uint64_t x = (*(struct wal_segment **) a)->seq;
+    uint64_t y = (*(struct wal_segment **) b)->seq;
+    return x < y ? -1 : x > y;
+}
+
+
+/**
+ * Creates an open-addressing set for up to n ids. Id 0 marks empty slots.
+ *
+ * Parameters:
+ *  -capacity : Storage for the number of slots of the set.
+ *
+ * Returns:
+ *  The slots of the set, or NULL on failure.
+ */
+uint64_t *
+_id_set_create(size_t n, size_t *capacity)
+{
+    size_t cap = 16;
+    while (cap < 2 * n) cap <<= 1;
+    *capacity = cap;
+    return (uint64_t *) calloc(cap, sizeof(uint64_t));
+}
+
+
+void
+_id_set_add(uint64_t *set, size_t capacity, uint64_t id)
+{
+    if (!id) return;
+    size_t i = (id * 11400714819323198485ull) >> 32 & (capacity - 1);
+    while (set[i] && set[i] != id) i = (i + 1) & (capacity - 1);
+    set[i] = id;
+}
+
+
+int
+_id_set_contains(uint64_t *set, size_t capacity, uint64_t id)
+{
+    size_t i = (id * 11400714819323198485ull) >> 32 & (capacity - 1);
+    while (set[i]) {
+        if (set[i] == id) return 1;
+        i = (i + 1) & (capacity - 1);
+    }
+    return 0;
+}
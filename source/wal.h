@@ -0,0 +1,149 @@
+/**
+ * wal.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header defining a write-ahead log (WAL) of messages accepted by MTL.
+ *
+ * Log is a sequence of fixed-size segment files in a directory, which are
+ * memory-mapped, so appending a record is just a copy into memory. Every
+ * accepted message is appended and gets an id. Once a message has been
+ * delivered (or NACKed), its id is marked, so it won't be replayed. Marks of
+ * many messages are appended as a single record.
+ *
+ * Every segment counts its messages that haven't been marked yet. Compaction
+ * removes the oldest segments once all their messages have been marked.
+ * Marks are always appended to a segment not older than the one of their
+ * messages, so removing only the oldest segments never resurrects a message.
+ *
+ * Record header is written after its payload, so a record torn by a crash
+ * ends the log. Data reach the page cache as soon as they are copied, so
+ * they survive a crash of the process. Writeback of a segment to disk is
+ * started when it's retired, and all segments are synced when the log is
+ * closed.
+ *
+ * Appending and marking are thread-safe.
+ *
+ * Types defined in wal.h:
+ *  -wal_t
+ *
+ * Routines defined in wal.h:
+ *  -wal_t *
+ *   wal_open(const char *dir, size_t segment_size)
+ *  -void
+ *   wal_close(wal_t *w)
+ *  -int
+ *   wal_replay(wal_t *w, void (*handler)(message_t *, uint64_t, void *),
+ *              void *arg)
+ *  -uint64_t
+ *   wal_append(wal_t *w, message_t *m)
+ *  -void
+ *   wal_mark(wal_t *w, uint64_t *ids, int n)
+ *  -int
+ *   wal_compact(wal_t *w)
+ *
+ * Version: 0.1
+ */
+
+#ifndef __wal_h__
+#define __wal_h__
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "message.h"
+
+
+#define WAL_SEGMENT_SIZE_DEFAULT (64 << 20)  // Default size of a segment.
+
+
+struct wal_segment {
+    uint64_t seq;       // Sequence number of segment, also in its file name.
+    int fd;
+    char *map;          // Mapping of the whole segment file.
+    size_t used;        // Bytes of segment holding records.
+    long live;          // Messages appended but not marked yet.
+};
+
+typedef struct {
+    char *dir;
+    size_t segment_size;
+    struct wal_segment **segments;  // Segments from the oldest to the newest.
+    int segments_num;
+    int segments_cap;
+    pthread_mutex_t *mutex;
+} wal_t;
+
+
+/**
+ * Opens the log kept in given directory, creating the directory if needed.
+ * Existing segments are kept for replaying, while new records are appended
+ * to a new segment.
+ *
+ * Parameters:
+ *  -dir : Directory of segment files.
+ *  -segment_size : Size of every new segment file. When 0, a default is used.
+ *
+ * Returns:
+ *  On success, the opened log. On failure, NULL.
+ */
+wal_t *
+wal_open(const char *dir, size_t segment_size);
+
+/**
+ * Syncs and closes given log. Segments are kept on disk.
+ */
+void
+wal_close(wal_t *w);
+
+/**
+ * Passes every logged message that hasn't been marked to given handler, in
+ * the order they were appended. Meant to be called once, right after opening
+ * the log.
+ *
+ * Parameters:
+ *  -handler : Routine called with every message, its id and given argument.
+ *          Message is only valid during the call.
+ *  -arg : Argument passed to handler.
+ *
+ * Returns:
+ *  The number of replayed messages, or -1 on failure.
+ */
+int
+wal_replay(wal_t *w, void (*handler)(message_t *, uint64_t, void *),
+           void *arg);
+
+/**
+ * Appends given message to the log.
+ *
+ * Returns:
+ *  The id of the message, or 0 if it couldn't be logged.
+ */
+uint64_t
+wal_append(wal_t *w, message_t *m);
+
+/**
+ * Marks messages of given ids as delivered. Ids of 0 are ignored.
+ *
+ * Parameters:
+ *  -ids : Ids returned by wal_append() or passed by wal_replay().
+ *  -n : Number of ids.
+ */
+void
+wal_mark(wal_t *w, uint64_t *ids, int n);
+
+/**
+ * Removes the oldest segments of given log, whose messages have all been
+ * marked. It never removes the segment records are appended to.
+ *
+ * Returns:
+ *  The number of removed segments.
+ */
+int
+wal_compact(wal_t *w);
+
+
+#endif